@@ -0,0 +1,385 @@
+//
+// Fred Xia (fxia@yahoo.com)
+//
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sched.h>
+#include <sstream>
+#include <algorithm>
+#include "util.h"
+#include "async_log.h"
+#include "affinity.h"
+#include "task_controller.h"
+#include "admin.h"
+
+using namespace std;
+
+namespace epoll_demo {
+
+// Results longer than a page are paginated by offset, and output beyond
+// max_admin_output waits until the client has read it.
+static const uint32_t admin_page_size = 100;
+static const uint32_t max_admin_page = 1000;
+static const uint32_t max_admin_line = 1024;
+static const uint32_t max_admin_output = 1 << 20;
+
+// Tasks dropped for a dependency cycle listed by status, the rest counted
+static const uint32_t max_admin_cyclic = 100;
+
+static string hist_json(const uint64_t* hist, uint64_t count)
+{
+  uint32_t last = 0;
+  for (uint32_t i = 0; i < run_hist_buckets; i++) {
+    if (hist[i]) {
+      last = i;
+    }
+  }
+  string out = "{\"count\":" + to_string(count) + ",\"buckets\":[";
+  for (uint32_t i = 0; i <= last && count; i++) {
+    out += (i ? ",{\"lt\":" : "{\"lt\":");
+    out += (i + 1 < run_hist_buckets ? to_string(1ULL << i) : "null");
+    out += ",\"count\":" + to_string(hist[i]) + "}";
+  }
+  return out + "]}";
+}
+
+static string task_json(const Task* t, uint64_t now)
+{
+  string out = "{\"task\":" + json_string(t->task_name) +
+               ",\"state\":\"" + state_name(t->state) + "\"" +
+               ",\"sleep_ms\":" + to_string(t->sleep_ms) +
+               ",\"tenant\":" + json_string(t->tenant);
+  if (t->state == TaskRunning) {
+    out += ",\"worker\":" + json_string(t->worker) +
+           ",\"lease\":" + to_string(t->lease) +
+           ",\"elapsed_ms\":" + to_string(now - min(t->assign_ms, now));
+    if (!t->backup_worker.empty()) {
+      out += ",\"backup_worker\":" + json_string(t->backup_worker);
+    }
+  }
+  return out + "}";
+}
+
+// Next offset of a page, or null at the end
+static string next_json(uint64_t offset, uint64_t count, uint64_t total)
+{
+  return offset + count < total ? to_string(offset + count) : "null";
+}
+
+AdminHandler::AdminHandler(TaskController& controller)
+  : _controller(controller)
+{
+}
+
+void AdminHandler::add(int fd)
+{
+  _conns.insert(fd);
+}
+
+string AdminHandler::status()
+{
+  ControllerStats s = _controller.stats();
+  uint64_t running = 0;
+  uint64_t held = 0;    // running on a worker that is disconnected
+  for (auto& it : _controller.assigned()) {
+    for (Task* t : it.second) {
+      running += (t->state == TaskRunning);
+      held += (t->state == TaskRunning && t->lease_expiry_ms != 0);
+    }
+  }
+  return "{\"uptime_ms\":" + to_string(monotonic_ms() - s.start_ms) +
+         ",\"tasks\":" + to_string(_controller.tasks().size()) +
+         ",\"ready\":" + to_string(_controller.ready().size()) +
+         ",\"blocked\":" + to_string(s.blocked) +
+         ",\"cyclic\":" + to_string(_controller.cyclic().size()) +
+         ",\"cyclic_tasks\":" + cyclic() +
+         ",\"running\":" + to_string(running) +
+         ",\"held\":" + to_string(held) +
+         ",\"completed\":" + to_string(s.completed) +
+         ",\"fenced\":" + to_string(s.fenced) +
+         ",\"workers\":" + to_string(_controller.workers().size()) +
+         ",\"sessions\":" + to_string(s.sessions) +
+         ",\"mux_connections\":" + to_string(s.mux_connections) +
+         ",\"uploads\":" + to_string(s.uploads) +
+         ",\"result_bytes\":" + to_string(s.result_bytes) +
+         ",\"idle_workers\":" + to_string(_controller.idle().size()) +
+         ",\"all_loaded\":" + (s.all_loaded ? "true" : "false") +
+         ",\"log_dropped\":" + to_string(async_log_dropped()) +
+         shard() + placement() +
+         ",\"shutdown\":" + (s.shutdown ? "true" : "false") + "}";
+}
+
+string AdminHandler::cyclic()
+{
+  string out = "[";
+  uint32_t n = 0;
+  for (auto& name : _controller.cyclic()) {
+    if (n++ == max_admin_cyclic) {
+      break;
+    }
+    out += (n > 1 ? "," : "") + json_string(name);
+  }
+  return out + "]";
+}
+
+string AdminHandler::shard()
+{
+  ControllerStats s = _controller.stats();
+  if (s.shard.empty()) {
+    return "";
+  }
+  return ",\"shard\":" + json_string(s.shard) +
+         ",\"stolen\":" + to_string(s.stolen) +
+         ",\"stolen_total\":" + to_string(s.stolen_total) +
+         ",\"lent\":" + to_string(s.lent);
+}
+
+string AdminHandler::placement()
+{
+  const map<int, uint64_t>& rx_cpus = _controller.rx_cpus();
+  string out = ",\"reactor_cpus\":" +
+               json_string(thread_role_cpus("reactor")) +
+               ",\"log_cpus\":" + json_string(thread_role_cpus("log")) +
+               ",\"reactor_cpu\":" + to_string(sched_getcpu()) +
+               ",\"rx_cpus\":{";
+  for (auto it = rx_cpus.begin(); it != rx_cpus.end(); ++it) {
+    out += (it == rx_cpus.begin() ? "\"" : ",\"") + to_string(it->first) +
+           "\":" + to_string(it->second);
+  }
+  return out + "},\"rx_off_node\":" +
+         to_string(_controller.stats().rx_off_node);
+}
+
+string AdminHandler::queue(uint64_t offset, uint64_t limit)
+{
+  const FairQueue& ready = _controller.ready();
+  uint64_t now = monotonic_ms();
+  string out = "{\"depth\":" + to_string(ready.size()) +
+               ",\"offset\":" + to_string(offset) + ",\"tasks\":[";
+  uint64_t count = 0;
+  uint64_t skip = offset;
+  for (auto& tenant : ready.tenants()) {
+    const list<Task*>& tasks = tenant.ready.tasks();
+    if (skip >= tasks.size()) {
+      skip -= tasks.size();
+      continue;
+    }
+    auto it = tasks.begin();
+    for (; skip > 0; skip--) {
+      ++it;
+    }
+    for (; it != tasks.end() && count < limit; ++it, count++) {
+      out += (count ? "," : "") + task_json(*it, now);
+    }
+    if (count == limit) {
+      break;
+    }
+  }
+  return out + "],\"next\":" + next_json(offset, count, ready.size()) + "}";
+}
+
+string AdminHandler::tenants()
+{
+  string out = "{\"tenants\":[";
+  bool first = true;
+  for (auto& tenant : _controller.ready().tenants()) {
+    out += (first ? "" : ",");
+    out += "{\"tenant\":" + json_string(tenant.config.name) +
+           ",\"weight\":" + to_string(tenant.config.weight) +
+           ",\"max_running\":" + to_string(tenant.config.max_running) +
+           ",\"ready\":" + to_string(tenant.ready.size()) +
+           ",\"running\":" + to_string(tenant.running) +
+           ",\"dispatched\":" + to_string(tenant.dispatched) + "}";
+    first = false;
+  }
+  return out + "]}";
+}
+
+string AdminHandler::workers(uint64_t offset, uint64_t limit)
+{
+  const map<int, string>& workers = _controller.workers();
+  const map<int, uint32_t>& idle = _controller.idle();
+  const map<string, set<Task*>>& assigned = _controller.assigned();
+  uint64_t now = monotonic_ms();
+  string out = "{\"count\":" + to_string(workers.size()) +
+               ",\"offset\":" + to_string(offset) + ",\"workers\":[";
+  uint64_t count = 0;
+  auto it = workers.begin();
+  for (uint64_t i = 0; i < offset && it != workers.end(); i++) {
+    ++it;
+  }
+  for (; it != workers.end() && count < limit; ++it, count++) {
+    auto idle_it = idle.find(it->first);
+    out += (count ? "," : "");
+    out += "{\"worker\":" + json_string(it->second) +
+           ",\"fd\":" + to_string(it->first) +
+           ",\"idle_requests\":" +
+           to_string(idle_it == idle.end() ? 0 : idle_it->second) +
+           ",\"tasks\":[";
+    auto assigned_it = assigned.find(it->second);
+    if (assigned_it != assigned.end()) {
+      bool first = true;
+      for (Task* t : assigned_it->second) {
+        out += (first ? "" : ",") + task_json(t, now);
+        first = false;
+      }
+    }
+    out += "]}";
+  }
+  return out + "],\"next\":" + next_json(offset, count, workers.size()) +
+         "}";
+}
+
+string AdminHandler::histogram()
+{
+  uint64_t running[run_hist_buckets];
+  memset(running, 0, sizeof(running));
+  uint64_t count = 0;
+  uint64_t now = monotonic_ms();
+  for (auto& it : _controller.assigned()) {
+    for (Task* t : it.second) {
+      if (t->state == TaskRunning) {
+        running[hist_bucket(now - min(t->assign_ms, now))]++;
+        count++;
+      }
+    }
+  }
+  return "{\"run_ms\":" +
+         hist_json(_controller.run_hist(), _controller.stats().completed) +
+         ",\"running_ms\":" + hist_json(running, count) + "}";
+}
+
+string AdminHandler::load()
+{
+  if (_controller.stats().shutdown) {
+    return "{\"error\":\"shutting down\"}";
+  }
+  int r = _controller.load_now();
+  if (r < 0) {
+    return "{\"error\":\"database error\"}";
+  }
+  return "{\"loaded\":" + to_string(r) + ",\"tasks\":" +
+         to_string(_controller.tasks().size()) + ",\"ready\":" +
+         to_string(_controller.ready().size()) + "}";
+}
+
+string AdminHandler::command(const string& line)
+{
+  istringstream in(line);
+  string cmd, arg;
+  in >> cmd;
+  uint64_t offset = 0;
+  uint64_t limit = admin_page_size;
+  if (cmd == "task") {
+    in >> arg;
+    auto it = _controller.tasks().find(arg);
+    if (it == _controller.tasks().end()) {
+      return "{\"error\":\"task not loaded\"}";
+    }
+    return task_json(it->second, monotonic_ms());
+  }
+  if (!(in >> offset)) {
+    offset = 0;
+  }
+  if (!(in >> limit)) {
+    limit = admin_page_size;
+  }
+  limit = min(limit, (uint64_t)max_admin_page);
+  if (cmd == "status") {
+    return status();
+  } else if (cmd == "queue") {
+    return queue(offset, limit);
+  } else if (cmd == "workers") {
+    return workers(offset, limit);
+  } else if (cmd == "histogram") {
+    return histogram();
+  } else if (cmd == "tenants") {
+    return tenants();
+  } else if (cmd == "load") {
+    return load();
+  } else if (cmd == "help") {
+    return "{\"commands\":[\"status\",\"queue [offset [limit]]\","
+           "\"workers [offset [limit]]\",\"histogram\",\"tenants\","
+           "\"task <name>\",\"load\"]}";
+  }
+  return "{\"error\":\"unknown command\"}";
+}
+
+int AdminHandler::flush(int fd)
+{
+  string& out = _out[fd];
+  size_t done = 0;
+  while (done < out.size()) {
+    ssize_t n = ::write(fd, out.data() + done, out.size() - done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && errno == EAGAIN) {
+      break;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    done += n;
+  }
+  out.erase(0, done);
+  return 0;
+}
+
+void AdminHandler::close_conn(int fd)
+{
+  _conns.erase(fd);
+  _eof.erase(fd);
+  _out.erase(fd);
+  _inbufs.erase(fd);
+}
+
+uint32_t AdminHandler::handle(const epoll_event& ev)
+{
+  int fd = ev.data.fd;
+  string& in = _inbufs[fd];
+  char chunk[4096];
+  // Input beyond that is read once the output drains
+  while (in.size() < max_admin_output && !_eof.count(fd)) {
+    int r = ::read(fd, chunk, sizeof(chunk));
+    if (r > 0) {
+      in.append(chunk, r);
+      continue;
+    }
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r < 0 && errno == EAGAIN) {
+      break;
+    }
+    _eof.insert(fd);
+  }
+  string& out = _out[fd];
+  size_t pos;
+  while (out.size() < max_admin_output &&
+         (pos = in.find('\n')) != string::npos) {
+    string line = in.substr(0, pos);
+    in.erase(0, pos + 1);
+    if (!line.empty() && line.back() == '\r') {
+      line.pop_back();
+    }
+    if (!line.empty()) {
+      out += command(line) + "\n";
+    }
+  }
+  bool eof = _eof.count(fd);
+  if (in.find('\n') == string::npos && (in.size() > max_admin_line || eof)) {
+    // Not a query, or cut off by the close
+    in.clear();
+  }
+  if (flush(fd) < 0 || (eof && out.empty() && in.empty())) {
+    close_conn(fd);
+    return 0;
+  }
+  // More queries wait for the output to drain
+  uint32_t events = EPOLLET | (out.empty() ? 0 : EPOLLOUT);
+  return eof ? events : events | EPOLLIN | EPOLLHUP;
+}
+
+}
@@ -0,0 +1,86 @@
+#ifndef __task_admin_h__
+#define __task_admin_h__
+//
+// Fred Xia (fxia@yahoo.com)
+//
+
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <string>
+#include <map>
+#include <set>
+#include "task_db.h"
+
+namespace epoll_demo {
+
+struct TaskController;
+
+// Admin connections of the controller on its Unix socket. Clients send one
+// query per line and get one line of JSON back, answered from the state
+// the controller keeps in memory, not from the database. Queries are
+// answered in order, and a client may close its end once it has sent them.
+//
+// Queries are status, queue [offset [limit]], workers [offset [limit]],
+// histogram, tenants, task <name>, load and help. Results longer than a
+// page are paginated by offset.
+class AdminHandler {
+public:
+  explicit AdminHandler(TaskController& controller);
+
+  // A new connection on the admin socket
+  void add(int fd);
+
+  // Whether fd is an admin connection
+  bool owns(int fd) const { return _conns.count(fd) != 0; }
+
+  // Read the queries on an admin connection and write their answers.
+  // Returns the events to wait for, 0 if the connection is to be closed.
+  uint32_t handle(const epoll_event& ev);
+
+private:
+  // Answer one admin query, as a line of JSON
+  std::string command(const std::string& line);
+
+  std::string status();
+
+  // Names of the tasks dropped for waiting on a dependency cycle, the
+  // first max_admin_cyclic of them
+  std::string cyclic();
+
+  // Shard of the cluster, tasks stolen from and lent to peers
+  std::string shard();
+
+  // CPUs of the threads and of the packets of worker connections. The
+  // packets of a connection taken in on another NUMA node than the reactor
+  // cross nodes on every message.
+  std::string placement();
+
+  // Ready tasks tenant by tenant, each tenant's in dispatch order
+  std::string queue(uint64_t offset, uint64_t limit);
+
+  // Share of the workers of each tenant
+  std::string tenants();
+
+  std::string workers(uint64_t offset, uint64_t limit);
+
+  std::string histogram();
+
+  // Load new tasks now instead of at the next periodic fetch, e.g. after a
+  // bulk insert, and hand them to idle workers
+  std::string load();
+
+  // Write pending output. Returns -1 if the connection failed.
+  int flush(int fd);
+
+  void close_conn(int fd);
+
+  TaskController& _controller;
+  std::set<int> _conns;
+  std::set<int> _eof;                     // closed for reading, output pending
+  std::map<int, std::string> _inbufs;     // fd => partial queries
+  std::map<int, std::string> _out;        // fd => output not written yet
+};
+
+}
+
+#endif
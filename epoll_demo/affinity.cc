@@ -0,0 +1,166 @@
+//
+// Fred Xia (fxia@yahoo.com)
+//
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <map>
+#include "affinity.h"
+
+using namespace std;
+
+namespace epoll_demo {
+
+static map<string, cpu_set_t> roles;
+static cpu_set_t process_cpus;    // before any thread was placed
+
+// Parse a list of CPUs and ranges of CPUs, e.g. "0-3,8". Returns 0 for
+// success, -1 for failure
+static int parse_cpu_list(const char* list, cpu_set_t& set)
+{
+  CPU_ZERO(&set);
+  const char* p = list;
+  while (*p) {
+    char* end;
+    long first = strtol(p, &end, 10);
+    long last = first;
+    if (end == p) {
+      return -1;
+    }
+    if (*end == '-') {
+      p = end + 1;
+      last = strtol(p, &end, 10);
+      if (end == p) {
+        return -1;
+      }
+    }
+    if (first < 0 || last < first || last >= CPU_SETSIZE) {
+      return -1;
+    }
+    for (long cpu = first; cpu <= last; cpu++) {
+      CPU_SET(cpu, &set);
+    }
+    if (*end == ',') {
+      end++;
+    } else if (*end) {
+      return -1;
+    }
+    p = end;
+  }
+  return CPU_COUNT(&set) ? 0 : -1;
+}
+
+int set_thread_role(const string& role, const char* list)
+{
+  if (roles.empty() &&
+      sched_getaffinity(0, sizeof(process_cpus), &process_cpus) < 0) {
+    return -1;
+  }
+  cpu_set_t set;
+  if (parse_cpu_list(list, set) < 0) {
+    return -1;
+  }
+  cpu_set_t allowed;
+  CPU_AND(&allowed, &set, &process_cpus);
+  if (!CPU_EQUAL(&allowed, &set)) {
+    return -1;
+  }
+  roles[role] = set;
+  return 0;
+}
+
+int parse_thread_role(const char* spec)
+{
+  const char* eq = strchr(spec, '=');
+  if (eq == nullptr || eq == spec) {
+    return -1;
+  }
+  return set_thread_role(string(spec, eq - spec), eq + 1);
+}
+
+int enter_thread_role(const char* role)
+{
+  if (roles.empty()) {
+    return 0;
+  }
+  cpu_set_t set;
+  auto it = roles.find(role);
+  if (it != roles.end()) {
+    set = it->second;
+  } else {
+    // Off the CPUs of the roles, e.g. of the reactor
+    set = process_cpus;
+    for (auto& r : roles) {
+      for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &r.second)) {
+          CPU_CLR(cpu, &set);
+        }
+      }
+    }
+    if (CPU_COUNT(&set) == 0) {
+      set = process_cpus;
+    }
+  }
+  // For the calling thread only, threads it starts later inherit it
+  if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+    return -1;
+  }
+  // Also overrides a policy inherited from e.g. numactl --interleave
+  return syscall(SYS_set_mempolicy, MPOL_LOCAL, nullptr, 0) < 0 ? -1 : 0;
+}
+
+string thread_role_cpus(const char* role)
+{
+  auto it = roles.find(role);
+  if (it == roles.end()) {
+    return "";
+  }
+  string out;
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (!CPU_ISSET(cpu, &it->second)) {
+      continue;
+    }
+    int last = cpu;
+    while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, &it->second)) {
+      last++;
+    }
+    out += (out.empty() ? "" : ",") + to_string(cpu);
+    if (last > cpu) {
+      out += "-" + to_string(last);
+    }
+    cpu = last;
+  }
+  return out;
+}
+
+int cpu_node(int cpu)
+{
+  static map<int, int> nodes;
+  auto it = nodes.find(cpu);
+  if (it != nodes.end()) {
+    return it->second;
+  }
+  // The directory of a CPU links to its node as node<n>
+  char path[64];
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+  int node = 0;
+  DIR* dir = opendir(path);
+  if (dir) {
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != nullptr) {
+      if (sscanf(entry->d_name, "node%d", &node) == 1) {
+        break;
+      }
+    }
+    closedir(dir);
+  }
+  nodes[cpu] = node;
+  return node;
+}
+
+}
@@ -0,0 +1,39 @@
+#ifndef __task_affinity_h__
+#define __task_affinity_h__
+//
+// Fred Xia (fxia@yahoo.com)
+//
+
+#include <string>
+
+namespace epoll_demo {
+
+// Placement of the threads of a process by role, e.g. the reactor or the
+// log writer. A role can be given a set of CPUs. A thread entering a role
+// is pinned to them, and from then on allocates memory on the NUMA node it
+// runs on, so the pages of its buffers and of its malloc arena are local.
+// A thread whose role has no CPUs runs on the CPUs of the process given to
+// no role, or on all of them if every CPU is taken. Nothing is changed
+// until a role is given CPUs.
+//
+// Roles are set up before the threads are started, and not changed later.
+
+// Give role the CPUs of list, e.g. "0-3,8". Every CPU must be one the
+// process may run on. Returns 0 for success, -1 for failure
+int set_thread_role(const std::string& role, const char* list);
+
+// Same as set_thread_role() from a "<role>=<list>" spec
+int parse_thread_role(const char* spec);
+
+// Place the calling thread by role. Returns 0 for success, -1 for failure
+int enter_thread_role(const char* role);
+
+// CPUs of role as a list, empty if it has none
+std::string thread_role_cpus(const char* role);
+
+// NUMA node of cpu, 0 if not known. Not thread safe.
+int cpu_node(int cpu);
+
+}
+
+#endif
@@ -0,0 +1,398 @@
+//
+// Fred Xia (fxia@yahoo.com)
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <map>
+#include <vector>
+#include "util.h"
+#include "archive.h"
+#include "affinity.h"
+
+using namespace std;
+
+#define LOG(fmt, args...) do { \
+   log_message(_log_file, __FILE__, __LINE__, fmt, ##args); \
+} while (0)
+
+namespace epoll_demo {
+
+// Milliseconds between batches while there is more to archive, so the
+// controller gets the database in between
+#define ARCHIVE_PAUSE_MS      20
+
+// Milliseconds between runs once everything old enough is archived
+#define ARCHIVE_INTERVAL_MS   60000
+
+TaskArchiver::TaskArchiver(const char* db_file_name, FILE* log_file)
+  : _db_name(db_file_name), _archive_name(_db_name + ".archive"),
+    _log_file(log_file), _db(nullptr), _incremental(false), _stop_fd(-1)
+{}
+
+TaskArchiver::~TaskArchiver()
+{
+  stop();
+  if (_db) {
+    sqlite3_close(_db);
+  }
+}
+
+int TaskArchiver::exec(const char* sql)
+{
+  char* err = nullptr;
+  if (sqlite3_exec(_db, sql, nullptr, nullptr, &err) != SQLITE_OK) {
+    LOG("Error: '%s': %s", sql, err);
+    sqlite3_free(err);
+    return -1;
+  }
+  return 0;
+}
+
+// Open the database with the archive attached, and learn the columns of
+// demo_task and the existing archive tables. Returns 0 for success, -1 for
+// failure
+int TaskArchiver::open()
+{
+  if (_db) {
+    return 0;
+  }
+  int rc = sqlite3_open_v2(_db_name.c_str(), &_db, SQLITE_OPEN_READWRITE, 0);
+  if (rc != SQLITE_OK) {
+    LOG("Cannot open database %s: %s", _db_name.c_str(), sqlite3_errmsg(_db));
+    sqlite3_close(_db);
+    _db = nullptr;
+    return -1;
+  }
+  sqlite3_busy_timeout(_db, 5000);
+  sqlite3_stmt* stmt = nullptr;
+  sqlite3_prepare_v2(_db, "attach ? as archive", -1, &stmt, 0);
+  sqlite3_bind_text(stmt, 1, _archive_name.c_str(), -1, SQLITE_STATIC);
+  rc = sqlite3_step(stmt);
+  sqlite3_finalize(stmt);
+  if (rc != SQLITE_DONE ||
+      sqlite3_prepare_v2(_db, "pragma main.auto_vacuum", -1, &stmt, 0) !=
+      SQLITE_OK) {
+    LOG("Cannot open archive %s: %s", _archive_name.c_str(),
+        sqlite3_errmsg(_db));
+    sqlite3_finalize(stmt);
+    sqlite3_close(_db);
+    _db = nullptr;
+    return -1;
+  }
+  // 2 is incremental
+  _incremental = (sqlite3_step(stmt) == SQLITE_ROW &&
+                  sqlite3_column_int(stmt, 0) == 2);
+  sqlite3_finalize(stmt);
+  _columns.clear();
+  sqlite3_prepare_v2(_db, "pragma main.table_info(demo_task)", -1, &stmt, 0);
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    _columns += (_columns.empty() ? "" : ", ");
+    _columns += (const char*)sqlite3_column_text(stmt, 1);
+  }
+  sqlite3_finalize(stmt);
+  sqlite3_prepare_v2(_db, "select name from archive.sqlite_master where "
+                     "type = 'table' and name like 'demo_task_%'", -1, &stmt,
+                     0);
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    _partitions.insert((const char*)sqlite3_column_text(stmt, 0) +
+                       strlen("demo_task_"));
+  }
+  sqlite3_finalize(stmt);
+  if (_columns.empty()) {
+    LOG("No task table in %s", _db_name.c_str());
+    sqlite3_close(_db);
+    _db = nullptr;
+    return -1;
+  }
+  return 0;
+}
+
+// Create the archive table of a month if needed, with every column of
+// demo_task, and rebuild the view over all archive tables. Returns 0 for
+// success, -1 for failure
+int TaskArchiver::add_partition(const string& month)
+{
+  string table = "archive.demo_task_" + month;
+  string sql = "create table if not exists " + table +
+               " as select " + _columns + " from main.demo_task where 0;"
+               "create index if not exists archive.demo_task_" + month +
+               "_name on demo_task_" + month + " (task_name);";
+  if (exec(sql.c_str()) < 0) {
+    return -1;
+  }
+  // Columns added to demo_task after the table was created
+  sqlite3_stmt* stmt;
+  string info = "pragma archive.table_info(demo_task_" + month + ")";
+  sqlite3_prepare_v2(_db, info.c_str(), -1, &stmt, 0);
+  set<string> existing;
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    existing.insert((const char*)sqlite3_column_text(stmt, 1));
+  }
+  sqlite3_finalize(stmt);
+  size_t pos = 0;
+  while (pos < _columns.size()) {
+    size_t end = _columns.find(", ", pos);
+    end = (end == string::npos ? _columns.size() : end);
+    string column = _columns.substr(pos, end - pos);
+    pos = end + 2;
+    if (!existing.count(column)) {
+      sql = "alter table " + table + " add column " + column;
+      if (exec(sql.c_str()) < 0) {
+        return -1;
+      }
+    }
+  }
+  _partitions.insert(month);
+  sql = "drop view if exists archive.demo_task_archive;"
+        "create view archive.demo_task_archive as ";
+  bool first = true;
+  for (auto& m : _partitions) {
+    sql += (first ? "" : " union all ");
+    sql += "select '" + m + "' as month, " + _columns + " from demo_task_" + m;
+    first = false;
+  }
+  return exec(sql.c_str());
+}
+
+int TaskArchiver::archive_batch(time_t cutoff, uint32_t limit)
+{
+  // Walks the state index. The last row stays, see above.
+  static const char* select_sql =
+    "select rowid, task_name, complete_time from main.demo_task "
+    "where state = 3 and complete_time < ? and "
+    "rowid < (select max(rowid) from main.demo_task) order by rowid limit ?";
+  if (open() < 0 || exec("begin immediate") < 0) {
+    return -1;
+  }
+  struct Row {
+    int64_t rowid;
+    string task_name;
+    string month;
+  };
+  vector<Row> rows;
+  sqlite3_stmt* stmt;
+  sqlite3_prepare_v2(_db, select_sql, -1, &stmt, 0);
+  sqlite3_bind_int64(stmt, 1, cutoff);
+  sqlite3_bind_int(stmt, 2, limit);
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    Row row;
+    row.rowid = sqlite3_column_int64(stmt, 0);
+    row.task_name = (const char*)sqlite3_column_text(stmt, 1);
+    time_t complete_time = sqlite3_column_int64(stmt, 2);
+    struct tm tm;
+    gmtime_r(&complete_time, &tm);
+    char month[32];
+    snprintf(month, sizeof(month), "%04d%02d", tm.tm_year + 1900,
+             tm.tm_mon + 1);
+    row.month = month;
+    rows.push_back(row);
+  }
+  sqlite3_finalize(stmt);
+  // Statements of the tables written by this batch
+  map<string, sqlite3_stmt*> inserts;
+  sqlite3_stmt* delete_task = nullptr;
+  sqlite3_stmt* delete_deps = nullptr;
+  sqlite3_prepare_v2(_db, "delete from main.demo_task where rowid = ?", -1,
+                     &delete_task, 0);
+  sqlite3_prepare_v2(_db, "delete from main.demo_task_dep where task_name = ?",
+                     -1, &delete_deps, 0);
+  int count = 0;
+  for (auto& row : rows) {
+    sqlite3_stmt*& insert = inserts[row.month];
+    if (insert == nullptr) {
+      if (!_partitions.count(row.month) && add_partition(row.month) < 0) {
+        count = -1;
+        break;
+      }
+      string sql = "insert into archive.demo_task_" + row.month + " (" +
+                   _columns + ") select " + _columns +
+                   " from main.demo_task where rowid = ?";
+      if (sqlite3_prepare_v2(_db, sql.c_str(), -1, &insert, 0) != SQLITE_OK) {
+        LOG("Error: prepare archive insert: %s", sqlite3_errmsg(_db));
+        count = -1;
+        break;
+      }
+    }
+    sqlite3_bind_int64(insert, 1, row.rowid);
+    sqlite3_bind_int64(delete_task, 1, row.rowid);
+    sqlite3_bind_text(delete_deps, 1, row.task_name.c_str(), -1,
+                      SQLITE_STATIC);
+    if (sqlite3_step(insert) != SQLITE_DONE ||
+        sqlite3_step(delete_task) != SQLITE_DONE ||
+        (delete_deps && sqlite3_step(delete_deps) != SQLITE_DONE)) {
+      LOG("Error: archive task %s: %s", row.task_name.c_str(),
+          sqlite3_errmsg(_db));
+      count = -1;
+      break;
+    }
+    sqlite3_reset(insert);
+    sqlite3_reset(delete_task);
+    if (delete_deps) {
+      sqlite3_reset(delete_deps);
+    }
+    count++;
+  }
+  for (auto& it : inserts) {
+    sqlite3_finalize(it.second);
+  }
+  sqlite3_finalize(delete_task);
+  sqlite3_finalize(delete_deps);
+  if (exec(count < 0 ? "rollback" : "commit") < 0) {
+    exec("rollback");
+    count = -1;
+  }
+  if (count < 0) {
+    // Reopened by the next batch, which also relearns the archive tables in
+    // case a new one was rolled back
+    _partitions.clear();
+    sqlite3_close(_db);
+    _db = nullptr;
+    return -1;
+  }
+  if (count > 0 && _incremental) {
+    exec("pragma main.incremental_vacuum");
+  }
+  if (count > 0) {
+    LOG("Archived %d tasks", count);
+  }
+  return count;
+}
+
+int TaskArchiver::archive(time_t cutoff)
+{
+  int total = 0;
+  while (true) {
+    int r = archive_batch(cutoff);
+    if (r < 0) {
+      return -1;
+    }
+    total += r;
+    if (r < ARCHIVE_BATCH) {
+      return total;
+    }
+  }
+}
+
+int TaskArchiver::start(uint32_t age_sec)
+{
+  if (open() < 0) {
+    return -1;
+  }
+  _stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (_stop_fd < 0) {
+    LOG("Error in eventfd(): %s", strerror(errno));
+    return -1;
+  }
+  _thread = thread(&TaskArchiver::run, this, age_sec);
+  LOG("Archiving tasks completed %u seconds ago to %s", age_sec,
+      _archive_name.c_str());
+  return 0;
+}
+
+void TaskArchiver::stop()
+{
+  if (_thread.joinable()) {
+    uint64_t one = 1;
+    if (::write(_stop_fd, &one, sizeof(one)) < 0) {
+      LOG("Error in write(): %s", strerror(errno));
+    }
+    _thread.join();
+  }
+  if (_stop_fd >= 0) {
+    close(_stop_fd);
+    _stop_fd = -1;
+  }
+}
+
+void TaskArchiver::run(uint32_t age_sec)
+{
+  if (enter_thread_role("archive") < 0) {
+    LOG("Cannot place archiver thread: %s", strerror(errno));
+  }
+  while (true) {
+    int r = archive_batch(time(0) - age_sec);
+    struct pollfd fd = { _stop_fd, POLLIN, 0 };
+    int wait = (r == ARCHIVE_BATCH ? ARCHIVE_PAUSE_MS : ARCHIVE_INTERVAL_MS);
+    if (poll(&fd, 1, wait) != 0 && (fd.revents || errno != EINTR)) {
+      return;
+    }
+  }
+}
+
+// Print the current row of stmt as name=value pairs
+static void print_row(sqlite3_stmt* stmt, FILE* out)
+{
+  int n = sqlite3_column_count(stmt);
+  for (int i = 0; i < n; i++) {
+    const char* value = (const char*)sqlite3_column_text(stmt, i);
+    fprintf(out, "%s%s=%s", i ? " " : "", sqlite3_column_name(stmt, i),
+            value ? value : "");
+  }
+  fprintf(out, "\n");
+}
+
+int TaskArchiver::print_task(const string& task_name, FILE* out)
+{
+  if (open() < 0) {
+    return -1;
+  }
+  // Newest first. A name may be reused once its task is archived.
+  string sql = "select 'demo_task' as source, " + _columns +
+               " from main.demo_task where task_name = ?1";
+  for (auto it = _partitions.rbegin(); it != _partitions.rend(); ++it) {
+    sql += " union all select 'archive " + *it + "', " + _columns +
+           " from archive.demo_task_" + *it + " where task_name = ?1";
+  }
+  sqlite3_stmt* stmt;
+  if (sqlite3_prepare_v2(_db, sql.c_str(), -1, &stmt, 0) != SQLITE_OK) {
+    LOG("Error: prepare sql '%s': %s", sql.c_str(), sqlite3_errmsg(_db));
+    sqlite3_finalize(stmt);
+    return -1;
+  }
+  sqlite3_bind_text(stmt, 1, task_name.c_str(), -1, SQLITE_STATIC);
+  int count = 0;
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    print_row(stmt, out);
+    count++;
+  }
+  sqlite3_finalize(stmt);
+  return count;
+}
+
+int TaskArchiver::print_partitions(FILE* out)
+{
+  if (open() < 0) {
+    return -1;
+  }
+  for (auto& month : _partitions) {
+    sqlite3_stmt* stmt;
+    string sql = "select count(*) from archive.demo_task_" + month;
+    if (sqlite3_prepare_v2(_db, sql.c_str(), -1, &stmt, 0) != SQLITE_OK ||
+        sqlite3_step(stmt) != SQLITE_ROW) {
+      LOG("Error: count archive %s: %s", month.c_str(), sqlite3_errmsg(_db));
+      sqlite3_finalize(stmt);
+      return -1;
+    }
+    fprintf(out, "demo_task_%s %lld tasks\n", month.c_str(),
+            (long long)sqlite3_column_int64(stmt, 0));
+    sqlite3_finalize(stmt);
+  }
+  return (int)_partitions.size();
+}
+
+int TaskArchiver::enable_incremental_vacuum()
+{
+  if (open() < 0 || exec("pragma main.auto_vacuum = incremental") < 0 ||
+      exec("vacuum main") < 0) {
+    return -1;
+  }
+  _incremental = true;
+  return 0;
+}
+
+}
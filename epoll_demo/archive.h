@@ -0,0 +1,83 @@
+#ifndef __task_archive_h__
+#define __task_archive_h__
+//
+// Fred Xia (fxia@yahoo.com)
+//
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <sqlite3.h>
+#include <string>
+#include <set>
+#include <thread>
+
+namespace epoll_demo {
+
+// Tasks moved per transaction, which is as long as the controller may have
+// to wait for the database
+#define ARCHIVE_BATCH         1000
+
+// Moves completed tasks out of demo_task, so the table the controller
+// reads and updates only holds unfinished and recently completed tasks.
+//
+// Archived tasks go to "<database>.archive", a database of one table per
+// month of completion, demo_task_YYYYMM in UTC, with the view
+// demo_task_archive over all of them. Their dependency edges are deleted.
+// The task with the largest rowid is never archived, since the controller
+// expects rowids to only grow. If the database uses incremental auto
+// vacuum the pages freed by a batch are returned to the file system,
+// otherwise they are reused by new tasks.
+class TaskArchiver {
+public:
+  TaskArchiver(const char* db_file_name, FILE* log_file);
+  ~TaskArchiver();
+
+  // Move up to limit tasks completed before cutoff, in one transaction.
+  // Returns number of tasks moved, or -1 if error
+  int archive_batch(time_t cutoff, uint32_t limit = ARCHIVE_BATCH);
+
+  // Move every task completed before cutoff, in batches. Returns number of
+  // tasks moved, or -1 if error
+  int archive(time_t cutoff);
+
+  // Archive tasks completed age_sec ago or earlier from a thread of its
+  // own, pausing between batches. Returns 0 for success, -1 for failure
+  int start(uint32_t age_sec);
+
+  // Stop the thread. Also done by the destructor.
+  void stop();
+
+  // Print the rows of task_name in demo_task and in the archive. Returns
+  // number of rows, or -1 if error
+  int print_task(const std::string& task_name, FILE* out);
+
+  // Print the number of tasks of every archive table. Returns number of
+  // tables, or -1 if error
+  int print_partitions(FILE* out);
+
+  // Switch the database to incremental auto vacuum. This rewrites the whole
+  // database, so it is meant to be run once while no controller runs.
+  // Returns 0 for success, -1 for failure
+  int enable_incremental_vacuum();
+
+private:
+  int open();
+  int exec(const char* sql);
+  int add_partition(const std::string& month);
+  void run(uint32_t age_sec);
+
+  std::string _db_name;
+  std::string _archive_name;
+  FILE* _log_file;
+  sqlite3* _db;
+  std::string _columns;             // columns copied to the archive
+  std::set<std::string> _partitions;
+  bool _incremental;                // database has incremental auto vacuum
+  int _stop_fd;
+  std::thread _thread;
+};
+
+}
+
+#endif
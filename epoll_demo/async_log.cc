@@ -0,0 +1,780 @@
+//
+// Fred Xia (fxia@yahoo.com)
+//
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <map>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+#include <algorithm>
+#include "async_log.h"
+#include "affinity.h"
+
+using namespace std;
+
+namespace epoll_demo {
+
+// First bytes of a binary log file
+static const char log_magic[8] = { 'E', 'P', 'L', 'O', 'G', '1', 0, 0 };
+
+// Every record starts with a LogHeader and its size is a multiple of 8
+enum LogRecordType {
+  LogPad,           // skips the end of a ring
+  LogSiteDef,       // a call site, before its first message in a file
+  LogMessage,
+  LogDropped        // messages lost to full rings
+};
+
+struct LogHeader {
+  uint32_t size;
+  uint16_t type;
+  uint16_t reserved;
+};
+
+// Followed by the file name and the format
+struct LogSiteRecord {
+  LogHeader hdr;
+  uint32_t  site;
+  uint32_t  line;
+  uint16_t  file_len;
+  uint16_t  fmt_len;
+  uint32_t  reserved;
+};
+
+// Followed by the arguments. Numbers take 8 bytes, a string is a 16 bit
+// length and the bytes.
+struct LogMessageRecord {
+  LogHeader hdr;
+  uint32_t  site;
+  uint32_t  reserved;
+  uint64_t  time_ns;    // CLOCK_REALTIME
+};
+
+struct LogDroppedRecord {
+  LogHeader hdr;
+  uint64_t  count;
+};
+
+enum LogArgType {
+  ArgInt,           // int and smaller
+  ArgLong,          // long, long long, size_t
+  ArgDouble,
+  ArgString,
+  ArgPointer
+};
+
+// Strings are cut to this length in a record
+static const uint32_t max_string_arg = 1024;
+static const uint32_t max_record_size = 8192;
+
+// Longest wait of the background thread for new records, in microseconds
+static const uint32_t max_idle_us = 10000;
+
+// One conversion of a printf format. '*' width and precision are int
+// arguments in front of the value.
+struct LogConv {
+  uint32_t  begin;
+  uint32_t  end;
+  uint8_t   type;
+  uint8_t   stars;
+};
+
+struct LogSite {
+  string  file;
+  uint32_t line;
+  string  fmt;
+  vector<LogConv> convs;
+};
+
+static uint32_t align8(uint32_t n)
+{
+  return (n + 7) & ~7u;
+}
+
+// Find the conversions of fmt. %n and long double are not supported.
+static void parse_format(const string& fmt, vector<LogConv>& convs)
+{
+  for (size_t i = 0; i < fmt.size(); i++) {
+    if (fmt[i] != '%') {
+      continue;
+    }
+    LogConv conv;
+    conv.begin = i++;
+    conv.stars = 0;
+    if (i < fmt.size() && fmt[i] == '%') {
+      continue;
+    }
+    while (i < fmt.size() && strchr("-+ #0", fmt[i])) {
+      i++;
+    }
+    while (i < fmt.size() &&
+           (isdigit(fmt[i]) || fmt[i] == '.' || fmt[i] == '*')) {
+      conv.stars += (fmt[i] == '*');
+      i++;
+    }
+    bool is_long = false;
+    while (i < fmt.size() && strchr("hlqjzt", fmt[i])) {
+      is_long |= (fmt[i] != 'h');
+      i++;
+    }
+    if (i >= fmt.size()) {
+      break;
+    }
+    conv.end = i + 1;
+    switch (fmt[i]) {
+    case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+      conv.type = is_long ? ArgLong : ArgInt;
+      break;
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G':
+    case 'a': case 'A':
+      conv.type = ArgDouble;
+      break;
+    case 's':
+      conv.type = ArgString;
+      break;
+    case 'p':
+      conv.type = ArgPointer;
+      break;
+    default:
+      continue;
+    }
+    convs.push_back(conv);
+  }
+}
+
+// Copy the arguments of a message into a record. Returns the end of the
+// arguments written, which stop early if the record is full.
+static char* encode_args(const LogSite* site, va_list args, char* p,
+                         const char* end)
+{
+  for (auto& conv : site->convs) {
+    int64_t stars[2];
+    for (uint32_t i = 0; i < conv.stars && i < 2; i++) {
+      stars[i] = va_arg(args, int);
+    }
+    int64_t ival = 0;
+    double dval = 0;
+    const char* sval = nullptr;
+    switch (conv.type) {
+    case ArgInt:
+      ival = va_arg(args, int);
+      break;
+    case ArgLong:
+      ival = va_arg(args, long long);
+      break;
+    case ArgDouble:
+      dval = va_arg(args, double);
+      break;
+    case ArgString:
+      sval = va_arg(args, const char*);
+      if (sval == nullptr) {
+        sval = "(null)";
+      }
+      break;
+    case ArgPointer:
+      ival = (int64_t)(uintptr_t)va_arg(args, void*);
+      break;
+    }
+    uint32_t need = conv.stars * 8 + (conv.type == ArgString ? 2 : 8);
+    if ((size_t)(end - p) < need) {
+      break;
+    }
+    for (uint32_t i = 0; i < conv.stars && i < 2; i++) {
+      memcpy(p, &stars[i], 8);
+      p += 8;
+    }
+    if (conv.type == ArgString) {
+      uint16_t len = (uint16_t)min(min(strlen(sval), (size_t)max_string_arg),
+                                   (size_t)(end - p - 2));
+      memcpy(p, &len, 2);
+      memcpy(p + 2, sval, len);
+      p += 2 + len;
+    } else if (conv.type == ArgDouble) {
+      memcpy(p, &dval, 8);
+      p += 8;
+    } else {
+      memcpy(p, &ival, 8);
+      p += 8;
+    }
+  }
+  return p;
+}
+
+// Format with '*' arguments in front of the value
+template <typename T>
+static void append_value(string& out, const string& spec,
+                         const int64_t* stars, uint32_t num_stars, T value)
+{
+  char buf[max_string_arg + 128];
+  int n;
+  if (num_stars == 0) {
+    n = snprintf(buf, sizeof(buf), spec.c_str(), value);
+  } else if (num_stars == 1) {
+    n = snprintf(buf, sizeof(buf), spec.c_str(), (int)stars[0], value);
+  } else {
+    n = snprintf(buf, sizeof(buf), spec.c_str(), (int)stars[0],
+                 (int)stars[1], value);
+  }
+  if (n > 0) {
+    out.append(buf, min((size_t)n, sizeof(buf) - 1));
+  }
+}
+
+// Text of a format between conversions, with %% unescaped
+static void append_literal(string& out, const string& fmt, size_t begin,
+                           size_t end)
+{
+  for (size_t i = begin; i < end; i++) {
+    out.push_back(fmt[i]);
+    if (fmt[i] == '%' && i + 1 < end && fmt[i + 1] == '%') {
+      i++;
+    }
+  }
+}
+
+// Format a message from the arguments in a record, as log_message() does
+static void format_message(const LogSite* site, const char* p,
+                           const char* end, string& out)
+{
+  char prefix[64];
+  snprintf(prefix, sizeof(prefix), "%.16s:%d ", site->file.c_str(),
+           site->line);
+  out.append(prefix);
+  size_t pos = 0;
+  for (auto& conv : site->convs) {
+    append_literal(out, site->fmt, pos, conv.begin);
+    pos = conv.end;
+    string spec = site->fmt.substr(conv.begin, conv.end - conv.begin);
+    int64_t stars[2];
+    uint32_t need = conv.stars * 8 + (conv.type == ArgString ? 2 : 8);
+    if ((size_t)(end - p) < need) {
+      // Cut off in the record
+      out.append(spec);
+      continue;
+    }
+    for (uint32_t i = 0; i < conv.stars && i < 2; i++) {
+      memcpy(&stars[i], p, 8);
+      p += 8;
+    }
+    if (conv.type == ArgString) {
+      uint16_t len;
+      memcpy(&len, p, 2);
+      len = min((size_t)len, (size_t)(end - p - 2));
+      string value(p + 2, len);
+      p += 2 + len;
+      append_value(out, spec, stars, conv.stars, value.c_str());
+      continue;
+    }
+    int64_t ival;
+    double dval;
+    memcpy(&ival, p, 8);
+    memcpy(&dval, p, 8);
+    p += 8;
+    if (conv.type == ArgInt) {
+      append_value(out, spec, stars, conv.stars, (int)ival);
+    } else if (conv.type == ArgLong) {
+      append_value(out, spec, stars, conv.stars, (long long)ival);
+    } else if (conv.type == ArgDouble) {
+      append_value(out, spec, stars, conv.stars, dval);
+    } else {
+      append_value(out, spec, stars, conv.stars, (void*)(uintptr_t)ival);
+    }
+  }
+  append_literal(out, site->fmt, pos, site->fmt.size());
+  out.push_back('\n');
+}
+
+// Single producer, single consumer ring of records. Positions only grow, a
+// record never wraps around the end of the buffer.
+class LogRing {
+public:
+  LogRing() : _head(0), _tail(0), _dropped(0) {
+    _buf = new char[LOG_RING_SIZE];
+  }
+
+  ~LogRing() {
+    delete[] _buf;
+  }
+
+  // Called by the owning thread. Returns false if the ring is full.
+  bool write(const char* rec, uint32_t size) {
+    uint64_t head = _head.load(memory_order_relaxed);
+    uint64_t tail = _tail.load(memory_order_acquire);
+    uint32_t offset = head & (LOG_RING_SIZE - 1);
+    uint32_t to_end = LOG_RING_SIZE - offset;
+    uint32_t need = size + (to_end < size ? to_end : 0);
+    if (LOG_RING_SIZE - (head - tail) < need) {
+      _dropped.fetch_add(1, memory_order_relaxed);
+      return false;
+    }
+    if (to_end < size) {
+      LogHeader pad = { to_end, LogPad, 0 };
+      memcpy(_buf + offset, &pad, sizeof(pad));
+      head += to_end;
+      offset = 0;
+    }
+    memcpy(_buf + offset, rec, size);
+    _head.store(head + size, memory_order_release);
+    return true;
+  }
+
+  // Called by the background thread. Hands every record to fn, returns the
+  // number of records.
+  template <typename Fn>
+  uint32_t drain(Fn fn) {
+    uint64_t tail = _tail.load(memory_order_relaxed);
+    uint64_t head = _head.load(memory_order_acquire);
+    uint32_t count = 0;
+    while (tail < head) {
+      const char* rec = _buf + (tail & (LOG_RING_SIZE - 1));
+      LogHeader hdr;
+      memcpy(&hdr, rec, sizeof(hdr));
+      if (hdr.type != LogPad) {
+        fn(rec);
+        count++;
+      }
+      tail += hdr.size;
+    }
+    _tail.store(tail, memory_order_release);
+    return count;
+  }
+
+  uint64_t take_dropped() {
+    return _dropped.exchange(0, memory_order_relaxed);
+  }
+
+private:
+  char* _buf;
+  atomic<uint64_t> _head;
+  atomic<uint64_t> _tail;
+  atomic<uint64_t> _dropped;
+};
+
+class AsyncLog {
+public:
+  AsyncLog()
+    : _file(nullptr), _text(false), _fd(-1), _rotate_size(0), _written(0),
+      _num_sites(0), _stopping(false), _stopped(true), _dropped(0) {
+    memset(_sites, 0, sizeof(_sites));
+  }
+
+  int start(FILE* log_file, const string& path, uint64_t rotate_size);
+  void stop();
+  bool message(FILE* log_file, const char* file_name, uint32_t line,
+               const char* fmt, va_list args);
+  uint64_t dropped() const { return _dropped.load(); }
+
+private:
+  LogRing* thread_ring();
+  uint32_t site_id(const char* file_name, uint32_t line, const char* fmt);
+  void thread_main();
+  uint32_t drain();
+  void process(const char* rec);
+  void flush();
+  void rotate();
+
+  atomic<FILE*> _file;
+  string    _path;
+  bool      _text;            // format messages, for stderr
+  int       _fd;
+  uint64_t  _rotate_size;
+  uint64_t  _written;         // bytes in the current file
+
+  // Guards _rings and registration of sites
+  mutex     _mutex;
+  vector<LogRing*> _rings;
+  map<pair<const char*, uint32_t>, uint32_t> _site_ids;
+  LogSite*  _sites[MAX_LOG_SITES];
+  atomic<uint32_t> _num_sites;
+
+  // Guards the output, written by the background thread or, once stopped,
+  // by the thread logging
+  mutex     _out_mutex;
+  vector<bool> _site_written; // sites defined in the current file
+  string    _out;
+
+  atomic<bool> _stopping;
+  atomic<bool> _stopped;
+  thread    _thread;
+  atomic<uint64_t> _dropped;
+};
+
+static AsyncLog async_log;
+
+// Call sites seen by a thread. The key is the format address and the line,
+// user space addresses leave the top 16 bits free.
+static thread_local unordered_map<uint64_t, uint32_t>* thread_sites;
+static thread_local LogRing* thread_log_ring;
+
+int AsyncLog::start(FILE* log_file, const string& path, uint64_t rotate_size)
+{
+  if (_file.load() != nullptr) {
+    return -1;
+  }
+  _path = path;
+  _text = (log_file == stderr);
+  _rotate_size = rotate_size;
+  fflush(log_file);
+  _fd = dup(fileno(log_file));
+  if (_fd < 0) {
+    return -1;
+  }
+  fcntl(_fd, F_SETFD, FD_CLOEXEC);
+  if (!_text) {
+    // A binary log starts on a file of its own
+    struct stat st;
+    if (fstat(_fd, &st) == 0 && st.st_size > 0) {
+      rotate();
+    } else {
+      _written = 0;
+      _out.assign(log_magic, sizeof(log_magic));
+      flush();
+    }
+  }
+  _stopping = false;
+  _stopped = false;
+  _thread = thread(&AsyncLog::thread_main, this);
+  _file.store(log_file, memory_order_release);
+  static bool at_exit = false;
+  if (!at_exit) {
+    at_exit = true;
+    atexit(async_log_stop);
+  }
+  return 0;
+}
+
+void AsyncLog::stop()
+{
+  if (_stopped || _file.load() == nullptr) {
+    return;
+  }
+  _stopping = true;
+  if (_thread.joinable()) {
+    _thread.join();
+  }
+  lock_guard<mutex> lock(_out_mutex);
+  drain();
+  flush();
+  _stopped = true;
+}
+
+LogRing* AsyncLog::thread_ring()
+{
+  if (thread_log_ring == nullptr) {
+    thread_log_ring = new LogRing();
+    thread_sites = new unordered_map<uint64_t, uint32_t>();
+    // Rings stay around after their thread exits, until drained
+    lock_guard<mutex> lock(_mutex);
+    _rings.push_back(thread_log_ring);
+  }
+  return thread_log_ring;
+}
+
+// Returns MAX_LOG_SITES if there are too many sites
+uint32_t AsyncLog::site_id(const char* file_name, uint32_t line,
+                           const char* fmt)
+{
+  uint64_t key = (uint64_t)(uintptr_t)fmt ^ ((uint64_t)line << 48);
+  auto it = thread_sites->find(key);
+  if (it != thread_sites->end()) {
+    return it->second;
+  }
+  lock_guard<mutex> lock(_mutex);
+  auto site_key = make_pair(fmt, line);
+  auto site_it = _site_ids.find(site_key);
+  uint32_t id;
+  if (site_it != _site_ids.end()) {
+    id = site_it->second;
+  } else {
+    id = _num_sites.load();
+    if (id == MAX_LOG_SITES) {
+      return id;
+    }
+    LogSite* site = new LogSite();
+    site->file = file_name;
+    site->line = line;
+    site->fmt = fmt;
+    parse_format(site->fmt, site->convs);
+    _sites[id] = site;
+    _num_sites.store(id + 1, memory_order_release);
+    _site_ids[site_key] = id;
+  }
+  (*thread_sites)[key] = id;
+  return id;
+}
+
+bool AsyncLog::message(FILE* log_file, const char* file_name, uint32_t line,
+                       const char* fmt, va_list args)
+{
+  if (log_file == nullptr || log_file != _file.load(memory_order_acquire)) {
+    return false;
+  }
+  LogRing* ring = thread_ring();
+  uint32_t id = site_id(file_name, line, fmt);
+  if (id == MAX_LOG_SITES) {
+    _dropped++;
+    return true;
+  }
+  char rec[max_record_size];
+  LogMessageRecord* msg = (LogMessageRecord*)rec;
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  msg->hdr.type = LogMessage;
+  msg->hdr.reserved = 0;
+  msg->site = id;
+  msg->reserved = 0;
+  msg->time_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  char* end = encode_args(_sites[id], args, rec + sizeof(*msg),
+                          rec + sizeof(rec));
+  uint32_t size = align8(end - rec);
+  memset(end, 0, rec + size - end);
+  msg->hdr.size = size;
+  if (_stopped.load()) {
+    lock_guard<mutex> lock(_out_mutex);
+    process(rec);
+    flush();
+    return true;
+  }
+  ring->write(rec, size);
+  return true;
+}
+
+void AsyncLog::thread_main()
+{
+  // Placed before it allocates its buffers
+  enter_thread_role("log");
+  uint32_t idle_us = 0;
+  while (true) {
+    bool stopping = _stopping.load();
+    uint32_t count;
+    {
+      lock_guard<mutex> lock(_out_mutex);
+      count = drain();
+      flush();
+    }
+    if (count) {
+      idle_us = 0;
+      continue;
+    }
+    if (stopping) {
+      break;
+    }
+    // Polling keeps loggers free of system calls. The wait backs off while
+    // there is nothing to write.
+    idle_us = min(max(idle_us * 2, 100u), max_idle_us);
+    usleep(idle_us);
+  }
+}
+
+// Called with _out_mutex held
+uint32_t AsyncLog::drain()
+{
+  vector<LogRing*> rings;
+  {
+    lock_guard<mutex> lock(_mutex);
+    rings = _rings;
+  }
+  uint32_t count = 0;
+  for (auto ring : rings) {
+    count += ring->drain([this](const char* rec) { process(rec); });
+    uint64_t dropped = ring->take_dropped();
+    if (dropped) {
+      _dropped += dropped;
+      LogDroppedRecord rec;
+      rec.hdr.size = sizeof(rec);
+      rec.hdr.type = LogDropped;
+      rec.hdr.reserved = 0;
+      rec.count = dropped;
+      process((const char*)&rec);
+      count++;
+    }
+  }
+  return count;
+}
+
+// Called with _out_mutex held
+void AsyncLog::process(const char* rec)
+{
+  LogHeader hdr;
+  memcpy(&hdr, rec, sizeof(hdr));
+  if (hdr.type == LogDropped) {
+    if (_text) {
+      LogDroppedRecord dropped;
+      memcpy(&dropped, rec, sizeof(dropped));
+      char line[64];
+      snprintf(line, sizeof(line), "log dropped %lu messages\n",
+               (unsigned long)dropped.count);
+      _out.append(line);
+    } else {
+      _out.append(rec, hdr.size);
+    }
+    return;
+  }
+  LogMessageRecord msg;
+  memcpy(&msg, rec, sizeof(msg));
+  const LogSite* site = _sites[msg.site];
+  if (_text) {
+    format_message(site, rec + sizeof(msg), rec + hdr.size, _out);
+    return;
+  }
+  if (_site_written.size() <= msg.site) {
+    _site_written.resize(msg.site + 1);
+  }
+  if (!_site_written[msg.site]) {
+    _site_written[msg.site] = true;
+    LogSiteRecord def;
+    def.hdr.type = LogSiteDef;
+    def.hdr.reserved = 0;
+    def.site = msg.site;
+    def.line = site->line;
+    def.file_len = site->file.size();
+    def.fmt_len = site->fmt.size();
+    def.reserved = 0;
+    uint32_t size = sizeof(def) + def.file_len + def.fmt_len;
+    def.hdr.size = align8(size);
+    _out.append((const char*)&def, sizeof(def));
+    _out.append(site->file);
+    _out.append(site->fmt);
+    _out.append(def.hdr.size - size, '\0');
+  }
+  _out.append(rec, hdr.size);
+}
+
+// Called with _out_mutex held
+void AsyncLog::flush()
+{
+  size_t done = 0;
+  while (done < _out.size()) {
+    ssize_t n = ::write(_fd, _out.data() + done, _out.size() - done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    done += n;
+  }
+  _written += done;
+  _out.clear();
+  if (!_text && _written >= _rotate_size) {
+    rotate();
+  }
+}
+
+// Called with _out_mutex held, or before the background thread starts
+void AsyncLog::rotate()
+{
+  string old_path = _path + ".1";
+  rename(_path.c_str(), old_path.c_str());
+  int fd = open(_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    // Keep writing to the renamed file
+    return;
+  }
+  close(_fd);
+  _fd = fd;
+  _written = 0;
+  _site_written.clear();
+  _out.assign(log_magic, sizeof(log_magic));
+  flush();
+}
+
+int async_log_start(FILE* log_file, const string& path, uint64_t rotate_size)
+{
+  return async_log.start(log_file, path, rotate_size);
+}
+
+void async_log_stop()
+{
+  async_log.stop();
+}
+
+bool async_log_message(FILE* log_file, const char* file_name, uint32_t line,
+                       const char* fmt, va_list args)
+{
+  return async_log.message(log_file, file_name, line, fmt, args);
+}
+
+uint64_t async_log_dropped()
+{
+  return async_log.dropped();
+}
+
+int decode_log_file(const char* path, FILE* out)
+{
+  FILE* f = fopen(path, "r");
+  if (f == nullptr) {
+    return -1;
+  }
+  string data;
+  char buf[1 << 16];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    data.append(buf, n);
+  }
+  fclose(f);
+  if (data.size() < sizeof(log_magic) ||
+      memcmp(data.data(), log_magic, sizeof(log_magic)) != 0) {
+    return -1;
+  }
+  map<uint32_t, LogSite> sites;
+  int count = 0;
+  string text;
+  size_t pos = sizeof(log_magic);
+  while (pos + sizeof(LogHeader) <= data.size()) {
+    const char* rec = data.data() + pos;
+    LogHeader hdr;
+    memcpy(&hdr, rec, sizeof(hdr));
+    if (hdr.size < sizeof(hdr) || pos + hdr.size > data.size()) {
+      // Cut short by a crash
+      break;
+    }
+    pos += hdr.size;
+    if (hdr.type == LogSiteDef && hdr.size >= sizeof(LogSiteRecord)) {
+      LogSiteRecord def;
+      memcpy(&def, rec, sizeof(def));
+      if (sizeof(def) + def.file_len + def.fmt_len > hdr.size) {
+        continue;
+      }
+      LogSite& site = sites[def.site];
+      site.file.assign(rec + sizeof(def), def.file_len);
+      site.line = def.line;
+      site.fmt.assign(rec + sizeof(def) + def.file_len, def.fmt_len);
+      site.convs.clear();
+      parse_format(site.fmt, site.convs);
+    } else if (hdr.type == LogDropped && hdr.size >= sizeof(LogDroppedRecord)) {
+      LogDroppedRecord dropped;
+      memcpy(&dropped, rec, sizeof(dropped));
+      fprintf(out, "log dropped %lu messages\n", (unsigned long)dropped.count);
+    } else if (hdr.type == LogMessage && hdr.size >= sizeof(LogMessageRecord)) {
+      LogMessageRecord msg;
+      memcpy(&msg, rec, sizeof(msg));
+      auto it = sites.find(msg.site);
+      if (it == sites.end()) {
+        continue;
+      }
+      time_t sec = msg.time_ns / 1000000000;
+      struct tm tm;
+      localtime_r(&sec, &tm);
+      char stamp[32];
+      strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+      text.clear();
+      format_message(&it->second, rec + sizeof(msg), rec + hdr.size, text);
+      fprintf(out, "%s.%06u %s", stamp,
+              (unsigned)(msg.time_ns % 1000000000 / 1000), text.c_str());
+      count++;
+    }
+  }
+  return count;
+}
+
+}
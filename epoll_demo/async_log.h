@@ -0,0 +1,58 @@
+#ifndef __async_log_h__
+#define __async_log_h__
+//
+// Fred Xia (fxia@yahoo.com)
+//
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string>
+
+namespace epoll_demo {
+
+// Bytes in the log ring of each thread. A message that does not fit is
+// dropped and counted.
+#define LOG_RING_SIZE       (1 << 20)
+
+// A binary log file is renamed to <path>.1 once it grows past this
+#define LOG_ROTATE_SIZE     (64 << 20)
+
+// Distinct LOG call sites
+#define MAX_LOG_SITES       4096
+
+// Asynchronous logging of the messages of the LOG macros.
+//
+// Once started for a log file, log_message() no longer formats messages for
+// it. The calling thread copies a compact binary record of the time, the
+// call site and the arguments into a lock free ring of its own, and a
+// background thread drains the rings. A log on stderr is formatted as text
+// by the background thread. A log file gets the binary records as they are,
+// with the call sites defined once per file, and is read with log_decode.
+// Only one log is handled at a time, messages to any other FILE* are
+// written synchronously as before.
+//
+// Returns 0 for success, -1 for failure. path is the name of log_file, used
+// for rotation, or "stderr".
+int async_log_start(FILE* log_file, const std::string& path,
+                    uint64_t rotate_size = LOG_ROTATE_SIZE);
+
+// Write out every queued message and stop the background thread. Messages
+// logged afterwards are written by the calling thread. Also run at exit.
+void async_log_stop();
+
+// Queue a message if log_file is handled asynchronously. Returns false if it
+// is not, in which case the caller writes the message itself.
+bool async_log_message(FILE* log_file, const char* file_name, uint32_t line,
+                       const char* fmt, va_list args);
+
+// Messages dropped so far because a ring was full
+uint64_t async_log_dropped();
+
+// Write a binary log file as text to out. Returns number of messages, or -1
+// if the file cannot be read or is not a binary log
+int decode_log_file(const char* path, FILE* out);
+
+}
+
+#endif
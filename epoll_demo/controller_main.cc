@@ -0,0 +1,237 @@
+//
+// Fred Xia (fxia@yahoo.com)
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include "util.h"
+#include "task_controller.h"
+#include "shard.h"
+#include "async_log.h"
+#include "trace.h"
+#include "affinity.h"
+
+using namespace std;
+using namespace epoll_demo;
+
+static const char* usage = "Usage:\n"
+  "task_controller [-v] -p <port> -d <database> [-b <percent>]\n"
+  "\t[-W <high> [-L <low>]] [-S <snapshot> [-I <seconds>]] [-t <trace>]\n"
+  "\t[-A <socket>] [-R <hours>] [-C <cluster> -s <shard>] [-E <ms>]\n"
+  "\t[-Q <tenants>] [-O <dir>] [-P <role>=<cpus>]...\n"
+  "\t[-v] : Log to stderr instead of log file\n"
+  "\t-p <port> : Listening port\n"
+  "\t-d <database> : Task database file, sqlite3 or a task log\n"
+  "\t[-b <percent>] : Dispatch a backup copy of a running task to an idle\n"
+  "\t\tworker once its elapsed time exceeds <percent> of sleep time\n"
+  "\t[-W <high>] : Keep at most <high> ready tasks in memory, loading more\n"
+  "\t\tfrom database as they are dispatched\n"
+  "\t[-L <low>] : Load more tasks when ready tasks drop below <low>,\n"
+  "\t\tdefault is half of <high>\n"
+  "\t[-S <snapshot>] : Periodically save controller state to <snapshot>\n"
+  "\t\tand restore from it on restart\n"
+  "\t[-I <seconds>] : Seconds between snapshots, default 60\n"
+  "\t[-t <trace>] : Record task lifecycle spans to <trace> as a Chrome\n"
+  "\t\ttrace\n"
+  "\t[-A <socket>] : Answer admin and stats queries on Unix socket <socket>\n"
+  "\t[-R <hours>] : Move tasks completed at least <hours> ago to the archive\n"
+  "\t\tdatabase <database>.archive in the background\n"
+  "\t[-C <cluster>] : Run as a shard of the controllers listed in file\n"
+  "\t\t<cluster>, owning the tasks that hash to it. Port and database\n"
+  "\t\tdefault to those of the shard in the file\n"
+  "\t[-s <shard>] : Name of this shard in <cluster>\n"
+  "\t[-E <ms>] : A disconnected worker keeps its tasks for <ms> in case it\n"
+  "\t\tcomes back, default 5000. 0 gives them to other workers at once\n"
+  "\t[-Q <tenants>] : Share workers among tenants by the weights and caps\n"
+  "\t\tin file <tenants>, a line of <name> <weight> [<max running>] per\n"
+  "\t\ttenant. Other tenants have weight 1 and no cap\n"
+  "\t[-O <dir>] : Keep the results workers send in <dir>, a file per task\n"
+  "\t[-P <role>=<cpus>] : Run the threads of <role> on <cpus>, e.g. 2-3,6,\n"
+  "\t\twith memory of their NUMA node. Roles are reactor, which also\n"
+  "\t\twrites the database, log, watch and archive. Threads without\n"
+  "\t\tCPUs run on the CPUs given to no role\n";
+
+int main(int argc, char** argv)
+{
+  char ch;
+  int port = 0;
+  string db_name;
+  bool to_stderr = false;
+  ControllerOptions opts;
+  const char* trace_path = nullptr;
+  const char* admin_path = nullptr;
+  int archive_hours = -1;
+  const char* cluster_path = nullptr;
+  string shard_name;
+  if (argc == 0) {
+    printf(usage);
+    exit(0);
+  }
+  while ((ch = getopt(argc, argv, "hvp:d:b:W:L:S:I:t:A:R:C:s:E:Q:O:P:")) > 0) {
+    switch (ch) {
+    case 'h':
+      printf(usage);
+      exit(0);
+    case 'p': {
+      port = atoi(optarg);
+      if (port > MAX_PORT_NUMBER) {
+        fprintf(stderr, "Invalid port number %d\n", port);
+        exit(1);
+      }
+      break;
+    }
+    case 'd':
+      db_name = optarg;
+      break;
+    case 'v':
+      to_stderr = true;
+      break;
+    case 'b': {
+      int pct = atoi(optarg);
+      if (pct < 100) {
+        fprintf(stderr, "Invalid backup percentage %d\n", pct);
+        exit(1);
+      }
+      opts.backup_pct = (uint32_t)pct;
+      break;
+    }
+    case 'W':
+      opts.window_high = (uint32_t)atoi(optarg);
+      break;
+    case 'L':
+      opts.window_low = (uint32_t)atoi(optarg);
+      break;
+    case 'S':
+      opts.snapshot_path = optarg;
+      break;
+    case 'I':
+      opts.snapshot_interval = (uint32_t)atoi(optarg);
+      break;
+    case 't':
+      trace_path = optarg;
+      break;
+    case 'A':
+      admin_path = optarg;
+      break;
+    case 'R':
+      archive_hours = atoi(optarg);
+      break;
+    case 'C':
+      cluster_path = optarg;
+      break;
+    case 's':
+      shard_name = optarg;
+      break;
+    case 'E':
+      opts.lease_ms = atoi(optarg);
+      break;
+    case 'Q':
+      opts.tenants_path = optarg;
+      break;
+    case 'O':
+      opts.result_dir = optarg;
+      break;
+    case 'P': {
+      string role(optarg, strcspn(optarg, "="));
+      if ((role != "reactor" && role != "log" && role != "watch" &&
+           role != "archive") || parse_thread_role(optarg) < 0) {
+        fprintf(stderr, "Invalid thread placement %s\n", optarg);
+        exit(1);
+      }
+      break;
+    }
+    }
+  }
+  ShardRing ring;
+  int shard = -1;
+  if (cluster_path) {
+    if (ring.load(cluster_path, stderr) < 0) {
+      exit(1);
+    }
+    shard = ring.find(shard_name);
+    if (shard < 0) {
+      fprintf(stderr, "No shard '%s' in %s\n", shard_name.c_str(),
+              cluster_path);
+      exit(1);
+    }
+    if (!port) {
+      port = ring.shards()[shard].port;
+    }
+    if (db_name.empty()) {
+      db_name = ring.shards()[shard].database;
+    }
+  }
+  if (!port || db_name.empty()) {
+    printf("Invalid arguments\n");
+    printf(usage);
+    exit(1);
+  }
+  struct stat statBuf;
+  if (stat(db_name.c_str(), &statBuf) < 0) {
+    fprintf(stderr, "Database file does not exist: %s\n", db_name.c_str());
+    exit(1);
+  }
+  // Result paths are recorded with the task, and must fit a log record
+  if (!opts.result_dir.empty() &&
+      (stat(opts.result_dir.c_str(), &statBuf) < 0 ||
+       !S_ISDIR(statBuf.st_mode) ||
+       opts.result_dir.size() + MAX_TASK_NAME_LEN >= MAX_RESULT_PATH_LEN)) {
+    fprintf(stderr, "Invalid result directory: %s\n",
+            opts.result_dir.c_str());
+    exit(1);
+  }
+  if (opts.window_low == 0 || opts.window_low > opts.window_high) {
+    opts.window_low = max(opts.window_high / 2, 1u);
+  }
+  // Before the controller allocates its state, so that it is local to the
+  // reactor, and before the other threads start
+  if (enter_thread_role("reactor") < 0) {
+    fprintf(stderr, "Cannot place reactor thread: %s\n", strerror(errno));
+    exit(1);
+  }
+  TaskController controller(db_name.c_str(), port, to_stderr, opts);
+  fprintf(stderr, "Controller log file is %s\n",
+          controller.log_file_name().c_str());
+  if (trace_path && trace_start(trace_path, "task_controller") < 0) {
+    fprintf(stderr, "Cannot open trace file %s\n", trace_path);
+    exit(1);
+  }
+  // Messages are formatted and written off the reactor thread
+  if (async_log_start(controller.log_file(), controller.log_file_name()) < 0) {
+    fprintf(stderr, "Cannot start asynchronous logging\n");
+  }
+  if (shard >= 0 && controller.join_cluster(&ring, shard) < 0) {
+    fprintf(stderr, "Cannot join cluster %s\n", cluster_path);
+    exit(1);
+  }
+  if (controller.init() < 0) {
+    fprintf(stderr, "Controller initialization failed\n");
+    exit(1);
+  }
+  // A reply may race with a worker closing its connection
+  signal(SIGPIPE, SIG_IGN);
+  if (controller.watch_db(db_name.c_str()) < 0) {
+    fprintf(stderr, "Cannot watch database, new tasks are found every %u "
+            "seconds\n", default_timeout / 1000);
+  }
+  if (archive_hours >= 0 &&
+      controller.start_archiver(db_name.c_str(), archive_hours * 3600) < 0) {
+    fprintf(stderr, "Cannot start archiving\n");
+    exit(1);
+  }
+  if (admin_path) {
+    controller.listen_unix(admin_path);
+  }
+  controller.run_loop();
+  if (controller._snapshot) {
+    controller.save_snapshot();
+  }
+  trace_stop();
+  async_log_stop();
+  return 0;
+}
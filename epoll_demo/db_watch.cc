@@ -0,0 +1,223 @@
+//
+// Fred Xia (fxia@yahoo.com)
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include "util.h"
+#include "db_watch.h"
+#include "log_store.h"
+#include "affinity.h"
+
+using namespace std;
+
+#define LOG(fmt, args...) do { \
+   log_message(_log_file, __FILE__, __LINE__, fmt, ##args); \
+} while (0)
+
+namespace epoll_demo {
+
+// Milliseconds between checks without inotify events, in case a change is
+// missed, e.g. on a network file system
+#define DB_WATCH_POLL_MS      1000
+
+// Least milliseconds between two checks. Every write of the controller is
+// an inotify event, checking each of them would only contend for locks.
+#define DB_WATCH_MIN_GAP_MS   2
+
+DbWatcher::DbWatcher(const char* db_file_name, FILE* log_file)
+  : _db_name(db_file_name), _log_file(log_file), _db(nullptr),
+    _store(nullptr),
+    _event_fd(-1), _stop_fd(-1), _inotify_fd(-1), _data_version(-1),
+    _rowid(0)
+{
+  size_t slash = _db_name.rfind('/');
+  _dir = (slash == string::npos ? "." : _db_name.substr(0, slash + 1));
+  _base = (slash == string::npos ? _db_name : _db_name.substr(slash + 1));
+}
+
+DbWatcher::~DbWatcher()
+{
+  stop();
+}
+
+int DbWatcher::start(int64_t rowid)
+{
+  _rowid = rowid;
+  if (LogStore::is_log(_db_name.c_str())) {
+    _store = new LogStore(_db_name.c_str(), _log_file, false);
+  } else {
+    int rc = sqlite3_open_v2(_db_name.c_str(), &_db, SQLITE_OPEN_READONLY, 0);
+    if (rc != SQLITE_OK) {
+      LOG("Cannot open database %s: %s", _db_name.c_str(),
+          sqlite3_errmsg(_db));
+      sqlite3_close(_db);
+      _db = nullptr;
+      return -1;
+    }
+    sqlite3_busy_timeout(_db, 100);
+  }
+  _event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  _stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (_event_fd < 0 || _stop_fd < 0) {
+    LOG("Error in eventfd(): %s", strerror(errno));
+    stop();
+    return -1;
+  }
+  // The directory is watched since the WAL file comes and goes. Without
+  // inotify changes are still found by polling.
+  _inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (_inotify_fd < 0 ||
+      inotify_add_watch(_inotify_fd, _dir.c_str(),
+                        IN_MODIFY | IN_CREATE | IN_MOVED_TO) < 0) {
+    LOG("Cannot watch %s, polling: %s", _dir.c_str(), strerror(errno));
+    if (_inotify_fd >= 0) {
+      close(_inotify_fd);
+      _inotify_fd = -1;
+    }
+  }
+  check();
+  _thread = thread(&DbWatcher::run, this);
+  LOG("Watching %s for new tasks after rowid %ld", _db_name.c_str(),
+      (long)rowid);
+  return 0;
+}
+
+void DbWatcher::stop()
+{
+  if (_thread.joinable()) {
+    uint64_t one = 1;
+    if (::write(_stop_fd, &one, sizeof(one)) < 0) {
+      LOG("Error in write(): %s", strerror(errno));
+    }
+    _thread.join();
+  }
+  int* fds[] = { &_event_fd, &_stop_fd, &_inotify_fd };
+  for (int* fd : fds) {
+    if (*fd >= 0) {
+      close(*fd);
+      *fd = -1;
+    }
+  }
+  if (_db) {
+    sqlite3_close(_db);
+    _db = nullptr;
+  }
+  delete _store;
+  _store = nullptr;
+}
+
+bool DbWatcher::consume()
+{
+  uint64_t count;
+  return ::read(_event_fd, &count, sizeof(count)) == sizeof(count);
+}
+
+// Signal the event loop if rows were added. Returns 0 for success, -1 if
+// the database cannot be read at the moment
+int DbWatcher::check()
+{
+  if (_store) {
+    int64_t rowid = _store->max_rowid();
+    if (rowid > _rowid) {
+      _rowid = rowid;
+      uint64_t one = 1;
+      return ::write(_event_fd, &one, sizeof(one)) < 0 ? -1 : 0;
+    }
+    return rowid < 0 ? -1 : 0;
+  }
+  sqlite3_stmt* stmt;
+  if (sqlite3_prepare_v2(_db, "pragma data_version", -1, &stmt, 0) !=
+      SQLITE_OK) {
+    return -1;
+  }
+  int64_t version = -1;
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    version = sqlite3_column_int64(stmt, 0);
+  }
+  sqlite3_finalize(stmt);
+  if (version < 0 || version == _data_version) {
+    return version < 0 ? -1 : 0;
+  }
+  if (sqlite3_prepare_v2(_db, "select max(rowid) from demo_task", -1, &stmt,
+                         0) != SQLITE_OK) {
+    return -1;
+  }
+  int r = -1;
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    r = 0;
+    _data_version = version;
+    int64_t rowid = sqlite3_column_int64(stmt, 0);
+    if (rowid > _rowid) {
+      _rowid = rowid;
+      uint64_t one = 1;
+      if (::write(_event_fd, &one, sizeof(one)) < 0) {
+        r = -1;
+      }
+    }
+  }
+  sqlite3_finalize(stmt);
+  return r;
+}
+
+void DbWatcher::run()
+{
+  if (enter_thread_role("watch") < 0) {
+    LOG("Cannot place watcher thread: %s", strerror(errno));
+  }
+  uint64_t last_check = monotonic_ms();
+  bool pending = false;   // an event came in too soon after a check
+  char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  while (true) {
+    struct pollfd fds[2] = {
+      { _stop_fd, POLLIN, 0 },
+      { _inotify_fd, POLLIN, 0 },
+    };
+    uint64_t now = monotonic_ms();
+    uint64_t wait = DB_WATCH_POLL_MS;
+    if (pending) {
+      wait = DB_WATCH_MIN_GAP_MS - min(now - last_check,
+                                       (uint64_t)DB_WATCH_MIN_GAP_MS);
+    }
+    int r = poll(fds, _inotify_fd >= 0 ? 2 : 1, (int)wait);
+    if (r < 0 && errno != EINTR) {
+      LOG("Error in poll(): %s", strerror(errno));
+      return;
+    }
+    if (fds[0].revents) {
+      return;
+    }
+    bool changed = (r == 0);
+    if (r > 0 && fds[1].revents) {
+      ssize_t len;
+      while ((len = ::read(_inotify_fd, buf, sizeof(buf))) > 0) {
+        for (char* p = buf; p < buf + len; ) {
+          struct inotify_event* ev = (struct inotify_event*)p;
+          // The database, its WAL or its rollback journal
+          if (ev->len && strncmp(ev->name, _base.c_str(), _base.size()) == 0) {
+            changed = true;
+          }
+          p += sizeof(struct inotify_event) + ev->len;
+        }
+      }
+    }
+    if (!changed && !pending) {
+      continue;
+    }
+    now = monotonic_ms();
+    if (now - last_check < DB_WATCH_MIN_GAP_MS) {
+      pending = true;
+      continue;
+    }
+    pending = false;
+    last_check = now;
+    check();
+  }
+}
+
+}
@@ -0,0 +1,66 @@
+#ifndef __db_watch_h__
+#define __db_watch_h__
+//
+// Fred Xia (fxia@yahoo.com)
+//
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sqlite3.h>
+#include <string>
+#include <atomic>
+#include <thread>
+#include "task_db.h"
+
+namespace epoll_demo {
+
+// Watches the task database for new tasks from a thread of its own, so the
+// controller learns about them within milliseconds however busy it is.
+//
+// The thread sleeps on inotify events of the database file and its WAL, and
+// at most every DB_WATCH_POLL_MS. When the database changed, as told by
+// "pragma data_version" of its own connection, it reads the largest rowid
+// of the task table. A rowid past the last one seen means tasks were added,
+// and an eventfd is signalled for the event loop to load them. Changes made
+// by the controller itself only cost the thread a cheap query. A task log
+// is followed by an index of its own, which reads only the records
+// appended since the last check.
+class DbWatcher {
+public:
+  DbWatcher(const char* db_file_name, FILE* log_file);
+  ~DbWatcher();
+
+  // Start watching for rows after rowid. Returns 0 for success, -1 for
+  // failure
+  int start(int64_t rowid);
+
+  // Stop the thread. Also done by the destructor.
+  void stop();
+
+  // Readable when tasks were added. Owned by the watcher.
+  int event_fd() const { return _event_fd; }
+
+  // Clear the signal of event_fd(). Returns true if it was signalled.
+  bool consume();
+
+private:
+  void run();
+  int check();
+
+  std::string _db_name;
+  std::string _dir;         // directory of the database, watched by inotify
+  std::string _base;        // file name of the database in _dir
+  FILE* _log_file;
+  sqlite3* _db;
+  TaskStore* _store;        // for a task log instead of _db
+  int _event_fd;
+  int _stop_fd;
+  int _inotify_fd;
+  int64_t _data_version;
+  int64_t _rowid;           // largest rowid seen
+  std::thread _thread;
+};
+
+}
+
+#endif
@@ -0,0 +1,353 @@
+//
+// Fred Xia (fxia@yahoo.com)
+//
+// End to end benchmark of task dispatch. Creates a database of short
+// tasks, starts task_controller on it and drives it with a fleet of
+// simulated workers until every task is done. Throughput, dispatch latency
+// and the CPU and memory used by the controller are written as JSON, so
+// runs can be compared over time. Placement of the controller threads is
+// compared by passing e.g. -- -P reactor=2 -P log=3, with the simulated
+// workers kept off those CPUs by -a.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sqlite3.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "util.h"
+#include "load_gen.h"
+#include "affinity.h"
+
+using namespace std;
+using namespace epoll_demo;
+
+// How long to wait for the controller to start listening
+static const uint32_t start_timeout_ms = 10000;
+
+// Create the task table with num_tasks tasks of up to max_sleep_ms each
+static int create_db(const char* db_name, uint32_t num_tasks,
+                     uint32_t max_sleep_ms)
+{
+  unlink(db_name);
+  sqlite3* db;
+  if (sqlite3_open(db_name, &db) != SQLITE_OK) {
+    fprintf(stderr, "Cannot create database %s\n", db_name);
+    return -1;
+  }
+  const char* schema =
+    "create table demo_task (task_name text primary key, sleep_time integer, "
+    "state integer, worker text, assign_time integer, "
+    "complete_time integer, sleep_ms integer);"
+    "begin;";
+  char* err = nullptr;
+  if (sqlite3_exec(db, schema, nullptr, nullptr, &err) != SQLITE_OK) {
+    fprintf(stderr, "Cannot create task table: %s\n", err);
+    sqlite3_free(err);
+    sqlite3_close(db);
+    return -1;
+  }
+  sqlite3_stmt* stmt;
+  sqlite3_prepare_v2(db, "insert into demo_task values (?, ?, 0, '', 0, 0, ?)",
+                     -1, &stmt, nullptr);
+  for (uint32_t i = 0; i < num_tasks; i++) {
+    char name[MAX_TASK_NAME_LEN];
+    snprintf(name, sizeof(name), "task_%u", i);
+    uint32_t sleep_ms = max_sleep_ms ? rand() % (max_sleep_ms + 1) : 0;
+    sqlite3_bind_text(stmt, 1, name, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int(stmt, 2, sleep_ms / 1000);
+    sqlite3_bind_int(stmt, 3, sleep_ms);
+    sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+  }
+  sqlite3_finalize(stmt);
+  int rc = sqlite3_exec(db, "commit;", nullptr, nullptr, nullptr);
+  sqlite3_close(db);
+  return rc == SQLITE_OK ? 0 : -1;
+}
+
+// Number of tasks in the database that succeeded, -1 if error
+static int count_completed(const char* db_name)
+{
+  sqlite3* db;
+  if (sqlite3_open_v2(db_name, &db, SQLITE_OPEN_READONLY, nullptr)
+      != SQLITE_OK) {
+    return -1;
+  }
+  int count = -1;
+  sqlite3_stmt* stmt;
+  if (sqlite3_prepare_v2(db, "select count(*) from demo_task where state = 3",
+                         -1, &stmt, nullptr) == SQLITE_OK) {
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+      count = sqlite3_column_int(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+  }
+  sqlite3_close(db);
+  return count;
+}
+
+// File change counter of a sqlite database, which every write transaction
+// bumps. Returns -1 if error
+static int64_t db_change_counter(const char* db_name)
+{
+  int fd = open(db_name, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  // Big endian, at offset 24 of the database header
+  unsigned char buf[4];
+  ssize_t n = pread(fd, buf, sizeof(buf), 24);
+  close(fd);
+  if (n != (ssize_t)sizeof(buf)) {
+    return -1;
+  }
+  return ((int64_t)buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+}
+
+// Start the controller with its log discarded. Extra arguments are passed
+// through, e.g. -W for windowed loading.
+static pid_t start_controller(const char* path, const char* db_name,
+                              int port, char** extra_args, int num_extra)
+{
+  string port_str = to_string(port);
+  vector<char*> argv;
+  argv.push_back((char*)path);
+  argv.push_back((char*)"-v");
+  argv.push_back((char*)"-p");
+  argv.push_back((char*)port_str.c_str());
+  argv.push_back((char*)"-d");
+  argv.push_back((char*)db_name);
+  for (int i = 0; i < num_extra; i++) {
+    argv.push_back(extra_args[i]);
+  }
+  argv.push_back(nullptr);
+  pid_t pid = fork();
+  if (pid == 0) {
+    int fd = open("/dev/null", O_WRONLY);
+    dup2(fd, 2);
+    execv(path, argv.data());
+    _exit(127);
+  }
+  return pid;
+}
+
+// Wait until the controller accepts connections. Returns 0 if it does, -1
+// if it exited or did not start in time.
+static int wait_listening(pid_t pid, const sockaddr_in& addr)
+{
+  uint64_t deadline = monotonic_ms() + start_timeout_ms;
+  while (monotonic_ms() < deadline) {
+    if (waitpid(pid, nullptr, WNOHANG) == pid) {
+      return -1;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int r = ::connect(fd, (struct sockaddr*)&addr, sizeof(addr));
+    close(fd);
+    if (r == 0) {
+      return 0;
+    }
+    usleep(10000);
+  }
+  return -1;
+}
+
+static uint32_t percentile(const vector<uint32_t>& sorted, double p)
+{
+  if (sorted.empty()) {
+    return 0;
+  }
+  size_t i = min((size_t)(p * sorted.size()), sorted.size() - 1);
+  return sorted[i];
+}
+
+static const char* usage =
+  "Usage:\n"
+  "\tdispatch_bench [-n <tasks>] [-m <workers>] [-t <max sleep ms>]\n"
+  "\t\t[-T <threads>] [-p <port>] [-c <controller>] [-d <db file>]\n"
+  "\t\t[-o <json file>] [-a <cpus>] [-- <controller args>]\n"
+  "\t[-a <cpus>] : Run the simulated workers on <cpus>, e.g. 0-1\n";
+
+int main(int argc, char** argv)
+{
+  char ch;
+  uint32_t num_tasks = 100000;
+  uint32_t max_sleep_ms = 0;
+  int port = 2041;
+  const char* controller = "./task_controller";
+  const char* db_name = "/tmp/dispatch_bench.db";
+  const char* json_file = nullptr;
+  const char* bench_cpus = "";
+  LoadGenOptions opts;
+  opts.num_workers = 100;
+  opts.id_prefix = "bench";
+  opts.record_latency = true;
+  while ((ch = getopt(argc, argv, "hn:m:t:T:p:c:d:o:a:")) > 0) {
+    switch (ch) {
+    case 'n':
+      num_tasks = (uint32_t)atoi(optarg);
+      break;
+    case 'm':
+      opts.num_workers = (uint32_t)atoi(optarg);
+      break;
+    case 't':
+      max_sleep_ms = (uint32_t)atoi(optarg);
+      break;
+    case 'T':
+      opts.num_threads = (uint32_t)atoi(optarg);
+      break;
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 'c':
+      controller = optarg;
+      break;
+    case 'd':
+      db_name = optarg;
+      break;
+    case 'o':
+      json_file = optarg;
+      break;
+    case 'a':
+      bench_cpus = optarg;
+      if (set_thread_role("bench", bench_cpus) < 0) {
+        fprintf(stderr, "Invalid CPUs %s\n", bench_cpus);
+        exit(1);
+      }
+      break;
+    default:
+      printf(usage);
+      exit(ch == 'h' ? 0 : 1);
+    }
+  }
+  if (num_tasks == 0 || opts.num_workers == 0 || opts.num_threads == 0 ||
+      port <= 0 || port > MAX_PORT_NUMBER) {
+    printf(usage);
+    exit(1);
+  }
+  srand(1);
+  if (create_db(db_name, num_tasks, max_sleep_ms) < 0) {
+    exit(1);
+  }
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  uint64_t controller_start = monotonic_ms();
+  pid_t pid = start_controller(controller, db_name, port, argv + optind,
+                               argc - optind);
+  if (pid < 0 || wait_listening(pid, addr) < 0) {
+    fprintf(stderr, "Cannot start %s\n", controller);
+    if (pid > 0) {
+      kill(pid, SIGKILL);
+      waitpid(pid, nullptr, 0);
+    }
+    exit(1);
+  }
+  // The controller is started first, so that it is not confined with the
+  // workers
+  if (enter_thread_role("bench") < 0) {
+    fprintf(stderr, "Cannot run on CPUs %s\n", bench_cpus);
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+    exit(1);
+  }
+  // The controller updates the task table in a transaction of its own per
+  // state change, once it is listening
+  int64_t changes_start = db_change_counter(db_name);
+  string controller_args;
+  for (int i = optind; i < argc; i++) {
+    controller_args += (i > optind ? " " : "") + string(argv[i]);
+  }
+
+  // The run lasts until the controller runs out of tasks and tells every
+  // worker to exit
+  LoadGenerator gen(addr, opts, stderr);
+  uint64_t start = monotonic_ms();
+  int r = gen.run();
+  uint64_t elapsed_ms = max(monotonic_ms() - start, (uint64_t)1);
+  if (r < 0) {
+    kill(pid, SIGTERM);
+  }
+  int status = 0;
+  struct rusage usage;
+  memset(&usage, 0, sizeof(usage));
+  wait4(pid, &status, 0, &usage);
+  uint64_t controller_ms = max(monotonic_ms() - controller_start,
+                               (uint64_t)1);
+
+  const LoadGenStats& stats = gen.stats();
+  vector<uint32_t> latencies;
+  gen.latencies(latencies);
+  sort(latencies.begin(), latencies.end());
+  int completed = count_completed(db_name);
+  uint64_t user_ms = usage.ru_utime.tv_sec * 1000 +
+                     usage.ru_utime.tv_usec / 1000;
+  uint64_t sys_ms = usage.ru_stime.tv_sec * 1000 +
+                    usage.ru_stime.tv_usec / 1000;
+  // Counted by the database, so kills, backups and fenced off reports are
+  // as they happened at the controller
+  int64_t changes_end = db_change_counter(db_name);
+  uint32_t db_updates = 0;
+  if (changes_start >= 0 && changes_end >= 0) {
+    db_updates = (uint32_t)(changes_end - changes_start);
+  }
+
+  FILE* out = stdout;
+  if (json_file) {
+    out = fopen(json_file, "w");
+    if (out == nullptr) {
+      fprintf(stderr, "Cannot open %s: %s\n", json_file, strerror(errno));
+      exit(1);
+    }
+  }
+  fprintf(out,
+          "{\n"
+          "  \"benchmark\": \"dispatch\",\n"
+          "  \"timestamp\": %ld,\n"
+          "  \"config\": {\"tasks\": %u, \"workers\": %u, \"threads\": %u, "
+          "\"max_sleep_ms\": %u, \"bench_cpus\": %s, "
+          "\"controller_args\": %s},\n"
+          "  \"elapsed_ms\": %lu,\n"
+          "  \"tasks_completed\": %d,\n"
+          "  \"dispatches\": %lu,\n"
+          "  \"dispatches_per_sec\": %.1f,\n"
+          "  \"db_updates\": %u,\n"
+          "  \"db_updates_per_sec\": %.1f,\n"
+          "  \"dispatch_latency_us\": {\"samples\": %zu, \"p50\": %u, "
+          "\"p99\": %u, \"p999\": %u, \"max\": %u},\n"
+          "  \"controller\": {\"exit_status\": %d, \"wall_ms\": %lu, "
+          "\"user_ms\": %lu, \"sys_ms\": %lu, \"cpu_pct\": %.1f, "
+          "\"max_rss_kb\": %ld}\n"
+          "}\n",
+          (long)time(0), num_tasks, opts.num_workers, opts.num_threads,
+          max_sleep_ms, json_string(bench_cpus).c_str(),
+          json_string(controller_args).c_str(), (unsigned long)elapsed_ms,
+          completed,
+          (unsigned long)stats.assigned, stats.assigned * 1000.0 / elapsed_ms,
+          db_updates, db_updates * 1000.0 / elapsed_ms, latencies.size(),
+          percentile(latencies, 0.5), percentile(latencies, 0.99),
+          percentile(latencies, 0.999),
+          latencies.empty() ? 0 : latencies.back(),
+          WIFEXITED(status) ? WEXITSTATUS(status) : -1,
+          (unsigned long)controller_ms, (unsigned long)user_ms,
+          (unsigned long)sys_ms, (user_ms + sys_ms) * 100.0 / controller_ms,
+          usage.ru_maxrss);
+  if (out != stdout) {
+    fclose(out);
+  }
+  return r == 0 && completed == (int)num_tasks ? 0 : 1;
+}
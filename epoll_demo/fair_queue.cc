@@ -0,0 +1,197 @@
+//
+// Fred Xia (fxia@yahoo.com)
+//
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "util.h"
+#include "fair_queue.h"
+
+using namespace std;
+
+#define LOG(fmt, args...) do { \
+  log_message(log_file, __FILE__, __LINE__, fmt, ##args); \
+} while (0)
+
+namespace epoll_demo {
+
+int FairQueue::load(const char* path, FILE* log_file)
+{
+  FILE* f = fopen(path, "r");
+  if (f == nullptr) {
+    LOG("Cannot open tenants file %s: %s", path, strerror(errno));
+    return -1;
+  }
+  char line[1024];
+  uint32_t line_no = 0;
+  int r = 0;
+  while (r == 0 && fgets(line, sizeof(line), f)) {
+    line_no++;
+    char name[256];
+    int weight = 0;
+    int max_running = 0;
+    int n = sscanf(line, " %255s %d %d", name, &weight, &max_running);
+    if (n <= 0 || name[0] == '#') {
+      continue;
+    }
+    if (n < 2 || weight <= 0 || max_running < 0 ||
+        strlen(name) >= MAX_TASK_NAME_LEN) {
+      LOG("Invalid tenant at line %u of %s", line_no, path);
+      r = -1;
+      break;
+    }
+    TenantConfig config;
+    config.name = name;
+    config.weight = weight;
+    config.max_running = (n == 3 ? max_running : 0);
+    set_tenant(config);
+  }
+  fclose(f);
+  return r;
+}
+
+void FairQueue::set_tenant(const TenantConfig& config)
+{
+  auto it = _ids.find(config.name);
+  uint32_t id;
+  if (it == _ids.end()) {
+    id = _tenants.size();
+    _ids[config.name] = id;
+    _tenants.push_back(Tenant());
+    Tenant& tenant = _tenants.back();
+    tenant.running = 0;
+    tenant.deficit = 0;
+    tenant.dispatched = 0;
+    tenant.in_round = false;
+  } else {
+    id = it->second;
+  }
+  Tenant& tenant = _tenants[id];
+  tenant.config = config;
+  tenant.config.weight = max(config.weight, 1u);
+  tenant.deficit = min(tenant.deficit, tenant.config.weight);
+  if (config.max_running && tenant.running >= config.max_running) {
+    leave_round(id);
+  } else {
+    join_round(id);
+  }
+}
+
+// Index of the tenant of a task, added with the defaults if not known yet.
+// Resolved once per task.
+uint32_t FairQueue::tenant_of(Task* t)
+{
+  if (t->tenant_id == 0) {
+    const string& name = t->tenant.empty() ? DEFAULT_TENANT : t->tenant;
+    auto it = _ids.find(name);
+    if (it == _ids.end()) {
+      TenantConfig config;
+      config.name = name;
+      set_tenant(config);
+      it = _ids.find(name);
+    }
+    t->tenant_id = it->second + 1;
+  }
+  return t->tenant_id - 1;
+}
+
+// Join the back of the round if the tenant has ready tasks and is under its
+// cap
+void FairQueue::join_round(uint32_t id)
+{
+  Tenant& tenant = _tenants[id];
+  if (tenant.in_round || tenant.ready.size() == 0 ||
+      (tenant.config.max_running &&
+       tenant.running >= tenant.config.max_running)) {
+    return;
+  }
+  tenant.round_pos = _round.insert(_round.end(), id);
+  tenant.in_round = true;
+}
+
+// Leave the round. The next turn starts with a full weight again.
+void FairQueue::leave_round(uint32_t id)
+{
+  Tenant& tenant = _tenants[id];
+  if (!tenant.in_round) {
+    return;
+  }
+  _round.erase(tenant.round_pos);
+  tenant.in_round = false;
+  tenant.deficit = 0;
+}
+
+void FairQueue::push(Task* t)
+{
+  if (t->queued) {
+    return;
+  }
+  uint32_t id = tenant_of(t);
+  _tenants[id].ready.push(t);
+  _size++;
+  join_round(id);
+}
+
+Task* FairQueue::pop()
+{
+  if (_round.empty()) {
+    return nullptr;
+  }
+  uint32_t id = _round.front();
+  Tenant& tenant = _tenants[id];
+  if (tenant.deficit == 0) {
+    tenant.deficit = tenant.config.weight;
+  }
+  Task* t = tenant.ready.pop();
+  _size--;
+  tenant.deficit--;
+  tenant.dispatched++;
+  if (tenant.ready.size() == 0) {
+    leave_round(id);
+  } else if (tenant.deficit == 0) {
+    // Turn is over
+    _round.splice(_round.end(), _round, tenant.round_pos);
+  }
+  return t;
+}
+
+void FairQueue::remove(Task* t)
+{
+  if (!t->queued) {
+    return;
+  }
+  uint32_t id = tenant_of(t);
+  _tenants[id].ready.remove(t);
+  _size--;
+  if (_tenants[id].ready.size() == 0) {
+    leave_round(id);
+  }
+}
+
+void FairQueue::start(Task* t)
+{
+  if (t->tenant_running) {
+    return;
+  }
+  t->tenant_running = true;
+  uint32_t id = tenant_of(t);
+  Tenant& tenant = _tenants[id];
+  tenant.running++;
+  if (tenant.config.max_running &&
+      tenant.running >= tenant.config.max_running) {
+    leave_round(id);
+  }
+}
+
+void FairQueue::stop(Task* t)
+{
+  if (!t->tenant_running) {
+    return;
+  }
+  t->tenant_running = false;
+  uint32_t id = tenant_of(t);
+  _tenants[id].running--;
+  join_round(id);
+}
+
+}
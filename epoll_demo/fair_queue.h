@@ -0,0 +1,96 @@
+#ifndef __task_fair_queue_h__
+#define __task_fair_queue_h__
+//
+// Fred Xia (fxia@yahoo.com)
+//
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <deque>
+#include <list>
+#include <unordered_map>
+#include "task_db.h"
+#include "task_graph.h"
+
+namespace epoll_demo {
+
+// Share of the workers a tenant gets
+struct TenantConfig {
+  std::string name;
+  uint32_t    weight;         // tasks dispatched in each of its turns
+  uint32_t    max_running;    // cap of running tasks, 0 if none
+
+  TenantConfig() : weight(1), max_running(0) {}
+};
+
+// Ready tasks of all tenants, each tenant in a FIFO of its own. Tenants
+// with ready tasks take turns by deficit round robin: the tenant at the
+// head of the round is given up to its weight in tasks, then goes to the
+// back. A tenant at its cap of running tasks sits out of the round until
+// one of them stops running. Every operation is O(1), however many tenants
+// and tasks are queued.
+//
+// The tenants file has a line per tenant:
+//
+//   <name> <weight> [<max running>]
+//
+// Blank lines and lines starting with '#' are skipped. Tenants not in the
+// file have weight 1 and no cap.
+class FairQueue {
+public:
+  struct Tenant {
+    TenantConfig  config;
+    ReadyQueue    ready;
+    uint32_t      running;      // tasks counted against the cap
+    uint32_t      deficit;      // tasks left of its current turn
+    uint64_t      dispatched;   // tasks popped since start
+    bool          in_round;
+    std::list<uint32_t>::iterator round_pos;
+  };
+
+  FairQueue() : _size(0) {}
+
+  // Read the tenants file. Returns 0 for success, -1 for failure
+  int load(const char* path, FILE* log_file);
+
+  // Add a tenant or change its weight and cap
+  void set_tenant(const TenantConfig& config);
+
+  // Append a task to the queue of its tenant. No-op if already queued.
+  void push(Task* t);
+
+  // Remove and return the next task in turn, nullptr if no tenant under
+  // its cap has a ready task
+  Task* pop();
+
+  // Remove a task if queued
+  void remove(Task* t);
+
+  // Ready tasks of all tenants, including those at their cap
+  size_t size() const { return _size; }
+
+  // Whether pop() would return a task
+  bool dispatchable() const { return !_round.empty(); }
+
+  // The task started or stopped running. A running task counts against the
+  // cap of its tenant once, however often it is reported.
+  void start(Task* t);
+  void stop(Task* t);
+
+  const std::deque<Tenant>& tenants() const { return _tenants; }
+
+private:
+  uint32_t tenant_of(Task* t);
+  void join_round(uint32_t id);
+  void leave_round(uint32_t id);
+
+  std::deque<Tenant> _tenants;   // by index, never moved once added
+  std::unordered_map<std::string, uint32_t> _ids;  // name => index
+  std::list<uint32_t> _round;   // tenants in the round, head has the turn
+  size_t _size;
+};
+
+}
+
+#endif
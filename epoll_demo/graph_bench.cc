@@ -0,0 +1,105 @@
+//
+// Fred Xia (fxia@yahoo.com)
+//
+// Benchmark of task dependency tracking. Builds a random DAG of tasks, then
+// drains it the way task_controller does: pop a ready task, complete it and
+// queue the dependents it releases.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "task_graph.h"
+
+using namespace std;
+using namespace epoll_demo;
+
+static double now_sec()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const char* usage =
+  "Usage:\n"
+  "\tgraph_bench [-n <tasks>] [-e <edges per task>] [-r <seed>]\n";
+
+int main(int argc, char** argv)
+{
+  char ch;
+  uint32_t num_tasks = 1000000;
+  uint32_t edges_per_task = 4;
+  unsigned seed = 1;
+  while ((ch = getopt(argc, argv, "hn:e:r:")) > 0) {
+    switch (ch) {
+    case 'n':
+      num_tasks = (uint32_t)atoi(optarg);
+      break;
+    case 'e':
+      edges_per_task = (uint32_t)atoi(optarg);
+      break;
+    case 'r':
+      seed = (unsigned)atoi(optarg);
+      break;
+    default:
+      printf(usage);
+      exit(ch == 'h' ? 0 : 1);
+    }
+  }
+  srand(seed);
+  vector<Task*> tasks(num_tasks);
+  unordered_map<string, Task*> by_name;
+  for (uint32_t i = 0; i < num_tasks; i++) {
+    Task* t = new Task();
+    t->task_name = "task_" + to_string(i);
+    t->state = TaskCreated;
+    tasks[i] = t;
+    by_name[t->task_name] = t;
+  }
+
+  // Every task depends on up to edges_per_task earlier tasks
+  TaskGraph graph;
+  double start = now_sec();
+  for (uint32_t i = 1; i < num_tasks; i++) {
+    for (uint32_t j = 0; j < edges_per_task; j++) {
+      graph.add_edge(tasks[i]->task_name, tasks[rand() % i]->task_name);
+    }
+  }
+  double build_time = now_sec() - start;
+  size_t edges = graph.edge_count();
+
+  start = now_sec();
+  ReadyQueue ready;
+  for (auto t : tasks) {
+    if (graph.pending(t->task_name) == 0) {
+      ready.push(t);
+    }
+  }
+  uint32_t completed = 0;
+  vector<string> released;
+  Task* t;
+  while ((t = ready.pop()) != nullptr) {
+    released.clear();
+    graph.complete(t->task_name, released);
+    for (auto& name : released) {
+      ready.push(by_name[name]);
+    }
+    completed++;
+  }
+  double drain_time = now_sec() - start;
+
+  printf("tasks %u, edges %zu\n", num_tasks, edges);
+  printf("build: %.3f sec, %.1f ns/edge\n",
+         build_time, build_time * 1e9 / max(edges, (size_t)1));
+  printf("drain: %.3f sec, %.1f ns/edge, %.1f ns/task, completed %u\n",
+         drain_time, drain_time * 1e9 / max(edges, (size_t)1),
+         drain_time * 1e9 / max(completed, 1u), completed);
+  for (auto t : tasks) {
+    delete t;
+  }
+  return completed == num_tasks ? 0 : 1;
+}
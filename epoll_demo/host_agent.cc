@@ -0,0 +1,333 @@
+//
+// Fred Xia (fxia@yahoo.com)
+//
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "util.h"
+#include "mux.h"
+#include "host_agent.h"
+
+using namespace std;
+
+#define LOG(fmt, args...) do { \
+   log_message(log_file(), __FILE__, __LINE__, fmt, ##args); \
+} while (0)
+
+namespace epoll_demo {
+
+// Messages pile up for a worker that does not read them. Its session is
+// closed beyond this, the others go on.
+static const uint32_t max_worker_output = 1 << 20;
+
+// The agent has nothing to do on its own, handle_timeout() runs after every
+// batch of events
+static const uint32_t agent_timeout = 10000;
+
+HostAgent::HostAgent(uint16_t port, const sockaddr_in& addr, bool to_stderr)
+  : TcpServer("host_agent", port, agent_timeout, to_stderr), _addr(addr),
+    _up_fd(0), _connecting(false), _next_id(1)
+{
+}
+
+// Start a non-blocking connect to the controller. Frames queued meanwhile
+// are written once it completes. Returns 0 for success, -1 for failure
+int HostAgent::connect_upstream()
+{
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    LOG("Error in socket(): %s", strerror(errno));
+    return -1;
+  }
+  if (::connect(fd, (struct sockaddr*)&_addr, sizeof(_addr)) < 0 &&
+      errno != EINPROGRESS) {
+    LOG("Error connect() to controller: %s", strerror(errno));
+    close(fd);
+    return -1;
+  }
+  // Frames of many sessions are written back to back
+  int yes = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+  if (add_connection(fd, EPOLLOUT | EPOLLHUP | EPOLLET) < 0) {
+    close(fd);
+    return -1;
+  }
+  _up_fd = fd;
+  _connecting = true;
+  return 0;
+}
+
+uint32_t HostAgent::upstream_events() const
+{
+  return EPOLLIN | EPOLLHUP | EPOLLET | (_up_out.empty() ? 0 : EPOLLOUT);
+}
+
+// Write frames queued for the controller. Returns -1 if the connection
+// failed
+int HostAgent::flush_upstream()
+{
+  if (_up_fd == 0 || _connecting) {
+    return 0;
+  }
+  if (write_pending(_up_fd, _up_out) < 0) {
+    LOG("Error in write() to controller: %s", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+// The connection to the controller is gone. Every session is closed, and
+// its worker reconnects to the agent, which connects again.
+void HostAgent::upstream_lost()
+{
+  LOG("Lost connection to controller, close %lu sessions",
+      (unsigned long)_sessions.size());
+  for (auto& it : _sessions) {
+    it.second.closed = true;
+    it.second.out.clear();
+    ::shutdown(it.first, SHUT_RDWR);
+  }
+  _ids.clear();
+  _up_in.clear();
+  _up_out.clear();
+  _up_fd = 0;
+  _connecting = false;
+}
+
+uint32_t HostAgent::handle_upstream(const epoll_event& ev)
+{
+  if (_connecting) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(_up_fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+      err = errno;
+    }
+    _connecting = false;
+    if (err) {
+      LOG("Cannot connect to controller: %s", strerror(err));
+      upstream_lost();
+      return 0;
+    }
+    LOG("Connected to controller");
+  }
+  bool closed = false;
+  if (ev.events & EPOLLIN) {
+    char chunk[4096];
+    while (true) {
+      int r = ::read(_up_fd, chunk, sizeof(chunk));
+      if (r > 0) {
+        _up_in.append(chunk, r);
+        continue;
+      }
+      if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        break;
+      }
+      if (r < 0 && errno == EINTR) {
+        continue;
+      }
+      closed = true;
+      break;
+    }
+    size_t offset = 0;
+    MuxFrame frame;
+    int r;
+    while ((r = parse_mux_frame(_up_in.data() + offset,
+                                _up_in.size() - offset, MAX_SERVER_MSG_LEN,
+                                frame)) > 0) {
+      handle_frame(frame.session, frame.msg, frame.msg_len);
+      offset += frame.len;
+    }
+    if (r < 0) {
+      LOG("Error in frame of controller");
+      upstream_lost();
+      return 0;
+    }
+    _up_in.erase(0, offset);
+  } else if (ev.events & EPOLLHUP) {
+    closed = true;
+  }
+  if (closed) {
+    upstream_lost();
+    return 0;
+  }
+  if (flush_upstream() < 0) {
+    upstream_lost();
+    return 0;
+  }
+  return upstream_events();
+}
+
+// A message of the controller for the worker of session id, or the close
+// of the session if msg_len is 0
+void HostAgent::handle_frame(uint32_t id, const char* msg, uint32_t msg_len)
+{
+  auto it = _ids.find(id);
+  if (it == _ids.end()) {
+    // Closed by the worker meanwhile
+    return;
+  }
+  int fd = it->second;
+  Session& s = _sessions[fd];
+  if (msg_len == 0) {
+    // Done with the worker, e.g. told it to exit. It is let go once it has
+    // what was sent before.
+    s.closed = true;
+    _ids.erase(it);
+    if (s.out.empty()) {
+      ::shutdown(fd, SHUT_WR);
+    }
+    return;
+  }
+  s.out.append(msg, msg_len);
+  if (s.out.size() > max_worker_output) {
+    LOG("Worker connection %d is not reading, close session %u", fd, id);
+    close_session(fd, s);
+    ::shutdown(fd, SHUT_RDWR);
+    return;
+  }
+  if (s.out.size() == msg_len) {
+    flush_worker(fd, s);
+  }
+}
+
+uint32_t HostAgent::worker_events(const Session& s) const
+{
+  return EPOLLIN | EPOLLHUP | EPOLLET | (s.out.empty() ? 0 : EPOLLOUT);
+}
+
+// Write messages queued for a worker, and wait for it to drain if they do
+// not all fit. Returns -1 if the connection failed
+int HostAgent::flush_worker(int fd, Session& s)
+{
+  if (write_pending(fd, s.out) < 0) {
+    LOG("Error in write() to worker connection %d: %s", fd, strerror(errno));
+    s.out.clear();
+    ::shutdown(fd, SHUT_RDWR);
+    return -1;
+  }
+  if (s.out.empty() && s.closed) {
+    ::shutdown(fd, SHUT_WR);
+  }
+  set_events(fd, worker_events(s));
+  return 0;
+}
+
+// Tell the controller the worker of a session is gone
+void HostAgent::close_session(int fd, Session& s)
+{
+  if (s.closed) {
+    return;
+  }
+  append_mux_frame(_up_out, s.id, nullptr, 0);
+  _ids.erase(s.id);
+  s.closed = true;
+  s.out.clear();
+}
+
+uint32_t HostAgent::handle_new_connection(int fd)
+{
+  if (_up_fd == 0 && connect_upstream() < 0) {
+    // The worker retries as it would with the controller
+    return 0;
+  }
+  Session& s = _sessions[fd];
+  s.id = _next_id++;
+  _ids[s.id] = fd;
+  LOG("Worker connection %d is session %u", fd, s.id);
+  return EPOLLIN | EPOLLHUP | EPOLLET;
+}
+
+// Carry every whole message of a worker to the controller in a frame of
+// its session
+uint32_t HostAgent::handle_worker(int fd, const epoll_event& ev)
+{
+  auto it = _sessions.find(fd);
+  if (it == _sessions.end()) {
+    return 0;
+  }
+  Session& s = it->second;
+  bool closed = false;
+  if (ev.events & EPOLLIN) {
+    char chunk[4096];
+    while (true) {
+      int r = ::read(fd, chunk, sizeof(chunk));
+      if (r > 0) {
+        s.inbuf.append(chunk, r);
+        continue;
+      }
+      if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        break;
+      }
+      if (r < 0 && errno == EINTR) {
+        continue;
+      }
+      closed = true;
+      break;
+    }
+    size_t offset = 0;
+    while (s.inbuf.size() - offset >= sizeof(uint32_t)) {
+      uint32_t msg_len;
+      memcpy(&msg_len, s.inbuf.data() + offset, sizeof(msg_len));
+      // A result chunk is carried like any message, its length word keeps
+      // the flag
+      uint32_t len = msg_len & ~RESULT_CHUNK_FLAG;
+      if (msg_len & RESULT_CHUNK_FLAG ?
+          len < RESULT_CHUNK_HEADER_LEN || len > MAX_RESULT_CHUNK_LEN :
+          msg_len > MAX_CLIENT_MSG_LEN || msg_len <= sizeof(msg_len)) {
+        LOG("Error in client message len %u", msg_len);
+        closed = true;
+        break;
+      }
+      msg_len = len;
+      if (s.inbuf.size() - offset < msg_len) {
+        break;
+      }
+      // A worker whose session the controller closed is on its way out
+      if (!s.closed) {
+        append_mux_frame(_up_out, s.id, s.inbuf.data() + offset, msg_len);
+      }
+      offset += msg_len;
+    }
+    s.inbuf.erase(0, offset);
+  } else if (ev.events & EPOLLHUP) {
+    closed = true;
+  }
+  if (!closed && (ev.events & EPOLLOUT) && flush_worker(fd, s) < 0) {
+    closed = true;
+  }
+  if (closed) {
+    LOG("Worker connection %d of session %u closed", fd, s.id);
+    close_session(fd, s);
+    _sessions.erase(it);
+    return 0;
+  }
+  return worker_events(s);
+}
+
+uint32_t HostAgent::handle_connection(const epoll_event& ev)
+{
+  if (_up_fd && ev.data.fd == _up_fd) {
+    return handle_upstream(ev);
+  }
+  return handle_worker(ev.data.fd, ev);
+}
+
+// Frames of the workers whose messages were just read go out in one write
+int HostAgent::handle_timeout(bool is_timeout)
+{
+  if (_up_fd && !_connecting && !_up_out.empty()) {
+    if (flush_upstream() < 0) {
+      // Cleaned up when its event comes
+      ::shutdown(_up_fd, SHUT_RDWR);
+    } else {
+      set_events(_up_fd, upstream_events());
+    }
+  }
+  return 0;
+}
+
+}
@@ -0,0 +1,70 @@
+#ifndef __task_host_agent_h__
+#define __task_host_agent_h__
+//
+// Fred Xia (fxia@yahoo.com)
+//
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include <string>
+#include <map>
+#include "server.h"
+
+namespace epoll_demo {
+
+// Relays the workers of a host to the controller over one connection. The
+// workers connect to the agent as they would to the controller, and each
+// of their connections becomes a session of the connection to the
+// controller, its messages carried in frames of the session. The
+// controller then keeps one connection per host instead of one per worker.
+//
+// A worker that does not read its messages does not hold up the others:
+// frames for it are kept apart, and its session is closed once too many
+// pile up. If the connection to the controller is lost every session is
+// closed, and the workers reconnect as they would to a restarted
+// controller.
+class HostAgent : public TcpServer {
+public:
+  // Accept workers on port and relay them to the controller at addr
+  HostAgent(uint16_t port, const sockaddr_in& addr, bool to_stderr);
+  virtual ~HostAgent() {}
+
+  virtual uint32_t handle_new_connection(int fd);
+  virtual uint32_t handle_connection(const epoll_event& ev);
+  virtual int handle_timeout(bool is_timeout);
+
+private:
+  // A worker connection to the agent
+  struct Session {
+    uint32_t    id;       // session id on the connection to the controller
+    std::string inbuf;    // partial message of the worker
+    std::string out;      // messages not written to the worker yet
+    bool        closed;   // closed by the controller, drained then shut
+
+    Session() : id(0), closed(false) {}
+  };
+
+  int connect_upstream();
+  uint32_t handle_upstream(const epoll_event& ev);
+  uint32_t upstream_events() const;
+  int flush_upstream();
+  void upstream_lost();
+  void handle_frame(uint32_t id, const char* msg, uint32_t msg_len);
+  uint32_t handle_worker(int fd, const epoll_event& ev);
+  uint32_t worker_events(const Session& s) const;
+  int flush_worker(int fd, Session& s);
+  void close_session(int fd, Session& s);
+
+  sockaddr_in _addr;        // of the controller
+  int         _up_fd;       // connection to the controller, 0 if none
+  bool        _connecting;  // _up_fd is a connect() in progress
+  std::string _up_in;       // partial frames from the controller
+  std::string _up_out;      // frames not written to the controller yet
+  std::map<int, Session> _sessions;   // worker fd => session
+  std::map<uint32_t, int> _ids;       // session id => worker fd
+  uint32_t    _next_id;
+};
+
+}
+
+#endif
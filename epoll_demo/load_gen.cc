@@ -0,0 +1,530 @@
+//
+// Fred Xia (fxia@yahoo.com)
+//
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <map>
+#include <algorithm>
+#include "util.h"
+#include "load_gen.h"
+#include "shard.h"
+
+using namespace std;
+
+#define LOG(fmt, args...) do { \
+  log_message(_log_file, __FILE__, __LINE__, fmt, ##args); \
+} while (0)
+
+namespace epoll_demo {
+
+// Extra sleep of a slacker, as task_worker -s
+static const uint32_t slacker_delay_ms = 20000;
+
+// Reconnect delay after a dropped connection is drawn up to this
+static const uint32_t max_reconnect_ms = 1000;
+
+static const int max_events = 256;
+
+enum SimState {
+  SimIdle,          // waiting to reconnect
+  SimConnecting,
+  SimConnected,
+  SimExited
+};
+
+struct SimWorker {
+  string      worker_id;
+  bool        is_slacker;
+  SimState    state;
+  sockaddr_in home;       // controller it starts at
+  sockaddr_in addr;       // controller it connects to
+  uint32_t    redirects;  // since the last task
+  int         fd;
+  string      inbuf;      // partial server messages
+  string      task_name;  // current task, empty if none
+  uint64_t    lease;      // of the current task
+  uint32_t    sleep_ms;   // of the current task, after scaling
+  uint64_t    start_ms;   // when the current task started
+  uint64_t    wake_ms;    // key in the timer map, 0 if none
+  uint64_t    request_us; // when the worker last asked for a task, 0 if not
+};
+
+// One epoll loop driving a share of the simulated workers. Task
+// completions and reconnects are timers ordered by due time.
+class LoadGenThread {
+public:
+  LoadGenThread(LoadGenerator* gen, uint32_t index)
+    : _gen(gen), _log_file(gen->_log_file), _index(index), _epoll_fd(-1),
+      _seed(index * 7919 + getpid()), _live(0)
+  {}
+
+  ~LoadGenThread() {
+    for (auto w : _workers) {
+      if (w->fd >= 0) {
+        close(w->fd);
+      }
+      delete w;
+    }
+    if (_epoll_fd >= 0) {
+      close(_epoll_fd);
+    }
+  }
+
+  void add_worker(const string& worker_id, bool is_slacker,
+                  const sockaddr_in& addr) {
+    SimWorker* w = new SimWorker();
+    w->worker_id = worker_id;
+    w->is_slacker = is_slacker;
+    w->state = SimIdle;
+    w->home = w->addr = addr;
+    w->redirects = 0;
+    w->fd = -1;
+    w->lease = 0;
+    w->sleep_ms = 0;
+    w->start_ms = 0;
+    w->wake_ms = 0;
+    w->request_us = 0;
+    _workers.push_back(w);
+  }
+
+  const vector<uint32_t>& latencies() const { return _latencies; }
+
+  void start() {
+    _thread = thread(&LoadGenThread::run, this);
+  }
+
+  void join() {
+    if (_thread.joinable()) {
+      _thread.join();
+    }
+  }
+
+private:
+  void run() {
+    _epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (_epoll_fd < 0) {
+      LOG("Error in epoll_create1(): %s", strerror(errno));
+      return;
+    }
+    _live = _workers.size();
+    for (auto w : _workers) {
+      connect_worker(w);
+    }
+    // Churn of this thread, as the mean gap between drops
+    double churn = _gen->_opts.churn_rate / _gen->_opts.num_threads;
+    uint64_t next_churn = churn > 0 ? monotonic_ms() + next_gap(churn) : 0;
+    struct epoll_event events[max_events];
+    while (_live > 0) {
+      uint64_t now = monotonic_ms();
+      uint64_t due = UINT64_MAX;
+      if (!_timers.empty()) {
+        due = _timers.begin()->first;
+      }
+      if (next_churn) {
+        due = min(due, next_churn);
+      }
+      int timeout = -1;
+      if (due != UINT64_MAX) {
+        timeout = due > now ? (int)(due - now) : 0;
+      }
+      int r = epoll_wait(_epoll_fd, events, max_events, timeout);
+      for (int i = 0; i < r; i++) {
+        handle_event((SimWorker*)events[i].data.ptr, events[i].events);
+      }
+      now = monotonic_ms();
+      while (!_timers.empty() && _timers.begin()->first <= now) {
+        SimWorker* w = _timers.begin()->second;
+        _timers.erase(_timers.begin());
+        w->wake_ms = 0;
+        handle_timer(w);
+      }
+      if (next_churn && now >= next_churn) {
+        churn_one();
+        next_churn = now + next_gap(churn);
+      }
+    }
+  }
+
+  // Exponential gap for a Poisson process of rate per second
+  uint32_t next_gap(double rate) {
+    double u = (rand_r(&_seed) + 1.0) / ((double)RAND_MAX + 2.0);
+    return (uint32_t)(-log(u) / rate * 1000) + 1;
+  }
+
+  void set_timer(SimWorker* w, uint64_t when) {
+    cancel_timer(w);
+    w->wake_ms = when;
+    _timers.insert(make_pair(when, w));
+  }
+
+  void cancel_timer(SimWorker* w) {
+    if (w->wake_ms == 0) {
+      return;
+    }
+    auto range = _timers.equal_range(w->wake_ms);
+    for (auto it = range.first; it != range.second; ++it) {
+      if (it->second == w) {
+        _timers.erase(it);
+        break;
+      }
+    }
+    w->wake_ms = 0;
+  }
+
+  void connect_worker(SimWorker* w) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+      LOG("Error in socket(): %s", strerror(errno));
+      _gen->_stats.errors++;
+      schedule_reconnect(w);
+      return;
+    }
+    int r = ::connect(fd, (struct sockaddr*)&w->addr, sizeof(w->addr));
+    if (r < 0 && errno != EINPROGRESS) {
+      close(fd);
+      schedule_reconnect(w);
+      return;
+    }
+    struct epoll_event ev;
+    ev.data.ptr = w;
+    ev.events = EPOLLOUT | EPOLLIN | EPOLLRDHUP;
+    if (epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+      LOG("Error in epoll_ctl(): %s", strerror(errno));
+      close(fd);
+      _gen->_stats.errors++;
+      schedule_reconnect(w);
+      return;
+    }
+    w->fd = fd;
+    w->state = SimConnecting;
+  }
+
+  // A worker sent to another shard starts over at its own
+  void schedule_reconnect(SimWorker* w) {
+    w->addr = w->home;
+    w->state = SimIdle;
+    set_timer(w, monotonic_ms() + rand_r(&_seed) % max_reconnect_ms + 1);
+  }
+
+  // Drop the connection of a worker. Its task keeps running, as on a real
+  // worker, and is reported after reconnecting. A connection closed by the
+  // controller means the task was taken away, e.g. from a slacker, so it is
+  // forgotten unless keep_task is set.
+  void drop(SimWorker* w, bool keep_task = true) {
+    if (w->fd >= 0) {
+      close(w->fd);
+      w->fd = -1;
+    }
+    w->inbuf.clear();
+    w->request_us = 0;
+    if (w->state == SimExited) {
+      return;
+    }
+    if (!keep_task) {
+      w->task_name.clear();
+    }
+    // A completion timer is replaced by the reconnect. The task is picked
+    // up again from start_ms and sleep_ms.
+    schedule_reconnect(w);
+  }
+
+  void churn_one() {
+    if (_workers.empty()) {
+      return;
+    }
+    SimWorker* w = _workers[rand_r(&_seed) % _workers.size()];
+    if (w->state == SimConnected) {
+      _gen->_stats.churned++;
+      drop(w);
+    }
+  }
+
+  int send_status(SimWorker* w, const string& task_name, uint32_t time_left,
+                  const TaskResult* result) {
+    uint32_t sz;
+    char* msg = serialize_client_message(w->worker_id.c_str(),
+                                         task_name.c_str(), time_left,
+                                         task_name.empty() ? 0 : w->lease, sz,
+                                         result);
+    if (msg == nullptr) {
+      return -1;
+    }
+    // Messages are small, a full socket buffer means the controller is
+    // not keeping up and the connection is dropped
+    int r = ::send(w->fd, msg, sz, MSG_NOSIGNAL);
+    free(msg);
+    if (r != (int)sz) {
+      _gen->_stats.errors++;
+      drop(w);
+      return -1;
+    }
+    // Any report but a running task asks for the next one
+    if (time_left == 0 && _gen->_opts.record_latency) {
+      w->request_us = monotonic_us();
+    }
+    return 0;
+  }
+
+  void handle_timer(SimWorker* w) {
+    if (w->state == SimIdle) {
+      connect_worker(w);
+      return;
+    }
+    if (w->state != SimConnected || w->task_name.empty()) {
+      return;
+    }
+    // If the send fails the task is reported after reconnecting
+    TaskResult result;
+    memset(&result, 0, sizeof(result));
+    result.run_ms = monotonic_ms() - w->start_ms;
+    if (send_status(w, w->task_name, 0, &result) == 0) {
+      w->task_name.clear();
+      _gen->_stats.completed++;
+    }
+  }
+
+  void handle_connected(SimWorker* w) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    getsockopt(w->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    if (err) {
+      drop(w);
+      return;
+    }
+    struct epoll_event ev;
+    ev.data.ptr = w;
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    epoll_ctl(_epoll_fd, EPOLL_CTL_MOD, w->fd, &ev);
+    w->state = SimConnected;
+    _gen->_stats.connects++;
+    if (w->task_name.empty()) {
+      send_status(w, "", 0, nullptr);
+      return;
+    }
+    // Report the task still running, or finished while disconnected
+    uint64_t elapsed = monotonic_ms() - w->start_ms;
+    if (elapsed >= w->sleep_ms) {
+      handle_timer(w);
+    } else if (send_status(w, w->task_name, w->sleep_ms - elapsed,
+                           nullptr) == 0) {
+      set_timer(w, w->start_ms + w->sleep_ms);
+    }
+  }
+
+  void handle_event(SimWorker* w, uint32_t events) {
+    if (w->state == SimConnecting) {
+      if (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+        handle_connected(w);
+      }
+      if (w->state != SimConnected) {
+        return;
+      }
+    }
+    if (w->state != SimConnected) {
+      return;
+    }
+    // Messages that came before a close are still handled, the last one
+    // may tell the worker to exit
+    char buf[4096];
+    bool closed = false;
+    while (true) {
+      int r = ::read(w->fd, buf, sizeof(buf));
+      if (r > 0) {
+        w->inbuf.append(buf, r);
+        continue;
+      }
+      if (r < 0 && errno == EINTR) {
+        continue;
+      }
+      if (r < 0 && errno == EAGAIN) {
+        break;
+      }
+      closed = true;
+      break;
+    }
+    size_t offset = 0;
+    while (w->state == SimConnected &&
+           w->inbuf.size() - offset >= sizeof(uint32_t)) {
+      uint32_t msg_len;
+      memcpy(&msg_len, w->inbuf.data() + offset, sizeof(msg_len));
+      if (msg_len <= sizeof(msg_len) || msg_len > MAX_SERVER_MSG_LEN) {
+        _gen->_stats.errors++;
+        drop(w, false);
+        return;
+      }
+      if (w->inbuf.size() - offset < msg_len) {
+        break;
+      }
+      handle_message(w, w->inbuf.data() + offset + sizeof(msg_len),
+                     msg_len - sizeof(msg_len));
+      offset += msg_len;
+    }
+    if (w->state != SimConnected) {
+      return;
+    }
+    if (closed) {
+      drop(w, false);
+    } else {
+      w->inbuf.erase(0, offset);
+    }
+  }
+
+  void handle_message(SimWorker* w, const char* msg, uint32_t len) {
+    string task_name, command;
+    uint32_t sleep_ms;
+    uint64_t lease;
+    if (deserialize_server_message(msg, len, task_name, sleep_ms, lease,
+                                   command) < 0) {
+      _gen->_stats.errors++;
+      drop(w, false);
+      return;
+    }
+    if (task_name.empty() && sleep_ms == REDIRECT_SLEEP_TIME &&
+        ++w->redirects <= MAX_REDIRECTS &&
+        resolve_address(command, w->addr) == 0) {
+      // Connect right away, the shard it left has nothing for it
+      _gen->_stats.redirected++;
+      close(w->fd);
+      w->fd = -1;
+      w->inbuf.clear();
+      w->request_us = 0;
+      connect_worker(w);
+      return;
+    }
+    if (task_name.empty()) {
+      w->state = SimExited;
+      cancel_timer(w);
+      drop(w);
+      _gen->_stats.exited++;
+      _live--;
+      return;
+    }
+    if (sleep_ms == CANCEL_SLEEP_TIME) {
+      if (w->task_name == task_name && (lease == 0 || lease == w->lease)) {
+        cancel_timer(w);
+        w->task_name.clear();
+        _gen->_stats.cancelled++;
+        send_status(w, "", 0, nullptr);
+      }
+      return;
+    }
+    if (w->task_name == task_name) {
+      w->lease = lease;
+      return;
+    }
+    w->redirects = 0;
+    w->lease = lease;
+    _gen->_stats.assigned++;
+    if (w->request_us) {
+      _latencies.push_back((uint32_t)min(monotonic_us() - w->request_us,
+                                         (uint64_t)UINT32_MAX));
+      w->request_us = 0;
+    }
+    w->task_name = task_name;
+    w->sleep_ms = (uint32_t)(sleep_ms * _gen->_opts.time_scale);
+    if (w->is_slacker) {
+      w->sleep_ms += slacker_delay_ms;
+    }
+    w->start_ms = monotonic_ms();
+    set_timer(w, w->start_ms + w->sleep_ms);
+  }
+
+  LoadGenerator* _gen;
+  FILE* _log_file;
+  uint32_t _index;
+  int _epoll_fd;
+  unsigned int _seed;
+  uint32_t _live;       // workers not told to exit yet
+  vector<SimWorker*> _workers;
+  vector<uint32_t> _latencies;
+  multimap<uint64_t, SimWorker*> _timers;
+  thread _thread;
+};
+
+LoadGenerator::LoadGenerator(const sockaddr_in& controller_addr,
+                             const LoadGenOptions& opts, FILE* log_file,
+                             const ShardRing* ring)
+  : _addr(controller_addr), _opts(opts), _log_file(log_file), _valid(true)
+{
+  vector<sockaddr_in> shard_addrs;
+  if (ring) {
+    for (auto& shard : ring->shards()) {
+      sockaddr_in addr;
+      string address = shard.host + ":" + to_string(shard.port);
+      if (resolve_address(address, addr) < 0) {
+        LOG("Cannot resolve shard %s at %s", shard.name.c_str(),
+            address.c_str());
+        _valid = false;
+      }
+      shard_addrs.push_back(addr);
+    }
+  }
+  _opts.num_threads = max(min(_opts.num_threads, _opts.num_workers), 1u);
+  for (uint32_t i = 0; i < _opts.num_threads; i++) {
+    _threads.push_back(new LoadGenThread(this, i));
+  }
+  // Slackers are spread evenly over the fleet
+  double slack = 0;
+  for (uint32_t i = 0; i < _opts.num_workers; i++) {
+    slack += _opts.slacker_ratio;
+    bool is_slacker = slack >= 1.0;
+    if (is_slacker) {
+      slack -= 1.0;
+    }
+    char worker_id[MAX_TASK_NAME_LEN];
+    snprintf(worker_id, sizeof(worker_id), "%s_%u",
+             _opts.id_prefix.c_str(), i);
+    _threads[i % _opts.num_threads]->add_worker(
+      worker_id, is_slacker,
+      ring ? shard_addrs[ring->owner(worker_id)] : _addr);
+  }
+}
+
+LoadGenerator::~LoadGenerator()
+{
+  for (auto t : _threads) {
+    delete t;
+  }
+}
+
+int LoadGenerator::run()
+{
+  // Every simulated worker needs a descriptor
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 &&
+      rl.rlim_cur < _opts.num_workers + 64) {
+    LOG("Error: %u workers need more than %lu descriptors",
+        _opts.num_workers, (unsigned long)rl.rlim_cur);
+    return -1;
+  }
+  LOG("Start %u simulated workers on %u threads", _opts.num_workers,
+      _opts.num_threads);
+  for (auto t : _threads) {
+    t->start();
+  }
+  for (auto t : _threads) {
+    t->join();
+  }
+  return 0;
+}
+
+void LoadGenerator::latencies(vector<uint32_t>& out) const
+{
+  out.clear();
+  for (auto t : _threads) {
+    out.insert(out.end(), t->latencies().begin(), t->latencies().end());
+  }
+}
+
+}
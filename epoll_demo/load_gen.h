@@ -0,0 +1,93 @@
+#ifndef __task_load_gen_h__
+#define __task_load_gen_h__
+//
+// Fred Xia (fxia@yahoo.com)
+//
+
+#include <stdint.h>
+#include <stdio.h>
+#include <netinet/in.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+
+namespace epoll_demo {
+
+struct LoadGenOptions {
+  uint32_t  num_workers;    // simulated workers
+  uint32_t  num_threads;    // epoll threads hosting them
+  double    time_scale;     // task sleep time is multiplied by it
+  double    slacker_ratio;  // fraction of workers that act as slackers
+  double    churn_rate;     // disconnects per second across all workers
+  std::string id_prefix;    // worker ids are <prefix>_<n>
+  bool      record_latency; // keep the dispatch latency of every task
+
+  LoadGenOptions()
+    : num_workers(1000), num_threads(4), time_scale(1.0), slacker_ratio(0),
+      churn_rate(0), id_prefix("sim"), record_latency(false)
+  {}
+};
+
+// Totals of a load generator run, summed over its threads
+struct LoadGenStats {
+  std::atomic<uint64_t> connects;
+  std::atomic<uint64_t> assigned;     // task assignments received
+  std::atomic<uint64_t> completed;    // completions sent
+  std::atomic<uint64_t> cancelled;
+  std::atomic<uint64_t> churned;      // connections dropped on purpose
+  std::atomic<uint64_t> redirected;   // sent to another controller
+  std::atomic<uint64_t> errors;
+  std::atomic<uint32_t> exited;       // workers told to exit
+
+  LoadGenStats()
+    : connects(0), assigned(0), completed(0), cancelled(0), churned(0),
+      redirected(0), errors(0), exited(0)
+  {}
+};
+
+struct SimWorker;
+class LoadGenThread;
+class ShardRing;
+
+// A fleet of simulated task workers in one process, for load testing
+// task_controller. Every simulated worker has its own connection and
+// speaks the worker protocol, but its tasks are only timers. Workers are
+// spread over a few threads, each running its own epoll loop. Given the
+// ring of a controller cluster, every worker connects to the shard its id
+// hashes to instead of controller_addr.
+class LoadGenerator {
+public:
+  LoadGenerator(const sockaddr_in& controller_addr,
+                const LoadGenOptions& opts, FILE* log_file,
+                const ShardRing* ring = nullptr);
+  ~LoadGenerator();
+
+  // Whether the addresses of the controllers could be resolved
+  bool valid() const { return _valid; }
+
+  // Run until every simulated worker is told to exit. Returns 0 for
+  // success, -1 for failure
+  int run();
+
+  const LoadGenStats& stats() const { return _stats; }
+
+  // Dispatch latencies in microseconds, from a worker reporting a task or
+  // asking for one to the next task arriving. Only kept with
+  // record_latency, and only valid after run().
+  void latencies(std::vector<uint32_t>& out) const;
+
+private:
+  friend class LoadGenThread;
+
+  sockaddr_in _addr;
+  LoadGenOptions _opts;
+  FILE* _log_file;
+  LoadGenStats _stats;
+  std::vector<LoadGenThread*> _threads;
+  bool _valid;
+};
+
+}
+
+#endif
@@ -0,0 +1,31 @@
+//
+// Fred Xia (fxia@yahoo.com)
+//
+// Print binary log files of task_controller as text
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include "async_log.h"
+
+using namespace epoll_demo;
+
+static const char* usage =
+  "Usage:\n"
+  "\tlog_decode <log file> [<log file> ...]\n"
+  "\tA rotated log is decoded by giving <file>.1 before <file>\n";
+
+int main(int argc, char** argv)
+{
+  if (argc < 2 || argv[1][0] == '-') {
+    printf(usage);
+    exit(argc < 2 ? 1 : 0);
+  }
+  int r = 0;
+  for (int i = 1; i < argc; i++) {
+    if (decode_log_file(argv[i], stdout) < 0) {
+      fprintf(stderr, "%s is not a binary log file\n", argv[i]);
+      r = 1;
+    }
+  }
+  return r;
+}
@@ -0,0 +1,751 @@
+//
+// Fred Xia (fxia@yahoo.com)
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "util.h"
+#include "log_store.h"
+
+using namespace std;
+
+#define LOG(fmt, args...) do { \
+   log_message(_log_file, __FILE__, __LINE__, fmt, ##args); \
+} while (0)
+
+namespace epoll_demo {
+
+// Record types
+enum LogRecordType {
+  LogAddTask = 1,
+  LogUpdateTask = 2,
+};
+
+// A record is a header followed by its body, which starts with the type.
+// Integers are in host byte order, strings are a uint16_t length and the
+// bytes.
+//
+//   add:     type rowid sleep_ms <state> command [lease [tenant [result]]]
+//   update:  type <state> [lease [result]]
+//   <state>: state assign_time complete_time result task_name worker
+//
+// The lease of the latest assignment, the tenant and the result file were
+// added later. They are left out of older records, the lease also of the
+// add record of a task never assigned unless a tenant follows, the tenant
+// of a task of the default tenant unless a result file follows, and the
+// result file of a task without one.
+struct LogRecordHeader {
+  uint32_t crc;       // of the body
+  uint32_t len;       // of the body
+};
+
+#define MAX_LOG_RECORD_LEN \
+  (64 + sizeof(TaskResult) + MAX_TASK_NAME_LEN * 3 + MAX_COMMAND_LEN + \
+   MAX_RESULT_PATH_LEN)
+
+static uint32_t crc_table[256];
+
+static void init_crc_table()
+{
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; k++) {
+      c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+    }
+    crc_table[i] = c;
+  }
+}
+
+static uint32_t crc32(const char* data, size_t len)
+{
+  if (crc_table[1] == 0) {
+    init_crc_table();
+  }
+  uint32_t c = 0xffffffff;
+  for (size_t i = 0; i < len; i++) {
+    c = crc_table[(c ^ (uint8_t)data[i]) & 0xff] ^ (c >> 8);
+  }
+  return c ^ 0xffffffff;
+}
+
+// Builds the body of a record
+struct RecordWriter {
+  string body;
+
+  template <typename T> void put(T value) {
+    body.append((const char*)&value, sizeof(value));
+  }
+
+  void put_str(const string& s) {
+    put((uint16_t)s.size());
+    body.append(s);
+  }
+
+  void put_state(TaskState state, time_t assign_time, time_t complete_time,
+                 const TaskResult& result, const string& task_name,
+                 const string& worker) {
+    put((uint8_t)state);
+    put((int64_t)assign_time);
+    put((int64_t)complete_time);
+    put(result);
+    put_str(task_name);
+    put_str(worker);
+  }
+
+  // Append the record to out
+  void finish(string& out) {
+    LogRecordHeader header;
+    header.crc = crc32(body.data(), body.size());
+    header.len = (uint32_t)body.size();
+    out.append((const char*)&header, sizeof(header));
+    out.append(body);
+  }
+};
+
+// Reads the body of a record
+struct RecordReader {
+  const char* p;
+  const char* end;
+  bool ok;
+
+  RecordReader(const char* body, uint32_t len)
+    : p(body), end(body + len), ok(true) {}
+
+  template <typename T> T get() {
+    T value;
+    memset(&value, 0, sizeof(value));
+    if ((size_t)(end - p) < sizeof(value)) {
+      ok = false;
+      return value;
+    }
+    memcpy(&value, p, sizeof(value));
+    p += sizeof(value);
+    return value;
+  }
+
+  // A field at the end of the record that older records lack
+  template <typename T> T get_optional(T value) {
+    return p < end ? get<T>() : value;
+  }
+
+  string get_str() {
+    uint16_t len = get<uint16_t>();
+    if ((size_t)(end - p) < len) {
+      ok = false;
+      return "";
+    }
+    string s(p, len);
+    p += len;
+    return s;
+  }
+
+  string get_optional_str(const string& value) {
+    return p < end ? get_str() : value;
+  }
+};
+
+// State fields common to both record types
+struct LogTaskState {
+  TaskState   state;
+  time_t      assign_time;
+  time_t      complete_time;
+  TaskResult  result;
+  string      task_name;
+  string      worker;
+  uint64_t    lease;
+
+  void read(RecordReader& r) {
+    state = (TaskState)r.get<uint8_t>();
+    assign_time = (time_t)r.get<int64_t>();
+    complete_time = (time_t)r.get<int64_t>();
+    result = r.get<TaskResult>();
+    task_name = r.get_str();
+    worker = r.get_str();
+  }
+};
+
+LogStore::LogStore(const char* path, FILE* log_file, bool sync)
+  : _path(path), _log_file(log_file), _sync(sync), _fd(-1), _ino(0),
+    _map(nullptr), _map_len(0), _read_offset(0), _live_bytes(0)
+{}
+
+LogStore::~LogStore()
+{
+  close_log();
+}
+
+bool LogStore::is_log(const char* path)
+{
+  int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  char magic[LOG_STORE_MAGIC_LEN];
+  bool r = (::read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+            memcmp(magic, LOG_STORE_MAGIC, sizeof(magic)) == 0);
+  close(fd);
+  return r;
+}
+
+int LogStore::create(const char* path)
+{
+  int fd = ::open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return (errno == EEXIST && is_log(path)) ? 0 : -1;
+  }
+  int r = 0;
+  if (::write(fd, LOG_STORE_MAGIC, LOG_STORE_MAGIC_LEN) !=
+      LOG_STORE_MAGIC_LEN || fsync(fd) < 0) {
+    r = -1;
+  }
+  close(fd);
+  return r;
+}
+
+void LogStore::close_log()
+{
+  if (_map) {
+    munmap((void*)_map, _map_len);
+    _map = nullptr;
+    _map_len = 0;
+  }
+  if (_fd >= 0) {
+    close(_fd);
+    _fd = -1;
+  }
+  _read_offset = 0;
+  _live_bytes = 0;
+  _entries.clear();
+  _rowids.clear();
+  _created.clear();
+  _killed.clear();
+  _running.clear();
+}
+
+// Open the log and index every record in it. Returns 0 for success, -1 for
+// failure
+int LogStore::open_log()
+{
+  close_log();
+  _fd = ::open(_path.c_str(), O_RDWR | O_APPEND | O_CLOEXEC);
+  struct stat st;
+  if (_fd < 0 || fstat(_fd, &st) < 0) {
+    LOG("Cannot open task log %s: %s", _path.c_str(), strerror(errno));
+    close_log();
+    return -1;
+  }
+  _ino = st.st_ino;
+  char magic[LOG_STORE_MAGIC_LEN];
+  if (pread(_fd, magic, sizeof(magic), 0) != sizeof(magic) ||
+      memcmp(magic, LOG_STORE_MAGIC, sizeof(magic)) != 0) {
+    LOG("Not a task log: %s", _path.c_str());
+    close_log();
+    return -1;
+  }
+  _read_offset = LOG_STORE_MAGIC_LEN;
+  return catch_up(false);
+}
+
+// Index records appended since the last call. A record that is incomplete
+// or fails its checksum may still be being written by another process, so
+// reading stops there. With truncate_torn the caller holds the lock, no one
+// else is writing, and such a record is left over from a crash and cut off.
+// Returns 0 for success, -1 for failure
+int LogStore::catch_up(bool truncate_torn)
+{
+  struct stat st;
+  if (_fd < 0 || (stat(_path.c_str(), &st) == 0 && st.st_ino != _ino)) {
+    // Compacted by another process
+    return open_log();
+  }
+  if (fstat(_fd, &st) < 0) {
+    LOG("Error in fstat(): %s", strerror(errno));
+    return -1;
+  }
+  uint64_t size = (uint64_t)st.st_size;
+  if (size > _map_len) {
+    if (_map) {
+      munmap((void*)_map, _map_len);
+      _map = nullptr;
+      _map_len = 0;
+    }
+    void* map = mmap(nullptr, size, PROT_READ, MAP_SHARED, _fd, 0);
+    if (map == MAP_FAILED) {
+      LOG("Error in mmap(): %s", strerror(errno));
+      return -1;
+    }
+    _map = (const char*)map;
+    _map_len = size;
+  }
+  uint64_t offset = _read_offset;
+  while (offset + sizeof(LogRecordHeader) <= size) {
+    LogRecordHeader header;
+    memcpy(&header, _map + offset, sizeof(header));
+    uint64_t body = offset + sizeof(header);
+    if (header.len == 0 || header.len > MAX_LOG_RECORD_LEN ||
+        body + header.len > size ||
+        crc32(_map + body, header.len) != header.crc) {
+      break;
+    }
+    apply(_map + body, header.len, offset);
+    offset = body + header.len;
+  }
+  _read_offset = offset;
+  if (truncate_torn && offset < size) {
+    LOG("Cut off %lu bytes of torn records at %lu of %s",
+        (unsigned long)(size - offset), (unsigned long)offset, _path.c_str());
+    if (ftruncate(_fd, offset) < 0) {
+      LOG("Error in ftruncate(): %s", strerror(errno));
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void LogStore::set_state(int64_t rowid, Entry& e, TaskState state)
+{
+  std::set<int64_t>* sets[] = { &_created, &_running, &_killed, nullptr };
+  if (e.state <= TaskKilled) {
+    sets[e.state]->erase(rowid);
+  }
+  e.state = state;
+  if (state <= TaskKilled) {
+    sets[state]->insert(rowid);
+  }
+}
+
+// Index a record read at offset
+void LogStore::apply(const char* record, uint32_t len, uint64_t offset)
+{
+  RecordReader r(record, len);
+  uint8_t type = r.get<uint8_t>();
+  if (type == LogAddTask) {
+    int64_t rowid = r.get<int64_t>();
+    r.get<uint32_t>();
+    LogTaskState s;
+    s.read(r);
+    if (!r.ok || rowid <= 0 || s.state > TaskSuccess ||
+        _rowids.count(s.task_name)) {
+      return;
+    }
+    if ((size_t)rowid > _entries.size()) {
+      Entry none = { 0, 0, 0, TaskSuccess };
+      _entries.resize(rowid, none);
+    }
+    Entry& e = _entries[rowid - 1];
+    e.add_offset = offset;
+    e.update_offset = 0;
+    e.record_len = sizeof(LogRecordHeader) + len;
+    e.state = TaskSuccess;
+    set_state(rowid, e, s.state);
+    _rowids[s.task_name] = rowid;
+    _live_bytes += e.record_len;
+  } else if (type == LogUpdateTask) {
+    LogTaskState s;
+    s.read(r);
+    auto it = _rowids.find(s.task_name);
+    if (!r.ok || s.state > TaskSuccess || it == _rowids.end()) {
+      return;
+    }
+    Entry& e = _entries[it->second - 1];
+    e.update_offset = offset;
+    set_state(it->second, e, s.state);
+  }
+}
+
+// Take the exclusive lock of the log, switching to a new log if it was
+// compacted in the meantime, and read everything appended before. Returns 0
+// for success, -1 for failure
+int LogStore::lock()
+{
+  if (_fd < 0 && open_log() < 0) {
+    return -1;
+  }
+  while (true) {
+    if (flock(_fd, LOCK_EX) < 0) {
+      LOG("Error in flock(): %s", strerror(errno));
+      return -1;
+    }
+    struct stat st;
+    if (stat(_path.c_str(), &st) < 0) {
+      LOG("Task log %s is gone", _path.c_str());
+      unlock();
+      return -1;
+    }
+    if (st.st_ino == _ino) {
+      break;
+    }
+    unlock();
+    if (open_log() < 0) {
+      return -1;
+    }
+  }
+  if (catch_up(true) < 0) {
+    unlock();
+    return -1;
+  }
+  return 0;
+}
+
+void LogStore::unlock()
+{
+  flock(_fd, LOCK_UN);
+}
+
+// Append records with the lock held. Returns 0 for success, -1 for failure
+int LogStore::append(const string& records)
+{
+  size_t done = 0;
+  while (done < records.size()) {
+    ssize_t n = ::write(_fd, records.data() + done, records.size() - done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      LOG("Error in write() of task log: %s", strerror(errno));
+      // A partial record is cut off by the next writer
+      return -1;
+    }
+    done += n;
+  }
+  if (_sync && fdatasync(_fd) < 0) {
+    LOG("Error in fdatasync(): %s", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+int LogStore::init_schema()
+{
+  // Recovers the log, nothing else to prepare
+  if (lock() < 0) {
+    return -1;
+  }
+  unlock();
+  return 0;
+}
+
+int LogStore::check()
+{
+  struct stat st;
+  return stat(_path.c_str(), &st) < 0 ? -1 : 0;
+}
+
+// Create a task from the records of a rowid
+Task* LogStore::read_task(int64_t rowid)
+{
+  const Entry& e = _entries[rowid - 1];
+  const char* add = _map + e.add_offset;
+  LogRecordHeader header;
+  memcpy(&header, add, sizeof(header));
+  RecordReader r(add + sizeof(header), header.len);
+  r.get<uint8_t>();
+  r.get<int64_t>();
+  Task* task = new Task();
+  task->sleep_ms = r.get<uint32_t>();
+  LogTaskState s;
+  s.read(r);
+  task->command = r.get_str();
+  s.lease = r.get_optional<uint64_t>(0);
+  task->tenant = r.get_optional_str(DEFAULT_TENANT);
+  if (e.update_offset) {
+    const char* update = _map + e.update_offset;
+    memcpy(&header, update, sizeof(header));
+    RecordReader u(update + sizeof(header), header.len);
+    u.get<uint8_t>();
+    s.read(u);
+    s.lease = u.get_optional<uint64_t>(0);
+  }
+  task->task_name = s.task_name;
+  task->state = e.state;
+  task->worker = s.worker;
+  task->assign_time = s.assign_time;
+  task->lease = s.lease;
+  task->complete_time = 0;
+  task->backup_assign_time = 0;
+  return task;
+}
+
+// Load the task of rowid unless it is finished or loaded already. Returns 1
+// if loaded, otherwise 0
+int LogStore::load_task(int64_t rowid, TaskCollection& tasks,
+                        vector<Task*>* new_tasks)
+{
+  const Entry& e = _entries[rowid - 1];
+  if (e.add_offset == 0 || e.state == TaskSuccess) {
+    return 0;
+  }
+  Task* task = read_task(rowid);
+  if (tasks.find(task->task_name) != tasks.end()) {
+    delete task;
+    return 0;
+  }
+  tasks[task->task_name] = task;
+  if (new_tasks) {
+    new_tasks->push_back(task);
+  }
+  return 1;
+}
+
+int LogStore::fetch_tasks(TaskCollection& tasks, vector<Task*>* new_tasks,
+                          int64_t after_rowid)
+{
+  if (catch_up(false) < 0) {
+    return -1;
+  }
+  int count = 0;
+  for (int64_t rowid = max(after_rowid, (int64_t)0) + 1;
+       rowid <= (int64_t)_entries.size(); rowid++) {
+    count += load_task(rowid, tasks, new_tasks);
+  }
+  LOG("Loaded %d new tasks, total count %d", count, (int)tasks.size());
+  return count;
+}
+
+int LogStore::fetch_running_tasks(TaskCollection& tasks,
+                                  vector<Task*>* new_tasks)
+{
+  if (catch_up(false) < 0) {
+    return -1;
+  }
+  int count = 0;
+  for (int64_t rowid : _running) {
+    count += load_task(rowid, tasks, new_tasks);
+  }
+  LOG("Loaded %d new tasks, total count %d", count, (int)tasks.size());
+  return count;
+}
+
+int64_t LogStore::max_rowid()
+{
+  if (catch_up(false) < 0) {
+    return -1;
+  }
+  return (int64_t)_entries.size();
+}
+
+int LogStore::digest(int64_t max_rowid, TaskDigest& digest)
+{
+  if (catch_up(false) < 0) {
+    return -1;
+  }
+  digest = TaskDigest();
+  for (int64_t rowid : _running) {
+    Task* task = read_task(rowid);
+    digest.running++;
+    digest.lease_sum += task->lease;
+    delete task;
+  }
+  std::set<int64_t>* sets[] = { &_killed, &_created };
+  for (int i = 0; i < 2; i++) {
+    for (auto it = sets[i]->begin();
+         it != sets[i]->end() && *it <= max_rowid; ++it) {
+      digest.waiting++;
+    }
+  }
+  return 0;
+}
+
+int LogStore::fetch_task_window(TaskCollection& tasks, TaskWindow& window,
+                                uint32_t limit, vector<Task*>* new_tasks)
+{
+  if (catch_up(false) < 0) {
+    return -1;
+  }
+  // Tasks killed by a previous controller come first, then new tasks
+  int count = 0;
+  window.at_end = true;
+  std::set<int64_t>* sets[] = { &_killed, &_created };
+  int64_t* cursors[] = { &window.killed_rowid, &window.created_rowid };
+  for (int i = 0; i < 2 && count < (int)limit; i++) {
+    uint32_t rows = 0;
+    uint32_t room = limit - count;
+    auto it = sets[i]->upper_bound(*cursors[i]);
+    for (; it != sets[i]->end() && rows < room; ++it, rows++) {
+      count += load_task(*it, tasks, new_tasks);
+      *cursors[i] = *it;
+    }
+    // A full page may have more behind it, as may the states not read
+    if (it != sets[i]->end() || rows == room) {
+      window.at_end = false;
+    }
+  }
+  if (count > 0) {
+    LOG("Loaded %d new tasks into window, total count %d",
+        count, (int)tasks.size());
+  }
+  return count;
+}
+
+int LogStore::fetch_task(TaskCollection& tasks, const string& task_name,
+                         vector<Task*>* new_tasks)
+{
+  if (catch_up(false) < 0) {
+    return -1;
+  }
+  auto it = _rowids.find(task_name);
+  return it == _rowids.end() ? 0 : load_task(it->second, tasks, new_tasks);
+}
+
+int LogStore::fetch_dependencies(const vector<Task*>& new_tasks,
+                                 TaskGraph& graph)
+{
+  return 0;
+}
+
+int LogStore::insert_tasks(const vector<NewTask>& tasks)
+{
+  if (tasks.empty()) {
+    return 0;
+  }
+  if (lock() < 0) {
+    return -1;
+  }
+  static const TaskResult no_result = { 0, 0, 0, 0, 0 };
+  string records;
+  unordered_map<string, int64_t> added;
+  int64_t rowid = (int64_t)_entries.size();
+  for (auto& t : tasks) {
+    if (_rowids.count(t.task_name) || added.count(t.task_name)) {
+      continue;
+    }
+    added[t.task_name] = ++rowid;
+    RecordWriter w;
+    w.put((uint8_t)LogAddTask);
+    w.put(rowid);
+    w.put(t.sleep_ms);
+    w.put_state(TaskCreated, 0, 0, no_result, t.task_name, "");
+    w.put_str(t.command);
+    if (!t.tenant.empty() && t.tenant != DEFAULT_TENANT) {
+      w.put((uint64_t)0);
+      w.put_str(t.tenant);
+    }
+    w.finish(records);
+  }
+  int r = append(records);
+  unlock();
+  return r < 0 ? -1 : (int)added.size();
+}
+
+int LogStore::update_task_db(const Task* task)
+{
+  RecordWriter w;
+  w.put((uint8_t)LogUpdateTask);
+  w.put_state(task->state, task->assign_time,
+              task->state == TaskSuccess ? task->complete_time : 0,
+              task->result, task->task_name, task->worker);
+  w.put(task->lease);
+  if (!task->result_file.empty()) {
+    w.put_str(task->result_file);
+  }
+  string record;
+  w.finish(record);
+  if (lock() < 0) {
+    return -1;
+  }
+  int r = append(record);
+  unlock();
+  return r;
+}
+
+int LogStore::maintain()
+{
+  if (_read_offset < LOG_STORE_COMPACT_MIN ||
+      _read_offset < _live_bytes * LOG_STORE_COMPACT_RATIO) {
+    return 0;
+  }
+  return compact();
+}
+
+int LogStore::compact()
+{
+  if (lock() < 0) {
+    return -1;
+  }
+  uint64_t old_size = _read_offset;
+  string tmp_path = _path + ".compact";
+  int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0644);
+  if (fd < 0) {
+    LOG("Cannot create %s: %s", tmp_path.c_str(), strerror(errno));
+    unlock();
+    return -1;
+  }
+  // Every task becomes one add record with its latest state
+  string out(LOG_STORE_MAGIC, LOG_STORE_MAGIC_LEN);
+  bool ok = true;
+  for (size_t i = 0; i < _entries.size() && ok; i++) {
+    const Entry& e = _entries[i];
+    if (e.add_offset == 0) {
+      continue;
+    }
+    const char* add = _map + e.add_offset;
+    LogRecordHeader header;
+    memcpy(&header, add, sizeof(header));
+    RecordReader r(add + sizeof(header), header.len);
+    r.get<uint8_t>();
+    r.get<int64_t>();
+    uint32_t sleep_ms = r.get<uint32_t>();
+    LogTaskState s;
+    s.read(r);
+    string command = r.get_str();
+    s.lease = r.get_optional<uint64_t>(0);
+    string tenant = r.get_optional_str(DEFAULT_TENANT);
+    string result_file = r.get_optional_str("");
+    if (e.update_offset) {
+      const char* update = _map + e.update_offset;
+      memcpy(&header, update, sizeof(header));
+      RecordReader u(update + sizeof(header), header.len);
+      u.get<uint8_t>();
+      s.read(u);
+      s.lease = u.get_optional<uint64_t>(0);
+      result_file = u.get_optional_str("");
+    }
+    RecordWriter w;
+    w.put((uint8_t)LogAddTask);
+    w.put((int64_t)(i + 1));
+    w.put(sleep_ms);
+    w.put_state(e.state, s.assign_time, s.complete_time, s.result,
+                s.task_name, s.worker);
+    w.put_str(command);
+    w.put(s.lease);
+    if (tenant != DEFAULT_TENANT || !result_file.empty()) {
+      w.put_str(tenant);
+    }
+    if (!result_file.empty()) {
+      w.put_str(result_file);
+    }
+    w.finish(out);
+    if (out.size() >= (1 << 20) || i + 1 == _entries.size()) {
+      ok = (::write(fd, out.data(), out.size()) == (ssize_t)out.size());
+      out.clear();
+    }
+  }
+  if (ok && !out.empty()) {
+    ok = (::write(fd, out.data(), out.size()) == (ssize_t)out.size());
+  }
+  ok = ok && fsync(fd) == 0;
+  close(fd);
+  if (!ok || rename(tmp_path.c_str(), _path.c_str()) < 0) {
+    LOG("Cannot compact %s: %s", _path.c_str(), strerror(errno));
+    unlink(tmp_path.c_str());
+    unlock();
+    return -1;
+  }
+  // Processes waiting for the lock of the old log switch to the new one
+  unlock();
+  if (open_log() < 0) {
+    return -1;
+  }
+  LOG("Compacted %s from %lu to %lu bytes", _path.c_str(),
+      (unsigned long)old_size, (unsigned long)_read_offset);
+  return 0;
+}
+
+}
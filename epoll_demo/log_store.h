@@ -0,0 +1,122 @@
+#ifndef __log_store_h__
+#define __log_store_h__
+//
+// Fred Xia (fxia@yahoo.com)
+//
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <string>
+#include <vector>
+#include <set>
+#include <unordered_map>
+#include "task_db.h"
+
+namespace epoll_demo {
+
+// First bytes of a task log
+#define LOG_STORE_MAGIC         "EPTASKS1"
+#define LOG_STORE_MAGIC_LEN     8
+
+// A log is compacted once it is this many times the size of a compacted
+// copy, and at least LOG_STORE_COMPACT_MIN bytes
+#define LOG_STORE_COMPACT_RATIO 4
+#define LOG_STORE_COMPACT_MIN   (16 << 20)
+
+// Task storage in an append-only log instead of sqlite3.
+//
+// The log is a sequence of checksummed records: one when a task is added,
+// with its rowid, and one for every state change, which is appended instead
+// of updating anything in place. Appends are made under an exclusive flock
+// of the log, so task_ingest can add tasks while a controller runs. Every
+// process keeps an index of rowid => offsets of the latest records of the
+// task, and reads the records themselves through a read-only mmap of the
+// log, following what other processes append.
+//
+// After a crash the log ends at the last record with a good checksum, and
+// a torn record after it is cut off by the next writer. Compaction writes a
+// new log with a single record per task and renames it over the old one,
+// which other processes notice and switch to. Dependencies are not kept,
+// every task is runnable.
+class LogStore : public TaskStore {
+public:
+  // With sync every append is flushed to disk before it returns, as sqlite3
+  // does for a transaction
+  LogStore(const char* path, FILE* log_file, bool sync = true);
+  ~LogStore();
+
+  // Returns true if the file at path is a task log
+  static bool is_log(const char* path);
+
+  // Create an empty task log at path unless it already exists. Returns 0
+  // for success, -1 for failure
+  static int create(const char* path);
+
+  int init_schema();
+  int check();
+  int fetch_tasks(TaskCollection& tasks,
+                  std::vector<Task*>* new_tasks = nullptr,
+                  int64_t after_rowid = 0);
+  int fetch_running_tasks(TaskCollection& tasks,
+                          std::vector<Task*>* new_tasks);
+  int64_t max_rowid();
+  int digest(int64_t max_rowid, TaskDigest& digest);
+  int fetch_task_window(TaskCollection& tasks, TaskWindow& window,
+                        uint32_t limit, std::vector<Task*>* new_tasks);
+  int fetch_task(TaskCollection& tasks, const std::string& task_name,
+                 std::vector<Task*>* new_tasks);
+  int fetch_dependencies(const std::vector<Task*>& new_tasks,
+                         TaskGraph& graph);
+  int insert_tasks(const std::vector<NewTask>& tasks);
+  int update_task_db(const Task* task);
+
+  // Compact the log if it is due
+  int maintain();
+
+  // Rewrite the log with one record per task. Returns 0 for success, -1
+  // for failure
+  int compact();
+
+  // Bytes of the log read so far
+  uint64_t log_size() const { return _read_offset; }
+
+private:
+  struct Entry {
+    uint64_t    add_offset;       // 0 if there is no task of this rowid
+    uint64_t    update_offset;    // latest state change, 0 if none
+    uint32_t    record_len;       // of the task once compacted
+    TaskState   state;
+  };
+
+  int open_log();
+  void close_log();
+  int catch_up(bool truncate_torn);
+  int lock();
+  void unlock();
+  int append(const std::string& records);
+  void apply(const char* record, uint32_t len, uint64_t offset);
+  void set_state(int64_t rowid, Entry& e, TaskState state);
+  Task* read_task(int64_t rowid);
+  int load_task(int64_t rowid, TaskCollection& tasks,
+                std::vector<Task*>* new_tasks);
+
+  std::string _path;
+  FILE* _log_file;
+  bool _sync;
+  int _fd;
+  ino_t _ino;
+  const char* _map;
+  size_t _map_len;
+  uint64_t _read_offset;            // records before it are applied
+  uint64_t _live_bytes;             // size of a compacted copy
+  std::vector<Entry> _entries;      // rowid - 1 => entry
+  std::unordered_map<std::string, int64_t> _rowids;
+  std::set<int64_t> _created;       // rowids by state, for windows
+  std::set<int64_t> _killed;
+  std::set<int64_t> _running;
+};
+
+}
+
+#endif
@@ -0,0 +1,379 @@
+//
+// Fred Xia (fxia@yahoo.com)
+//
+// Micro benchmarks of the primitives on the dispatch path of
+// task_controller, each measured on its own: the wire protocol codec,
+// loading tasks from the database, writing a task state change,
+// dispatch_task() against backlogs of ready tasks, and the fair queue of
+// ready tasks shared by many tenants.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sqlite3.h>
+#include <sstream>
+#include <algorithm>
+#include "util.h"
+#include "task_db.h"
+#include "fair_queue.h"
+#include "task_controller.h"
+
+using namespace std;
+using namespace epoll_demo;
+
+static const char* bench_db = "/tmp/micro_bench.db";
+
+static double now_sec()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char* name, double sec, uint64_t ops)
+{
+  printf("%-36s %10lu ops %12.1f ns/op %12.0f ops/s\n", name,
+         (unsigned long)ops, sec * 1e9 / max(ops, (uint64_t)1),
+         ops / max(sec, 1e-9));
+}
+
+// Parse a comma separated list of numbers
+static vector<uint32_t> parse_list(const char* arg)
+{
+  vector<uint32_t> list;
+  stringstream ss(arg);
+  string item;
+  while (getline(ss, item, ',')) {
+    list.push_back((uint32_t)atoi(item.c_str()));
+  }
+  return list;
+}
+
+// Create the task table with num_tasks created tasks
+static int create_db(uint32_t num_tasks)
+{
+  unlink(bench_db);
+  sqlite3* db;
+  if (sqlite3_open(bench_db, &db) != SQLITE_OK) {
+    fprintf(stdout, "Cannot create database %s\n", bench_db);
+    return -1;
+  }
+  sqlite3_exec(db,
+               "pragma journal_mode = off; pragma synchronous = off;"
+               "create table demo_task (task_name text primary key, "
+               "sleep_time integer, state integer, worker text, "
+               "assign_time integer, complete_time integer);"
+               "begin;", nullptr, nullptr, nullptr);
+  sqlite3_stmt* stmt;
+  sqlite3_prepare_v2(db, "insert into demo_task values (?, 1, 0, '', 0, 0)",
+                     -1, &stmt, nullptr);
+  for (uint32_t i = 0; i < num_tasks; i++) {
+    char name[MAX_TASK_NAME_LEN];
+    snprintf(name, sizeof(name), "task_%u", i);
+    sqlite3_bind_text(stmt, 1, name, -1, SQLITE_TRANSIENT);
+    sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+  }
+  sqlite3_finalize(stmt);
+  int rc = sqlite3_exec(db, "commit;", nullptr, nullptr, nullptr);
+  sqlite3_close(db);
+  // Add the optional columns up front, as a controller would at startup
+  Taskdb task_db(bench_db, stderr);
+  if (rc != SQLITE_OK || task_db.init_schema() < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+static void bench_codec(uint32_t iterations)
+{
+  TaskResult result = { 0, 120, 30, 2048, 1500 };
+  uint32_t sz;
+  size_t total = 0;
+  double start = now_sec();
+  for (uint32_t i = 0; i < iterations; i++) {
+    char* msg = serialize_client_message("worker_1", "task_12345", 0, 42, sz,
+                                         &result);
+    total += sz;
+    free(msg);
+  }
+  report("serialize_client_message", now_sec() - start, iterations);
+
+  char* msg = serialize_client_message("worker_1", "task_12345", 0, 42, sz,
+                                       &result);
+  string worker, task_name;
+  uint32_t time_left;
+  uint64_t lease;
+  TaskResult out;
+  start = now_sec();
+  for (uint32_t i = 0; i < iterations; i++) {
+    deserialize_client_message(msg + sizeof(uint32_t), sz - sizeof(uint32_t),
+                               worker, task_name, time_left, lease, &out);
+    total += time_left;
+  }
+  report("deserialize_client_message", now_sec() - start, iterations);
+  free(msg);
+
+  const char* commands[] = { "", "gzip -9 /data/input/part-00017.csv" };
+  for (const char* command : commands) {
+    start = now_sec();
+    for (uint32_t i = 0; i < iterations; i++) {
+      msg = serialize_server_message("task_12345", 1500, 42, command, sz);
+      total += sz;
+      free(msg);
+    }
+    report(*command ? "serialize_server_message command" :
+           "serialize_server_message", now_sec() - start, iterations);
+
+    msg = serialize_server_message("task_12345", 1500, 42, command, sz);
+    string cmd;
+    uint32_t sleep_ms;
+    start = now_sec();
+    for (uint32_t i = 0; i < iterations; i++) {
+      deserialize_server_message(msg + sizeof(uint32_t), sz - sizeof(uint32_t),
+                                 task_name, sleep_ms, lease, cmd);
+      total += sleep_ms;
+    }
+    report(*command ? "deserialize_server_message command" :
+           "deserialize_server_message", now_sec() - start, iterations);
+    free(msg);
+  }
+  // Keep the loops from being optimized away
+  if (total == 0) {
+    printf("\n");
+  }
+}
+
+static int bench_fetch(const vector<uint32_t>& rows)
+{
+  for (uint32_t n : rows) {
+    if (create_db(n) < 0) {
+      return -1;
+    }
+    Taskdb task_db(bench_db, stderr);
+    TaskCollection tasks;
+    double start = now_sec();
+    int r = task_db.fetch_tasks(tasks);
+    double sec = now_sec() - start;
+    for (auto it : tasks) {
+      delete it.second;
+    }
+    if (r != (int)n) {
+      printf("fetch_tasks loaded %d of %u rows\n", r, n);
+      return -1;
+    }
+    char name[64];
+    snprintf(name, sizeof(name), "fetch_tasks %u rows", n);
+    report(name, sec, n);
+  }
+  return 0;
+}
+
+// Each state change is written to a different row
+static int bench_update(uint32_t iterations)
+{
+  if (create_db(iterations) < 0) {
+    return -1;
+  }
+  Taskdb task_db(bench_db, stderr);
+  vector<Task*> tasks;
+  for (uint32_t i = 0; i < iterations; i++) {
+    Task* t = new Task();
+    t->task_name = "task_" + to_string(i);
+    t->worker = "worker_1";
+    t->assign_time = t->complete_time = time(0);
+    memset(&t->result, 0, sizeof(t->result));
+    tasks.push_back(t);
+  }
+  struct Transition {
+    TaskState state;
+    const char* name;
+  } transitions[] = {
+    { TaskRunning, "update_task_db running" },
+    { TaskKilled, "update_task_db killed" },
+    { TaskSuccess, "update_task_db success" },
+  };
+  int r = 0;
+  for (auto& tr : transitions) {
+    double start = now_sec();
+    for (auto t : tasks) {
+      t->state = tr.state;
+      if (task_db.update_task_db(t) < 0) {
+        r = -1;
+      }
+    }
+    report(tr.name, now_sec() - start, iterations);
+  }
+  for (auto t : tasks) {
+    delete t;
+  }
+  return r;
+}
+
+// Dispatch to a set of workers in turn. The previous task of a worker is
+// completed in memory before it asks again, outside the timed part.
+static int bench_dispatch(const vector<uint32_t>& backlogs,
+                          uint32_t iterations, uint32_t num_workers)
+{
+  for (uint32_t backlog : backlogs) {
+    if (create_db(backlog) < 0) {
+      return -1;
+    }
+    ControllerOptions opts;
+    TaskController controller(bench_db, 0, true, opts);
+    if (controller.init() < 0) {
+      return -1;
+    }
+    vector<int> fds;
+    for (uint32_t i = 0; i < num_workers; i++) {
+      int fd = open("/dev/null", O_WRONLY);
+      controller._workers[fd] = "worker_" + to_string(i);
+      fds.push_back(fd);
+    }
+    uint32_t count = min(iterations, backlog);
+    double sec = 0;
+    for (uint32_t i = 0; i < count; i++) {
+      int fd = fds[i % fds.size()];
+      auto it = controller._assigned.find(controller._workers[fd]);
+      if (it != controller._assigned.end()) {
+        set<Task*> done = it->second;
+        for (Task* t : done) {
+          controller.complete_task(t);
+          delete t;
+        }
+      }
+      double start = now_sec();
+      controller.dispatch_task(fd);
+      sec += now_sec() - start;
+    }
+    char name[64];
+    snprintf(name, sizeof(name), "dispatch_task backlog %u", backlog);
+    report(name, sec, count);
+    for (int fd : fds) {
+      close(fd);
+    }
+  }
+  return 0;
+}
+
+// A task popped from the fair queue runs until the next pop of its tenant
+// and is queued again, so every tenant keeps its backlog, weight and one
+// task counted against its cap
+static int bench_fair_queue(const vector<uint32_t>& tenant_counts,
+                            uint32_t iterations)
+{
+  const uint32_t tasks_per_tenant = 16;
+  for (uint32_t n : tenant_counts) {
+    FairQueue queue;
+    for (uint32_t i = 0; i < n; i++) {
+      TenantConfig config;
+      config.name = "tenant_" + to_string(i);
+      config.weight = 1 + i % 4;
+      config.max_running = 2;
+      queue.set_tenant(config);
+    }
+    vector<Task*> tasks;
+    for (uint32_t i = 0; i < n * tasks_per_tenant; i++) {
+      Task* t = new Task();
+      t->task_name = "task_" + to_string(i);
+      t->tenant = "tenant_" + to_string(i % n);
+      tasks.push_back(t);
+      queue.push(t);
+    }
+    vector<Task*> running(n, nullptr);
+    double start = now_sec();
+    for (uint32_t i = 0; i < iterations; i++) {
+      Task* t = queue.pop();
+      if (t == nullptr) {
+        printf("Fair queue ran dry\n");
+        return -1;
+      }
+      uint32_t id = t->tenant_id - 1;
+      if (running[id]) {
+        queue.stop(running[id]);
+        queue.push(running[id]);
+      }
+      queue.start(t);
+      running[id] = t;
+    }
+    double sec = now_sec() - start;
+    char name[64];
+    snprintf(name, sizeof(name), "fair_queue pop %u tenants", n);
+    report(name, sec, iterations);
+    for (Task* t : tasks) {
+      delete t;
+    }
+  }
+  return 0;
+}
+
+static const char* bench_usage =
+  "Usage:\n"
+  "\tmicro_bench [-v] [-c <codec iterations>] [-r <rows,...>]\n"
+  "\t\t[-u <updates>] [-b <backlogs,...>] [-d <dispatches>]\n"
+  "\t\t[-w <workers>] [-f <tenants,...>] [-p <pops>]\n"
+  "\t[-v] : keep log output of the controller on stderr\n";
+
+int main(int argc, char** argv)
+{
+  char ch;
+  bool verbose = false;
+  uint32_t codec_iterations = 1000000;
+  vector<uint32_t> rows = { 10000, 1000000 };
+  uint32_t updates = 1000;
+  vector<uint32_t> backlogs = { 1000, 10000, 100000 };
+  uint32_t dispatches = 1000;
+  uint32_t num_workers = 100;
+  vector<uint32_t> tenant_counts = { 1, 100, 10000 };
+  uint32_t pops = 1000000;
+  while ((ch = getopt(argc, argv, "hvc:r:u:b:d:w:f:p:")) > 0) {
+    switch (ch) {
+    case 'v':
+      verbose = true;
+      break;
+    case 'c':
+      codec_iterations = (uint32_t)atoi(optarg);
+      break;
+    case 'r':
+      rows = parse_list(optarg);
+      break;
+    case 'u':
+      updates = (uint32_t)atoi(optarg);
+      break;
+    case 'b':
+      backlogs = parse_list(optarg);
+      break;
+    case 'd':
+      dispatches = (uint32_t)atoi(optarg);
+      break;
+    case 'w':
+      num_workers = max((uint32_t)atoi(optarg), 1u);
+      break;
+    case 'f':
+      tenant_counts = parse_list(optarg);
+      break;
+    case 'p':
+      pops = (uint32_t)atoi(optarg);
+      break;
+    default:
+      printf(bench_usage);
+      exit(ch == 'h' ? 0 : 1);
+    }
+  }
+  // The controller logs every dispatch
+  if (!verbose) {
+    freopen("/dev/null", "w", stderr);
+  }
+  bench_codec(codec_iterations);
+  int r = 0;
+  if (bench_fetch(rows) < 0 || bench_update(updates) < 0 ||
+      bench_dispatch(backlogs, dispatches, num_workers) < 0 ||
+      bench_fair_queue(tenant_counts, pops) < 0) {
+    r = 1;
+  }
+  unlink(bench_db);
+  return r;
+}
@@ -0,0 +1,66 @@
+//
+// Fred Xia (fxia@yahoo.com)
+//
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "mux.h"
+
+using namespace std;
+
+namespace epoll_demo {
+
+void append_mux_frame(string& out, uint32_t session, const char* msg,
+                      uint32_t msg_len)
+{
+  uint32_t header[2] = { (uint32_t)(MUX_HEADER_LEN + msg_len) | MUX_FRAME_FLAG,
+                         session };
+  out.append((const char*)header, sizeof(header));
+  out.append(msg, msg_len);
+}
+
+int parse_mux_frame(const char* data, size_t avail, uint32_t max_msg_len,
+                    MuxFrame& frame)
+{
+  if (avail < sizeof(uint32_t)) {
+    return 0;
+  }
+  uint32_t len;
+  memcpy(&len, data, sizeof(len));
+  if (!(len & MUX_FRAME_FLAG)) {
+    return -1;
+  }
+  len &= ~MUX_FRAME_FLAG;
+  if (len < MUX_HEADER_LEN || len > MUX_HEADER_LEN + max_msg_len) {
+    return -1;
+  }
+  if (avail < len) {
+    return 0;
+  }
+  frame.len = len;
+  memcpy(&frame.session, data + sizeof(len), sizeof(frame.session));
+  frame.msg = data + MUX_HEADER_LEN;
+  frame.msg_len = len - MUX_HEADER_LEN;
+  return 1;
+}
+
+int write_pending(int fd, string& out)
+{
+  size_t done = 0;
+  while (done < out.size()) {
+    ssize_t n = ::write(fd, out.data() + done, out.size() - done);
+    if (n > 0) {
+      done += n;
+    } else if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    } else {
+      return -1;
+    }
+  }
+  out.erase(0, done);
+  return 0;
+}
+
+}
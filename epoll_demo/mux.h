@@ -0,0 +1,54 @@
+#ifndef __task_mux_h__
+#define __task_mux_h__
+//
+// Fred Xia (fxia@yahoo.com)
+//
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+namespace epoll_demo {
+
+// A connection can carry the messages of many worker sessions, e.g. of the
+// workers of a host behind a host agent. Each message then goes in a frame
+// whose length word has MUX_FRAME_FLAG set:
+//
+//   (frame length | MUX_FRAME_FLAG) session message
+//
+// The frame length counts the whole frame, and the message keeps its own
+// length word. A frame without a message closes the session. Sessions are
+// numbered by the agent and never reused on a connection.
+#define MUX_FRAME_FLAG      0x80000000
+#define MUX_HEADER_LEN      (2 * sizeof(uint32_t))
+
+// A frame of a multiplexed connection, pointing into the buffer it was
+// parsed from
+struct MuxFrame {
+  uint32_t    len;        // of the whole frame
+  uint32_t    session;
+  const char* msg;        // the message with its length word
+  uint32_t    msg_len;    // 0 if the frame closes the session
+
+  MuxFrame() : len(0), session(0), msg(nullptr), msg_len(0) {}
+};
+
+// Append a frame of session carrying the whole message msg to out. A
+// msg_len of 0 makes the frame that closes the session.
+void append_mux_frame(std::string& out, uint32_t session, const char* msg,
+                      uint32_t msg_len);
+
+// Parse the frame at the head of the avail bytes at data, whose message is
+// at most max_msg_len bytes. Returns 1 if the frame is complete, 0 if more
+// is to come, -1 if data does not start with a valid frame
+int parse_mux_frame(const char* data, size_t avail, uint32_t max_msg_len,
+                    MuxFrame& frame);
+
+// Write as much of out to the non-blocking fd as it takes, and drop what
+// was written. The rest waits for the connection to drain. Returns -1 if
+// the connection failed
+int write_pending(int fd, std::string& out);
+
+}
+
+#endif
@@ -0,0 +1,259 @@
+//
+// Fred Xia (fxia@yahoo.com)
+//
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <algorithm>
+#include <vector>
+#include "util.h"
+#include "result_upload.h"
+
+using namespace std;
+
+#define LOG(fmt, args...) do { \
+   log_message(_log_file, __FILE__, __LINE__, fmt, ##args); \
+} while (0)
+
+namespace epoll_demo {
+
+// Sink for result data that is not kept
+static int null_fd()
+{
+  static int fd = ::open("/dev/null", O_WRONLY | O_CLOEXEC);
+  return fd;
+}
+
+ResultUploads::ResultUploads()
+  : _log_file(nullptr), _bytes(0)
+{
+  _pipe[0] = _pipe[1] = -1;
+}
+
+ResultUploads::~ResultUploads()
+{
+  for (auto& it : _uploads) {
+    close(it.second.file);
+  }
+  for (int fd : _pipe) {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+}
+
+int ResultUploads::init(const string& dir, FILE* log_file)
+{
+  _dir = dir;
+  _log_file = log_file;
+  // A chunk of result data fits the pipe whole
+  if (pipe2(_pipe, O_CLOEXEC) < 0) {
+    LOG("Error in pipe2(): %s", strerror(errno));
+    return -1;
+  }
+  fcntl(_pipe[1], F_SETPIPE_SZ, RESULT_CHUNK_LEN);
+  return 0;
+}
+
+string ResultUploads::path(const string& task_name) const
+{
+  string name = task_name;
+  replace(name.begin(), name.end(), '/', '_');
+  return _dir + "/" + name;
+}
+
+const ResultUpload* ResultUploads::get(uint64_t lease) const
+{
+  auto it = _uploads.find(lease);
+  return it == _uploads.end() ? nullptr : &it->second;
+}
+
+ResultUpload* ResultUploads::find(int fd, uint64_t lease, uint64_t offset)
+{
+  auto it = _uploads.find(lease);
+  if (it == _uploads.end()) {
+    return nullptr;
+  }
+  if (it->second.fd != fd || offset == 0) {
+    // Sent again from the start, e.g. over a new connection
+    abort(lease);
+    return nullptr;
+  }
+  if (offset != it->second.bytes) {
+    LOG("Result of task %s is missing data at %lu",
+        it->second.task_name.c_str(), (unsigned long)it->second.bytes);
+    abort(lease);
+    return nullptr;
+  }
+  return &it->second;
+}
+
+ResultUpload* ResultUploads::open(int fd, uint64_t lease,
+                                  const string& task_name)
+{
+  ResultUpload& u = _uploads[lease];
+  u.fd = fd;
+  u.task_name = task_name;
+  u.last_ms = monotonic_ms();
+  u.path = path(task_name) + "." + to_string(lease) + ".part";
+  u.file = ::open(u.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0644);
+  if (u.file < 0) {
+    LOG("Cannot create %s: %s", u.path.c_str(), strerror(errno));
+    _uploads.erase(lease);
+    return nullptr;
+  }
+  return &u;
+}
+
+void ResultUploads::abort(uint64_t lease)
+{
+  auto it = _uploads.find(lease);
+  if (it == _uploads.end()) {
+    return;
+  }
+  LOG("Drop result of task %s after %lu bytes",
+      it->second.task_name.c_str(), (unsigned long)it->second.bytes);
+  close(it->second.file);
+  unlink(it->second.path.c_str());
+  _uploads.erase(it);
+}
+
+void ResultUploads::abort_all(int fd)
+{
+  _receiving.erase(fd);
+  vector<uint64_t> leases;
+  for (auto& it : _uploads) {
+    if (it.second.fd == fd) {
+      leases.push_back(it.first);
+    }
+  }
+  for (uint64_t lease : leases) {
+    abort(lease);
+  }
+}
+
+string ResultUploads::finish(uint64_t lease)
+{
+  auto it = _uploads.find(lease);
+  if (it == _uploads.end()) {
+    return "";
+  }
+  ResultUpload u = it->second;
+  _uploads.erase(it);
+  close(u.file);
+  string result_path = path(u.task_name);
+  if (rename(u.path.c_str(), result_path.c_str()) < 0) {
+    LOG("Cannot rename %s: %s", u.path.c_str(), strerror(errno));
+    unlink(u.path.c_str());
+    return "";
+  }
+  LOG("Result of task %s is %lu bytes in %s", u.task_name.c_str(),
+      (unsigned long)u.bytes, result_path.c_str());
+  return result_path;
+}
+
+bool ResultUploads::take(int fd, uint64_t lease, ResultUpload* u,
+                         const char* chunk, uint32_t avail,
+                         uint32_t chunk_len)
+{
+  if (u) {
+    u->last_ms = monotonic_ms();
+  }
+  const char* data = chunk + RESULT_CHUNK_HEADER_LEN;
+  uint32_t len = avail - RESULT_CHUNK_HEADER_LEN;
+  _bytes += len;
+  while (u && len > 0) {
+    ssize_t n = ::write(u->file, data, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      LOG("Error in write() to %s: %s", u->path.c_str(), strerror(errno));
+      abort(lease);
+      break;
+    }
+    u->bytes += n;
+    data += n;
+    len -= n;
+  }
+  if (avail < chunk_len) {
+    ResultChunk& c = _receiving[fd];
+    c.lease = lease;
+    c.left = chunk_len - avail;
+    return false;
+  }
+  return true;
+}
+
+int ResultUploads::receive(int fd, uint64_t& lease)
+{
+  ResultChunk& c = _receiving[fd];
+  while (c.left > 0) {
+    ssize_t n = splice(fd, nullptr, _pipe[1], nullptr, c.left,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return 0;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    c.left -= n;
+    _bytes += n;
+    auto it = _uploads.find(c.lease);
+    if (it != _uploads.end()) {
+      it->second.last_ms = monotonic_ms();
+    }
+    int r = drain(it == _uploads.end() ? nullptr : &it->second, n);
+    if (r < 0) {
+      abort(c.lease);
+    }
+    if (r < -1) {
+      return -2;
+    }
+  }
+  lease = c.lease;
+  _receiving.erase(fd);
+  return 1;
+}
+
+int ResultUploads::drain(ResultUpload* u, size_t n)
+{
+  int r = 0;
+  while (n > 0) {
+    int file = (u && r == 0) ? u->file : null_fd();
+    ssize_t m = splice(_pipe[0], nullptr, file, nullptr, n, SPLICE_F_MOVE);
+    if (m < 0 && errno == EINTR) {
+      continue;
+    }
+    if (m > 0) {
+      if (u && r == 0) {
+        u->bytes += m;
+      }
+      n -= m;
+      continue;
+    }
+    if (u && r == 0) {
+      LOG("Error in splice() to %s: %s", u->path.c_str(), strerror(errno));
+      r = -1;
+      continue;
+    }
+    // Cannot happen with /dev/null, but the pipe must not keep data of
+    // one chunk into the next
+    char scratch[4096];
+    ssize_t k = ::read(_pipe[0], scratch, min(n, sizeof(scratch)));
+    if (k <= 0) {
+      LOG("Error: result pipe is stuck: %s", strerror(errno));
+      return -2;
+    }
+    n -= k;
+  }
+  return r;
+}
+
+}
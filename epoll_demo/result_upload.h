@@ -0,0 +1,114 @@
+#ifndef __task_result_upload_h__
+#define __task_result_upload_h__
+//
+// Fred Xia (fxia@yahoo.com)
+//
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <map>
+
+namespace epoll_demo {
+
+// Output of a run streamed by its worker, by the lease of the run. It is
+// written to <result dir>/<task>.<lease>.part and renamed to
+// <result dir>/<task> when the task completes.
+struct ResultUpload {
+  int       fd;           // connection or session of the worker
+  std::string task_name;
+  std::string path;       // of the part file
+  int       file;
+  uint64_t  bytes;        // written so far
+  uint64_t  last_ms;      // monotonic, when data last arrived
+
+  ResultUpload() : fd(0), file(-1), bytes(0), last_ms(0) {}
+};
+
+// Result chunk whose data is still arriving on a connection
+struct ResultChunk {
+  uint64_t  lease;
+  uint32_t  left;         // bytes not received yet
+
+  ResultChunk() : lease(0), left(0) {}
+};
+
+// Results workers stream back while their tasks run, kept a file per task.
+// A chunk is taken from the input buffer of its connection as far as it
+// is there, and the rest of it goes from the socket to the file through a
+// pipe with splice(), it is not copied into the process. Which run a chunk
+// belongs to is up to the caller.
+class ResultUploads {
+public:
+  ResultUploads();
+  ~ResultUploads();
+
+  // Keep results in dir, or drop them if it is empty. Returns 0 for
+  // success, -1 for failure
+  int init(const std::string& dir, FILE* log_file);
+
+  bool keeping() const { return !_dir.empty(); }
+
+  // Results being received
+  size_t count() const { return _uploads.size(); }
+
+  // Result data received since start
+  uint64_t bytes() const { return _bytes; }
+
+  // Path a result is kept at once its task completes
+  std::string path(const std::string& task_name) const;
+
+  // The upload of the run with lease, nullptr if there is none
+  const ResultUpload* get(uint64_t lease) const;
+
+  // The upload a chunk at offset of the run with lease from fd goes on.
+  // One sent again from the start, or missing data, is dropped. Returns
+  // nullptr if there is none.
+  ResultUpload* find(int fd, uint64_t lease, uint64_t offset);
+
+  // Start the upload of the run with lease of task_name from fd. Returns
+  // nullptr if its file cannot be created
+  ResultUpload* open(int fd, uint64_t lease, const std::string& task_name);
+
+  // Drop a result not complete, e.g. of a run that lost its worker
+  void abort(uint64_t lease);
+
+  // Drop the results arriving from fd, and the chunk in progress on it
+  void abort_all(int fd);
+
+  // Move the result of a completed run into place. Returns its path, empty
+  // if the run sent none.
+  std::string finish(uint64_t lease);
+
+  // Take a chunk of the run with lease of chunk_len bytes, the first avail
+  // of which are at chunk, into u, or drop it if u is nullptr. Returns
+  // whether the chunk is complete, the rest is left to receive() if not
+  bool take(int fd, uint64_t lease, ResultUpload* u, const char* chunk,
+            uint32_t avail, uint32_t chunk_len);
+
+  // Whether the data of a chunk is still arriving on fd
+  bool receiving(int fd) const { return _receiving.count(fd) != 0; }
+
+  // Move the data of the chunk in progress on fd from the socket to its
+  // file. Returns 1 once the chunk is complete, with lease set to its
+  // run, 0 if more is to come, -1 if the connection is closed or failed,
+  // -2 if the pipe is stuck and no more results can be received
+  int receive(int fd, uint64_t& lease);
+
+private:
+  // Pass the n bytes in the pipe on to the file of u, or drop them if u is
+  // nullptr. The pipe is left empty. Returns -1 if the file cannot be
+  // written, -2 if the pipe is stuck
+  int drain(ResultUpload* u, size_t n);
+
+  std::string _dir;
+  FILE* _log_file;
+  std::map<uint64_t, ResultUpload> _uploads;  // lease => upload
+  std::map<int, ResultChunk> _receiving;      // fd => chunk in progress
+  int _pipe[2];             // data passes through on its way to file
+  uint64_t _bytes;
+};
+
+}
+
+#endif
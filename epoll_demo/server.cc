@@ -2,6 +2,7 @@
 #include <sys/types.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/epoll.h>
 #include <time.h>
 #include <string.h>
@@ -12,6 +13,7 @@
 #include <errno.h>
 #include <string>
 #include <map>
+#include <vector>
 #include "util.h"
 #include "server.h"
 
@@ -29,6 +31,9 @@ struct TcpServerImpl {
   uint16_t _server_port;
   uint32_t _timeout;    
   int _server_fd;
+  int _unix_fd;         // 0 if no Unix domain socket
+  string _unix_path;
+  vector<int> _watched;   // fds other than connections to wait for
   int _epoll_fd;
   struct sockaddr_in _server_addr;
   map<int, epoll_event*> _conn_events;
@@ -38,7 +43,7 @@ struct TcpServerImpl {
   TcpServerImpl(TcpServer* svr, const char* name, uint16_t port,
                 uint32_t timeout, bool to_stderr)
     : _server(svr), _server_name(name), _server_port(port), _timeout(timeout),
-      _server_fd(0), _epoll_fd(0) {
+      _server_fd(0), _unix_fd(0), _epoll_fd(0) {
     if (!to_stderr) {
       char buffer[128];
       snprintf(buffer, sizeof(buffer), "/tmp/%s_XXXXXX", name);
@@ -62,6 +67,14 @@ struct TcpServerImpl {
       close(_epoll_fd);
       _epoll_fd = 0;
     }
+    // Watched fds belong to the caller
+    for (int fd : _watched) {
+      auto it = _conn_events.find(fd);
+      if (it != _conn_events.end()) {
+        delete it->second;
+        _conn_events.erase(it);
+      }
+    }
     for (auto it : _conn_events) {
       close(it.first);
       delete it.second;
@@ -71,6 +84,11 @@ struct TcpServerImpl {
       close(_server_fd);
       _server_fd = 0;
     }
+    if (_unix_fd) {
+      close(_unix_fd);
+      unlink(_unix_path.c_str());
+      _unix_fd = 0;
+    }
     if (_log_file && _log_file != stderr) {
       fclose(_log_file);
       _log_file = nullptr;
@@ -102,7 +120,7 @@ struct TcpServerImpl {
       LOG("Error in bind(): %s", strerror(errno));
       return -1;
     }
-    r = ::listen(sock_fd, 5);
+    r = ::listen(sock_fd, SOMAXCONN);
     if (r < 0) {
       LOG("Error in listen(): %s", strerror(errno));
       return -1;
@@ -123,12 +141,64 @@ struct TcpServerImpl {
     LOG("Server port initialized: %d", _server_port);
     _server_fd = sock_fd;
     _epoll_fd = epoll_fd;
+    if (!_unix_path.empty() && init_unix() < 0) {
+      return -1;
+    }
+    for (int fd : _watched) {
+      struct epoll_event* watch_ev = new epoll_event;
+      watch_ev->data.fd = fd;
+      watch_ev->events = EPOLLIN | EPOLLET;
+      if (epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, fd, watch_ev) < 0) {
+        LOG("Error in epoll_ctl(): %s", strerror(errno));
+        delete watch_ev;
+        return -1;
+      }
+      _conn_events[fd] = watch_ev;
+    }
+    return 0;
+  }
+
+  int init_unix() {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (_unix_path.size() >= sizeof(addr.sun_path)) {
+      LOG("Unix socket path too long: %s", _unix_path.c_str());
+      return -1;
+    }
+    strcpy(addr.sun_path, _unix_path.c_str());
+    int sock_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                         0);
+    if (sock_fd < 0) {
+      LOG("Error in socket(): %s", strerror(errno));
+      return -1;
+    }
+    // A socket left by a previous run is replaced
+    unlink(_unix_path.c_str());
+    if (::bind(sock_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        ::listen(sock_fd, SOMAXCONN) < 0) {
+      LOG("Error in bind() or listen() on %s: %s", _unix_path.c_str(),
+          strerror(errno));
+      close(sock_fd);
+      return -1;
+    }
+    struct epoll_event ev;
+    ev.data.fd = sock_fd;
+    ev.events = EPOLLIN | EPOLLERR | EPOLLHUP | EPOLLET;
+    if (epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, sock_fd, &ev) < 0) {
+      LOG("Error in epoll_ctl(): %s", strerror(errno));
+      close(sock_fd);
+      return -1;
+    }
+    LOG("Unix socket initialized: %s", _unix_path.c_str());
+    _unix_fd = sock_fd;
     return 0;
   }
 
   int run_loop() {
     while (true) {
-      size_t max_events = _conn_events.size() + 1;
+      // Connections and the listening sockets
+      size_t max_events = _conn_events.size() + 2;
       struct epoll_event events[max_events];
       memset((char*)events, 0, sizeof(events));
       int r = epoll_wait(_epoll_fd, events, max_events, _timeout);
@@ -140,7 +210,9 @@ struct TcpServerImpl {
       } else {
         for (int i = 0; i < r; i++) {
           if (events[i].data.fd == _server_fd) {
-            handle_server_fd(events[i]);
+            handle_server_fd(_server_fd);
+          } else if (_unix_fd && events[i].data.fd == _unix_fd) {
+            handle_server_fd(_unix_fd);
           } else {
             handle_connection(events[i]);
           }
@@ -153,11 +225,10 @@ struct TcpServerImpl {
     return 0;
   }
 
-  int handle_server_fd(const epoll_event& event) {
-    socklen_t len = sizeof(_server_addr);
+  int handle_server_fd(int listen_fd) {
     LOG("handle_server_fd");
     while (true) {
-      int fd = accept(_server_fd, (struct sockaddr*)&_server_addr, &len);
+      int fd = accept(listen_fd, nullptr, nullptr);
       if (fd < 0) {
         if (errno == EAGAIN) {
           break;
@@ -169,7 +240,9 @@ struct TcpServerImpl {
         LOG("Error in set_fd_non_block(): %s", strerror(errno));
         return -1;
       }
-      uint32_t what_to_do = _server->handle_new_connection(fd);
+      uint32_t what_to_do = (listen_fd == _unix_fd ?
+                             _server->handle_new_unix_connection(fd) :
+                             _server->handle_new_connection(fd));
       if (what_to_do == 0) {
         LOG("Connection rejected");
         close(fd);
@@ -190,6 +263,36 @@ struct TcpServerImpl {
     return 0;
   }
 
+  int add_connection(int fd, uint32_t events) {
+    struct epoll_event* ev = new epoll_event;
+    ev->events = events;
+    ev->data.fd = fd;
+    if (epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, fd, ev) < 0) {
+      LOG("Error in epoll_ctl(): %s", strerror(errno));
+      delete ev;
+      return -1;
+    }
+    _conn_events[fd] = ev;
+    LOG("Added connection %d, %x", fd, events);
+    return 0;
+  }
+
+  int set_events(int fd, uint32_t events) {
+    auto it = _conn_events.find(fd);
+    if (it == _conn_events.end()) {
+      return -1;
+    }
+    if (it->second->events == events) {
+      return 0;
+    }
+    it->second->events = events;
+    if (epoll_ctl(_epoll_fd, EPOLL_CTL_MOD, fd, it->second) < 0) {
+      LOG("Error epoll_ctl(): %s", strerror(errno));
+      return -1;
+    }
+    return 0;
+  }
+
   int handle_connection(const epoll_event& event) {
     uint32_t what_to_do = _server->handle_connection(event);
     auto it = _conn_events.find(event.data.fd);
@@ -259,6 +362,26 @@ void TcpServer::set_timeout(uint32_t timeout)
   impl->_timeout = timeout;
 }
 
+void TcpServer::listen_unix(const char* path)
+{
+  impl->_unix_path = path;
+}
+
+void TcpServer::watch_fd(int fd)
+{
+  impl->_watched.push_back(fd);
+}
+
+int TcpServer::add_connection(int fd, uint32_t events)
+{
+  return impl->add_connection(fd, events);
+}
+
+int TcpServer::set_events(int fd, uint32_t events)
+{
+  return impl->set_events(fd, events);
+}
+
 int TcpServer::run_loop()
 {
   if (impl->init_server() < 0) {
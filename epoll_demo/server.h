@@ -30,10 +30,33 @@ public:
   // Set epoll_wait timeout value in milliseconds
   void set_timeout(uint32_t timeout);
 
+  // Also accept connections on a Unix domain socket at path, e.g. for local
+  // administration. Call before run_loop().
+  void listen_unix(const char* path);
+
+  // Also wait for input on fd, e.g. an eventfd signalled by another thread.
+  // Its events go to handle_connection() like those of a connection. fd is
+  // not closed by the server. Call before run_loop().
+  void watch_fd(int fd);
+
+  // Add a connection made by the server itself, e.g. a connect() in
+  // progress to another server. Its events go to handle_connection() like
+  // those of an accepted connection. Returns 0 for success, -1 for failure
+  int add_connection(int fd, uint32_t events);
+
+  // Change the events of interest of a connection outside of its
+  // handle_connection(), e.g. to wait for output queued meanwhile to drain.
+  // Returns 0 for success, -1 for failure
+  int set_events(int fd, uint32_t events);
+
   // Handle a newly accepted connection. Returns mask of interest for
   // epoll_wait call. 0 means connection rejected and to be closed.
   virtual uint32_t handle_new_connection(int fd) = 0;
 
+  // Same as handle_new_connection() for a connection accepted on the Unix
+  // domain socket. Rejected by default.
+  virtual uint32_t handle_new_unix_connection(int fd) { return 0; }
+
   // Handle a connection event. Returns the mask of interst for next
   // epoll_wait call. If 0 the fd is closed.
   virtual uint32_t handle_connection(const epoll_event& event) = 0;
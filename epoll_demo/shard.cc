@@ -0,0 +1,333 @@
+//
+// Fred Xia (fxia@yahoo.com)
+//
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include "util.h"
+#include "shard.h"
+
+using namespace std;
+
+#define LOG(fmt, args...) do { \
+  log_message(log_file, __FILE__, __LINE__, fmt, ##args); \
+} while (0)
+
+namespace epoll_demo {
+
+// A link to a peer shard that could not be made, or was closed, e.g. as the
+// peer had no task to give, is made again after this long
+static const uint32_t peer_retry_ms = 1000;
+
+uint64_t shard_hash(const string& s)
+{
+  // FNV-1a, then the finalizer of splitmix64 so names that differ only in
+  // the last characters land far apart
+  uint64_t h = 14695981039346656037ULL;
+  for (unsigned char c : s) {
+    h = (h ^ c) * 1099511628211ULL;
+  }
+  h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+  return h ^ (h >> 31);
+}
+
+int ShardRing::load(const char* path, FILE* log_file)
+{
+  FILE* f = fopen(path, "r");
+  if (f == nullptr) {
+    LOG("Cannot open cluster file %s: %s", path, strerror(errno));
+    return -1;
+  }
+  char line[1024];
+  uint32_t line_no = 0;
+  int r = 0;
+  while (r == 0 && fgets(line, sizeof(line), f)) {
+    line_no++;
+    char name[256], address[256], database[512];
+    int n = sscanf(line, " %255s %255s %511s", name, address, database);
+    if (n <= 0 || name[0] == '#') {
+      continue;
+    }
+    ShardInfo shard;
+    shard.name = name;
+    char* colon = (n >= 2 ? strrchr(address, ':') : nullptr);
+    int port = colon ? atoi(colon + 1) : 0;
+    if (colon == nullptr || colon == address || port <= 0 ||
+        port > MAX_PORT_NUMBER || shard.name.size() > MAX_TASK_NAME_LEN ||
+        find(shard.name) >= 0) {
+      LOG("Invalid shard at line %u of %s", line_no, path);
+      r = -1;
+      break;
+    }
+    shard.host.assign(address, colon - address);
+    shard.port = (uint16_t)port;
+    if (n == 3) {
+      shard.database = database;
+    }
+    add_shard(shard);
+  }
+  fclose(f);
+  if (r == 0 && _shards.empty()) {
+    LOG("No shards in cluster file %s", path);
+    r = -1;
+  }
+  return r;
+}
+
+void ShardRing::add_shard(const ShardInfo& shard)
+{
+  uint32_t index = _shards.size();
+  _shards.push_back(shard);
+  for (uint32_t i = 0; i < SHARD_RING_POINTS; i++) {
+    _ring.push_back(make_pair(shard_hash(shard.name + "#" + to_string(i)),
+                              index));
+  }
+  sort(_ring.begin(), _ring.end());
+}
+
+int ShardRing::find(const string& name) const
+{
+  for (uint32_t i = 0; i < _shards.size(); i++) {
+    if (_shards[i].name == name) {
+      return (int)i;
+    }
+  }
+  return -1;
+}
+
+uint32_t ShardRing::owner(const string& task_name) const
+{
+  auto it = lower_bound(_ring.begin(), _ring.end(),
+                        make_pair(shard_hash(task_name), 0u));
+  if (it == _ring.end()) {
+    it = _ring.begin();
+  }
+  return it->second;
+}
+
+// Peer links log to the log file of their shard
+#undef LOG
+#define LOG(fmt, args...) do { \
+  log_message(_log_file, __FILE__, __LINE__, fmt, ##args); \
+} while (0)
+
+int PeerLinks::init(const ShardRing* ring, uint32_t self, FILE* log_file)
+{
+  _ring = ring;
+  _self = self;
+  _log_file = log_file;
+  _links.resize(ring->shards().size());
+  for (uint32_t i = 0; i < _links.size(); i++) {
+    if (i != _self && resolve_address(address(i), _links[i].addr) < 0) {
+      LOG("Cannot resolve shard %s at %s", name(i).c_str(),
+          address(i).c_str());
+      return -1;
+    }
+  }
+  _next = _self + 1;
+  return 0;
+}
+
+string PeerLinks::address(uint32_t i) const
+{
+  const ShardInfo& shard = _ring->shards()[i];
+  return shard.host + ":" + to_string(shard.port);
+}
+
+int PeerLinks::find(int fd) const
+{
+  auto it = _fds.find(fd);
+  return it == _fds.end() ? -1 : (int)it->second;
+}
+
+int PeerLinks::next_up()
+{
+  for (uint32_t k = 0; k < _links.size(); k++) {
+    uint32_t i = (_next + k) % _links.size();
+    if (i != _self && _links[i].fd && !_links[i].connecting) {
+      _next = i + 1;
+      return (int)i;
+    }
+  }
+  return -1;
+}
+
+uint64_t PeerLinks::requests() const
+{
+  uint64_t n = 0;
+  for (auto& p : _links) {
+    n += p.requests;
+  }
+  return n;
+}
+
+vector<uint32_t> PeerLinks::due(uint64_t now) const
+{
+  vector<uint32_t> peers;
+  for (uint32_t i = 0; i < _links.size(); i++) {
+    if (i != _self && _links[i].fd == 0 && _links[i].retry_ms <= now) {
+      peers.push_back(i);
+    }
+  }
+  return peers;
+}
+
+uint32_t PeerLinks::next_retry(uint64_t now, uint32_t max_ms) const
+{
+  uint64_t next = max_ms;
+  for (uint32_t i = 0; i < _links.size(); i++) {
+    const PeerLink& p = _links[i];
+    if (i != _self && p.fd == 0) {
+      next = min(next, p.retry_ms - min(p.retry_ms, now));
+    }
+  }
+  return (uint32_t)next;
+}
+
+int PeerLinks::connect(uint32_t i)
+{
+  PeerLink& p = _links[i];
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    LOG("Error in socket(): %s", strerror(errno));
+    p.retry_ms = monotonic_ms() + peer_retry_ms;
+    return -1;
+  }
+  if (::connect(fd, (struct sockaddr*)&p.addr, sizeof(p.addr)) < 0 &&
+      errno != EINPROGRESS) {
+    LOG("Cannot connect to shard %s: %s", name(i).c_str(), strerror(errno));
+    ::close(fd);
+    p.retry_ms = monotonic_ms() + peer_retry_ms;
+    return -1;
+  }
+  p.fd = fd;
+  p.connecting = true;
+  _fds[fd] = i;
+  return fd;
+}
+
+int PeerLinks::connected(uint32_t i)
+{
+  PeerLink& p = _links[i];
+  int err = 0;
+  socklen_t len = sizeof(err);
+  if (getsockopt(p.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+    err = errno;
+  }
+  if (err) {
+    LOG("Cannot connect to shard %s: %s", name(i).c_str(), strerror(err));
+    return -1;
+  }
+  LOG("Connected to shard %s", name(i).c_str());
+  p.connecting = false;
+  return 0;
+}
+
+int PeerLinks::receive(uint32_t i, vector<PeerMessage>& msgs)
+{
+  PeerLink& p = _links[i];
+  char chunk[4096];
+  while (true) {
+    int r = ::read(p.fd, chunk, sizeof(chunk));
+    if (r > 0) {
+      p.inbuf.append(chunk, r);
+      continue;
+    }
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r < 0 && errno == EAGAIN) {
+      break;
+    }
+    return -1;
+  }
+  size_t offset = 0;
+  int r = 0;
+  while (p.inbuf.size() - offset >= sizeof(uint32_t)) {
+    uint32_t msg_len;
+    memcpy(&msg_len, p.inbuf.data() + offset, sizeof(msg_len));
+    if (msg_len <= sizeof(msg_len) || msg_len > MAX_SERVER_MSG_LEN) {
+      LOG("Error in shard message len %u", msg_len);
+      r = -1;
+      break;
+    }
+    if (p.inbuf.size() - offset < msg_len) {
+      break;
+    }
+    PeerMessage m;
+    if (deserialize_server_message(p.inbuf.data() + offset + sizeof(msg_len),
+                                   msg_len - sizeof(msg_len), m.task_name,
+                                   m.sleep_ms, m.lease, m.command) < 0) {
+      LOG("Error in deserialize_server_message");
+      r = -1;
+      break;
+    }
+    msgs.push_back(m);
+    offset += msg_len;
+  }
+  p.inbuf.erase(0, offset);
+  return r;
+}
+
+int PeerLinks::send(int fd, const char* task_name, const TaskResult* result,
+                    uint64_t lease, uint32_t time_left)
+{
+  uint32_t msg_len;
+  char* msg = serialize_client_message(name(_self).c_str(), task_name,
+                                       time_left, lease, msg_len, result);
+  if (msg == nullptr) {
+    return -1;
+  }
+  int r = ::send(fd, msg, msg_len, MSG_NOSIGNAL);
+  free(msg);
+  if (r != (int)msg_len) {
+    LOG("Error in send() to shard: %s", strerror(errno));
+    ::shutdown(fd, SHUT_RDWR);
+    return -1;
+  }
+  return 0;
+}
+
+int PeerLinks::request(uint32_t i)
+{
+  _links[i].requests++;
+  return send(_links[i].fd, "", nullptr);
+}
+
+void PeerLinks::leave()
+{
+  for (auto& p : _links) {
+    if (p.fd && !p.connecting) {
+      send(p.fd, "", nullptr, 0, PEER_LEAVING);
+    }
+  }
+}
+
+void PeerLinks::left(uint32_t i)
+{
+  PeerLink& p = _links[i];
+  if (p.fd) {
+    ::shutdown(p.fd, SHUT_RDWR);
+    p.connecting = true;  // not used until closed
+  }
+}
+
+void PeerLinks::close(uint32_t i)
+{
+  PeerLink& p = _links[i];
+  if (!p.connecting) {
+    LOG("Close link to shard %s", name(i).c_str());
+  }
+  _fds.erase(p.fd);
+  p.fd = 0;
+  p.connecting = false;
+  p.requests = 0;
+  p.inbuf.clear();
+  p.retry_ms = monotonic_ms() + peer_retry_ms;
+}
+
+}
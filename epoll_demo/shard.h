@@ -0,0 +1,181 @@
+#ifndef __task_shard_h__
+#define __task_shard_h__
+//
+// Fred Xia (fxia@yahoo.com)
+//
+
+#include <stdint.h>
+#include <stdio.h>
+#include <netinet/in.h>
+#include <string>
+#include <map>
+#include <set>
+#include <vector>
+#include <utility>
+#include "task_db.h"
+
+namespace epoll_demo {
+
+// Points of every shard on the hash ring. More points spread the tasks
+// more evenly and move fewer of them when a shard is added or removed.
+#define SHARD_RING_POINTS   128
+
+// Time left of a message a shard sends its peers when it is leaving
+#define PEER_LEAVING        0xffffffff
+
+// A controller of a cluster
+struct ShardInfo {
+  std::string name;       // also the worker id it steals tasks with
+  std::string host;
+  uint16_t    port;
+  std::string database;   // empty if the database is given with -d
+};
+
+// Shards of a controller cluster and the consistent hash ring that tells
+// which of them owns a task. A task belongs to the first point of a shard
+// at or after the hash of its name, so every process that reads the same
+// cluster file agrees on the owner without talking to the others.
+//
+// The cluster file has a line per shard:
+//
+//   <name> <host>:<port> [<database>]
+//
+// Blank lines and lines starting with '#' are skipped.
+class ShardRing {
+public:
+  ShardRing() {}
+
+  // Read the cluster file. Returns 0 for success, -1 for failure
+  int load(const char* path, FILE* log_file);
+
+  void add_shard(const ShardInfo& shard);
+
+  const std::vector<ShardInfo>& shards() const { return _shards; }
+
+  // Index of the shard named name, -1 if there is none
+  int find(const std::string& name) const;
+
+  // Index of the shard owning a task
+  uint32_t owner(const std::string& task_name) const;
+
+private:
+  std::vector<ShardInfo> _shards;
+  std::vector<std::pair<uint64_t, uint32_t>> _ring; // point => shard index
+};
+
+// Hash of names on the ring, the same in every process and build
+uint64_t shard_hash(const std::string& s);
+
+// Link to another shard of the cluster, kept open while the peer runs
+struct PeerLink {
+  struct sockaddr_in addr;
+  int       fd;           // 0 if not connected
+  bool      connecting;   // fd is a connect() in progress
+  uint32_t  requests;     // task requests not answered yet
+  uint64_t  retry_ms;     // not connected again before, monotonic
+  std::string inbuf;      // partial server messages
+  std::set<Task*> stolen; // tasks taken over the link, not done yet
+
+  PeerLink() : fd(0), connecting(false), requests(0), retry_ms(0) {}
+};
+
+// A message of a peer: a task it gives, the cancel of one, or no more
+// tasks to give
+struct PeerMessage {
+  std::string task_name;  // empty if the peer has no task to give
+  uint32_t    sleep_ms;   // CANCEL_SLEEP_TIME for a cancel
+  uint64_t    lease;      // of the task on the peer, 0 cancels any
+  std::string command;
+
+  PeerMessage() : sleep_ms(0), lease(0) {}
+};
+
+// Links of a shard to the other shards of its cluster. Over a link the
+// shard asks the peer for tasks as a worker would, runs them on its own
+// workers and reports them back, so the peer keeps owning them. The links
+// carry the messages and keep count of the tasks taken over them, what is
+// done with the tasks is up to the shard. Their sockets are watched by the
+// event loop of the shard.
+class PeerLinks {
+public:
+  PeerLinks() : _ring(nullptr), _self(0), _next(0), _log_file(nullptr) {}
+
+  // Link shard self of ring to the others. Returns 0 for success, -1 for
+  // failure
+  int init(const ShardRing* ring, uint32_t self, FILE* log_file);
+
+  // Number of shards, the link to self is never up
+  uint32_t size() const { return _links.size(); }
+
+  PeerLink& link(uint32_t i) { return _links[i]; }
+  const PeerLink& link(uint32_t i) const { return _links[i]; }
+
+  const std::string& name(uint32_t i) const {
+    return _ring->shards()[i].name;
+  }
+
+  // "<host>:<port>" of shard i
+  std::string address(uint32_t i) const;
+
+  // Index of the peer linked over fd, -1 if fd is not a link
+  int find(int fd) const;
+
+  // Next peer that is up, round robin. A peer that has finished its tasks
+  // exits and closes its links. Returns -1 if there is none
+  int next_up();
+
+  // Task requests not answered yet on all links
+  uint64_t requests() const;
+
+  // Peers whose link is down and due to be made again
+  std::vector<uint32_t> due(uint64_t now) const;
+
+  // Milliseconds until the next link that is down is due, at most max_ms
+  uint32_t next_retry(uint64_t now, uint32_t max_ms) const;
+
+  // Start a connect to peer i. Returns the socket, to be watched for
+  // EPOLLOUT until the connect completes, or -1 for failure, after which
+  // the link is due again later
+  int connect(uint32_t i);
+
+  // The connect to peer i completed. Returns 0 if the link is up, -1 if
+  // it failed
+  int connected(uint32_t i);
+
+  // Read what peer i sent, and parse its complete messages into msgs.
+  // Returns -1 if the link is closed or broken, msgs then has the messages
+  // before the break
+  int receive(uint32_t i, std::vector<PeerMessage>& msgs);
+
+  // Send a message over the link on fd. A failed link is closed through its
+  // next event. Returns 0 for success, -1 for failure
+  int send(int fd, const char* task_name, const TaskResult* result,
+           uint64_t lease = 0, uint32_t time_left = 0);
+
+  // Ask peer i for a task
+  int request(uint32_t i);
+
+  // Tell the peers that are up that this shard is leaving
+  void leave();
+
+  // Peer i is leaving. Its link is shut down, and made again only after
+  // it is closed.
+  void left(uint32_t i);
+
+  // The link to peer i is closed, the caller has dropped the tasks stolen
+  // over it. Its socket is closed by the caller. It is made again after
+  // a while.
+  void close(uint32_t i);
+
+private:
+  const ShardRing* _ring;
+  uint32_t _self;               // index of this shard in _ring
+  std::vector<PeerLink> _links; // by shard index
+  std::map<int, uint32_t> _fds; // fd => shard index
+  uint32_t _next;               // round robin of next_up()
+  FILE* _log_file;
+};
+
+}
+
+#endif
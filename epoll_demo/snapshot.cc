@@ -0,0 +1,392 @@
+//
+// Fred Xia (fxia@yahoo.com)
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "snapshot.h"
+
+using namespace std;
+
+#define LOG(fmt, args...) do { \
+   log_message(_log_file, __FILE__, __LINE__, fmt, ##args); \
+} while (0)
+
+namespace epoll_demo {
+
+static const uint32_t snapshot_magic = 0x534b5444; // "DTKS"
+static const uint32_t change_magic = 0x434b5444;   // "DTKC"
+static const uint32_t snapshot_version = 5;
+
+struct SnapshotHeader {
+  uint32_t  magic;
+  uint32_t  version;
+  uint64_t  generation;     // change log records must match it
+  uint32_t  task_count;
+  uint32_t  stats_count;
+  int64_t   created;
+  int64_t   max_rowid;
+  int64_t   killed_rowid;
+  int64_t   created_rowid;
+  uint64_t  command_bytes;  // size of the task commands after the records
+  uint64_t  checksum;       // FNV-1a of the records after the header
+};
+
+struct TaskRecord {
+  char      task_name[MAX_TASK_NAME_LEN];
+  char      worker[MAX_TASK_NAME_LEN];
+  char      tenant[MAX_TASK_NAME_LEN];
+  uint32_t  sleep_ms;
+  uint32_t  state;
+  int64_t   assign_time;
+  int64_t   complete_time;
+  uint64_t  lease;          // of the latest assignment
+  uint32_t  command_len;    // the command follows in the command section
+  uint32_t  reserved;
+};
+
+// Runtime statistics of a worker, an empty worker id is the global stats
+struct StatsRecord {
+  char      worker[MAX_TASK_NAME_LEN];
+  uint32_t  samples;
+  uint32_t  reserved;
+  double    mean;
+  double    var;
+};
+
+// Followed by the command of the task, padded to 8 bytes
+struct ChangeRecord {
+  uint32_t    magic;
+  uint32_t    reserved;
+  uint64_t    generation;
+  TaskRecord  task;
+};
+
+static size_t change_record_size(uint32_t command_len)
+{
+  return sizeof(ChangeRecord) + ((command_len + 7) & ~7u);
+}
+
+static uint64_t fnv1a(const char* p, size_t len, uint64_t h)
+{
+  for (size_t i = 0; i < len; i++) {
+    h ^= (uint8_t)p[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+static const uint64_t fnv_basis = 14695981039346656037ULL;
+
+static void copy_name(char* dst, const string& src)
+{
+  memset(dst, 0, MAX_TASK_NAME_LEN);
+  strncpy(dst, src.c_str(), MAX_TASK_NAME_LEN - 1);
+}
+
+static string read_name(const char* src)
+{
+  return string(src, strnlen(src, MAX_TASK_NAME_LEN));
+}
+
+static void to_record(const Task* t, TaskRecord& rec)
+{
+  copy_name(rec.task_name, t->task_name);
+  copy_name(rec.worker, t->worker);
+  copy_name(rec.tenant, t->tenant);
+  rec.sleep_ms = t->sleep_ms;
+  rec.state = t->state;
+  rec.assign_time = t->assign_time;
+  rec.complete_time = t->complete_time;
+  rec.lease = t->lease;
+  rec.command_len = t->command.size();
+}
+
+static void from_record(const TaskRecord& rec, Task* t)
+{
+  t->task_name = read_name(rec.task_name);
+  t->worker = read_name(rec.worker);
+  t->tenant = read_name(rec.tenant);
+  t->sleep_ms = rec.sleep_ms;
+  t->state = (TaskState)rec.state;
+  t->assign_time = rec.assign_time;
+  t->complete_time = rec.complete_time;
+  t->lease = rec.lease;
+  t->backup_assign_time = 0;
+}
+
+// Command of a record, stored right after it at p
+static void read_command(const TaskRecord& rec, const char* p, Task* t)
+{
+  t->command.assign(p, rec.command_len);
+}
+
+// Map a whole file read only. Returns nullptr if it does not exist or
+// cannot be mapped. An empty file maps to a non-null pointer of size 0.
+static const char* map_file(const string& path, size_t& size)
+{
+  static const char empty[1] = {0};
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return nullptr;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return nullptr;
+  }
+  size = st.st_size;
+  if (size == 0) {
+    close(fd);
+    return empty;
+  }
+  void* p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  return p == MAP_FAILED ? nullptr : (const char*)p;
+}
+
+static void unmap_file(const char* p, size_t size)
+{
+  if (p && size) {
+    munmap((void*)p, size);
+  }
+}
+
+Snapshot::Snapshot(const char* path, FILE* log_file)
+  : _path(path), _log_path(string(path) + ".log"), _log_file(log_file),
+    _change_fd(-1), _generation(0), _changes(0)
+{}
+
+Snapshot::~Snapshot()
+{
+  if (_change_fd >= 0) {
+    close(_change_fd);
+    _change_fd = -1;
+  }
+}
+
+int Snapshot::open_change_log(bool truncate)
+{
+  if (_change_fd >= 0) {
+    close(_change_fd);
+  }
+  int flags = O_WRONLY | O_CREAT | O_APPEND | (truncate ? O_TRUNC : 0);
+  _change_fd = open(_log_path.c_str(), flags, 0644);
+  if (_change_fd < 0) {
+    LOG("Error: open change log %s: %s", _log_path.c_str(), strerror(errno));
+    return -1;
+  }
+  _changes = 0;
+  return 0;
+}
+
+int Snapshot::save(const TaskCollection& tasks, const TimeoutModel& model,
+                   const SnapshotInfo& info)
+{
+  string tmp_path = _path + ".tmp";
+  FILE* f = fopen(tmp_path.c_str(), "w");
+  if (f == nullptr) {
+    LOG("Error: create snapshot %s: %s", tmp_path.c_str(), strerror(errno));
+    return -1;
+  }
+  SnapshotHeader hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = snapshot_magic;
+  hdr.version = snapshot_version;
+  hdr.generation = _generation + 1;
+  hdr.task_count = tasks.size();
+  hdr.stats_count = model.worker_stats().size() + 1;
+  hdr.created = time(0);
+  hdr.max_rowid = info.max_rowid;
+  hdr.killed_rowid = info.window.killed_rowid;
+  hdr.created_rowid = info.window.created_rowid;
+  for (auto& it : tasks) {
+    hdr.command_bytes += it.second->command.size();
+  }
+  hdr.checksum = fnv_basis;
+  // Header is rewritten with the checksum once the records are out
+  bool ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+  for (auto it = tasks.begin(); ok && it != tasks.end(); ++it) {
+    TaskRecord rec;
+    memset(&rec, 0, sizeof(rec));
+    to_record(it->second, rec);
+    hdr.checksum = fnv1a((const char*)&rec, sizeof(rec), hdr.checksum);
+    ok = fwrite(&rec, sizeof(rec), 1, f) == 1;
+  }
+  StatsRecord rec;
+  memset(&rec, 0, sizeof(rec));
+  rec.samples = model.global_stats().samples;
+  rec.mean = model.global_stats().mean;
+  rec.var = model.global_stats().var;
+  hdr.checksum = fnv1a((const char*)&rec, sizeof(rec), hdr.checksum);
+  ok = ok && fwrite(&rec, sizeof(rec), 1, f) == 1;
+  for (auto& it : model.worker_stats()) {
+    if (!ok) {
+      break;
+    }
+    memset(&rec, 0, sizeof(rec));
+    copy_name(rec.worker, it.first);
+    rec.samples = it.second.samples;
+    rec.mean = it.second.mean;
+    rec.var = it.second.var;
+    hdr.checksum = fnv1a((const char*)&rec, sizeof(rec), hdr.checksum);
+    ok = fwrite(&rec, sizeof(rec), 1, f) == 1;
+  }
+  // Commands in the order of the task records
+  for (auto it = tasks.begin(); ok && it != tasks.end(); ++it) {
+    const string& command = it->second->command;
+    if (command.empty()) {
+      continue;
+    }
+    hdr.checksum = fnv1a(command.data(), command.size(), hdr.checksum);
+    ok = fwrite(command.data(), command.size(), 1, f) == 1;
+  }
+  ok = ok && fseek(f, 0, SEEK_SET) == 0 &&
+       fwrite(&hdr, sizeof(hdr), 1, f) == 1 &&
+       fflush(f) == 0 && fsync(fileno(f)) == 0;
+  fclose(f);
+  if (!ok || rename(tmp_path.c_str(), _path.c_str()) < 0) {
+    LOG("Error: write snapshot %s: %s", _path.c_str(), strerror(errno));
+    unlink(tmp_path.c_str());
+    return -1;
+  }
+  // Changes still in the log belong to the previous generation and are
+  // ignored on load even if the truncate below does not happen
+  _generation = hdr.generation;
+  LOG("Saved snapshot %s generation %lu, %u tasks", _path.c_str(),
+      (unsigned long)_generation, hdr.task_count);
+  return open_change_log(true);
+}
+
+int Snapshot::log_change(const Task* task)
+{
+  if (_change_fd < 0) {
+    return -1;
+  }
+  // One write per change, so a crash leaves at most a torn last record
+  size_t size = change_record_size(task->command.size());
+  char buf[size];
+  memset(buf, 0, size);
+  ChangeRecord* rec = (ChangeRecord*)buf;
+  rec->magic = change_magic;
+  rec->generation = _generation;
+  to_record(task, rec->task);
+  memcpy(rec + 1, task->command.data(), task->command.size());
+  if (::write(_change_fd, buf, size) != (ssize_t)size) {
+    LOG("Error: write change log: %s", strerror(errno));
+    return -1;
+  }
+  _changes++;
+  return 0;
+}
+
+int Snapshot::load(TaskCollection& tasks, vector<Task*>& new_tasks,
+                   TimeoutModel& model, SnapshotInfo& info)
+{
+  size_t size = 0;
+  const char* p = map_file(_path, size);
+  if (p == nullptr) {
+    return -1;
+  }
+  const SnapshotHeader* hdr = (const SnapshotHeader*)p;
+  if (size < sizeof(*hdr) || hdr->magic != snapshot_magic ||
+      hdr->version != snapshot_version ||
+      size != sizeof(*hdr) + hdr->task_count * sizeof(TaskRecord) +
+              hdr->stats_count * sizeof(StatsRecord) + hdr->command_bytes ||
+      fnv1a(p + sizeof(*hdr), size - sizeof(*hdr), fnv_basis) !=
+        hdr->checksum) {
+    LOG("Invalid snapshot %s", _path.c_str());
+    unmap_file(p, size);
+    return -1;
+  }
+  const TaskRecord* task_recs = (const TaskRecord*)(hdr + 1);
+  const StatsRecord* stats_recs =
+    (const StatsRecord*)(task_recs + hdr->task_count);
+  const char* commands = (const char*)(stats_recs + hdr->stats_count);
+  const char* commands_end = commands + hdr->command_bytes;
+  for (uint32_t i = 0; i < hdr->task_count; i++) {
+    if (task_recs[i].command_len > commands_end - commands) {
+      LOG("Invalid snapshot %s command", _path.c_str());
+      unmap_file(p, size);
+      return -1;
+    }
+    Task* t = new Task();
+    from_record(task_recs[i], t);
+    read_command(task_recs[i], commands, t);
+    commands += task_recs[i].command_len;
+    tasks[t->task_name] = t;
+  }
+  for (uint32_t i = 0; i < hdr->stats_count; i++) {
+    RuntimeStats stats;
+    stats.samples = stats_recs[i].samples;
+    stats.mean = stats_recs[i].mean;
+    stats.var = stats_recs[i].var;
+    string worker = read_name(stats_recs[i].worker);
+    if (worker.empty()) {
+      model.set_global_stats(stats);
+    } else {
+      model.set_worker_stats(worker, stats);
+    }
+  }
+  _generation = hdr->generation;
+  info.max_rowid = hdr->max_rowid;
+  info.window.killed_rowid = hdr->killed_rowid;
+  info.window.created_rowid = hdr->created_rowid;
+  info.window.at_end = false;
+  unmap_file(p, size);
+
+  // Replay changes made after the snapshot. A torn record at the end of the
+  // log is ignored.
+  uint32_t replayed = 0;
+  p = map_file(_log_path, size);
+  if (p) {
+    const char* end = p + size;
+    const ChangeRecord* rec;
+    for (const char* q = p; q + sizeof(ChangeRecord) <= end;
+         q += change_record_size(rec->task.command_len)) {
+      rec = (const ChangeRecord*)q;
+      if (rec->magic != change_magic ||
+          q + change_record_size(rec->task.command_len) > end) {
+        break;
+      }
+      if (rec->generation != _generation) {
+        continue;
+      }
+      string task_name = read_name(rec->task.task_name);
+      auto it = tasks.find(task_name);
+      Task* t = (it == tasks.end() ? nullptr : it->second);
+      if (rec->task.state == TaskSuccess) {
+        if (t) {
+          tasks.erase(it);
+          delete t;
+        }
+      } else {
+        if (t == nullptr) {
+          t = new Task();
+          tasks[task_name] = t;
+        }
+        from_record(rec->task, t);
+        read_command(rec->task, (const char*)(rec + 1), t);
+      }
+      replayed++;
+    }
+    unmap_file(p, size);
+  }
+  for (auto& it : tasks) {
+    new_tasks.push_back(it.second);
+  }
+  LOG("Loaded snapshot %s generation %lu, %u tasks, %u changes",
+      _path.c_str(), (unsigned long)_generation, (uint32_t)tasks.size(),
+      replayed);
+  if (open_change_log(false) < 0) {
+    return -1;
+  }
+  return (int)tasks.size();
+}
+
+}
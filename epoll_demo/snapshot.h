@@ -0,0 +1,68 @@
+#ifndef __task_snapshot_h__
+#define __task_snapshot_h__
+//
+// Fred Xia (fxia@yahoo.com)
+//
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include "util.h"
+#include "task_db.h"
+#include "timeout_model.h"
+
+namespace epoll_demo {
+
+// Controller state that is not part of a task
+struct SnapshotInfo {
+  int64_t     max_rowid;    // largest rowid of demo_task when saved
+  TaskWindow  window;       // position of windowed loading
+};
+
+// Compact binary image of controller state, so a restarted controller does
+// not need to reload everything from the database. The snapshot file holds
+// fixed size records of loaded tasks and learned worker statistics, then
+// the commands of the tasks. Task
+// changes made after the snapshot are appended to a change log next to it,
+// "<path>.log", which is replayed on load and reset by the next save.
+class Snapshot {
+public:
+  Snapshot(const char* path, FILE* log_file);
+  ~Snapshot();
+
+  // Write a new snapshot of tasks and model and reset the change log.
+  // Returns 0 for success, -1 for failure
+  int save(const TaskCollection& tasks, const TimeoutModel& model,
+           const SnapshotInfo& info);
+
+  // Append the current state of a task to the change log. Returns 0 for
+  // success, -1 for failure. The log is not synced: a change is written to
+  // the database first, so a crash may lose the tail of the log but never
+  // log a change the database does not have. The controller tells such a
+  // snapshot apart by comparing it with the database.
+  int log_change(const Task* task);
+
+  // Map the snapshot and replay the change log. Unfinished tasks are added
+  // to tasks and new_tasks. Returns number of tasks loaded, or -1 if there
+  // is no valid snapshot
+  int load(TaskCollection& tasks, std::vector<Task*>& new_tasks,
+           TimeoutModel& model, SnapshotInfo& info);
+
+  // Number of changes logged since the last save
+  uint32_t change_count() const { return _changes; }
+
+private:
+  int open_change_log(bool truncate);
+
+  std::string _path;
+  std::string _log_path;
+  FILE* _log_file;
+  int _change_fd;         // change log, opened for append
+  uint64_t _generation;   // generation of the current snapshot
+  uint32_t _changes;
+};
+
+}
+
+#endif
@@ -0,0 +1,205 @@
+//
+// Fred Xia (fxia@yahoo.com)
+//
+// Compare the task stores: sqlite3 and the append-only task log, with and
+// without a flush to disk per append. For each one measures adding tasks,
+// state changes as the controller writes them, and recovery, which is
+// opening the store and loading the unfinished tasks as a restarted
+// controller does. The task log is measured again after compaction.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sqlite3.h>
+#include <string>
+#include <vector>
+#include "task_db.h"
+#include "log_store.h"
+
+using namespace std;
+using namespace epoll_demo;
+
+static double now_sec()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const string& name, double sec, uint64_t ops)
+{
+  printf("%-40s %10lu ops %12.1f us/op %12.0f ops/s\n", name.c_str(),
+         (unsigned long)ops, sec * 1e6 / max(ops, (uint64_t)1),
+         ops / max(sec, 1e-9));
+}
+
+static uint64_t file_size(const string& path)
+{
+  struct stat st;
+  return stat(path.c_str(), &st) < 0 ? 0 : (uint64_t)st.st_size;
+}
+
+// Create an empty store of the kind name at path
+static int create_store(const string& name, const string& path)
+{
+  unlink(path.c_str());
+  if (name != "sqlite3") {
+    return LogStore::create(path.c_str());
+  }
+  sqlite3* db;
+  if (sqlite3_open(path.c_str(), &db) != SQLITE_OK) {
+    return -1;
+  }
+  int rc = sqlite3_exec(db,
+                        "create table demo_task (task_name text primary key, "
+                        "sleep_time integer, state integer, worker text, "
+                        "assign_time integer, complete_time integer)",
+                        nullptr, nullptr, nullptr);
+  sqlite3_close(db);
+  return rc == SQLITE_OK ? 0 : -1;
+}
+
+static TaskStore* open_store(const string& name, const string& path)
+{
+  if (name == "sqlite3") {
+    return new Taskdb(path.c_str(), stderr);
+  }
+  return new LogStore(path.c_str(), stderr, name == "log");
+}
+
+// Open the store and load its unfinished tasks
+static int bench_recovery(const string& name, const string& path,
+                          const string& label)
+{
+  double start = now_sec();
+  TaskStore* store = open_store(name, path);
+  TaskCollection tasks;
+  int r = store->fetch_tasks(tasks);
+  double sec = now_sec() - start;
+  for (auto it : tasks) {
+    delete it.second;
+  }
+  delete store;
+  if (r < 0) {
+    return -1;
+  }
+  report(label, sec, r);
+  return 0;
+}
+
+static int bench_store(const string& name, const string& path,
+                       uint32_t num_tasks, uint32_t updates)
+{
+  if (create_store(name, path) < 0) {
+    printf("Cannot create %s\n", path.c_str());
+    return -1;
+  }
+  TaskStore* store = open_store(name, path);
+  if (store->init_schema() < 0) {
+    delete store;
+    return -1;
+  }
+  vector<NewTask> new_tasks(num_tasks);
+  for (uint32_t i = 0; i < num_tasks; i++) {
+    new_tasks[i].task_name = "task_" + to_string(i);
+    new_tasks[i].sleep_ms = 1000;
+  }
+  double start = now_sec();
+  int r = store->insert_tasks(new_tasks);
+  report(name + " insert_tasks", now_sec() - start, num_tasks);
+  // Run and complete tasks from the start of the table
+  Task t;
+  t.worker = "worker_1";
+  t.assign_time = t.complete_time = time(0);
+  memset(&t.result, 0, sizeof(t.result));
+  updates = min(updates, num_tasks);
+  start = now_sec();
+  for (uint32_t i = 0; i < updates && r >= 0; i++) {
+    t.task_name = new_tasks[i].task_name;
+    t.state = TaskRunning;
+    r = store->update_task_db(&t);
+    t.state = TaskSuccess;
+    if (r >= 0) {
+      r = store->update_task_db(&t);
+    }
+  }
+  report(name + " update_task_db", now_sec() - start, updates * 2);
+  if (r < 0) {
+    delete store;
+    return -1;
+  }
+  uint64_t size = file_size(path);
+  r = bench_recovery(name, path, name + " recovery");
+  LogStore* log = dynamic_cast<LogStore*>(store);
+  if (r >= 0 && log) {
+    start = now_sec();
+    r = log->compact();
+    report(name + " compact", now_sec() - start, num_tasks);
+    if (r >= 0) {
+      printf("%-40s %10lu bytes, %lu compacted\n", (name + " size").c_str(),
+             (unsigned long)size, (unsigned long)file_size(path));
+      r = bench_recovery(name, path, name + " recovery after compact");
+    }
+  } else if (r >= 0) {
+    printf("%-40s %10lu bytes\n", (name + " size").c_str(),
+           (unsigned long)size);
+  }
+  delete store;
+  return r;
+}
+
+static const char* usage =
+  "Usage:\n"
+  "\tstore_bench [-n <tasks>] [-u <updates>] [-d <directory>]\n"
+  "\t[-n <tasks>] : Tasks in each store, default 100000\n"
+  "\t[-u <updates>] : Tasks run and completed, two updates each,\n"
+  "\t\tdefault 2000\n"
+  "\t[-d <directory>] : Where the stores are created, default /tmp\n";
+
+int main(int argc, char** argv)
+{
+  char ch;
+  uint32_t num_tasks = 100000;
+  uint32_t updates = 2000;
+  string dir = "/tmp";
+  while ((ch = getopt(argc, argv, "hn:u:d:")) > 0) {
+    switch (ch) {
+    case 'n':
+      num_tasks = (uint32_t)atoi(optarg);
+      break;
+    case 'u':
+      updates = (uint32_t)atoi(optarg);
+      break;
+    case 'd':
+      dir = optarg;
+      break;
+    default:
+      printf(usage);
+      exit(ch == 'h' ? 0 : 1);
+    }
+  }
+  // Log messages of the stores are not of interest
+  freopen("/dev/null", "w", stderr);
+  struct {
+    const char* name;
+    const char* file;
+  } stores[] = {
+    { "sqlite3", "/store_bench.db" },
+    { "log", "/store_bench.log" },
+    { "log nosync", "/store_bench_nosync.log" },
+  };
+  int r = 0;
+  for (auto& s : stores) {
+    string path = dir + s.file;
+    if (bench_store(s.name, path, num_tasks, updates) < 0) {
+      printf("%s failed\n", s.name);
+      r = 1;
+    }
+    unlink(path.c_str());
+  }
+  return r;
+}
@@ -0,0 +1,86 @@
+//
+// Fred Xia (fxia@yahoo.com)
+//
+// Archive completed tasks of a task database, and look up archived tasks.
+// A controller started with -R archives in the background by itself.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <string>
+#include "archive.h"
+
+using namespace std;
+using namespace epoll_demo;
+
+static const char* usage =
+  "Usage:\n"
+  "\ttask_archive -d <database> [-a <hours>] [-V]\n"
+  "\ttask_archive -d <database> -c <task name>\n"
+  "\ttask_archive -d <database> -l\n"
+  "\t-d <database> : Task database file\n"
+  "\t[-a <hours>] : Archive tasks completed at least <hours> ago, default 0\n"
+  "\t[-V] : Switch the database to incremental auto vacuum first. Rewrites\n"
+  "\t\tthe database, run it while no controller runs\n"
+  "\t[-c <task name>] : Print a task from the task table and the archive\n"
+  "\t[-l] : Print the number of tasks of every archive table\n";
+
+int main(int argc, char** argv)
+{
+  char ch;
+  const char* db_name = nullptr;
+  const char* task_name = nullptr;
+  uint32_t hours = 0;
+  bool vacuum = false;
+  bool list = false;
+  while ((ch = getopt(argc, argv, "hd:a:Vc:l")) > 0) {
+    switch (ch) {
+    case 'd':
+      db_name = optarg;
+      break;
+    case 'a':
+      hours = (uint32_t)atoi(optarg);
+      break;
+    case 'V':
+      vacuum = true;
+      break;
+    case 'c':
+      task_name = optarg;
+      break;
+    case 'l':
+      list = true;
+      break;
+    default:
+      printf(usage);
+      exit(ch == 'h' ? 0 : 1);
+    }
+  }
+  if (db_name == nullptr) {
+    printf("Invalid arguments\n");
+    printf(usage);
+    exit(1);
+  }
+  TaskArchiver archiver(db_name, stderr);
+  if (task_name) {
+    int r = archiver.print_task(task_name, stdout);
+    if (r == 0) {
+      printf("Task %s not found\n", task_name);
+    }
+    return r > 0 ? 0 : 1;
+  }
+  if (list) {
+    return archiver.print_partitions(stdout) < 0 ? 1 : 0;
+  }
+  if (vacuum && archiver.enable_incremental_vacuum() < 0) {
+    fprintf(stderr, "Cannot switch %s to incremental vacuum\n", db_name);
+    return 1;
+  }
+  int r = archiver.archive(time(0) - hours * 3600);
+  if (r < 0) {
+    return 1;
+  }
+  printf("Archived %d tasks\n", r);
+  return 0;
+}
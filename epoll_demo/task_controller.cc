@@ -5,377 +5,1845 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <assert.h>
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/tcp.h>
 #include <sqlite3.h>
 #include <getopt.h>
 #include <errno.h>
+#include <signal.h>
+#include <sched.h>
 #include <string.h>
 #include <unistd.h>
 #include <map>
+#include <set>
+#include <sstream>
+#include <algorithm>
 #include "util.h"
+#include "mux.h"
 #include "server.h"
 #include "task_db.h"
+#include "log_store.h"
+#include "timeout_model.h"
+#include "task_graph.h"
+#include "fair_queue.h"
+#include "snapshot.h"
+#include "db_watch.h"
+#include "archive.h"
+#include "shard.h"
+#include "async_log.h"
+#include "trace.h"
+#include "affinity.h"
+#include "task_controller.h"
 
 using namespace std;
-using namespace epoll_demo;
 
 #define LOG(fmt, args...) do { \
    log_message(log_file(), __FILE__, __LINE__, fmt, ##args); \
 } while (0)
 
-// Default timeout for epoll_wait is 10 seconds
-static const uint32_t default_timeout = 10000;
+namespace epoll_demo {
 
-struct TaskController : public TcpServer {
+// A shard that is done tells its peers it is leaving, and still answers the
+// workers they sent before they knew for this long, less than
+// peer_retry_ms of the peer links so the peers do not link to it again
+static const uint32_t peer_linger_ms = 500;
 
-  Taskdb _task_db;
-  TaskCollection _tasks;
-  map<int, string> _workers; // fd => worker_id
-  bool _shutdown; // shutdown flag. Set when database is gone.
+// Worker sessions of multiplexed connections are known by handles from
+// here on, above any fd, so they are kept like connections of their own
+static const int session_handle_base = 1 << 24;
 
-  TaskController(const char* db, uint16_t port, bool to_stderr)
-    : TcpServer("controller", port, default_timeout, to_stderr),
-      _task_db(db, log_file()), _shutdown(false)
-    {}
+// A multiplexed connection whose unwritten frames grow beyond this is
+// dropped, its host is not reading
+static const uint32_t max_mux_output = 16 << 20;
 
-  virtual ~TaskController() {
+// A run whose result is arriving is past its deadline only once no data
+// came for this long
+static const uint32_t result_idle_ms = 10000;
+
+const char* state_name(TaskState state)
+{
+  switch (state) {
+  case TaskCreated:
+    return "created";
+  case TaskRunning:
+    return "running";
+  case TaskKilled:
+    return "killed";
+  case TaskSuccess:
+    return "success";
+  }
+  return "unknown";
+}
+
+uint32_t hist_bucket(uint64_t ms)
+{
+  uint32_t i = 0;
+  while (i + 1 < run_hist_buckets && ms >= (1ULL << i)) {
+    i++;
+  }
+  return i;
+}
+
+TaskController::TaskController(const char* db, uint16_t port, bool to_stderr,
+                               const ControllerOptions& opts)
+  : TcpServer("controller", port, default_timeout, to_stderr),
+    _task_db(open_task_store(db, log_file())), _blocked(0),
+    _shutdown(false), _opts(opts),
+    _snapshot(nullptr), _last_snapshot(monotonic_ms()), _loaded_rowid(0),
+    _last_idle_check(0), _next_slacker_check(0),
+    _last_fetch(monotonic_ms()), _watcher(nullptr),
+    _archiver(nullptr), _admin(*this), _start_ms(monotonic_ms()),
+    _completed(0), _ring(nullptr), _shard(0), _stolen(0),
+    _leave_ms(0), _next_lease(1), _fenced(0),
+    _next_session(session_handle_base), _rx_off_node(0)
+{
+  memset(_run_hist, 0, sizeof(_run_hist));
+  if (!_opts.snapshot_path.empty()) {
+    _snapshot = new Snapshot(_opts.snapshot_path.c_str(), log_file());
+  }
+}
+
+TaskController::~TaskController()
+{
+  for (auto it : _tasks) {
+    delete it.second;
+  }
+  _tasks.clear();
+  _workers.clear();
+  delete _snapshot;
+  delete _watcher;
+  delete _task_db;
+  delete _archiver;
+}
+
+int TaskController::init()
+{
+  if (_task_db->init_schema() < 0) {
+    return -1;
+  }
+  if (!_opts.tenants_path.empty() &&
+      _ready.load(_opts.tenants_path.c_str(), log_file()) < 0) {
+    return -1;
+  }
+  if (_results.init(_opts.result_dir, log_file()) < 0) {
+    return -1;
+  }
+  int r = load_snapshot();
+  if (r >= 0) {
+    return 0;
+  }
+  if (_opts.window_high) {
+    // Only running tasks are loaded in full, they are bounded by the
+    // number of workers
+    vector<Task*> new_tasks;
+    r = _task_db->fetch_running_tasks(_tasks, &new_tasks);
+    if (r >= 0) {
+      r = (add_tasks(new_tasks) < 0 ? -1 : (int)new_tasks.size());
+    }
+    if (r >= 0) {
+      int n = refill_window();
+      r = (n < 0 ? -1 : r + n);
+    }
+  } else {
+    r = load_tasks();
+  }
+  if (r == 0 && _ring) {
+    // Workers that come are sent to the other shards
+    LOG("Shard %s has no tasks to run", _ring->shards()[_shard].name.c_str());
+  } else if (r <= 0) {
+    if (r == 0) {
+      LOG("No tasks to run");
+    }
+    return -1;
+  }
+  if (_snapshot) {
+    save_snapshot();
+  }
+  return 0;
+}
+
+bool TaskController::snapshot_matches(int64_t max_rowid)
+{
+  TaskDigest db;
+  if (_task_db->digest(max_rowid, db) < 0) {
+    return false;
+  }
+  TaskDigest mem;
+  for (auto it : _tasks) {
+    Task* t = it.second;
+    if (t->state == TaskRunning) {
+      mem.running++;
+      mem.lease_sum += t->lease;
+    } else {
+      mem.waiting++;
+    }
+  }
+  // A window holds only part of the waiting tasks, and a shard only its
+  // own
+  bool all_waiting = (_opts.window_high == 0 && _ring == nullptr);
+  if (db.running != mem.running || db.lease_sum != mem.lease_sum ||
+      (all_waiting && db.waiting != mem.waiting)) {
+    LOG("Snapshot does not match database, running %lu/%lu, "
+        "waiting %lu/%lu", (unsigned long)mem.running,
+        (unsigned long)db.running, (unsigned long)mem.waiting,
+        (unsigned long)db.waiting);
+    return false;
+  }
+  return true;
+}
+
+int TaskController::load_snapshot()
+{
+  if (_snapshot == nullptr) {
+    return -1;
+  }
+  vector<Task*> new_tasks;
+  SnapshotInfo info;
+  int r = _snapshot->load(_tasks, new_tasks, _timeout_model, info);
+  if (r < 0) {
+    return -1;
+  }
+  int64_t max_rowid = _task_db->max_rowid();
+  if (max_rowid < info.max_rowid) {
+    LOG("Snapshot does not match database, rowid %ld, was %ld",
+        (long)max_rowid, (long)info.max_rowid);
+  }
+  if (max_rowid < info.max_rowid || !snapshot_matches(info.max_rowid)) {
     for (auto it : _tasks) {
       delete it.second;
     }
-    _tasks.clear();
-    _workers.clear();
+    _tasks.clear();
+    _timeout_model = TimeoutModel();
+    return -1;
+  }
+  _window = info.window;
+  _loaded_rowid = info.max_rowid;
+  if (_opts.window_high == 0) {
+    _loaded_rowid = max_rowid;
+    if (_task_db->fetch_tasks(_tasks, &new_tasks, info.max_rowid) < 0) {
+      return -1;
+    }
+  }
+  if (add_tasks(new_tasks) < 0) {
+    return -1;
+  }
+  if (_opts.window_high && refill_window() < 0) {
+    return -1;
+  }
+  return (int)_tasks.size();
+}
+
+int TaskController::save_snapshot()
+{
+  _last_snapshot = monotonic_ms();
+  SnapshotInfo info;
+  info.max_rowid = _loaded_rowid;
+  info.window = _window;
+  if (_ring) {
+    // Tasks stolen from peers are theirs to restore
+    TaskCollection own;
+    for (auto& it : _tasks) {
+      if (it.second->owner_fd == 0) {
+        own.insert(it);
+      }
+    }
+    return _snapshot->save(own, _timeout_model, info);
+  }
+  return _snapshot->save(_tasks, _timeout_model, info);
+}
+
+int TaskController::update_task(Task* t)
+{
+  if (t->owner_fd) {
+    // The peer owning the task keeps it in its database, and only needs
+    // to hear that it is done
+    return t->state == TaskSuccess ? report_stolen(t) : 0;
+  }
+  TraceScope scope("db_update", t->task_name, state_name(t->state));
+  if (_task_db->update_task_db(t) < 0) {
+    return -1;
+  }
+  if (_snapshot) {
+    _snapshot->log_change(t);
+  }
+  return 0;
+}
+
+int TaskController::load_tasks()
+{
+  vector<Task*> new_tasks;
+  // Rows added while fetching may or may not be loaded, so remember the
+  // last rowid known before the fetch
+  int64_t max_rowid = _task_db->max_rowid();
+  int r = _task_db->fetch_tasks(_tasks, &new_tasks, _loaded_rowid);
+  if (r >= 0 && max_rowid >= 0) {
+    _loaded_rowid = max_rowid;
+  }
+  if (r <= 0) {
+    return r;
+  }
+  return add_tasks(new_tasks) < 0 ? -1 : (int)new_tasks.size();
+}
+
+int TaskController::refill_window()
+{
+  int count = 0;
+  // Most rows of a shard of a cluster belong to the other shards, so it
+  // keeps reading until its own ready tasks are enough. So does a window
+  // whose new tasks were all dropped for a dependency cycle.
+  bool more = false;
+  do {
+    if (_ready.size() >= _opts.window_low) {
+      break;
+    }
+    // Tasks waiting on dependencies take room in the window too, or with
+    // a DAG memory would grow with the backlog
+    uint32_t held = _ready.size() + _blocked;
+    uint32_t limit;
+    if (held < _opts.window_high) {
+      limit = _opts.window_high - held;
+    } else if (_ready.size() == 0 && _tasks.size() == _blocked) {
+      // Nothing runs that could release them, what they wait on is
+      // further on
+      limit = _opts.window_low;
+    } else {
+      break;
+    }
+    vector<Task*> new_tasks;
+    int r = _task_db->fetch_task_window(_tasks, _window, limit, &new_tasks);
+    if (r <= 0) {
+      return r < 0 ? -1 : count;
+    }
+    if (add_tasks(new_tasks) < 0) {
+      return -1;
+    }
+    count += new_tasks.size();
+    more = (_ring || new_tasks.empty());
+  } while (more && !_window.at_end);
+  return count;
+}
+
+int TaskController::watch_db(const char* db)
+{
+  _watcher = new DbWatcher(db, log_file());
+  // In window mode rows past the window are loaded as it moves on
+  int64_t rowid = _opts.window_high ? _window.created_rowid : _loaded_rowid;
+  if (_watcher->start(rowid) < 0) {
+    delete _watcher;
+    _watcher = nullptr;
+    return -1;
+  }
+  watch_fd(_watcher->event_fd());
+  return 0;
+}
+
+int TaskController::start_archiver(const char* db, uint32_t age_sec)
+{
+  if (LogStore::is_log(db)) {
+    LOG("Archiving is not supported for task logs");
+    return -1;
+  }
+  _archiver = new TaskArchiver(db, log_file());
+  if (_archiver->start(age_sec) < 0) {
+    delete _archiver;
+    _archiver = nullptr;
+    return -1;
+  }
+  return 0;
+}
+
+int TaskController::join_cluster(ShardRing* ring, uint32_t index)
+{
+  _ring = ring;
+  _shard = index;
+  return _peers.init(ring, index, log_file());
+}
+
+bool TaskController::is_peer(const string& worker_id)
+{
+  return _ring && _ring->find(worker_id) >= 0;
+}
+
+void TaskController::drop_foreign(vector<Task*>& new_tasks)
+{
+  size_t n = 0;
+  for (Task* t : new_tasks) {
+    if (_ring->owner(t->task_name) == _shard) {
+      new_tasks[n++] = t;
+    } else {
+      _tasks.erase(t->task_name);
+      delete t;
+    }
+  }
+  new_tasks.resize(n);
+}
+
+uint32_t TaskController::connect_peers(uint64_t now)
+{
+  for (uint32_t i : _peers.due(now)) {
+    connect_peer(i);
+  }
+  return _peers.next_retry(now, default_timeout);
+}
+
+void TaskController::steal_task()
+{
+  uint64_t wanted = 0;
+  for (auto it : _idle) {
+    auto worker_it = _workers.find(it.first);
+    if (worker_it != _workers.end() && !is_peer(worker_it->second)) {
+      wanted += it.second;
+    }
+  }
+  if (_peers.requests() >= wanted) {
+    return;
+  }
+  int i = _peers.next_up();
+  if (i >= 0) {
+    _peers.request(i);
+  }
+}
+
+int TaskController::connect_peer(uint32_t i)
+{
+  int fd = _peers.connect(i);
+  if (fd < 0) {
+    return -1;
+  }
+  if (add_connection(fd, EPOLLOUT | EPOLLIN | EPOLLRDHUP | EPOLLET) < 0) {
+    LOG("Cannot watch the link to shard %s", _peers.name(i).c_str());
+    close(fd);
+    _peers.close(i);
+    return -1;
+  }
+  return 0;
+}
+
+int TaskController::report_stolen(Task* t)
+{
+  LOG("Report stolen task %s to its shard", t->task_name.c_str());
+  // A lost report is the same as a lost link, the owner runs it again
+  _peers.send(t->owner_fd, t->task_name.c_str(), &t->result, t->owner_lease);
+  return 0;
+}
+
+void TaskController::drop_stolen(Task* t)
+{
+  if (t->state == TaskRunning && t->fd) {
+    cancel_task(t->fd, t->task_name, t->lease);
+  }
+  int backup_fd = t->backup_worker.empty() ? 0 :
+                  find_worker_fd(t->backup_worker);
+  if (backup_fd) {
+    cancel_task(backup_fd, t->task_name, t->backup_lease);
+  }
+  forget_stolen(t);
+  unassign(t);
+  clear_backup(t);
+  _ready.remove(t);
+  _ready.stop(t);
+  _tasks.erase(t->task_name);
+  delete t;
+}
+
+void TaskController::forget_stolen(Task* t)
+{
+  int i = _peers.find(t->owner_fd);
+  if (i >= 0) {
+    _peers.link(i).stolen.erase(t);
+  }
+}
+
+void TaskController::close_peer(uint32_t i)
+{
+  set<Task*> stolen = _peers.link(i).stolen;
+  for (Task* t : stolen) {
+    drop_stolen(t);
+  }
+  _peers.close(i);
+}
+
+int TaskController::handle_peer_message(uint32_t i, const PeerMessage& m)
+{
+  PeerLink& p = _peers.link(i);
+  const char* peer = _peers.name(i).c_str();
+  if (m.task_name.empty()) {
+    LOG("Shard %s has no task to give", peer);
+    return -1;
+  }
+  auto it = _tasks.find(m.task_name);
+  if (m.sleep_ms == CANCEL_SLEEP_TIME) {
+    if (it != _tasks.end() && it->second->owner_fd == p.fd &&
+        (m.lease == 0 || m.lease == it->second->owner_lease)) {
+      LOG("Shard %s cancels task %s", peer, m.task_name.c_str());
+      drop_stolen(it->second);
+    }
+    return 0;
+  }
+  if (p.requests) {
+    p.requests--;
+  }
+  if (it != _tasks.end()) {
+    LOG("Error: task %s of shard %s is already loaded", m.task_name.c_str(),
+        peer);
+    return 0;
+  }
+  Task* t = new Task();
+  t->task_name = m.task_name;
+  t->sleep_ms = m.sleep_ms;
+  t->command = m.command;
+  t->state = TaskCreated;
+  t->owner_fd = p.fd;
+  t->owner_lease = m.lease;
+  _tasks[m.task_name] = t;
+  p.stolen.insert(t);
+  make_ready(t);
+  _stolen++;
+  LOG("Stole task %s from shard %s", m.task_name.c_str(), peer);
+  trace_instant("stolen", m.task_name);
+  return 0;
+}
+
+uint32_t TaskController::handle_peer(const epoll_event& ev)
+{
+  uint32_t i = _peers.find(ev.data.fd);
+  if (_peers.link(i).connecting && _peers.connected(i) < 0) {
+    close_peer(i);
+    return 0;
+  }
+  vector<PeerMessage> msgs;
+  int r = _peers.receive(i, msgs);
+  for (const PeerMessage& m : msgs) {
+    if (handle_peer_message(i, m) < 0) {
+      r = -1;
+      break;
+    }
+  }
+  if (r < 0 || _shutdown) {
+    close_peer(i);
+    return 0;
+  }
+  return EPOLLIN | EPOLLRDHUP | EPOLLET;
+}
+
+bool TaskController::leave_cluster(uint64_t now)
+{
+  if (_leave_ms == 0) {
+    LOG("Shard %s is leaving", _ring->shards()[_shard].name.c_str());
+    _leave_ms = now + peer_linger_ms;
+    _peers.leave();
+  }
+  set_timeout(max(_leave_ms - min(_leave_ms, now), (uint64_t)1));
+  return now < _leave_ms;
+}
+
+void TaskController::peer_left(const string& peer)
+{
+  LOG("Shard %s is leaving", peer.c_str());
+  _peers.left(_ring->find(peer));
+}
+
+void TaskController::release_worker(int fd)
+{
+  auto it = _workers.find(fd);
+  int peer = -1;
+  if (_ring && it != _workers.end() && !is_peer(it->second)) {
+    peer = _peers.next_up();
+  }
+  if (peer < 0) {
+    disconnect_client(fd, true);
+    return;
+  }
+  string address = _peers.address(peer);
+  uint32_t msg_len;
+  char* msg = serialize_server_message("", REDIRECT_SLEEP_TIME, 0,
+                                       address.c_str(), msg_len);
+  if (msg) {
+    send_worker(fd, msg, msg_len);
+    free(msg);
+    LOG("Redirect worker %s to shard %s", it->second.c_str(),
+        _peers.name(peer).c_str());
+  }
+  disconnect_client(fd, false);
+}
+
+uint32_t TaskController::handle_db_change()
+{
+  if (_watcher->consume() && !_shutdown) {
+    _last_fetch = monotonic_ms();
+    if (load_new_tasks() < 0) {
+      shutdown();
+    } else {
+      dispatch_idle();
+    }
+  }
+  return EPOLLIN | EPOLLET;
+}
+
+int TaskController::load_new_tasks()
+{
+  _window.at_end = false;
+  return _opts.window_high ? refill_window() : load_tasks();
+}
+
+int TaskController::add_tasks(vector<Task*>& new_tasks)
+{
+  if (_ring) {
+    drop_foreign(new_tasks);
+  }
+  size_t edges = _graph.edge_count();
+  if (_task_db->fetch_dependencies(new_tasks, _graph) < 0) {
+    return -1;
+  }
+  // Tasks running before the controller started only have a wall clock
+  // assignment time
+  time_t wall_time = time(0);
+  uint64_t now = monotonic_ms();
+  for (Task* t : new_tasks) {
+    // Leases go on from the largest one given before a restart
+    _next_lease = max(_next_lease, t->lease + 1);
+    if (t->state != TaskCreated && !t->worker.empty()) {
+      _assigned[t->worker].insert(t);
+    }
+    if (t->state == TaskRunning) {
+      uint64_t elapsed = (uint64_t)max(wall_time - t->assign_time,
+                                       (time_t)0) * 1000;
+      t->assign_ms = now - min(elapsed, now);
+      _ready.start(t);
+    }
+    if (_graph.pending(t->task_name) > 0) {
+      _blocked++;
+    } else {
+      make_ready(t);
+    }
+  }
+  // Only new edges can close a cycle
+  if (_graph.edge_count() > edges) {
+    drop_cyclic(new_tasks);
+  }
+  return 0;
+}
+
+void TaskController::drop_cyclic(vector<Task*>& new_tasks)
+{
+  vector<string> stuck;
+  _graph.find_stuck(stuck);
+  set<Task*> dropped;
+  for (auto& name : stuck) {
+    auto it = _tasks.find(name);
+    if (it == _tasks.end() || it->second->state == TaskRunning) {
+      continue;
+    }
+    Task* t = it->second;
+    LOG("Error: task %s waits on a dependency cycle, dropped",
+        name.c_str());
+    unassign(t);
+    _ready.remove(t);
+    _tasks.erase(it);
+    _blocked--;
+    _cyclic.insert(name);
+    dropped.insert(t);
+  }
+  if (dropped.empty()) {
+    return;
+  }
+  size_t n = 0;
+  for (Task* t : new_tasks) {
+    if (!dropped.count(t)) {
+      new_tasks[n++] = t;
+    }
+  }
+  new_tasks.resize(n);
+  for (Task* t : dropped) {
+    delete t;
+  }
+}
+
+void TaskController::make_ready(Task* t)
+{
+  if (t->state == TaskCreated || t->state == TaskKilled) {
+    if (trace_enabled()) {
+      t->ready_us = trace_now_us();
+    }
+    _ready.push(t);
+  }
+}
+
+uint64_t TaskController::new_lease(const Task* t)
+{
+  _next_lease = max(_next_lease, max(t->lease, t->backup_lease) + 1);
+  return _next_lease++;
+}
+
+void TaskController::assign(Task* t, const string& worker_id)
+{
+  unassign(t);
+  t->worker = worker_id;
+  _assigned[worker_id].insert(t);
+}
+
+void TaskController::unassign(Task* t)
+{
+  auto it = _assigned.find(t->worker);
+  if (it != _assigned.end()) {
+    it->second.erase(t);
+    if (it->second.empty()) {
+      _assigned.erase(it);
+    }
+  }
+}
+
+void TaskController::complete_task(Task* t)
+{
+  if (t->owner_fd) {
+    forget_stolen(t);
+  }
+  unassign(t);
+  clear_backup(t);
+  _ready.remove(t);
+  _ready.stop(t);
+  _tasks.erase(t->task_name);
+  vector<string> released;
+  _graph.complete(t->task_name, released);
+  for (auto& name : released) {
+    auto task_it = _tasks.find(name);
+    if (task_it != _tasks.end()) {
+      _blocked--;
+      make_ready(task_it->second);
+    }
+  }
+}
+
+void TaskController::shutdown()
+{
+  LOG("Database error. Shutdown everything...");
+  _shutdown = true;
+}
+
+int TaskController::find_worker_fd(const string& worker_id)
+{
+  for (auto it : _workers) {
+    if (it.second == worker_id) {
+      return it.first;
+    }
+  }
+  return 0;
+}
+
+void TaskController::set_backup(Task* t, const string& worker_id)
+{
+  clear_backup(t);
+  t->backup_worker = worker_id;
+  _backups[worker_id].insert(t);
+}
+
+void TaskController::clear_backup(Task* t)
+{
+  auto it = _backups.find(t->backup_worker);
+  if (it != _backups.end()) {
+    it->second.erase(t);
+    if (it->second.empty()) {
+      _backups.erase(it);
+    }
+  }
+  t->backup_worker.clear();
+}
+
+void TaskController::forget_worker(const string& worker_id)
+{
+  if (find_worker_fd(worker_id)) {
+    return;
+  }
+  auto it = _assigned.find(worker_id);
+  if (it != _assigned.end()) {
+    for (Task* t : it->second) {
+      if (t->state == TaskRunning && t->worker == worker_id) {
+        return;
+      }
+    }
+  }
+  _timeout_model.remove_worker(worker_id);
+}
+
+void TaskController::kill_task(Task* t)
+{
+  if (!t->backup_worker.empty()) {
+    LOG("Promote backup %s of task %s, primary %s is gone",
+        t->backup_worker.c_str(), t->task_name.c_str(), t->worker.c_str());
+    assign(t, t->backup_worker);
+    t->fd = find_worker_fd(t->worker);
+    t->lease = t->backup_lease;
+    t->assign_time = t->backup_assign_time;
+    t->assign_ms = t->backup_assign_ms;
+    clear_backup(t);
+    t->state = TaskRunning;
+  } else {
+    t->state = TaskKilled;
+    t->fd = 0;
+    _ready.stop(t);
+    make_ready(t);
+  }
+  t->lease_expiry_ms = 0;
+  if (update_task(t) < 0) {
+    shutdown();
+  } else if (t->state == TaskKilled) {
+    LOG("Change task %s state to TaskKilled", t->task_name.c_str());
+    trace_instant("killed", t->task_name);
+  }
+}
+
+Task* TaskController::find_straggler(const string& worker_id)
+{
+  if (_opts.backup_pct == 0 || is_peer(worker_id)) {
+    return nullptr;
+  }
+  uint64_t current_time = monotonic_ms();
+  Task* straggler = nullptr;
+  uint64_t max_overdue = 0;
+  for (auto it : _tasks) {
+    Task* t = it.second;
+    if (t->state != TaskRunning || !t->backup_worker.empty() ||
+        t->worker == worker_id) {
+      continue;
+    }
+    // Round trips dominate tasks shorter than 100 ms, count them as such
+    uint64_t elapse_pct = (current_time - t->assign_ms) * 100;
+    uint64_t threshold = (uint64_t)max(t->sleep_ms, 100u) * _opts.backup_pct;
+    if (elapse_pct > threshold && elapse_pct - threshold > max_overdue) {
+      max_overdue = elapse_pct - threshold;
+      straggler = t;
+    }
+  }
+  return straggler;
+}
+
+bool TaskController::has_backup_candidate(const string& worker_id)
+{
+  if (_opts.backup_pct == 0 || is_peer(worker_id)) {
+    return false;
+  }
+  for (auto it : _tasks) {
+    Task* t = it.second;
+    if (t->state == TaskRunning && t->backup_worker.empty() &&
+        t->worker != worker_id) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool TaskController::is_busy(int fd, const string& worker_id)
+{
+  auto it = _assigned.find(worker_id);
+  if (it == _assigned.end()) {
+    return false;
+  }
+  for (Task* t : it->second) {
+    if (t->fd == fd && t->state == TaskRunning) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void TaskController::dispatch_idle()
+{
+  uint64_t current_time = monotonic_ms();
+  if (_idle.empty() ||
+      (current_time - _last_idle_check < 1000 && !_ready.dispatchable())) {
+    return;
+  }
+  _last_idle_check = current_time;
+  map<int, uint32_t> idle;
+  idle.swap(_idle);
+  // Workers of this controller come before peers asking for tasks
+  for (int pass = 0; pass < 2; pass++) {
+    for (auto it : idle) {
+      auto worker_it = _workers.find(it.first);
+      if (worker_it == _workers.end() ||
+          is_peer(worker_it->second) != (pass == 1)) {
+        continue;
+      }
+      for (uint32_t i = 0; i < it.second; i++) {
+        if (dispatch_task(it.first) == 0) {
+          break;
+        }
+      }
+    }
+  }
+}
+
+void TaskController::cancel_task(int fd, const string& task_name,
+                                 uint64_t lease)
+{
+  uint32_t msg_len;
+  char* msg = serialize_server_message(task_name.c_str(),
+                                       CANCEL_SLEEP_TIME, lease, "",
+                                       msg_len);
+  trace_instant("cancel", task_name);
+  if (msg) {
+    send_worker(fd, msg, msg_len);
+    free(msg);
+  }
+}
+
+int TaskController::send_worker(int fd, const char* msg, uint32_t msg_len)
+{
+  auto it = _sessions.find(fd);
+  if (it == _sessions.end()) {
+    // Queued behind acks not written yet, to keep the message order
+    auto ack_it = _result_acks.find(fd);
+    if (ack_it != _result_acks.end()) {
+      ack_it->second.append(msg, msg_len);
+      return msg_len;
+    }
+    return ::write(fd, msg, msg_len);
+  }
+  return send_frame(it->second.fd, it->second.id, msg, msg_len);
+}
+
+int TaskController::send_frame(int fd, uint32_t session, const char* msg,
+                               uint32_t msg_len)
+{
+  string& out = _mux_out[fd];
+  append_mux_frame(out, session, msg, msg_len);
+  if (out.size() > max_mux_output) {
+    LOG("Multiplexed connection %d is not reading, drop it", fd);
+    out.clear();
+    ::shutdown(fd, SHUT_RDWR);
+    return -1;
+  }
+  return msg_len;
+}
+
+void TaskController::flush_all_mux()
+{
+  for (auto& it : _mux_out) {
+    if (!it.second.empty()) {
+      flush_mux(it.first);
+    }
   }
+}
 
-  int init() {
-    int r = _task_db.fetch_tasks(_tasks);
-    if (r <= 0) {
-      if (r == 0) {
-        LOG("No tasks to run");
-      }
-      return -1;
+int TaskController::flush_mux(int fd)
+{
+  string& out = _mux_out[fd];
+  if (write_pending(fd, out) < 0) {
+    LOG("Error in write() to multiplexed connection %d: %s", fd,
+        strerror(errno));
+    out.clear();
+    return -1;
+  }
+  if (!out.empty()) {
+    set_events(fd, EPOLLIN | EPOLLHUP | EPOLLET | EPOLLOUT);
+  }
+  return 0;
+}
+
+void TaskController::end_session(int handle)
+{
+  auto it = _sessions.find(handle);
+  if (it == _sessions.end()) {
+    return;
+  }
+  MuxSession session = it->second;
+  _sessions.erase(it);
+  _mux_conns[session.fd].erase(session.id);
+  if (!session.closed) {
+    send_frame(session.fd, session.id, nullptr, 0);
+  }
+}
+
+void TaskController::close_mux(int fd, bool to_exit)
+{
+  auto it = _mux_conns.find(fd);
+  if (it == _mux_conns.end()) {
+    return;
+  }
+  map<uint32_t, int> sessions = it->second;
+  for (auto& session : sessions) {
+    _sessions[session.second].closed = !to_exit;
+    disconnect_client(session.second, to_exit);
+  }
+  if (to_exit) {
+    flush_mux(fd);
+  }
+  _mux_conns.erase(fd);
+  _mux_out.erase(fd);
+}
+
+void TaskController::handle_mux_frame(int fd, const MuxFrame& frame)
+{
+  uint32_t id = frame.session;
+  map<uint32_t, int>& sessions = _mux_conns[fd];
+  auto it = sessions.find(id);
+  if (frame.msg_len == 0) {
+    // The worker behind the agent went away
+    if (it != sessions.end()) {
+      _sessions[it->second].closed = true;
+      disconnect_client(it->second, false);
     }
-    return 0;
+    return;
+  }
+  const char* msg = frame.msg;
+  uint32_t msg_len;
+  memcpy(&msg_len, msg, sizeof(msg_len));
+  int handle;
+  if (it == sessions.end()) {
+    handle = _next_session++;
+    sessions[id] = handle;
+    MuxSession& session = _sessions[handle];
+    session.fd = fd;
+    session.id = id;
+    if (sessions.size() == 1) {
+      // Frames of many sessions are written back to back
+      int yes = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    }
+    LOG("Session %u of connection %d is worker %d", id, fd, handle);
+  } else {
+    handle = it->second;
+  }
+  if (msg_len & RESULT_CHUNK_FLAG) {
+    // Comes whole in its frame, written from the buffer
+    msg_len &= ~RESULT_CHUNK_FLAG;
+    if (msg_len != frame.msg_len || msg_len < RESULT_CHUNK_HEADER_LEN) {
+      LOG("Error in result chunk len %u of session %u", msg_len, id);
+      disconnect_client(handle, false);
+      return;
+    }
+    handle_result_chunk(handle, msg, msg_len, msg_len);
+    return;
+  }
+  if (msg_len != frame.msg_len || msg_len <= sizeof(msg_len)) {
+    LOG("Error in message len %u of session %u", msg_len, id);
+    disconnect_client(handle, false);
+    return;
   }
+  if (handle_client_message(handle, msg + sizeof(msg_len),
+                            msg_len - sizeof(msg_len)) == 0) {
+    // Let go of like a connection closed after the message
+    disconnect_client(handle, false);
+  }
+}
 
-  // Shutdown flag can be turned on during message processing. We don't want
-  // to shutdown in the middle of processing to avoid data inconsistency.
-  // Actual shutdown is performed in handle_timeout()
-  void shutdown() {
-    LOG("Database error. Shutdown everything...");
-    _shutdown = true;
-  }
-
-  // Disconnect a worker client. If any task assigned to the worker mark it as
-  // TaskKilled. If to_exit tell worker to exit by sending the message with an
-  // empty task name.
-  void disconnect_client(int fd, bool to_exit) {
-    auto it = _workers.find(fd);
-    if (it != _workers.end()) {
-      auto worker_id = it->second;
-      for (auto task_it : _tasks) {
-        if (task_it.second->worker == worker_id) {
-          task_it.second->state = TaskKilled;
-          if (_task_db.update_task_db(task_it.second) < 0) {
-            shutdown();
-          } else {
-            LOG("Change task %s state to TaskKilled",
-                task_it.second->task_name.c_str());
+void TaskController::disconnect_client(int fd, bool to_exit)
+{
+  _idle.erase(fd);
+  _result_acks.erase(fd);
+  _results.abort_all(fd);
+  auto it = _workers.find(fd);
+  if (it != _workers.end()) {
+    auto worker_id = it->second;
+    auto task_it = _assigned.find(worker_id);
+    if (task_it != _assigned.end()) {
+      // A worker told to exit, or a peer, which drops what it took with
+      // the link, does not come back for its tasks
+      bool keep = (_opts.lease_ms && !to_exit && !is_peer(worker_id));
+      uint64_t expiry_ms = monotonic_ms() + _opts.lease_ms;
+      // Tasks of the worker not claimed by any connection yet, e.g.
+      // loaded from database, go with it too
+      set<Task*> tasks = task_it->second;
+      for (Task* t : tasks) {
+        if (t->state != TaskRunning || (t->fd != fd && t->fd != 0)) {
+          continue;
+        }
+        if (keep && t->backup_worker.empty()) {
+          t->fd = 0;
+          if (t->lease_expiry_ms == 0) {
+            t->lease_expiry_ms = expiry_ms;
           }
-          break;
+          _next_slacker_check = min(_next_slacker_check,
+                                    t->lease_expiry_ms);
+        } else {
+          kill_task(t);
         }
       }
-      _workers.erase(it);
-    }
-    if (to_exit) {
-      // tell worker to exit
-      uint32_t msg_len;
-      char* msg = serialize_server_message("", 0, msg_len);
-      if (msg) {
-        ::write(fd, msg, msg_len);
-        free(msg);
-        LOG("Send close to worker fd %d", fd);
+    }
+    auto backup_it = _backups.find(worker_id);
+    if (backup_it != _backups.end()) {
+      set<Task*> tasks = backup_it->second;
+      for (Task* t : tasks) {
+        LOG("Drop backup %s of task %s",
+            worker_id.c_str(), t->task_name.c_str());
+        clear_backup(t);
       }
     }
+    _workers.erase(it);
+    forget_worker(worker_id);
+  }
+  if (to_exit) {
+    // tell worker to exit
+    uint32_t msg_len;
+    char* msg = serialize_server_message("", 0, 0, "", msg_len);
+    if (msg) {
+      send_worker(fd, msg, msg_len);
+      free(msg);
+      LOG("Send close to worker fd %d", fd);
+    }
+  }
+  if (fd >= session_handle_base) {
+    end_session(fd);
   }
+}
 
-  // Dispatch a task to a worker. If there is an unfinished task previously
-  // assigned to the worker redispatch it. Otherwise find a new task to
-  // dispatch. If no more new tasks tell the worker to exit.
-  uint32_t dispatch_task(int fd) {
-    auto worker_it = _workers.find(fd);
-    string worker_id = worker_it->second;
-    assert(worker_it != _workers.end());
-    Task* t = nullptr;
-    bool previous_task = false;
-    for (auto it : _tasks) {
-      if (it.second->worker == worker_id &&
-          (it.second->state == TaskRunning ||
-           it.second->state == TaskKilled)) {
-        t = it.second;
+uint32_t TaskController::dispatch_task(int fd)
+{
+  uint64_t begin_us = trace_enabled() ? trace_now_us() : 0;
+  auto worker_it = _workers.find(fd);
+  string worker_id = worker_it->second;
+  assert(worker_it != _workers.end());
+  Task* t = nullptr;
+  bool previous_task = false;
+  auto prev_it = _assigned.find(worker_id);
+  if (prev_it != _assigned.end()) {
+    for (Task* prev : prev_it->second) {
+      if (prev->fd != fd && (prev->state == TaskRunning ||
+                             prev->state == TaskKilled)) {
+        t = prev;
+        _ready.remove(t);
         break;
-      } if (it.second->state == TaskCreated ||
-            it.second->state == TaskKilled) {
-        t = it.second;
       }
     }
-    if (t == nullptr) {
-      LOG("No more task for %s to work on", worker_id.c_str());
-      disconnect_client(fd, true);
-      return 0;
+  }
+  if (t == nullptr) {
+    t = _ready.pop();
+    if (t == nullptr && _opts.window_high && !_window.at_end) {
+      if (refill_window() < 0) {
+        shutdown();
+      }
+      t = _ready.pop();
     }
-    if (t->worker == worker_id) {
-      previous_task = true;
+  }
+  bool backup_task = false;
+  if (t == nullptr) {
+    t = find_straggler(worker_id);
+    backup_task = (t != nullptr);
+  }
+  if (t == nullptr && (_blocked > 0 || _ready.size() > 0 ||
+                       is_busy(fd, worker_id) ||
+                       has_backup_candidate(worker_id))) {
+    // Keep the worker around. Tasks waiting on dependencies, or of a
+    // tenant at its cap, may become ready, or it may back up a straggler
+    // later.
+    LOG("Worker %s is idle", worker_id.c_str());
+    _idle[fd]++;
+    if (_ring && !is_peer(worker_id)) {
+      // Meanwhile it can run a task of a busier shard
+      steal_task();
     }
-    uint32_t msg_len;
-    char* msg = serialize_server_message(t->task_name.c_str(),
-                                         t->sleep_time,
-                                         msg_len);
-    if (!msg) {
-      return 0;
+    return EPOLLIN | EPOLLHUP| EPOLLET;
+  }
+  if (t == nullptr) {
+    LOG("No more task for %s to work on", worker_id.c_str());
+    release_worker(fd);
+    return 0;
+  }
+  if (t->worker == worker_id) {
+    previous_task = true;
+  }
+  // A previous task given again gets a new lease too, fencing off the
+  // run the worker lost track of
+  uint64_t lease = new_lease(t);
+  uint32_t msg_len;
+  char* msg = serialize_server_message(t->task_name.c_str(),
+                                       t->sleep_ms,
+                                       lease,
+                                       t->command.c_str(),
+                                       msg_len);
+  if (!msg) {
+    return 0;
+  }
+  uint64_t send_us = begin_us ? trace_now_us() : 0;
+  int r = send_worker(fd, msg, msg_len);
+  if (r < 0) {
+    LOG("Error in write(): %s", strerror(errno));
+    free((void*)msg);
+    // A previous task still running is left to disconnect_client(), a
+    // killed one was taken off the queue above
+    if (!backup_task && (!previous_task || t->state == TaskKilled)) {
+      _ready.push(t);
     }
-    int r = ::write(fd, msg, msg_len);
-    if (r < 0) {
-      LOG("Error in write(): %s", strerror(errno));
-      free((void*)msg);
-      disconnect_client(fd, false);
-      return 0;
+    disconnect_client(fd, false);
+    return 0;
+  }
+  free((void*)msg);
+  if (begin_us) {
+    trace_span("send", t->task_name, send_us);
+  }
+  if (backup_task) {
+    // The database keeps tracking the primary. The backup is recorded
+    // only if it wins the race.
+    set_backup(t, worker_id);
+    t->backup_lease = lease;
+    t->backup_assign_time = time(0);
+    t->backup_assign_ms = monotonic_ms();
+    LOG("Dispatch backup of task %s to %s, primary %s",
+        t->task_name.c_str(), worker_id.c_str(), t->worker.c_str());
+    if (begin_us) {
+      trace_span("dispatch", t->task_name, begin_us, 0, "backup");
     }
-    free((void*)msg);
-    t->worker = worker_id;
-    t->state = TaskRunning;
-    t->assign_time = time(0);
-    if (_task_db.update_task_db(t) < 0) {
-      shutdown();
+    return EPOLLIN | EPOLLHUP| EPOLLET;
+  }
+  assign(t, worker_id);
+  t->fd = fd;
+  t->lease = lease;
+  t->lease_expiry_ms = 0;
+  t->state = TaskRunning;
+  t->assign_time = time(0);
+  t->assign_ms = monotonic_ms();
+  _ready.start(t);
+  // The new deadline may come before the next scheduled check
+  _next_slacker_check = min(_next_slacker_check, t->assign_ms +
+                            _timeout_model.deadline(worker_id, t->sleep_ms));
+  if (update_task(t) < 0) {
+    shutdown();
+  } else {
+    if (previous_task) {
+      LOG("Re-dispatch previous task %s to worker %s",
+          t->task_name.c_str(), worker_id.c_str());
     } else {
-      if (previous_task) {
-        LOG("Re-dispatch previous task %s to worker %s",
-            t->task_name.c_str(), worker_id.c_str());
+      LOG("Dispatch new task %s to %s",
+          t->task_name.c_str(), t->worker.c_str());
+    }
+  }
+  if (begin_us) {
+    if (t->ready_us) {
+      trace_span("queued", t->task_name, t->ready_us, begin_us);
+    }
+    trace_span("dispatch", t->task_name, begin_us);
+  }
+  t->ready_us = 0;
+  return EPOLLIN | EPOLLHUP| EPOLLET;
+}
+
+uint32_t TaskController::check_slackers(uint64_t current_time)
+{
+  uint32_t next_check = default_timeout;
+  for (auto task_it : _tasks) {
+    Task* t = task_it.second;
+    // A peer watches the workers running the tasks it took
+    if (t->state != TaskRunning || is_peer(t->worker)) {
+      continue;
+    }
+    if (t->lease_expiry_ms) {
+      // The worker is disconnected. Once its lease runs out the task goes
+      // to another worker, and whatever it reports later is fenced off.
+      if (current_time >= t->lease_expiry_ms) {
+        LOG("Lease of %s on task %s ran out", t->worker.c_str(),
+            t->task_name.c_str());
+        string worker_id = t->worker;
+        kill_task(t);
+        forget_worker(worker_id);
+        continue;
+      }
+      next_check = min(next_check,
+                       (uint32_t)(t->lease_expiry_ms - current_time));
+    }
+    if (!t->backup_worker.empty()) {
+      uint32_t elapse_time =
+        (uint32_t)(current_time - t->backup_assign_ms);
+      uint32_t deadline = _timeout_model.deadline(t->backup_worker,
+                                                  t->sleep_ms);
+      if (elapse_time > deadline &&
+          uploading(t->backup_lease, current_time)) {
+        next_check = min(next_check, result_idle_ms);
+      } else if (elapse_time > deadline) {
+        int fd = find_worker_fd(t->backup_worker);
+        LOG("Close off backup slacker %s", t->backup_worker.c_str());
+        if (fd) {
+          disconnect_client(fd, true);
+        } else {
+          clear_backup(t);
+        }
+      }
+    }
+    uint32_t elapse_time = (uint32_t)(current_time - t->assign_ms);
+    uint32_t deadline = _timeout_model.deadline(t->worker, t->sleep_ms);
+    // LOG("Check slacker %s, task %s, sleep time %d, elapse time %d...",
+    //     t->worker.c_str(), t->task_name.c_str(), t->sleep_ms,
+    //     elapse_time);
+    if (elapse_time > deadline && uploading(t->lease, current_time)) {
+      next_check = min(next_check, result_idle_ms);
+    } else if (elapse_time > deadline) {
+      int fd = find_worker_fd(t->worker);
+      if (fd) {
+        LOG("Close off slacker %s, elapsed %u ms, deadline %u ms",
+            t->worker.c_str(), elapse_time, deadline);
+        disconnect_client(fd, true);
       } else {
-        LOG("Dispatch new task %s to %s",
-            t->task_name.c_str(), t->worker.c_str());
+        // slacker is gone, just update database
+        LOG("Update task %s state to TaskKilled", t->task_name.c_str());
+        kill_task(t);
       }
+    } else {
+      next_check = min(next_check, deadline - elapse_time + 1);
     }
-    return EPOLLIN | EPOLLHUP| EPOLLET;
   }
+  return next_check;
+}
 
-  int handle_timeout(bool is_timeout) {
-    LOG("epoll timeout %d", is_timeout);
-    if (is_timeout) {
-      // Check demo database sanity
-      sqlite3* db = _task_db.open_task_db();
-      if (!db) {
-        _shutdown = true;
-      } else {
-        // Check workers that may be slacking off. We consider worker not
-        // responsive if the elapse time is more than 10 seconds after
-        // expected task finish time
-        time_t current_time = time(0);
-        for (auto task_it : _tasks) {
-          Task* t = task_it.second;
-          if (t->state != TaskRunning) {
-            continue;
-          }
+int TaskController::handle_timeout(bool is_timeout)
+{
+  LOG("epoll timeout %d", is_timeout);
+  uint64_t current_time = monotonic_ms();
+  // Also when the loop never times out, in case a change was not seen
+  if (current_time - _last_fetch >= default_timeout) {
+    _last_fetch = current_time;
+    // Check demo database sanity
+    if (_task_db->check() < 0) {
+      _shutdown = true;
+    } else if (load_new_tasks() < 0) {
+      shutdown();
+    } else {
+      // A failed compaction leaves the store as it was
+      _task_db->maintain();
+    }
+  }
+  if (!_shutdown && current_time >= _next_slacker_check) {
+    _next_slacker_check = current_time + check_slackers(current_time);
+  }
+  if (!_shutdown) {
+    // Wake up in time for the nearest deadline, or every second while
+    // idle workers wait for a backup assignment
+    uint64_t next_check = _next_slacker_check - min(_next_slacker_check,
+                                                    current_time);
+    if (!_idle.empty()) {
+      next_check = min(next_check, (uint64_t)1000);
+    }
+    if (_ring) {
+      next_check = min(next_check, (uint64_t)connect_peers(current_time));
+    }
+    set_timeout(max(next_check, (uint64_t)1));
+  }
+  if (!_shutdown && _opts.window_high && !_window.at_end &&
+      refill_window() < 0) {
+    shutdown();
+  }
+  if (!_shutdown) {
+    dispatch_idle();
+  }
+  if (_snapshot && _snapshot->change_count() > 0 &&
+      current_time - _last_snapshot >= _opts.snapshot_interval * 1000ULL) {
+    save_snapshot();
+  }
+  if (_shutdown || _tasks.size() == 0) {
+    // All done or shutting down. Release workers still connected, e.g.
+    // waiting for a backup assignment or stopping a cancelled task.
+    map<int, string> workers = _workers;
+    for (auto worker : workers) {
+      release_worker(worker.first);
+    }
+    flush_all_mux();
+    if (_ring && leave_cluster(current_time)) {
+      return 0;
+    }
+    return 1; // no more work, shutdown
+  }
+  _leave_ms = 0;
+  flush_all_mux();
+  return 0;
+}
 
-          uint32_t elapse_time = (uint32_t)(current_time - t->assign_time);
-          // LOG("Check slacker %s, task %s, sleep time %d, elapse time %d...",
-          //     t->worker.c_str(), t->task_name.c_str(), t->sleep_time,
-          //     elapse_time);
-          if (elapse_time > t->sleep_time + 10) {
-            int fd = 0;
-            for (auto it : _workers) {
-              if (it.second == t->worker) {
-                fd = it.first;
-                break;
-              }
-            }
-            if (fd) {
-              LOG("Close off slacker %s", t->worker.c_str());
-              disconnect_client(fd, true);
-            } else {
-              // slacker is gone, just update database
-              LOG("Update task %s state to TaskKilled", t->task_name.c_str());
-              t->state = TaskKilled;
-              if (_task_db.update_task_db(t) < 0) {
-                shutdown();
-              }
-            }
-          }
-        }
-        // Load more tasks
-        if (_task_db.fetch_tasks(_tasks) < 0) {
+uint32_t TaskController::handle_client_input(int fd)
+{
+  string& buf = _inbufs[fd];
+  char chunk[4096];
+  bool closed = false;
+  uint32_t what_to_do = EPOLLIN | EPOLLHUP | EPOLLET;
+  while (true) {
+    if (_results.receiving(fd)) {
+      uint64_t lease;
+      int r = _results.receive(fd, lease);
+      if (r == 0) {
+        break;
+      }
+      if (r < 0) {
+        LOG("Client connection %d closed in a result chunk", fd);
+        if (r < -1) {
           shutdown();
         }
+        closed = true;
+        break;
       }
+      ack_result(fd, lease);
     }
-    if (_shutdown) {
-      for (auto worker : _workers) {
-        disconnect_client(worker.first, true);
+    int r = ::read(fd, chunk, sizeof(chunk));
+    if (r > 0) {
+      buf.append(chunk, r);
+      what_to_do = handle_client_buffer(fd, buf);
+      if (what_to_do == 0) {
+        return 0;
+      }
+      // A short read took all there was. What the worker sends in reply to
+      // the messages just handled comes with a new event, so a busy worker
+      // does not keep the others waiting.
+      if (r < (int)sizeof(chunk) && !_results.receiving(fd)) {
+        break;
       }
+      continue;
+    }
+    if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
     }
-    if (_shutdown || _tasks.size() == 0) {
-      return 1; // no more work, shutdown
+    if (r < 0 && errno == EINTR) {
+      continue;
     }
+    // What arrived before the close is handled, e.g. a completion
+    LOG("Client connection %d closed: %d", fd, r);
+    closed = true;
+    break;
+  }
+  if (closed) {
+    disconnect_client(fd, false);
     return 0;
   }
+  return what_to_do;
+}
 
-  uint32_t handle_client_message(int fd) {
-    LOG("handle_client_message %d", fd);
+uint32_t TaskController::handle_client_buffer(int fd, string& buf)
+{
+  size_t offset = 0;
+  uint32_t what_to_do = EPOLLIN | EPOLLHUP | EPOLLET;
+  while (buf.size() - offset >= sizeof(uint32_t)) {
     uint32_t msg_len;
-    int r = ::read(fd, (char*)&msg_len, sizeof(msg_len));
-    if (r != sizeof(uint32_t)) {
-      LOG("Error in read client message header: %d", r);
-      disconnect_client(fd, false);
-      return 0;
+    memcpy(&msg_len, buf.data() + offset, sizeof(msg_len));
+    if (msg_len & MUX_FRAME_FLAG) {
+      // A host agent carrying many workers over this connection
+      MuxFrame frame;
+      int r = parse_mux_frame(buf.data() + offset, buf.size() - offset,
+                              MAX_RESULT_CHUNK_LEN, frame);
+      if (r < 0) {
+        LOG("Error in frame len %u", msg_len & ~MUX_FRAME_FLAG);
+        disconnect_client(fd, false);
+        return 0;
+      }
+      if (r == 0) {
+        break;
+      }
+      handle_mux_frame(fd, frame);
+      offset += frame.len;
+      continue;
+    }
+    if (msg_len & RESULT_CHUNK_FLAG) {
+      msg_len &= ~RESULT_CHUNK_FLAG;
+      if (msg_len < RESULT_CHUNK_HEADER_LEN ||
+          msg_len > MAX_RESULT_CHUNK_LEN) {
+        LOG("Error in result chunk len %u", msg_len);
+        disconnect_client(fd, false);
+        return 0;
+      }
+      if (buf.size() - offset < RESULT_CHUNK_HEADER_LEN) {
+        break;
+      }
+      uint32_t avail = (uint32_t)min((size_t)msg_len, buf.size() - offset);
+      handle_result_chunk(fd, buf.data() + offset, avail, msg_len);
+      offset += avail;
+      continue;
     }
-    if (msg_len > MAX_CLIENT_MSG_LEN) {
+    if (msg_len > MAX_CLIENT_MSG_LEN || msg_len <= sizeof(msg_len)) {
       LOG("Error in client message len %u", msg_len);
       disconnect_client(fd, false);
       return 0;
     }
-    uint32_t body_len = msg_len - sizeof(msg_len);    
-    char msg[body_len];
-    r = ::read(fd, msg, body_len);
-    if (r != (int)body_len) {
-      LOG("Error in read client msg: %d", r);
-      disconnect_client(fd, false);
-      return 0;
+    if (buf.size() - offset < msg_len) {
+      break;
     }
-    string worker;
-    string task_name;
-    uint32_t time_left;
-    if (deserialize_client_message(msg,
-                                   body_len,
-                                   worker,
-                                   task_name,
-                                   time_left) < 0) {
-      LOG("Error in deserialize_client_message");
-      disconnect_client(fd, false);
+    what_to_do = handle_client_message(fd,
+                                       buf.data() + offset + sizeof(msg_len),
+                                       msg_len - sizeof(msg_len));
+    if (what_to_do == 0) {
       return 0;
     }
-    auto worker_it = _workers.find(fd);
-    if (worker_it == _workers.end()) {
-      _workers[fd] = worker;
+    offset += msg_len;
+  }
+  buf.erase(0, offset);
+  return what_to_do;
+}
+
+Task* TaskController::find_run(int fd, uint64_t lease)
+{
+  auto worker_it = _workers.find(fd);
+  if (worker_it == _workers.end()) {
+    return nullptr;
+  }
+  const string& worker = worker_it->second;
+  auto task_it = _assigned.find(worker);
+  if (task_it != _assigned.end()) {
+    for (Task* t : task_it->second) {
+      if (t->state == TaskRunning && t->lease == lease) {
+        return t;
+      }
     }
-    if (task_name == "") {
-      // Worker requests new task
-      return dispatch_task(fd);
+  }
+  if (_opts.backup_pct) {
+    for (auto& it : _tasks) {
+      Task* t = it.second;
+      if (t->backup_worker == worker && t->backup_lease == lease) {
+        return t;
+      }
     }
-    auto task_it = _tasks.find(task_name);
-    if (task_it == _tasks.end()) {
-      LOG("Error: cannot find task %s", task_name.c_str());
-      disconnect_client(fd, false);
-      return 0;
+  }
+  return nullptr;
+}
+
+ResultUpload* TaskController::find_upload(int fd, uint64_t lease,
+                                          uint64_t offset)
+{
+  ResultUpload* u = _results.find(fd, lease, offset);
+  if (u || offset != 0 || !_results.keeping()) {
+    return u;
+  }
+  Task* t = find_run(fd, lease);
+  return t ? _results.open(fd, lease, t->task_name) : nullptr;
+}
+
+bool TaskController::uploading(uint64_t lease, uint64_t now)
+{
+  const ResultUpload* u = _results.get(lease);
+  return u && now - u->last_ms < result_idle_ms;
+}
+
+void TaskController::handle_result_chunk(int fd, const char* chunk,
+                                         uint32_t avail, uint32_t chunk_len)
+{
+  uint64_t lease, offset;
+  parse_result_chunk_header(chunk, lease, offset);
+  ResultUpload* u = find_upload(fd, lease, offset);
+  if (_results.take(fd, lease, u, chunk, avail, chunk_len)) {
+    ack_result(fd, lease);
+  }
+}
+
+void TaskController::ack_result(int fd, uint64_t lease)
+{
+  uint32_t msg_len;
+  char* msg = serialize_server_message("", RESULT_ACK_SLEEP_TIME, lease, "",
+                                       msg_len);
+  if (msg == nullptr) {
+    return;
+  }
+  if (_sessions.count(fd)) {
+    send_worker(fd, msg, msg_len);
+  } else {
+    _result_acks[fd].append(msg, msg_len);
+  }
+  free(msg);
+}
+
+int TaskController::flush_result_acks(int fd)
+{
+  auto it = _result_acks.find(fd);
+  if (it == _result_acks.end()) {
+    return 0;
+  }
+  if (write_pending(fd, it->second) < 0) {
+    LOG("Error in write() of result acks to %d: %s", fd,
+        strerror(errno));
+    _result_acks.erase(it);
+    return -1;
+  }
+  if (it->second.empty()) {
+    _result_acks.erase(it);
+  }
+  return 0;
+}
+
+uint32_t TaskController::handle_client_message(int fd, const char* msg,
+                                               uint32_t body_len)
+{
+  LOG("handle_client_message %d", fd);
+  uint64_t begin_us = trace_enabled() ? trace_now_us() : 0;
+  string worker;
+  string task_name;
+  uint32_t time_left;
+  uint64_t lease;
+  TaskResult result;
+  if (deserialize_client_message(msg,
+                                 body_len,
+                                 worker,
+                                 task_name,
+                                 time_left,
+                                 lease,
+                                 &result) < 0) {
+    LOG("Error in deserialize_client_message");
+    disconnect_client(fd, false);
+    return 0;
+  }
+  auto worker_it = _workers.find(fd);
+  if (worker_it == _workers.end()) {
+    _workers[fd] = worker;
+  }
+  if (task_name == "" && time_left == PEER_LEAVING && is_peer(worker)) {
+    peer_left(worker);
+    return EPOLLIN | EPOLLHUP | EPOLLET;
+  }
+  if (task_name == "") {
+    // Worker requests new task
+    return dispatch_task(fd);
+  }
+  auto task_it = _tasks.find(task_name);
+  if (task_it == _tasks.end() && _opts.window_high) {
+    // Not loaded yet, e.g. outside of the window. Without a window every
+    // unfinished task is in memory, so reports are checked against it
+    // alone.
+    vector<Task*> new_tasks;
+    if (_task_db->fetch_task(_tasks, task_name, &new_tasks) > 0 &&
+        add_tasks(new_tasks) == 0) {
+      task_it = _tasks.find(task_name);
     }
-    Task* t = task_it->second;
-    if (t->worker != worker) {
-      LOG("Error: invalid worker %s for task %s, was %s",
-          worker.c_str(), task_name.c_str(), t->worker.c_str());
-      disconnect_client(fd, false);
-      return 0;
+  }
+  if (task_it == _tasks.end()) {
+    // Finished already, e.g. by the winner of a speculative run
+    return fence_off(fd, worker, task_name, lease, time_left);
+  }
+  Task* t = task_it->second;
+  // Checked against memory only. The lease of the primary is in the
+  // database since its assignment, the backup is not kept there.
+  bool is_backup = (!t->backup_worker.empty() &&
+                    t->backup_worker == worker && t->backup_lease == lease);
+  if (!is_backup && (t->worker != worker || t->lease != lease)) {
+    return fence_off(fd, worker, task_name, lease, time_left);
+  }
+  if (time_left == 0) {
+    // First completion wins. The loser of a speculative run is cancelled.
+    string loser;
+    uint64_t loser_lease;
+    if (is_backup) {
+      loser = t->worker;
+      loser_lease = t->lease;
+      assign(t, t->backup_worker);
+      t->lease = t->backup_lease;
+      t->assign_time = t->backup_assign_time;
+      t->assign_ms = t->backup_assign_ms;
+      LOG("Backup %s won task %s", worker.c_str(), task_name.c_str());
+    } else {
+      loser = t->backup_worker;
+      loser_lease = t->backup_lease;
     }
-    if (time_left == 0) {
-      t->state = TaskSuccess;
-      t->complete_time = time(0);
-      if (_task_db.update_task_db(t) < 0) {
-        shutdown();
-      }
-      _tasks.erase(task_it);
-      delete t;
-      return dispatch_task(fd);
+    clear_backup(t);
+    t->state = TaskSuccess;
+    t->complete_time = time(0);
+    uint64_t elapsed = monotonic_ms() - t->assign_ms;
+    if (t->owner_fd == 0) {
+      // Counted by the shard owning it
+      _completed++;
+      _run_hist[hist_bucket(elapsed)]++;
     }
-    // a reconnect from client. update task state to running
-    LOG("Reconnected to worker %s, task %s",
-        worker.c_str(), task_name.c_str());
-    t->state = TaskRunning;
-    if (_task_db.update_task_db(t) < 0) {
+    t->result = result;
+    t->result_file = _results.finish(lease);
+    if (!loser.empty()) {
+      _results.abort(loser_lease);
+    }
+    if (!t->command.empty()) {
+      LOG("Task %s exit status %d, user %u ms, sys %u ms, max rss %u KB",
+          task_name.c_str(), result.exit_status, result.user_ms,
+          result.sys_ms, result.max_rss_kb);
+    }
+    _timeout_model.add_sample(t->worker, t->sleep_ms, (uint32_t)elapsed);
+    if (begin_us) {
+      // Assignment times are kept in milliseconds
+      trace_span("running", task_name, t->assign_ms * 1000, begin_us,
+                 is_backup ? "backup" : nullptr);
+    }
+    if (update_task(t) < 0) {
       shutdown();
     }
+    complete_task(t);
+    delete t;
+    if (begin_us) {
+      trace_span("complete", task_name, begin_us);
+    }
+    // The loser asks for a new task once it has stopped
+    int loser_fd = loser.empty() ? 0 : find_worker_fd(loser);
+    if (loser_fd) {
+      LOG("Cancel %s on task %s", loser.c_str(), task_name.c_str());
+      cancel_task(loser_fd, task_name, loser_lease);
+    }
+    if (is_peer(worker)) {
+      // A peer asks for every task it takes
+      return EPOLLIN | EPOLLHUP | EPOLLET;
+    }
+    return dispatch_task(fd);
+  }
+  // The worker knows how long the task has run, which is more exact
+  // than the assignment time kept in the database
+  uint64_t ran_ms = t->sleep_ms > time_left ? t->sleep_ms - time_left : 0;
+  uint64_t now = monotonic_ms();
+  if (is_backup) {
+    LOG("Reconnected to backup worker %s, task %s",
+        worker.c_str(), task_name.c_str());
+    t->backup_assign_ms = now - min(ran_ms, now);
+    return EPOLLIN | EPOLLHUP | EPOLLET;
+  }
+  // a reconnect from client. update task state to running
+  LOG("Reconnected to worker %s, task %s",
+      worker.c_str(), task_name.c_str());
+  t->fd = fd;
+  t->lease_expiry_ms = 0;
+  t->assign_ms = now - min(ran_ms, now);
+  if (t->state == TaskRunning) {
+    // Back within its lease, or the controller restarted. The database
+    // already has it.
     return EPOLLIN | EPOLLHUP | EPOLLET;
   }
+  t->state = TaskRunning;
+  _ready.remove(t);
+  _ready.start(t);
+  if (update_task(t) < 0) {
+    shutdown();
+  }
+  return EPOLLIN | EPOLLHUP | EPOLLET;
+}
 
-  virtual uint32_t handle_new_connection(int fd) {
-    LOG("handle_new_connection %d", fd);
-    if (_shutdown) {
-      LOG("Shutdown scheduled");
-      disconnect_client(fd, true);
-    }
-    // Wait for worker to initiate handshake
+uint32_t TaskController::fence_off(int fd, const string& worker,
+                                   const string& task_name, uint64_t lease,
+                                   uint32_t time_left)
+{
+  LOG("Fence off %s on task %s, lease %lu is stale", worker.c_str(),
+      task_name.c_str(), (unsigned long)lease);
+  trace_instant("fenced", task_name);
+  _fenced++;
+  _results.abort(lease);
+  if (time_left) {
+    cancel_task(fd, task_name, lease);
     return EPOLLIN | EPOLLHUP | EPOLLET;
   }
+  if (is_peer(worker)) {
+    return EPOLLIN | EPOLLHUP | EPOLLET;
+  }
+  return dispatch_task(fd);
+}
 
-  virtual uint32_t handle_connection(const epoll_event& ev) {
-    // We never turn on EPOLLOUT since controller always write out immediately
-    // after every read
-    int fd = ev.data.fd;    
-    if (_shutdown) {
-      disconnect_client(fd, true);
-      return 0;
-    }
-    if (ev.events & EPOLLIN) {
-      return handle_client_message(fd);
+ControllerStats TaskController::stats() const
+{
+  ControllerStats s;
+  s.start_ms = _start_ms;
+  s.blocked = _blocked;
+  s.completed = _completed;
+  s.fenced = _fenced;
+  s.sessions = _sessions.size();
+  s.mux_connections = _mux_conns.size();
+  s.uploads = _results.count();
+  s.result_bytes = _results.bytes();
+  s.all_loaded = (_opts.window_high == 0 || _window.at_end);
+  s.shutdown = _shutdown;
+  s.rx_off_node = _rx_off_node;
+  if (_ring == nullptr) {
+    return s;
+  }
+  s.shard = _ring->shards()[_shard].name;
+  s.stolen_total = _stolen;
+  // Counted from the tasks of each peer, not by a scan of all tasks
+  for (uint32_t i = 0; i < _peers.size(); i++) {
+    s.stolen += _peers.link(i).stolen.size();
+    auto it = _assigned.find(_ring->shards()[i].name);
+    if (it == _assigned.end()) {
+      continue;
     }
-    if (ev.events & EPOLLHUP) {
-      disconnect_client(fd, false);
-      return 0;
+    for (Task* t : it->second) {
+      s.lent += (t->state == TaskRunning);
     }
-    return 0;
   }
-};
-
-static const char* usage = "Usage:\n"
-  "task_controller [-v] -p <port> -d <database>\n"
-  "\t[-v] : Log to stderr instead of log file\n"
-  "\t-p <port> : Listening port\n"
-  "\t-d <database> : Task database file\n";
-
-int main(int argc, char** argv)
-{
-  char ch;
-  int port = 0;
-  string db_name;
-  bool to_stderr = false;
-  if (argc == 0) {
-    printf(usage);
-    exit(0);
-  }
-  while ((ch = getopt(argc, argv, "hvp:d:")) > 0) {
-    switch (ch) {
-    case 'h':
-      printf(usage);
-      exit(0);
-    case 'p': {
-      port = atoi(optarg);
-      if (port > MAX_PORT_NUMBER) {
-        fprintf(stderr, "Invalid port number %d\n", port);
-        exit(1);
-      }
-      break;
+  return s;
+}
+
+int TaskController::load_now()
+{
+  _last_fetch = monotonic_ms();
+  int r = load_new_tasks();
+  if (r < 0) {
+    shutdown();
+    return -1;
+  }
+  dispatch_idle();
+  return r;
+}
+
+uint32_t TaskController::handle_new_unix_connection(int fd)
+{
+  LOG("Admin connection %d", fd);
+  _admin.add(fd);
+  return EPOLLIN | EPOLLHUP | EPOLLET;
+}
+
+uint32_t TaskController::handle_new_connection(int fd)
+{
+  LOG("handle_new_connection %d", fd);
+  // Where the kernel handles the packets of the connection. With receive
+  // flow steering it follows the reactor, else it is up to the IRQ
+  // affinity of the NIC queue.
+  int cpu = -1;
+  socklen_t len = sizeof(cpu);
+  if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0 &&
+      cpu >= 0) {
+    _rx_cpus[cpu]++;
+    int reactor_cpu = sched_getcpu();
+    if (reactor_cpu >= 0 && cpu_node(cpu) != cpu_node(reactor_cpu)) {
+      _rx_off_node++;
     }
-    case 'd': {
-      db_name = optarg;
-      struct stat statBuf;
-      if (stat(db_name.c_str(), &statBuf) < 0) {
-        fprintf(stderr, "Database file does not exist: %s\n", db_name.c_str());
-        exit(1);
-      }
-      break;
+  }
+  if (_shutdown) {
+    LOG("Shutdown scheduled");
+    disconnect_client(fd, true);
+  }
+  // Wait for worker to initiate handshake
+  return EPOLLIN | EPOLLHUP | EPOLLET;
+}
+
+uint32_t TaskController::handle_connection(const epoll_event& ev)
+{
+  // Plain workers get EPOLLOUT only while result acks wait to be written,
+  // other messages to them go out at once. Admin output and the frames of
+  // a multiplexed connection may need more than one write.
+  int fd = ev.data.fd;    
+  if (_admin.owns(fd)) {
+    return _admin.handle(ev);
+  }
+  if (_watcher && fd == _watcher->event_fd()) {
+    return handle_db_change();
+  }
+  if (_peers.find(fd) >= 0) {
+    return handle_peer(ev);
+  }
+  if (_shutdown) {
+    if (_mux_conns.count(fd)) {
+      close_mux(fd, true);
+    } else {
+      disconnect_client(fd, true);
     }
-    case 'v':
-      to_stderr = true;
-      break;
+    return 0;
+  }
+  uint32_t what_to_do = 0;
+  if (ev.events & EPOLLIN) {
+    what_to_do = handle_client_input(fd);
+  } else if (ev.events & EPOLLHUP) {
+    disconnect_client(fd, false);
+  } else if (ev.events & EPOLLOUT) {
+    what_to_do = EPOLLIN | EPOLLHUP | EPOLLET;
+  }
+  if (what_to_do && _result_acks.count(fd)) {
+    if (flush_result_acks(fd) < 0) {
+      disconnect_client(fd, false);
+      what_to_do = 0;
+    } else if (_result_acks.count(fd)) {
+      what_to_do |= EPOLLOUT;
     }
   }
-  if (!port || db_name.empty()) {
-    printf("Invalid arguments\n");
-    printf(usage);
-    exit(1);
+  if (what_to_do && _mux_conns.count(fd)) {
+    if (flush_mux(fd) < 0) {
+      what_to_do = 0;
+    } else if (!_mux_out[fd].empty()) {
+      what_to_do |= EPOLLOUT;
+    }
   }
-  TaskController controller(db_name.c_str(), port, to_stderr);
-  fprintf(stderr, "Controller log file is %s\n", controller.log_file_name().c_str());
-  if (controller.init() < 0) {
-    fprintf(stderr, "Controller initialization failed\n");
-    exit(1);
+  if (what_to_do == 0) {
+    _inbufs.erase(fd);
+    close_mux(fd, false);
   }
-  controller.run_loop();
-  return 0;
+  return what_to_do;
+}
+
 }
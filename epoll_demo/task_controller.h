@@ -0,0 +1,466 @@
+#ifndef __task_controller_h__
+#define __task_controller_h__
+//
+// Fred Xia (fxia@yahoo.com)
+//
+
+#include <stdint.h>
+#include <string>
+#include <map>
+#include <set>
+#include <vector>
+#include "server.h"
+#include "task_db.h"
+#include "timeout_model.h"
+#include "task_graph.h"
+#include "fair_queue.h"
+#include "snapshot.h"
+#include "db_watch.h"
+#include "archive.h"
+#include "shard.h"
+#include "admin.h"
+#include "mux.h"
+#include "result_upload.h"
+
+namespace epoll_demo {
+
+// Default timeout for epoll_wait is 10 seconds
+const uint32_t default_timeout = 10000;
+
+// Buckets of run time histograms. Bucket i counts tasks that took less than
+// 2^i milliseconds, the last one the rest.
+const uint32_t run_hist_buckets = 24;
+
+// Bucket of a run time of ms milliseconds
+uint32_t hist_bucket(uint64_t ms);
+
+// Name of a state in traces and admin queries
+const char* state_name(TaskState state);
+
+// Command line options of the controller
+struct ControllerOptions {
+  // Percentage of expected sleep time after which a running task may get a
+  // speculative backup copy on an idle worker. 0 disables speculation.
+  uint32_t backup_pct;
+  // Watermarks of ready tasks kept in memory. When window_high is not 0
+  // tasks are loaded in windows instead of all at once.
+  uint32_t window_high;
+  uint32_t window_low;
+  // Snapshot file of controller state and seconds between snapshots. No
+  // snapshot is taken if the path is empty.
+  std::string snapshot_path;
+  uint32_t snapshot_interval;
+  // Milliseconds a worker that lost its connection keeps the lease on its
+  // tasks. A task it reports back in time goes on as if nothing happened,
+  // afterwards it is killed and given to another worker. 0 kills at once.
+  uint32_t lease_ms;
+  // Weights and caps of tenants sharing the workers, all tenants alike if
+  // empty
+  std::string tenants_path;
+  // Directory of the results workers stream back. Results are dropped if
+  // empty.
+  std::string result_dir;
+
+  ControllerOptions()
+    : backup_pct(0), window_high(0), window_low(0), snapshot_interval(60),
+      lease_ms(5000)
+  {}
+};
+
+// A worker session of a multiplexed connection
+struct MuxSession {
+  int       fd;           // the connection
+  uint32_t  id;           // session id on the connection
+  bool      closed;       // closed by the other end, not to be told
+
+  MuxSession() : fd(0), id(0), closed(false) {}
+};
+
+// Counters of the controller, as shown by admin status queries
+struct ControllerStats {
+  uint64_t  start_ms;         // monotonic
+  uint32_t  blocked;          // loaded tasks waiting on dependencies
+  uint64_t  completed;        // tasks completed since start
+  uint64_t  fenced;           // stale reports dropped since start
+  uint64_t  sessions;         // worker sessions of multiplexed connections
+  uint64_t  mux_connections;
+  uint64_t  uploads;          // results being received
+  uint64_t  result_bytes;     // result data received since start
+  bool      all_loaded;       // every unfinished task is loaded
+  bool      shutdown;
+  uint64_t  rx_off_node;      // connections taken in off the reactor's node
+  std::string shard;          // shard of the cluster, empty if alone
+  uint64_t  stolen;           // tasks held for peers now
+  uint64_t  stolen_total;     // tasks stolen from peers since start
+  uint64_t  lent;             // tasks of this shard running on peers
+
+  ControllerStats()
+    : start_ms(0), blocked(0), completed(0), fenced(0), sessions(0),
+      mux_connections(0), uploads(0), result_bytes(0), all_loaded(false),
+      shutdown(false), rx_off_node(0), stolen(0), stolen_total(0), lent(0)
+  {}
+};
+
+// Task dispatcher. Workers connect over TCP, ask for tasks and report their
+// status; the state of every task is kept in the task database.
+struct TaskController : public TcpServer {
+
+  TaskStore* _task_db;  // sqlite3 database or task log
+  TaskCollection _tasks;
+  TaskGraph _graph;     // dependencies of loaded tasks
+  FairQueue _ready;    // tasks that can be dispatched now, by tenant
+  uint32_t _blocked;    // loaded tasks waiting on dependencies
+  // tasks dropped for waiting on a dependency cycle
+  std::set<std::string> _cyclic;
+  // worker_id => tasks running or killed on the worker
+  std::map<std::string, std::set<Task*>> _assigned;
+  std::map<int, std::string> _workers; // fd => worker_id
+  // worker_id => tasks the worker runs a speculative backup of
+  std::map<std::string, std::set<Task*>> _backups;
+  std::map<int, std::string> _inbufs;  // fd => partial client messages
+  bool _shutdown; // shutdown flag. Set when database is gone.
+  ControllerOptions _opts;
+  TaskWindow _window; // position of windowed loading
+  Snapshot* _snapshot;
+  // Times below are monotonic milliseconds
+  uint64_t _last_snapshot;
+  int64_t _loaded_rowid; // rows up to this rowid are loaded
+  // Idle workers kept connected while they may still get work. fd => number
+  // of task requests not served yet
+  std::map<int, uint32_t> _idle;
+  uint64_t _last_idle_check;
+  // Learned run time of tasks, decides when a running task is stuck
+  TimeoutModel _timeout_model;
+  uint64_t _next_slacker_check;
+  uint64_t _last_fetch;
+  DbWatcher* _watcher;  // signals new tasks, nullptr if not watching
+  TaskArchiver* _archiver; // moves completed tasks away, nullptr if not
+  // Admin connections on the Unix socket, answered from memory
+  AdminHandler _admin;
+  uint64_t _start_ms;
+  uint64_t _completed;            // tasks completed since start
+  uint64_t _run_hist[run_hist_buckets];
+  // Cluster this controller is a shard of, nullptr if it runs alone
+  ShardRing* _ring;
+  uint32_t _shard;                // index of this controller in _ring
+  PeerLinks _peers;               // to the other shards
+  uint64_t _stolen;               // tasks stolen from peers since start
+  uint64_t _leave_ms;             // when to exit once done, 0 if not done
+  uint64_t _next_lease;           // lease of the next assignment
+  uint64_t _fenced;               // stale reports dropped since start
+  // Multiplexed connections and their worker sessions
+  std::map<int, MuxSession> _sessions;      // handle => session
+  // fd => session id => handle
+  std::map<int, std::map<uint32_t, int>> _mux_conns;
+  std::map<int, std::string> _mux_out;      // fd => frames not written yet
+  int _next_session;                        // handle of the next session
+  ResultUploads _results;   // results being received
+  // fd => acks, and messages behind them, not written yet
+  std::map<int, std::string> _result_acks;
+  // CPUs the kernel took in the packets of connections on, as seen at accept
+  std::map<int, uint64_t> _rx_cpus;           // cpu => connections
+  uint64_t _rx_off_node;    // connections taken in off the reactor's node
+
+  TaskController(const char* db, uint16_t port, bool to_stderr,
+                 const ControllerOptions& opts);
+
+  virtual ~TaskController();
+
+  int init();
+
+  // Whether the restored tasks agree with the database: the same running
+  // tasks under the same leases, and, when every unfinished task is loaded,
+  // as many waiting ones. Catches changes lost from the tail of the change
+  // log, and rows changed or deleted by other programs.
+  bool snapshot_matches(int64_t max_rowid);
+
+  // Restore tasks from the snapshot. The snapshot is valid only if the
+  // database still has every row it has seen, and agrees with it on the
+  // tasks it has. Tasks added to the database after the snapshot are loaded
+  // on top of it. Returns number of tasks, or -1 if there is no usable
+  // snapshot
+  int load_snapshot();
+
+  // Write a snapshot of loaded tasks. Returns 0 for success, -1 for failure
+  int save_snapshot();
+
+  // Write a task state change to database, and to the snapshot change log.
+  // Returns 0 for success, -1 for failure
+  int update_task(Task* t);
+
+  // Load new tasks and their dependencies from database. Only rows added
+  // since the last load are read. Tasks that do not wait on other tasks are
+  // queued for dispatch. Returns number of new tasks, or -1 if error
+  int load_tasks();
+
+  // Load more tasks once the ready queue drains below the low watermark, up
+  // to the high watermark. Returns number of new tasks, or -1 if error
+  int refill_window();
+
+  // Watch the database for new tasks from another thread instead of only
+  // fetching them periodically. Call before run_loop(). Returns 0 for
+  // success, -1 for failure
+  int watch_db(const char* db);
+
+  // Archive tasks completed age_sec ago or earlier in the background.
+  // Returns 0 for success, -1 for failure
+  int start_archiver(const char* db, uint32_t age_sec);
+
+  // Run as shard index of the cluster ring. Call before init(). Returns 0
+  // for success, -1 for failure
+  int join_cluster(ShardRing* ring, uint32_t index);
+
+  // Whether a connection is another shard asking for tasks
+  bool is_peer(const std::string& worker_id);
+
+  // Drop loaded tasks owned by other shards of the cluster
+  void drop_foreign(std::vector<Task*>& new_tasks);
+
+  // Make the links to peers that are down, once their retry time is up.
+  // Returns milliseconds until the next retry is due.
+  uint32_t connect_peers(uint64_t now);
+
+  // Ask a peer for a task for the idle workers. A task it sends is run
+  // here and reported back to it. There are never more requests out than
+  // requests of idle workers.
+  void steal_task();
+
+  // Start a connect to a peer. Returns 0 for success, -1 for failure
+  int connect_peer(uint32_t i);
+
+  // A task stolen from a peer is done, tell its owner
+  int report_stolen(Task* t);
+
+  // Forget a task stolen from a peer, stopping it where it runs
+  void drop_stolen(Task* t);
+
+  // A task stolen from a peer is no longer held for it
+  void forget_stolen(Task* t);
+
+  // The link to a peer is gone, or the peer has no more tasks to give.
+  // Tasks stolen over it are dropped, the peer runs them again.
+  void close_peer(uint32_t i);
+
+  // Handle a message of a peer: a task, the cancel of one, or no more
+  // tasks. Returns 0 for success, -1 if the link is to be closed
+  int handle_peer_message(uint32_t i, const PeerMessage& m);
+
+  uint32_t handle_peer(const epoll_event& ev);
+
+  // This shard is done. Tell the peers, so they send no more workers here,
+  // and keep answering the workers already on the way for a while.
+  // Returns whether to keep running
+  bool leave_cluster(uint64_t now);
+
+  // A peer is leaving. Its link is closed and made again only after it is
+  // gone.
+  void peer_left(const std::string& peer);
+
+  // Let go of a worker that has nothing more to do here. In a cluster it is
+  // sent to a peer that may still have tasks, otherwise told to exit.
+  void release_worker(int fd);
+
+  // Tasks were added to the database. Load them and hand them to idle
+  // workers right away.
+  uint32_t handle_db_change();
+
+  // Load tasks added to the database since the last load. In window mode
+  // look past the end of the table again. Returns number of new tasks, or -1
+  // if error
+  int load_new_tasks();
+
+  // Index newly loaded tasks and load their dependencies. Tasks that do not
+  // wait on other tasks are queued for dispatch. Tasks owned by other shards
+  // are dropped from new_tasks. Returns 0 for success, -1 for failure
+  int add_tasks(std::vector<Task*>& new_tasks);
+
+  // Drop the loaded tasks that wait on a dependency cycle, or they would
+  // keep workers waiting for good. They stay created in the database. A
+  // running one is left to finish. Dropped tasks are taken out of new_tasks
+  // too.
+  void drop_cyclic(std::vector<Task*>& new_tasks);
+
+  // Queue a task for dispatch if it is waiting to run
+  void make_ready(Task* t);
+
+  // Lease of a new assignment of t, larger than any lease it had
+  uint64_t new_lease(const Task* t);
+
+  // Record the worker a task is assigned to
+  void assign(Task* t, const std::string& worker_id);
+
+  // Drop a task from the tasks of its worker
+  void unassign(Task* t);
+
+  // A task completed. Drop it from all indexes and queue dependents that
+  // were waiting only on it. The caller deletes the task.
+  void complete_task(Task* t);
+
+  // Shutdown flag can be turned on during message processing. We don't want
+  // to shutdown in the middle of processing to avoid data inconsistency.
+  // Actual shutdown is performed in handle_timeout()
+  void shutdown();
+
+  // Find the connection of a worker. Returns 0 if the worker is not connected.
+  int find_worker_fd(const std::string& worker_id);
+
+  // Record a speculative backup of a task on a worker
+  void set_backup(Task* t, const std::string& worker_id);
+
+  // Drop the backup of a task, if it has one
+  void clear_backup(Task* t);
+
+  // Drop the run times learned for a worker once it is gone and holds no
+  // task under lease, so the model does not keep every worker ever seen
+  void forget_worker(const std::string& worker_id);
+
+  // The primary worker of a task is gone. If a speculative backup is running
+  // promote it to primary, otherwise mark the task as TaskKilled.
+  void kill_task(Task* t);
+
+  // Find a running task that has exceeded _opts.backup_pct of its expected
+  // sleep time and has no backup yet. Picks the task that is most overdue.
+  Task* find_straggler(const std::string& worker_id);
+
+  // Whether there is a running task that may later need a backup copy on
+  // worker_id.
+  bool has_backup_candidate(const std::string& worker_id);
+
+  // Whether the worker on fd is running any task
+  bool is_busy(int fd, const std::string& worker_id);
+
+  // Give idle workers another chance to pick up a new task or a straggler.
+  // Runs at most once a second unless there are ready tasks a tenant under
+  // its cap can run.
+  void dispatch_idle();
+
+  // Tell a worker to stop the run of a task it was given with lease
+  void cancel_task(int fd, const std::string& task_name, uint64_t lease);
+
+  // Write a message to a worker, in a frame of its session if it has one.
+  // Returns -1 if the worker cannot be reached, like write()
+  int send_worker(int fd, const char* msg, uint32_t msg_len);
+
+  // Queue a frame on a multiplexed connection. Frames are written once
+  // the events at hand are handled, so the answers to a batch of messages
+  // of its sessions go out in one write.
+  int send_frame(int fd, uint32_t session, const char* msg, uint32_t msg_len);
+
+  // Write the frames queued on every multiplexed connection
+  void flush_all_mux();
+
+  // Write frames queued on a multiplexed connection. A short write keeps
+  // the rest instead of cutting a frame, to go out once the connection
+  // drains. Returns -1 if the connection failed
+  int flush_mux(int fd);
+
+  // Drop a session. The agent is told unless it closed the session itself.
+  void end_session(int handle);
+
+  // A multiplexed connection is closed. Its sessions are disconnected, and
+  // told to exit first if to_exit.
+  void close_mux(int fd, bool to_exit);
+
+  // Handle a frame of a multiplexed connection, the message of a session or
+  // the close of one. A session is opened by its first message.
+  void handle_mux_frame(int fd, const MuxFrame& frame);
+
+  // Disconnect a worker client. Tasks assigned to the worker are marked as
+  // TaskKilled, or kept until their lease runs out if the worker may come
+  // back. If to_exit tell worker to exit by sending the message with an
+  // empty task name.
+  void disconnect_client(int fd, bool to_exit);
+
+  // Dispatch a task to a worker. If there is an unfinished task previously
+  // assigned to the worker, and not running on this connection, redispatch
+  // it. Otherwise find a new task to dispatch. If no more new tasks tell the
+  // worker to exit, unless it is still busy with other tasks.
+  uint32_t dispatch_task(int fd);
+
+  // Check workers that may be slacking off. A task is considered stuck when
+  // its elapsed time passes the deadline learned by _timeout_model for its
+  // worker, unless its result is arriving. Returns milliseconds until the
+  // nearest deadline of a running task.
+  uint32_t check_slackers(uint64_t current_time);
+
+  int handle_timeout(bool is_timeout);
+
+  // Read everything available on a worker connection and handle every
+  // complete message. A worker may send several messages at once, e.g. the
+  // status of each of its tasks, and with edge triggered epoll they must all
+  // be consumed now. A partial message is kept until the rest arrives, except
+  // for the data of a result chunk, which goes from the socket to its file
+  // as it arrives.
+  uint32_t handle_client_input(int fd);
+
+  // Handle every complete message in the input buffer of a connection, and
+  // start on a result chunk with the part of it in the buffer. Returns 0 if
+  // the connection is closed.
+  uint32_t handle_client_buffer(int fd, std::string& buf);
+
+  // The run with lease on worker fd, nullptr if it is not current
+  Task* find_run(int fd, uint64_t lease);
+
+  // The upload a chunk at offset of the run with lease on worker fd belongs
+  // to, opened by the first chunk. Returns nullptr if the data is dropped,
+  // e.g. of a run that is fenced off, or if results are not kept.
+  ResultUpload* find_upload(int fd, uint64_t lease, uint64_t offset);
+
+  // Whether the result of the run with lease is arriving, which keeps the
+  // run from being taken for stuck
+  bool uploading(uint64_t lease, uint64_t now);
+
+  // Handle a result chunk of chunk_len bytes, the first avail of which are
+  // at chunk. The rest is received as it arrives.
+  void handle_result_chunk(int fd, const char* chunk, uint32_t avail,
+                           uint32_t chunk_len);
+
+  // Let the worker send another chunk. Acks to a connection go out in one
+  // write once its input is handled, and the worker sends no more than its
+  // window meanwhile, which bounds the result data taken in one go.
+  void ack_result(int fd, uint64_t lease);
+
+  // Write the acks queued on a connection. A short write keeps the rest,
+  // to go out once the connection drains. Returns -1 if the connection
+  // failed
+  int flush_result_acks(int fd);
+
+  uint32_t handle_client_message(int fd, const char* msg, uint32_t body_len);
+
+  // Drop the report of a run whose lease is not current, e.g. of a task
+  // taken from a worker whose lease ran out and given to another. The task
+  // is left as it is. A run still going is cancelled, a completion asks for
+  // the next task as usual.
+  uint32_t fence_off(int fd, const std::string& worker,
+                     const std::string& task_name, uint64_t lease,
+                     uint32_t time_left);
+
+  // State read by admin queries
+  const TaskCollection& tasks() const { return _tasks; }
+  const FairQueue& ready() const { return _ready; }
+  const std::set<std::string>& cyclic() const { return _cyclic; }
+  const std::map<std::string, std::set<Task*>>& assigned() const {
+    return _assigned;
+  }
+  const std::map<int, std::string>& workers() const { return _workers; }
+  const std::map<int, uint32_t>& idle() const { return _idle; }
+  const uint64_t* run_hist() const { return _run_hist; }
+  const std::map<int, uint64_t>& rx_cpus() const { return _rx_cpus; }
+
+  ControllerStats stats() const;
+
+  // Load new tasks now instead of at the next periodic fetch, e.g. after a
+  // bulk insert, and hand them to idle workers. Returns number of new
+  // tasks, or -1 if error, which shuts the controller down
+  int load_now();
+
+  virtual uint32_t handle_new_unix_connection(int fd);
+
+  virtual uint32_t handle_new_connection(int fd);
+
+  virtual uint32_t handle_connection(const epoll_event& ev);
+};
+
+}
+
+#endif
@@ -7,9 +7,10 @@
 #include <assert.h>
 #include <errno.h>
 #include <string.h>
-#include <unistd.h>
 #include "util.h"
 #include "task_db.h"
+#include "task_graph.h"
+#include "log_store.h"
 
 using namespace std;
 
@@ -19,6 +20,22 @@ using namespace std;
 
 namespace epoll_demo {
 
+// Milliseconds to wait for a lock held by another connection, e.g. a bulk
+// insert, before a statement fails
+static const int busy_timeout_ms = 5000;
+
+// Rows per insert statement of insert_tasks(). Each row takes 5 of the 999
+// host parameters older sqlite allows per statement.
+static const uint32_t insert_rows = 190;
+
+TaskStore* open_task_store(const char* path, FILE* log_file)
+{
+  if (LogStore::is_log(path)) {
+    return new LogStore(path, log_file);
+  }
+  return new Taskdb(path, log_file);
+}
+
 sqlite3* Taskdb::open_task_db()
 {
   sqlite3* db{nullptr};
@@ -28,12 +45,145 @@ sqlite3* Taskdb::open_task_db()
     sqlite3_close(db);
     return nullptr;
   }
+  sqlite3_busy_timeout(db, busy_timeout_ms);
   return db;
 }
 
-int Taskdb::fetch_tasks(TaskCollection& tasks)
+int Taskdb::check()
+{
+  sqlite3* db = open_task_db();
+  if (db == nullptr) {
+    return -1;
+  }
+  sqlite3_close(db);
+  return 0;
+}
+
+int Taskdb::init_schema()
+{
+  // demo_task_dep holds edges of the task DAG. A task is runnable only when
+  // every task it depends on has completed. The state index lets windowed
+  // loading skip completed tasks.
+  static const char* sql =
+    "create table if not exists demo_task_dep ("
+    "task_name text not null, depends_on text not null, "
+    "primary key (task_name, depends_on));"
+    "create index if not exists demo_task_dep_on "
+    "on demo_task_dep (depends_on);"
+    "create index if not exists demo_task_state on demo_task (state);";
+  // Command of a task and what it did, durations in milliseconds, the
+  // lease of the latest assignment, the tenant the task belongs to, NULL
+  // for the default tenant, and the file its worker streamed the output to,
+  // NULL if none. Older databases lack them.
+  static const char* columns[][2] = {
+    { "command", "text" },
+    { "exit_status", "integer" },
+    { "user_ms", "integer" },
+    { "sys_ms", "integer" },
+    { "max_rss_kb", "integer" },
+    { "sleep_ms", "integer" },
+    { "run_ms", "integer" },
+    { "lease", "integer" },
+    { "tenant", "text" },
+    { "result_file", "text" },
+  };
+  sqlite3* db = open_task_db();
+  if (db == nullptr) {
+    return -1;
+  }
+  char* err = nullptr;
+  int rc = sqlite3_exec(db, sql, nullptr, nullptr, &err);
+  if (rc != SQLITE_OK) {
+    LOG("Error: init schema: %s", err);
+    sqlite3_free(err);
+    sqlite3_close(db);
+    return -1;
+  }
+  for (auto column : columns) {
+    // Preparing a select of the column fails if it does not exist
+    string select = string("select ") + column[0] + " from demo_task";
+    sqlite3_stmt* stmt;
+    rc = sqlite3_prepare_v2(db, select.c_str(), -1, &stmt, 0);
+    sqlite3_finalize(stmt);
+    if (rc == SQLITE_OK) {
+      continue;
+    }
+    string alter = string("alter table demo_task add column ") +
+                   column[0] + " " + column[1];
+    rc = sqlite3_exec(db, alter.c_str(), nullptr, nullptr, &err);
+    if (rc != SQLITE_OK) {
+      LOG("Error: add column %s: %s", column[0], err);
+      sqlite3_free(err);
+      sqlite3_close(db);
+      return -1;
+    }
+  }
+  sqlite3_close(db);
+  return 0;
+}
+
+// Columns of a task row, in the order read by read_task()
+// sleep_ms takes precedence over sleep_time, which is in seconds
+#define TASK_COLUMNS \
+  "task_name, coalesce(sleep_ms, sleep_time * 1000), state, worker, " \
+  "assign_time, command, coalesce(lease, 0), " \
+  "coalesce(tenant, '" DEFAULT_TENANT "')"
+#define TASK_COLUMN_COUNT 8
+
+// Create a task from the current row of stmt, selected as TASK_COLUMNS
+static Task* read_task(sqlite3_stmt* stmt)
+{
+  Task* task = new Task();
+  task->task_name = (char*)sqlite3_column_text(stmt, 0);
+  task->sleep_ms = (uint32_t)sqlite3_column_int64(stmt, 1);
+  task->state = (TaskState)sqlite3_column_int(stmt, 2);
+  const char* worker = (const char*)sqlite3_column_text(stmt, 3);
+  task->worker = worker ? worker : "";
+  task->assign_time = (uint64_t)sqlite3_column_int64(stmt, 4);
+  const char* command = (const char*)sqlite3_column_text(stmt, 5);
+  task->command = command ? command : "";
+  task->lease = (uint64_t)sqlite3_column_int64(stmt, 6);
+  task->tenant = (char*)sqlite3_column_text(stmt, 7);
+  task->complete_time = 0;
+  task->backup_assign_time = 0;
+  return task;
+}
+
+// Run a query selecting TASK_COLUMNS, optionally followed by rowid, and
+// load the tasks not in tasks yet. The last rowid seen is stored in
+// last_rowid if given. Returns number of rows, or -1 if error
+int Taskdb::load_tasks(sqlite3* db, sqlite3_stmt* stmt, TaskCollection& tasks,
+                       vector<Task*>* new_tasks, int64_t* last_rowid,
+                       int& count)
+{
+  int rows = 0;
+  int rc = sqlite3_step(stmt);
+  while (rc == SQLITE_ROW) {
+    rows++;
+    if (last_rowid) {
+      *last_rowid = sqlite3_column_int64(stmt, TASK_COLUMN_COUNT);
+    }
+    const char* task_name = (const char*)sqlite3_column_text(stmt, 0);
+    if (tasks.find(task_name) == tasks.end()) {
+      Task* task = read_task(stmt);
+      tasks[task->task_name] = task;
+      if (new_tasks) {
+        new_tasks->push_back(task);
+      }
+      count++;
+    }
+    rc = sqlite3_step(stmt);
+  }
+  if (rc != SQLITE_DONE) {
+    LOG("Error: load tasks: %s", sqlite3_errmsg(db));
+    return -1;
+  }
+  return rows;
+}
+
+int Taskdb::query_tasks(const char* sql, TaskCollection& tasks,
+                        vector<Task*>* new_tasks, int64_t after_rowid)
 {
-  static const char* sql = "select * from demo_task where state != 3";
   sqlite3* db = open_task_db();
   if (db == nullptr) {
     return -1;
@@ -46,39 +196,345 @@ int Taskdb::fetch_tasks(TaskCollection& tasks)
     sqlite3_close(db);
     return -1;
   }
+  if (sqlite3_bind_parameter_count(stmt) > 0) {
+    sqlite3_bind_int64(stmt, 1, after_rowid);
+  }
   int count = 0;
+  rc = load_tasks(db, stmt, tasks, new_tasks, nullptr, count);
+  sqlite3_finalize(stmt);
+  sqlite3_close(db);
+  if (rc < 0) {
+    return -1;
+  }
+  LOG("Loaded %d new tasks, total count %d", count, (int)tasks.size());
+  return count;
+}
+
+int Taskdb::fetch_tasks(TaskCollection& tasks, vector<Task*>* new_tasks,
+                        int64_t after_rowid)
+{
+  static const char* sql =
+    "select " TASK_COLUMNS " from demo_task where state != 3 and rowid > ?";
+  return query_tasks(sql, tasks, new_tasks, after_rowid);
+}
+
+int Taskdb::fetch_running_tasks(TaskCollection& tasks,
+                                vector<Task*>* new_tasks)
+{
+  static const char* sql =
+    "select " TASK_COLUMNS " from demo_task where state = 1";
+  return query_tasks(sql, tasks, new_tasks, 0);
+}
+
+int64_t Taskdb::max_rowid()
+{
+  static const char* sql = "select max(rowid) from demo_task";
+  sqlite3* db = open_task_db();
+  if (db == nullptr) {
+    return -1;
+  }
+  sqlite3_stmt* stmt;
+  int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+  if (rc != SQLITE_OK) {
+    LOG("Error: prepare sql '%s': %s", sql, sqlite3_errmsg(db));
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+    return -1;
+  }
+  int64_t rowid = -1;
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    rowid = sqlite3_column_int64(stmt, 0);
+  }
+  sqlite3_finalize(stmt);
+  sqlite3_close(db);
+  return rowid;
+}
+
+int Taskdb::digest(int64_t max_rowid, TaskDigest& digest)
+{
+  // Running tasks are few. Waiting ones are only counted, from the (state,
+  // rowid) index.
+  static const char* sqls[] = {
+    "select count(*), coalesce(sum(lease), 0) from demo_task where state = 1",
+    "select count(*) from demo_task where state in (0, 2) and rowid <= ?"
+  };
+  sqlite3* db = open_task_db();
+  if (db == nullptr) {
+    return -1;
+  }
+  int r = 0;
+  for (int i = 0; i < 2 && r == 0; i++) {
+    sqlite3_stmt* stmt;
+    if (sqlite3_prepare_v2(db, sqls[i], -1, &stmt, 0) != SQLITE_OK) {
+      LOG("Error: prepare sql '%s': %s", sqls[i], sqlite3_errmsg(db));
+      sqlite3_finalize(stmt);
+      r = -1;
+      break;
+    }
+    if (i == 1) {
+      sqlite3_bind_int64(stmt, 1, max_rowid);
+    }
+    if (sqlite3_step(stmt) != SQLITE_ROW) {
+      LOG("Error: step sql '%s': %s", sqls[i], sqlite3_errmsg(db));
+      r = -1;
+    } else if (i == 0) {
+      digest.running = (uint64_t)sqlite3_column_int64(stmt, 0);
+      digest.lease_sum = (uint64_t)sqlite3_column_int64(stmt, 1);
+    } else {
+      digest.waiting = (uint64_t)sqlite3_column_int64(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+  }
+  sqlite3_close(db);
+  return r;
+}
+
+int Taskdb::fetch_task_window(TaskCollection& tasks, TaskWindow& window,
+                              uint32_t limit, vector<Task*>* new_tasks)
+{
+  // Walks the (state, rowid) index, so every call costs O(limit) no
+  // matter how large the backlog is
+  static const char* sql =
+    "select " TASK_COLUMNS ", rowid from demo_task "
+    "where state = ? and rowid > ? order by rowid limit ?";
+  sqlite3* db = open_task_db();
+  if (db == nullptr) {
+    return -1;
+  }
+  sqlite3_stmt* stmt;
+  int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+  if (rc != SQLITE_OK) {
+    LOG("Error: prepare sql '%s': %s", sql, sqlite3_errmsg(db));
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+    return -1;
+  }
+  // Tasks killed by a previous controller come first, then new tasks
+  int count = 0;
+  window.at_end = true;
+  TaskState states[] = { TaskKilled, TaskCreated };
+  int64_t* cursors[] = { &window.killed_rowid, &window.created_rowid };
+  for (int i = 0; i < 2 && count < (int)limit; i++) {
+    int room = (int)limit - count;
+    sqlite3_reset(stmt);
+    sqlite3_bind_int(stmt, 1, states[i]);
+    sqlite3_bind_int64(stmt, 2, *cursors[i]);
+    sqlite3_bind_int(stmt, 3, room);
+    int rows = load_tasks(db, stmt, tasks, new_tasks, cursors[i], count);
+    if (rows < 0) {
+      count = -1;
+      break;
+    }
+    // A full page may have more behind it, as may the states not read
+    if (rows == room) {
+      window.at_end = false;
+    }
+  }
+  sqlite3_finalize(stmt);
+  sqlite3_close(db);
+  if (count > 0) {
+    LOG("Loaded %d new tasks into window, total count %d",
+        count, (int)tasks.size());
+  }
+  return count;
+}
+
+int Taskdb::fetch_task(TaskCollection& tasks, const string& task_name,
+                       vector<Task*>* new_tasks)
+{
+  static const char* sql =
+    "select " TASK_COLUMNS " from demo_task "
+    "where task_name = ? and state != 3";
+  sqlite3* db = open_task_db();
+  if (db == nullptr) {
+    return -1;
+  }
+  sqlite3_stmt* stmt;
+  int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+  if (rc != SQLITE_OK) {
+    LOG("Error: prepare sql '%s': %s", sql, sqlite3_errmsg(db));
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+    return -1;
+  }
+  sqlite3_bind_text(stmt, 1, task_name.c_str(), -1, SQLITE_STATIC);
+  int count = 0;
+  rc = load_tasks(db, stmt, tasks, new_tasks, nullptr, count);
+  sqlite3_finalize(stmt);
+  sqlite3_close(db);
+  return rc < 0 ? -1 : count;
+}
+
+int Taskdb::fetch_dependencies(const vector<Task*>& new_tasks,
+                               TaskGraph& graph)
+{
+  static const char* sql =
+    "select d.depends_on from demo_task_dep d "
+    "join demo_task t on t.task_name = d.depends_on "
+    "where d.task_name = ? and t.state != 3";
+  static const char* any_sql = "select 1 from demo_task_dep limit 1";
+  if (new_tasks.empty()) {
+    return 0;
+  }
+  sqlite3* db = open_task_db();
+  if (db == nullptr) {
+    return -1;
+  }
+  sqlite3_stmt* stmt;
+  int rc = sqlite3_prepare_v2(db, any_sql, -1, &stmt, 0);
+  if (rc != SQLITE_OK) {
+    LOG("Error: prepare sql '%s': %s", any_sql, sqlite3_errmsg(db));
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+    return -1;
+  }
   rc = sqlite3_step(stmt);
-  while (rc == SQLITE_ROW) {
-    string task_name = (char*)sqlite3_column_text(stmt, 0);
-    if (tasks.find(task_name) == tasks.end()) {
-      Task* task = new Task();
-      task->task_name = task_name;
-      task->sleep_time = (uint32_t)sqlite3_column_int(stmt, 1);
-      task->state = (TaskState)sqlite3_column_int(stmt, 2);
-      task->worker = (char*)sqlite3_column_text(stmt, 3);
-      task->assign_time = (uint64_t)sqlite3_column_int64(stmt, 4);
-      task->complete_time = 0;
-      tasks[task->task_name] = task;
+  sqlite3_finalize(stmt);
+  if (rc != SQLITE_ROW) {
+    // no dependencies at all
+    sqlite3_close(db);
+    return 0;
+  }
+  rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+  if (rc != SQLITE_OK) {
+    LOG("Error: prepare sql '%s': %s", sql, sqlite3_errmsg(db));
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+    return -1;
+  }
+  // One primary key lookup per new task, so loading a window of tasks does
+  // not scan the whole dependency table
+  int count = 0;
+  for (auto t : new_tasks) {
+    sqlite3_reset(stmt);
+    sqlite3_bind_text(stmt, 1, t->task_name.c_str(), -1, SQLITE_STATIC);
+    rc = sqlite3_step(stmt);
+    while (rc == SQLITE_ROW) {
+      graph.add_edge(t->task_name, (char*)sqlite3_column_text(stmt, 0));
       count++;
+      rc = sqlite3_step(stmt);
     }
-    rc = sqlite3_step(stmt);
   }
   sqlite3_finalize(stmt);
   sqlite3_close(db);
-  LOG("Loaded %d new tasks, total count %d", count, (int)tasks.size());
+  if (count) {
+    LOG("Loaded %d task dependencies", count);
+  }
+  return count;
+}
+
+// Prepare an insert of rows tasks in one statement
+static sqlite3_stmt* prepare_insert(sqlite3* db, uint32_t rows)
+{
+  string sql = "insert or ignore into demo_task (task_name, sleep_time, "
+               "sleep_ms, command, tenant, state, worker, assign_time, "
+               "complete_time) values ";
+  for (uint32_t i = 0; i < rows; i++) {
+    sql += (i ? ", (?, ?, ?, ?, ?, 0, '', 0, 0)" :
+                "(?, ?, ?, ?, ?, 0, '', 0, 0)");
+  }
+  sqlite3_stmt* stmt = nullptr;
+  if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, 0) != SQLITE_OK) {
+    sqlite3_finalize(stmt);
+    return nullptr;
+  }
+  return stmt;
+}
+
+int Taskdb::insert_tasks(const vector<NewTask>& tasks)
+{
+  if (tasks.empty()) {
+    return 0;
+  }
+  sqlite3* db = open_task_db();
+  if (db == nullptr) {
+    return -1;
+  }
+  // Take the write lock up front, so the transaction cannot fail half way
+  // on a lock held by the controller
+  char* err = nullptr;
+  if (sqlite3_exec(db, "begin immediate", nullptr, nullptr, &err) !=
+      SQLITE_OK) {
+    LOG("Error: begin insert: %s", err);
+    sqlite3_free(err);
+    sqlite3_close(db);
+    return -1;
+  }
+  int count = 0;
+  sqlite3_stmt* full = nullptr;
+  size_t i = 0;
+  while (i < tasks.size()) {
+    uint32_t rows = (uint32_t)min(tasks.size() - i, (size_t)insert_rows);
+    sqlite3_stmt* stmt;
+    if (rows == insert_rows) {
+      if (full == nullptr) {
+        full = prepare_insert(db, rows);
+      }
+      stmt = full;
+    } else {
+      stmt = prepare_insert(db, rows);
+    }
+    if (stmt == nullptr) {
+      LOG("Error: prepare insert: %s", sqlite3_errmsg(db));
+      count = -1;
+      break;
+    }
+    for (uint32_t r = 0; r < rows; r++, i++) {
+      const NewTask& t = tasks[i];
+      sqlite3_bind_text(stmt, r * 5 + 1, t.task_name.c_str(),
+                        t.task_name.size(), SQLITE_STATIC);
+      sqlite3_bind_int64(stmt, r * 5 + 2, t.sleep_ms / 1000);
+      sqlite3_bind_int64(stmt, r * 5 + 3, t.sleep_ms);
+      if (t.command.empty()) {
+        sqlite3_bind_null(stmt, r * 5 + 4);
+      } else {
+        sqlite3_bind_text(stmt, r * 5 + 4, t.command.c_str(),
+                          t.command.size(), SQLITE_STATIC);
+      }
+      if (t.tenant.empty() || t.tenant == DEFAULT_TENANT) {
+        sqlite3_bind_null(stmt, r * 5 + 5);
+      } else {
+        sqlite3_bind_text(stmt, r * 5 + 5, t.tenant.c_str(),
+                          t.tenant.size(), SQLITE_STATIC);
+      }
+    }
+    int rc = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    if (stmt != full) {
+      sqlite3_finalize(stmt);
+    }
+    if (rc != SQLITE_DONE) {
+      LOG("Error: insert tasks: %s", sqlite3_errmsg(db));
+      count = -1;
+      break;
+    }
+    count += sqlite3_changes(db);
+  }
+  sqlite3_finalize(full);
+  const char* end = (count < 0 ? "rollback" : "commit");
+  if (sqlite3_exec(db, end, nullptr, nullptr, &err) != SQLITE_OK) {
+    LOG("Error: %s insert: %s", end, err);
+    sqlite3_free(err);
+    count = -1;
+  }
+  sqlite3_close(db);
   return count;
 }
 
 int Taskdb::update_task_db(const Task* task)
 {
+  // The lease of an assignment is written with it, once
   static const char* running_sql =
-    "update demo_task set state = 1, worker = ?, assign_time = ? "
+    "update demo_task set state = 1, worker = ?, assign_time = ?, lease = ? "
     "where task_name = ?";
   static const char* kill_sql =
     "update demo_task set state = 2 where task_name = ?";
+  // The winner of a speculative run may be the backup worker, so the
+  // completion also records who finished the task and when it started.
   static const char* complete_sql =
-    "update demo_task set state = 3, complete_time = ? "
-    "where task_name = ?";
+    "update demo_task set state = 3, worker = ?, assign_time = ?, "
+    "complete_time = ?, exit_status = ?, user_ms = ?, sys_ms = ?, "
+    "max_rss_kb = ?, run_ms = ?, result_file = ? where task_name = ?";
   sqlite3* db = open_task_db();
   if (db == nullptr) {
     return -1;
@@ -111,14 +567,28 @@ int Taskdb::update_task_db(const Task* task)
   case TaskRunning:
     sqlite3_bind_text(stmt, 1, task->worker.c_str(), -1, SQLITE_STATIC);
     sqlite3_bind_int64(stmt, 2, task->assign_time);
-    sqlite3_bind_text(stmt, 3, task->task_name.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 3, (int64_t)task->lease);
+    sqlite3_bind_text(stmt, 4, task->task_name.c_str(), -1, SQLITE_STATIC);
     break;
   case TaskKilled:
     sqlite3_bind_text(stmt, 1, task->task_name.c_str(), -1, SQLITE_STATIC);
     break;
   case TaskSuccess:
-    sqlite3_bind_int64(stmt, 1, task->complete_time);
-    sqlite3_bind_text(stmt, 2, task->task_name.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 1, task->worker.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, task->assign_time);
+    sqlite3_bind_int64(stmt, 3, task->complete_time);
+    sqlite3_bind_int(stmt, 4, task->result.exit_status);
+    sqlite3_bind_int64(stmt, 5, task->result.user_ms);
+    sqlite3_bind_int64(stmt, 6, task->result.sys_ms);
+    sqlite3_bind_int64(stmt, 7, task->result.max_rss_kb);
+    sqlite3_bind_int64(stmt, 8, task->result.run_ms);
+    if (task->result_file.empty()) {
+      sqlite3_bind_null(stmt, 9);
+    } else {
+      sqlite3_bind_text(stmt, 9, task->result_file.c_str(), -1,
+                        SQLITE_STATIC);
+    }
+    sqlite3_bind_text(stmt, 10, task->task_name.c_str(), -1, SQLITE_STATIC);
     break;
   default:
     // Should not hit here. Avoid compiler warning
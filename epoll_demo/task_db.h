@@ -10,9 +10,15 @@
 #include <stdio.h>
 #include <string>
 #include <map>
+#include <list>
+#include <vector>
+#include "util.h"
 
 namespace epoll_demo {
 
+// Tenant of tasks added without one
+#define DEFAULT_TENANT "default"
+
 enum TaskState {
   TaskCreated,
   TaskRunning,
@@ -22,17 +28,139 @@ enum TaskState {
 
 struct Task {
   std::string   task_name;
-  uint32_t      sleep_time;
+  uint32_t      sleep_ms;           // expected run time of a command
+  std::string   command;            // empty for a plain sleep
   TaskState     state;
   std::string   worker;
-  time_t        assign_time;
+  time_t        assign_time;        // wall clock, as in database
   time_t        complete_time;
+  uint64_t      assign_ms;          // monotonic, for deadlines
+  TaskResult    result;             // set on completion
+  std::string   result_file;        // output streamed by the worker, empty
+                                    // if none
+  std::string   backup_worker;      // speculative copy, empty if none
+  time_t        backup_assign_time;
+  uint64_t      backup_assign_ms;
+  int           fd;                 // connection running it, 0 if none
+  uint64_t      lease;              // fencing token of the assignment to
+                                    // worker, 0 if never assigned
+  uint64_t      backup_lease;       // of the assignment to backup_worker
+  uint64_t      lease_expiry_ms;    // monotonic, when the task is taken from
+                                    // a disconnected worker, 0 if connected
+  int           owner_fd;           // link to the shard it was stolen from,
+                                    // 0 for a task of this controller
+  uint64_t      owner_lease;        // lease the owner gave it with
+  std::string   tenant;             // whose share of the workers it uses
+  uint32_t      tenant_id;          // 1 + index in the fair queue, 0 if not
+                                    // looked up yet
+  bool          tenant_running;     // counted against the cap of its tenant
+  bool          queued;             // in the ready queue
+  uint64_t      ready_us;           // when queued, on the trace clock
+  std::list<Task*>::iterator ready_pos;
 };
 
 // task_name => task
 typedef std::map<std::string, Task*> TaskCollection;
 
-class Taskdb {
+class TaskGraph;
+
+// A task to be added to the task table
+struct NewTask {
+  std::string   task_name;
+  uint32_t      sleep_ms;
+  std::string   command;            // empty for a plain sleep
+  std::string   tenant;             // empty for the default tenant
+};
+
+// Summary of the unfinished tasks of a database, to tell whether a snapshot
+// of them still holds
+struct TaskDigest {
+  uint64_t running;     // running tasks
+  uint64_t lease_sum;   // sum of the leases of running tasks
+  uint64_t waiting;     // created or killed tasks
+
+  TaskDigest() : running(0), lease_sum(0), waiting(0) {}
+};
+
+// Position of windowed loading in the task table. Rows are loaded in rowid
+// order, separately for killed and created tasks.
+struct TaskWindow {
+  int64_t killed_rowid;
+  int64_t created_rowid;
+  bool    at_end;     // last fetch reached the end of the table
+
+  TaskWindow() : killed_rowid(0), created_rowid(0), at_end(false) {}
+};
+
+// Storage of tasks. Every task has a rowid, assigned in the order tasks are
+// added, that never changes. Taskdb keeps tasks in sqlite3, LogStore in an
+// append-only log.
+class TaskStore {
+public:
+  virtual ~TaskStore() {}
+
+  // Prepare the store for use, e.g. add optional tables and columns.
+  // Returns 0 for success, -1 for failure
+  virtual int init_schema() = 0;
+
+  // Returns 0 if the store can still be used, -1 if it is gone
+  virtual int check() = 0;
+
+  // Fetch unfinished tasks from database and load into tasks. Tasks not
+  // seen before are appended to new_tasks if given. If after_rowid is given
+  // only rows added after it are fetched.
+  // Returns number of new tasks loaded, or -1 if error
+  virtual int fetch_tasks(TaskCollection& tasks,
+                          std::vector<Task*>* new_tasks = nullptr,
+                          int64_t after_rowid = 0) = 0;
+
+  // Same as fetch_tasks() but only tasks in TaskRunning state
+  virtual int fetch_running_tasks(TaskCollection& tasks,
+                                  std::vector<Task*>* new_tasks) = 0;
+
+  // Largest rowid in the task table, 0 if empty, -1 if error
+  virtual int64_t max_rowid() = 0;
+
+  // Digest of the running tasks, and of the created or killed tasks up to
+  // max_rowid. Returns 0 for success, -1 for failure
+  virtual int digest(int64_t max_rowid, TaskDigest& digest) = 0;
+
+  // Fetch up to limit more killed or created tasks after the position of
+  // window, and advance it. Returns number of new tasks loaded, or -1 if
+  // error
+  virtual int fetch_task_window(TaskCollection& tasks, TaskWindow& window,
+                                uint32_t limit,
+                                std::vector<Task*>* new_tasks) = 0;
+
+  // Fetch a single unfinished task by name. Returns 1 if loaded, 0 if not
+  // found or already loaded, -1 if error
+  virtual int fetch_task(TaskCollection& tasks, const std::string& task_name,
+                         std::vector<Task*>* new_tasks) = 0;
+
+  // Load the unfinished dependencies of new_tasks into graph. Dependencies
+  // on completed tasks are already satisfied and skipped.
+  // Returns number of edges loaded, or -1 if error
+  virtual int fetch_dependencies(const std::vector<Task*>& new_tasks,
+                                 TaskGraph& graph) = 0;
+
+  // Add tasks in a single transaction. Tasks whose names are already in the
+  // table are skipped. Returns number of tasks added, or -1 if error, in
+  // which case none is added
+  virtual int insert_tasks(const std::vector<NewTask>& tasks) = 0;
+
+  // Update task information in database. Returns 0 for success
+  // -1 for failure
+  virtual int update_task_db(const Task* task) = 0;
+
+  // Periodic upkeep, e.g. compaction. Returns 0 for success, -1 for failure
+  virtual int maintain() { return 0; }
+};
+
+// Open the store in file path, a sqlite3 database or a task log, telling
+// them apart by content. Returns nullptr if the file is neither.
+TaskStore* open_task_store(const char* path, FILE* log_file);
+
+class Taskdb : public TaskStore {
 public:
   Taskdb(const char* db_file_name, FILE* log_file)
     : _db_name(db_file_name), _log_file(log_file)
@@ -44,15 +172,43 @@ public:
   // open a database 
   sqlite3* open_task_db();
 
-  // Fetch unfinished tasks from database and load into tasks
-  // Returns number of new tasks loaded, or -1 if error
-  int fetch_tasks(TaskCollection& tasks);
+  // Create tables and columns that are optional to the task database, such
+  // as the dependency table and the command columns.
+  int init_schema();
+
+  int check();
+
+  int fetch_tasks(TaskCollection& tasks,
+                  std::vector<Task*>* new_tasks = nullptr,
+                  int64_t after_rowid = 0);
+
+  int fetch_running_tasks(TaskCollection& tasks,
+                          std::vector<Task*>* new_tasks);
+
+  int64_t max_rowid();
+
+  int digest(int64_t max_rowid, TaskDigest& digest);
+
+  int fetch_task_window(TaskCollection& tasks, TaskWindow& window,
+                        uint32_t limit, std::vector<Task*>* new_tasks);
+
+  int fetch_task(TaskCollection& tasks, const std::string& task_name,
+                 std::vector<Task*>* new_tasks);
+
+  int fetch_dependencies(const std::vector<Task*>& new_tasks,
+                         TaskGraph& graph);
+
+  int insert_tasks(const std::vector<NewTask>& tasks);
 
-  // Update task information in database. Returns 0 for success
-  // -1 for failure
   int update_task_db(const Task* task);
 
 private:
+  int query_tasks(const char* sql, TaskCollection& tasks,
+                  std::vector<Task*>* new_tasks, int64_t after_rowid);
+  int load_tasks(sqlite3* db, sqlite3_stmt* stmt, TaskCollection& tasks,
+                 std::vector<Task*>* new_tasks, int64_t* last_rowid,
+                 int& count);
+
   std::string _db_name;
   FILE* _log_file;
 };
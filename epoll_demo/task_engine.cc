@@ -0,0 +1,204 @@
+//
+// Fred Xia (fxia@yahoo.com)
+//
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <algorithm>
+#include <chrono>
+#include "util.h"
+#include "task_engine.h"
+#include "trace.h"
+
+using namespace std;
+
+namespace epoll_demo {
+
+TaskJob::TaskJob(const string& name, uint32_t sleep)
+  : task_name(name), sleep_ms(sleep), start_ms(monotonic_ms()),
+    _cancelled(false), _end_ms(start_ms)
+{}
+
+void TaskJob::run()
+{
+  // steady_clock is CLOCK_MONOTONIC, the wait ends on the millisecond
+  // deadline counted from when the job was received
+  auto deadline = chrono::steady_clock::time_point(
+    chrono::milliseconds(start_ms + sleep_ms));
+  unique_lock<mutex> lock(_mutex);
+  _cond.wait_until(lock, deadline, [this] { return _cancelled.load(); });
+  _end_ms = monotonic_ms();
+}
+
+void TaskJob::cancel()
+{
+  lock_guard<mutex> lock(_mutex);
+  _cancelled = true;
+  _cond.notify_all();
+}
+
+uint32_t TaskJob::time_left() const
+{
+  uint64_t elapsed = monotonic_ms() - start_ms;
+  return (sleep_ms < elapsed ? 0 : sleep_ms - elapsed);
+}
+
+TaskEngine::TaskEngine(uint32_t num_threads)
+  : _num_threads(max(num_threads, 1u)), _event_fd(-1), _next_queue(0),
+    _queued(0), _stopping(false)
+{
+  for (uint32_t i = 0; i < _num_threads; i++) {
+    _queues.push_back(new WorkQueue());
+  }
+}
+
+TaskEngine::~TaskEngine()
+{
+  stop();
+  for (auto q : _queues) {
+    for (auto job : q->jobs) {
+      delete job;
+    }
+    delete q;
+  }
+  for (auto job : _done) {
+    delete job;
+  }
+  if (_event_fd >= 0) {
+    close(_event_fd);
+  }
+}
+
+int TaskEngine::start()
+{
+  _event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (_event_fd < 0) {
+    return -1;
+  }
+  for (uint32_t i = 0; i < _num_threads; i++) {
+    _threads.push_back(thread(&TaskEngine::thread_main, this, i));
+  }
+  return 0;
+}
+
+void TaskEngine::stop()
+{
+  {
+    lock_guard<mutex> lock(_idle_mutex);
+    if (_stopping && _threads.empty()) {
+      return;
+    }
+    _stopping = true;
+  }
+  {
+    lock_guard<mutex> lock(_done_mutex);
+    for (auto job : _running) {
+      job->cancel();
+    }
+  }
+  _idle_cond.notify_all();
+  for (auto& t : _threads) {
+    t.join();
+  }
+  _threads.clear();
+}
+
+void TaskEngine::submit(TaskJob* job)
+{
+  WorkQueue* q = _queues[_next_queue++ % _num_threads];
+  {
+    lock_guard<mutex> lock(q->mutex);
+    q->jobs.push_back(job);
+  }
+  {
+    lock_guard<mutex> lock(_idle_mutex);
+    _queued++;
+  }
+  _idle_cond.notify_one();
+}
+
+TaskJob* TaskEngine::next_job(uint32_t index)
+{
+  // Own queue first, newest job, then steal the oldest job of the others
+  WorkQueue* own = _queues[index];
+  {
+    lock_guard<mutex> lock(own->mutex);
+    if (!own->jobs.empty()) {
+      TaskJob* job = own->jobs.back();
+      own->jobs.pop_back();
+      return job;
+    }
+  }
+  for (uint32_t i = 1; i < _num_threads; i++) {
+    WorkQueue* q = _queues[(index + i) % _num_threads];
+    lock_guard<mutex> lock(q->mutex);
+    if (!q->jobs.empty()) {
+      TaskJob* job = q->jobs.front();
+      q->jobs.pop_front();
+      return job;
+    }
+  }
+  return nullptr;
+}
+
+void TaskEngine::thread_main(uint32_t index)
+{
+  while (true) {
+    {
+      unique_lock<mutex> lock(_idle_mutex);
+      _idle_cond.wait(lock, [this] { return _stopping || _queued > 0; });
+      if (_stopping) {
+        return;
+      }
+      _queued--;
+    }
+    // A job counted in _queued is in one of the queues
+    TaskJob* job = nullptr;
+    while (job == nullptr) {
+      job = next_job(index);
+    }
+    {
+      lock_guard<mutex> lock(_done_mutex);
+      _running.push_back(job);
+    }
+    // stop() may have cancelled the running jobs before this one was among
+    // them
+    bool stopping;
+    {
+      lock_guard<mutex> lock(_idle_mutex);
+      stopping = _stopping;
+    }
+    if (stopping) {
+      job->cancel();
+    }
+    uint64_t begin_us = trace_enabled() ? trace_now_us() : 0;
+    if (begin_us) {
+      // Jobs are created in milliseconds
+      trace_span("queued", job->task_name, job->start_ms * 1000, begin_us);
+    }
+    job->run();
+    if (begin_us) {
+      trace_span("run", job->task_name, begin_us);
+    }
+    {
+      lock_guard<mutex> lock(_done_mutex);
+      _running.erase(find(_running.begin(), _running.end(), job));
+      _done.push_back(job);
+    }
+    uint64_t one = 1;
+    ssize_t r = ::write(_event_fd, &one, sizeof(one));
+    (void)r;
+  }
+}
+
+void TaskEngine::completed(vector<TaskJob*>& jobs)
+{
+  uint64_t count;
+  ssize_t r = ::read(_event_fd, &count, sizeof(count));
+  (void)r;
+  lock_guard<mutex> lock(_done_mutex);
+  jobs.insert(jobs.end(), _done.begin(), _done.end());
+  _done.clear();
+}
+
+}
@@ -0,0 +1,107 @@
+#ifndef __task_engine_h__
+#define __task_engine_h__
+//
+// Fred Xia (fxia@yahoo.com)
+//
+
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+namespace epoll_demo {
+
+// A task payload run by TaskEngine. The default payload is the sleep of a
+// demo task, which can be cut short by cancel().
+class TaskJob {
+public:
+  TaskJob(const std::string& task_name, uint32_t sleep_ms);
+  virtual ~TaskJob() {}
+
+  // Run the payload on a pool thread
+  virtual void run();
+
+  // Ask a queued or running job to stop early
+  virtual void cancel();
+
+  bool cancelled() const { return _cancelled; }
+
+  // Milliseconds until the job is expected to finish
+  uint32_t time_left() const;
+
+  // Milliseconds the job ran, once it is finished
+  uint32_t run_ms() const { return _end_ms - start_ms; }
+
+  const std::string   task_name;
+  const uint32_t      sleep_ms;
+  const uint64_t      start_ms;     // monotonic
+
+protected:
+  std::atomic<bool>       _cancelled;
+  uint64_t                _end_ms;
+  std::mutex              _mutex;
+  std::condition_variable _cond;
+};
+
+// Work stealing thread pool running task payloads off the network thread.
+// Every pool thread has its own queue. A thread takes jobs from the back of
+// its own queue and steals from the front of the others when it runs dry.
+// Finished jobs are handed back through completed(), and event_fd() becomes
+// readable whenever there are finished jobs to collect.
+class TaskEngine {
+public:
+  TaskEngine(uint32_t num_threads);
+  ~TaskEngine();
+
+  // Create the event fd and start the pool threads. Returns 0 for success,
+  // -1 for failure
+  int start();
+
+  // Cancel every job and join the pool threads
+  void stop();
+
+  int event_fd() const { return _event_fd; }
+
+  // Queue a job. The engine owns it until it is returned by completed().
+  void submit(TaskJob* job);
+
+  // Move finished jobs, cancelled or not, into jobs. Called by the network
+  // thread once event_fd() is readable.
+  void completed(std::vector<TaskJob*>& jobs);
+
+  uint32_t num_threads() const { return _num_threads; }
+
+private:
+  struct WorkQueue {
+    std::mutex            mutex;
+    std::deque<TaskJob*>  jobs;
+  };
+
+  void thread_main(uint32_t index);
+  TaskJob* next_job(uint32_t index);
+
+  uint32_t _num_threads;
+  int _event_fd;
+  std::vector<std::thread> _threads;
+  std::vector<WorkQueue*> _queues;
+  std::atomic<uint32_t> _next_queue;  // round robin submit target
+
+  // Idle threads wait here for new jobs
+  std::mutex _idle_mutex;
+  std::condition_variable _idle_cond;
+  uint32_t _queued;                   // jobs not taken yet
+  bool _stopping;
+
+  std::mutex _done_mutex;
+  std::vector<TaskJob*> _done;
+  std::vector<TaskJob*> _running;     // guarded by _done_mutex
+};
+
+}
+
+#endif
@@ -0,0 +1,127 @@
+//
+// Fred Xia (fxia@yahoo.com)
+//
+#include "task_graph.h"
+
+using namespace std;
+
+namespace epoll_demo {
+
+uint32_t TaskGraph::node_id(const string& task)
+{
+  auto it = _ids.find(task);
+  if (it != _ids.end()) {
+    return it->second;
+  }
+  uint32_t id;
+  if (!_free.empty()) {
+    id = _free.back();
+    _free.pop_back();
+    _names[id] = task;
+  } else {
+    id = (uint32_t)_nodes.size();
+    _nodes.push_back(Node());
+    _names.push_back(task);
+  }
+  _ids[task] = id;
+  return id;
+}
+
+void TaskGraph::add_edge(const string& task, const string& depends_on)
+{
+  uint32_t from = node_id(depends_on);
+  uint32_t to = node_id(task);
+  _nodes[from].dependents.push_back(to);
+  _nodes[to].pending++;
+  _edges++;
+}
+
+uint32_t TaskGraph::pending(const string& task) const
+{
+  auto it = _ids.find(task);
+  return it == _ids.end() ? 0 : _nodes[it->second].pending;
+}
+
+void TaskGraph::complete(const string& task, vector<string>& ready)
+{
+  auto it = _ids.find(task);
+  if (it == _ids.end()) {
+    return;
+  }
+  uint32_t done = it->second;
+  Node& node = _nodes[done];
+  for (uint32_t id : node.dependents) {
+    if (--_nodes[id].pending == 0) {
+      ready.push_back(_names[id]);
+    }
+  }
+  _edges -= node.dependents.size();
+  vector<uint32_t>().swap(node.dependents);
+  // The node is reused for a later task, a late edge to a completed task is
+  // not expected since those are filtered on load. A node still waiting on
+  // others stays, their out edges point to it.
+  if (node.pending == 0) {
+    _ids.erase(it);
+    string().swap(_names[done]);
+    _free.push_back(done);
+  }
+}
+
+void TaskGraph::find_stuck(vector<string>& stuck) const
+{
+  // Peel off every task that can still run, as completing them in
+  // dependency order would. Tasks left keep a pending count for good.
+  vector<uint32_t> pending(_nodes.size(), 0);
+  vector<uint32_t> runnable;
+  for (auto& it : _ids) {
+    pending[it.second] = _nodes[it.second].pending;
+    if (pending[it.second] == 0) {
+      runnable.push_back(it.second);
+    }
+  }
+  while (!runnable.empty()) {
+    uint32_t id = runnable.back();
+    runnable.pop_back();
+    for (uint32_t dependent : _nodes[id].dependents) {
+      if (--pending[dependent] == 0) {
+        runnable.push_back(dependent);
+      }
+    }
+  }
+  for (auto& it : _ids) {
+    if (pending[it.second] > 0) {
+      stuck.push_back(it.first);
+    }
+  }
+}
+
+void ReadyQueue::push(Task* t)
+{
+  if (t->queued) {
+    return;
+  }
+  t->ready_pos = _queue.insert(_queue.end(), t);
+  t->queued = true;
+}
+
+Task* ReadyQueue::pop()
+{
+  if (_queue.empty()) {
+    return nullptr;
+  }
+  Task* t = _queue.front();
+  _queue.pop_front();
+  t->queued = false;
+  return t;
+}
+
+void ReadyQueue::remove(Task* t)
+{
+  if (!t->queued) {
+    return;
+  }
+  _queue.erase(t->ready_pos);
+  t->queued = false;
+}
+
+}
@@ -0,0 +1,80 @@
+#ifndef __task_graph_h__
+#define __task_graph_h__
+//
+// Fred Xia (fxia@yahoo.com)
+//
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include "task_db.h"
+
+namespace epoll_demo {
+
+// Dependency graph of tasks. Keeps for every task the number of unfinished
+// tasks it depends on, so completing a task only touches its out edges.
+// Tasks are referenced by name and need not be loaded in memory.
+class TaskGraph {
+public:
+  TaskGraph() : _edges(0) {}
+
+  // Record that task cannot run before depends_on completes
+  void add_edge(const std::string& task, const std::string& depends_on);
+
+  // Number of unfinished tasks that task depends on
+  uint32_t pending(const std::string& task) const;
+
+  // Mark task as completed. Dependents that have no more pending
+  // dependencies are appended to ready.
+  void complete(const std::string& task, std::vector<std::string>& ready);
+
+  // Append to stuck the tasks that can never run, since they wait on
+  // themselves through a cycle, or on a task that does
+  void find_stuck(std::vector<std::string>& stuck) const;
+
+  size_t edge_count() const { return _edges; }
+  size_t node_count() const { return _ids.size(); }
+
+private:
+  struct Node {
+    uint32_t              pending;
+    std::vector<uint32_t> dependents;
+    Node() : pending(0) {}
+  };
+
+  uint32_t node_id(const std::string& task);
+
+  std::unordered_map<std::string, uint32_t> _ids;
+  std::vector<Node> _nodes;
+  std::vector<std::string> _names; // node id => task name
+  std::vector<uint32_t> _free;     // ids of completed nodes, for reuse
+  size_t _edges;
+};
+
+// FIFO of tasks ready for dispatch. A queued task can be removed in O(1),
+// e.g. when it is redispatched to its previous worker.
+class ReadyQueue {
+public:
+  // Append a task. No-op if already queued.
+  void push(Task* t);
+
+  // Remove and return the first task, nullptr if empty
+  Task* pop();
+
+  // Remove a task if queued
+  void remove(Task* t);
+
+  size_t size() const { return _queue.size(); }
+
+  // Queued tasks in dispatch order
+  const std::list<Task*>& tasks() const { return _queue; }
+
+private:
+  std::list<Task*> _queue;
+};
+
+}
+
+#endif
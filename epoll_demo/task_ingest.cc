@@ -0,0 +1,383 @@
+//
+// Fred Xia (fxia@yahoo.com)
+//
+// Bulk insert of tasks into the task database. Tasks are read from a file
+// or stdin, one per line:
+//
+//   <task name> <sleep ms> [<command>]
+//
+// and written in large transactions of multi-row inserts. A running
+// controller can be told over its admin socket to load every batch as soon
+// as it is committed. For a cluster of controllers with a database per
+// shard every task goes to the database of the shard owning it. Tasks can
+// be added for a tenant, to share the workers with other tenants as the
+// controller is configured to.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sqlite3.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "util.h"
+#include "task_db.h"
+#include "log_store.h"
+#include "shard.h"
+
+using namespace std;
+using namespace epoll_demo;
+
+static double now_sec()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Create the task table if the database is new, and the optional columns
+// the inserts use. Returns 0 for success, -1 for failure
+static int prepare_db(const char* db_name)
+{
+  sqlite3* db;
+  if (sqlite3_open(db_name, &db) != SQLITE_OK) {
+    fprintf(stderr, "Cannot open database %s: %s\n", db_name,
+            sqlite3_errmsg(db));
+    sqlite3_close(db);
+    return -1;
+  }
+  sqlite3_busy_timeout(db, 5000);
+  // A new database gets incremental auto vacuum, see archive.h
+  char* err = nullptr;
+  int rc = sqlite3_exec(db,
+                        "pragma auto_vacuum = incremental;"
+                        "create table if not exists demo_task ("
+                        "task_name text primary key, sleep_time integer, "
+                        "state integer, worker text, assign_time integer, "
+                        "complete_time integer)", nullptr, nullptr, &err);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Cannot create task table: %s\n", err);
+    sqlite3_free(err);
+  }
+  sqlite3_close(db);
+  Taskdb task_db(db_name, stderr);
+  if (rc != SQLITE_OK || task_db.init_schema() < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+// Create a task log if asked to and the file does not exist, and prepare a
+// sqlite3 database. Returns the store, or nullptr for failure
+static TaskStore* open_store(const char* db_name, bool task_log)
+{
+  struct stat st;
+  if (task_log && stat(db_name, &st) < 0 && LogStore::create(db_name) < 0) {
+    fprintf(stderr, "Cannot create task log %s: %s\n", db_name,
+            strerror(errno));
+    return nullptr;
+  }
+  if (!LogStore::is_log(db_name) && prepare_db(db_name) < 0) {
+    return nullptr;
+  }
+  return open_task_store(db_name, stderr);
+}
+
+// Connect to the admin socket of a controller. Returns the socket, or -1
+static int connect_admin(const char* path)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path too long: %s\n", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    fprintf(stderr, "Cannot connect to %s: %s\n", path, strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  return fd;
+}
+
+// Ask the controller to load new tasks and wait for its answer. Returns 0
+// for success, -1 if the controller is gone
+static int notify_controller(int fd, bool verbose)
+{
+  static const char cmd[] = "load\n";
+  if (send(fd, cmd, sizeof(cmd) - 1, MSG_NOSIGNAL) != sizeof(cmd) - 1) {
+    return -1;
+  }
+  string reply;
+  char c;
+  while (true) {
+    ssize_t r = read(fd, &c, 1);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r <= 0) {
+      return -1;
+    }
+    if (c == '\n') {
+      break;
+    }
+    reply.push_back(c);
+  }
+  if (verbose) {
+    fprintf(stderr, "Controller: %s\n", reply.c_str());
+  }
+  return 0;
+}
+
+// Parse a task line. Returns 1 for a task, 0 for a blank or comment line,
+// -1 if the line is not valid
+static int parse_task(char* line, NewTask& task)
+{
+  size_t len = strlen(line);
+  while (len && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+    line[--len] = '\0';
+  }
+  char* p = line + strspn(line, " \t");
+  if (*p == '\0' || *p == '#') {
+    return 0;
+  }
+  size_t name_len = strcspn(p, " \t");
+  if (name_len > MAX_TASK_NAME_LEN) {
+    return -1;
+  }
+  task.task_name.assign(p, name_len);
+  p += name_len;
+  p += strspn(p, " \t");
+  char* end;
+  errno = 0;
+  unsigned long sleep_ms = strtoul(p, &end, 10);
+  if (end == p || errno || sleep_ms >= CANCEL_SLEEP_TIME ||
+      (*end && *end != ' ' && *end != '\t')) {
+    return -1;
+  }
+  task.sleep_ms = (uint32_t)sleep_ms;
+  p = end + strspn(end, " \t");
+  if (strlen(p) > MAX_COMMAND_LEN) {
+    return -1;
+  }
+  task.command = p;
+  return 1;
+}
+
+static const char* usage =
+  "Usage:\n"
+  "\ttask_ingest -d <database> [-L] [-f <file>] [-b <batch>] [-A <socket>]\n"
+  "\ttask_ingest -d <database> [-L] -g <count> [-t <ms>] [-b <batch>]\n"
+  "\t\t[-A <socket>]\n"
+  "\ttask_ingest -C <cluster> [-d <database>] [-L] [-f <file>] [-g <count>]\n"
+  "\t-d <database> : Task database file, created if it does not exist\n"
+  "\t[-C <cluster>] : Add every task to the database of the shard of the\n"
+  "\t\tcontrollers in file <cluster> it hashes to. Shards without a\n"
+  "\t\tdatabase in the file use <database>\n"
+  "\t[-L] : Create a task log instead of a sqlite3 database\n"
+  "\t[-f <file>] : Read tasks from <file> instead of stdin, one per line as\n"
+  "\t\t<task name> <sleep ms> [<command>]\n"
+  "\t[-g <count>] : Generate <count> tasks named task_<n> instead\n"
+  "\t[-t <ms>] : Generated tasks sleep up to <ms>, default 0\n"
+  "\t[-b <batch>] : Tasks per transaction, default 50000\n"
+  "\t[-T <tenant>] : Add the tasks for tenant <tenant>, default " DEFAULT_TENANT
+  "\n"
+  "\t[-A <socket>] : Have the controller with admin socket <socket> load\n"
+  "\t\tevery batch once it is committed\n"
+  "\t[-v] : Print the answers of the controller\n";
+
+int main(int argc, char** argv)
+{
+  char ch;
+  const char* db_name = nullptr;
+  const char* input = nullptr;
+  const char* admin_path = nullptr;
+  uint64_t generate = 0;
+  uint32_t max_sleep_ms = 0;
+  uint32_t batch_size = 50000;
+  bool verbose = false;
+  bool task_log = false;
+  const char* cluster_path = nullptr;
+  string tenant;
+  while ((ch = getopt(argc, argv, "hvLd:f:g:t:b:A:C:T:")) > 0) {
+    switch (ch) {
+    case 'd':
+      db_name = optarg;
+      break;
+    case 'f':
+      input = optarg;
+      break;
+    case 'g':
+      generate = strtoull(optarg, nullptr, 10);
+      break;
+    case 't':
+      max_sleep_ms = (uint32_t)atoi(optarg);
+      break;
+    case 'b':
+      batch_size = max(atoi(optarg), 1);
+      break;
+    case 'A':
+      admin_path = optarg;
+      break;
+    case 'v':
+      verbose = true;
+      break;
+    case 'L':
+      task_log = true;
+      break;
+    case 'C':
+      cluster_path = optarg;
+      break;
+    case 'T':
+      tenant = optarg;
+      break;
+    default:
+      printf(usage);
+      exit(ch == 'h' ? 0 : 1);
+    }
+  }
+  if ((db_name == nullptr && cluster_path == nullptr) || (input && generate) ||
+      tenant.size() >= MAX_TASK_NAME_LEN) {
+    printf("Invalid arguments\n");
+    printf(usage);
+    exit(1);
+  }
+  FILE* in = stdin;
+  if (input && (in = fopen(input, "r")) == nullptr) {
+    fprintf(stderr, "Cannot open %s: %s\n", input, strerror(errno));
+    exit(1);
+  }
+  // A store per database. Without a cluster there is one shard, owning
+  // every task.
+  ShardRing ring;
+  vector<string> paths;
+  vector<uint32_t> shard_store;     // shard => index in paths
+  if (cluster_path && ring.load(cluster_path, stderr) < 0) {
+    exit(1);
+  }
+  for (uint32_t i = 0; i < max(ring.shards().size(), (size_t)1); i++) {
+    string path = db_name ? db_name : "";
+    if (cluster_path && !ring.shards()[i].database.empty()) {
+      path = ring.shards()[i].database;
+    }
+    if (path.empty()) {
+      fprintf(stderr, "No database for shard %s\n",
+              ring.shards()[i].name.c_str());
+      exit(1);
+    }
+    size_t k = find(paths.begin(), paths.end(), path) - paths.begin();
+    if (k == paths.size()) {
+      paths.push_back(path);
+    }
+    shard_store.push_back(k);
+  }
+  vector<TaskStore*> stores;
+  for (auto& path : paths) {
+    TaskStore* store = open_store(path.c_str(), task_log);
+    if (store == nullptr) {
+      exit(1);
+    }
+    stores.push_back(store);
+  }
+  int admin_fd = -1;
+  if (admin_path && (admin_fd = connect_admin(admin_path)) < 0) {
+    exit(1);
+  }
+  vector<NewTask> batch(batch_size);
+  vector<vector<NewTask>> parts(stores.size());
+  uint64_t read_count = 0, added = 0, line_no = 0, invalid = 0;
+  char* line = nullptr;
+  size_t line_cap = 0;
+  double start = now_sec();
+  bool done = false;
+  srand(time(0));
+  while (!done) {
+    // Fill a batch, reusing the strings of the previous one
+    uint32_t n = 0;
+    while (n < batch_size) {
+      NewTask& t = batch[n];
+      if (generate) {
+        if (read_count == generate) {
+          done = true;
+          break;
+        }
+        t.task_name = "task_" + to_string(read_count);
+        t.sleep_ms = max_sleep_ms ? rand() % (max_sleep_ms + 1) : 0;
+        t.command.clear();
+      } else {
+        if (getline(&line, &line_cap, in) < 0) {
+          done = true;
+          break;
+        }
+        line_no++;
+        int r = parse_task(line, t);
+        if (r <= 0) {
+          if (r < 0) {
+            fprintf(stderr, "Invalid task at line %lu\n",
+                    (unsigned long)line_no);
+            invalid++;
+          }
+          continue;
+        }
+      }
+      t.tenant = tenant;
+      read_count++;
+      n++;
+    }
+    if (n == 0) {
+      break;
+    }
+    batch.resize(n);
+    int r = 0;
+    if (stores.size() == 1) {
+      r = stores[0]->insert_tasks(batch);
+    } else {
+      for (auto& t : batch) {
+        parts[shard_store[ring.owner(t.task_name)]].push_back(t);
+      }
+      for (uint32_t k = 0; k < stores.size() && r >= 0; k++) {
+        int count = stores[k]->insert_tasks(parts[k]);
+        r = (count < 0 ? -1 : r + count);
+        parts[k].clear();
+      }
+    }
+    batch.resize(batch_size);
+    if (r < 0) {
+      fprintf(stderr, "Insert failed after %lu tasks\n",
+              (unsigned long)added);
+      exit(1);
+    }
+    added += r;
+    if (admin_fd >= 0 && notify_controller(admin_fd, verbose) < 0) {
+      // Tasks are in the database and loaded by the next periodic fetch
+      fprintf(stderr, "Controller is gone, no longer notified\n");
+      close(admin_fd);
+      admin_fd = -1;
+    }
+  }
+  double sec = max(now_sec() - start, 1e-9);
+  printf("Added %lu tasks, %lu already present, %lu invalid lines in "
+         "%.2f seconds, %.0f tasks/s\n", (unsigned long)added,
+         (unsigned long)(read_count - added), (unsigned long)invalid, sec,
+         added / sec);
+  free(line);
+  for (auto store : stores) {
+    delete store;
+  }
+  if (admin_fd >= 0) {
+    close(admin_fd);
+  }
+  return invalid ? 1 : 0;
+}
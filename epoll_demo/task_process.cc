@@ -0,0 +1,274 @@
+//
+// Fred Xia (fxia@yahoo.com)
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <vector>
+#include <algorithm>
+#include "task_process.h"
+
+extern char** environ;
+
+using namespace std;
+
+namespace epoll_demo {
+
+// Exit status reported when the command cannot be started, as a shell does
+static const int32_t spawn_failed_status = 127;
+
+// Exit status reported when the status of the command is lost
+static const int32_t reap_failed_status = -1;
+
+static int open_pidfd(pid_t pid)
+{
+  return syscall(SYS_pidfd_open, pid, 0);
+}
+
+// Sink for output beyond MAX_SPOOL_SIZE
+static int null_fd()
+{
+  static int fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  return fd;
+}
+
+// A command without shell syntax is split on blanks and run directly,
+// which saves starting a shell for every task
+static bool needs_shell(const string& command)
+{
+  return command.find_first_of("|&;<>()$`\\\"'*?[]#~=%{}\n") != string::npos;
+}
+
+static vector<string> split_command(const string& command)
+{
+  vector<string> args;
+  size_t pos = command.find_first_not_of(" \t");
+  while (pos != string::npos) {
+    size_t end = command.find_first_of(" \t", pos);
+    args.push_back(command.substr(pos, end - pos));
+    pos = command.find_first_not_of(" \t", end);
+  }
+  return args;
+}
+
+TaskProcess::TaskProcess(const string& task_name, uint32_t sleep_ms,
+                         const string& command, const string& spool_dir,
+                         const string& spool_tag, uint64_t max_out)
+  : task_name(task_name), sleep_ms(sleep_ms), command(command),
+    start_ms(monotonic_ms()), _pid(0), _pid_fd(-1), _out_fd(-1), _err_fd(-1),
+    _out_spool(-1), _err_spool(-1), _max_out(max_out), _out_size(0),
+    _err_size(0),
+    _cancelled(false)
+{
+  string name = task_name + "." + spool_tag;
+  replace(name.begin(), name.end(), '/', '_');
+  _spool_path = spool_dir + "/" + name;
+  memset(&_result, 0, sizeof(_result));
+}
+
+TaskProcess::~TaskProcess()
+{
+  if (_pid) {
+    kill(-_pid, SIGKILL);
+    waitpid(_pid, nullptr, 0);
+  }
+  int* fds[] = { &_pid_fd, &_out_fd, &_err_fd, &_out_spool, &_err_spool };
+  for (int* fd : fds) {
+    if (*fd >= 0) {
+      close(*fd);
+    }
+  }
+}
+
+void TaskProcess::remove_spool(const string& spool_path)
+{
+  unlink((spool_path + ".out").c_str());
+  unlink((spool_path + ".err").c_str());
+}
+
+int TaskProcess::open_spool(const char* suffix)
+{
+  string path = _spool_path + suffix;
+  return open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+}
+
+int TaskProcess::spawn()
+{
+  _result.exit_status = spawn_failed_status;
+  _out_spool = open_spool(".out");
+  _err_spool = open_spool(".err");
+  if (_out_spool < 0 || _err_spool < 0) {
+    return -1;
+  }
+  // Only the read ends are non-blocking, the command writes as usual
+  int out_pipe[2], err_pipe[2];
+  if (pipe2(out_pipe, O_CLOEXEC) < 0) {
+    return -1;
+  }
+  if (pipe2(err_pipe, O_CLOEXEC) < 0) {
+    close(out_pipe[0]);
+    close(out_pipe[1]);
+    return -1;
+  }
+  _out_fd = out_pipe[0];
+  _err_fd = err_pipe[0];
+  set_fd_non_block(_out_fd);
+  set_fd_non_block(_err_fd);
+
+  vector<string> args;
+  if (needs_shell(command)) {
+    args.push_back("/bin/sh");
+    args.push_back("-c");
+    args.push_back(command);
+  } else {
+    args = split_command(command);
+  }
+  if (args.empty()) {
+    close(out_pipe[1]);
+    close(err_pipe[1]);
+    return -1;
+  }
+  vector<char*> argv;
+  for (auto& arg : args) {
+    argv.push_back((char*)arg.c_str());
+  }
+  argv.push_back(nullptr);
+
+  // posix_spawn() uses vfork semantics, so starting a command does not
+  // copy the page tables of the worker
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+  posix_spawn_file_actions_adddup2(&actions, out_pipe[1], 1);
+  posix_spawn_file_actions_adddup2(&actions, err_pipe[1], 2);
+  // Own process group, so a cancel also kills what the command started
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  sigset_t mask, defaults;
+  sigemptyset(&mask);
+  sigemptyset(&defaults);
+  sigaddset(&defaults, SIGPIPE);
+  posix_spawnattr_setsigmask(&attr, &mask);
+  posix_spawnattr_setsigdefault(&attr, &defaults);
+  posix_spawnattr_setpgroup(&attr, 0);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK |
+                           POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP);
+  int r = posix_spawnp(&_pid, argv[0], &actions, &attr, argv.data(),
+                       environ);
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&actions);
+  close(out_pipe[1]);
+  close(err_pipe[1]);
+  if (r != 0) {
+    _pid = 0;
+    errno = r;
+    return -1;
+  }
+  // A pidfd stays valid until the child is reaped, so it can be opened
+  // even if the command has already exited
+  _pid_fd = open_pidfd(_pid);
+  if (_pid_fd < 0) {
+    return -1;
+  }
+  _result.exit_status = 0;
+  return 0;
+}
+
+int TaskProcess::drain(int fd)
+{
+  bool is_out = (fd == _out_fd);
+  int spool = is_out ? _out_spool : _err_spool;
+  uint64_t& spooled = is_out ? _out_size : _err_size;
+  uint64_t max_size = is_out ? _max_out : MAX_SPOOL_SIZE;
+  while (true) {
+    size_t len = 1 << 16;
+    int dst = spool;
+    if (spooled >= max_size) {
+      dst = null_fd();
+    } else {
+      len = min(len, (size_t)(max_size - spooled));
+    }
+    ssize_t n = splice(fd, nullptr, dst, nullptr, len,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n > 0) {
+      if (dst == spool) {
+        spooled += n;
+      }
+      continue;
+    }
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && errno == EAGAIN) {
+      return 0;
+    }
+    close(fd);
+    (is_out ? _out_fd : _err_fd) = -1;
+    return n == 0 ? 1 : -1;
+  }
+}
+
+int TaskProcess::reap()
+{
+  if (_pid == 0) {
+    return -1;
+  }
+  int status;
+  struct rusage usage;
+  pid_t r = wait4(_pid, &status, WNOHANG, &usage);
+  if (r == 0) {
+    return 0;
+  }
+  if (r < 0) {
+    if (errno == EINTR) {
+      // The pidfd stays readable, the next event tries again
+      return 0;
+    }
+    // The command is over but its status is lost, e.g. the child was
+    // reaped elsewhere
+    int saved_errno = errno;
+    _pid = 0;
+    _result.run_ms = monotonic_ms() - start_ms;
+    _result.exit_status = reap_failed_status;
+    errno = saved_errno;
+    return -1;
+  }
+  _pid = 0;
+  _result.run_ms = monotonic_ms() - start_ms;
+  if (WIFEXITED(status)) {
+    _result.exit_status = WEXITSTATUS(status);
+  } else if (WIFSIGNALED(status)) {
+    _result.exit_status = 128 + WTERMSIG(status);
+  }
+  _result.user_ms = usage.ru_utime.tv_sec * 1000 +
+                    usage.ru_utime.tv_usec / 1000;
+  _result.sys_ms = usage.ru_stime.tv_sec * 1000 +
+                   usage.ru_stime.tv_usec / 1000;
+  _result.max_rss_kb = usage.ru_maxrss;
+  return 1;
+}
+
+void TaskProcess::cancel()
+{
+  _cancelled = true;
+  if (_pid) {
+    // The process group cannot be reused before the child is reaped
+    kill(-_pid, SIGKILL);
+  }
+}
+
+uint32_t TaskProcess::time_left() const
+{
+  uint64_t elapsed = monotonic_ms() - start_ms;
+  return elapsed >= sleep_ms ? 0 : sleep_ms - elapsed;
+}
+
+}
@@ -0,0 +1,92 @@
+#ifndef __task_process_h__
+#define __task_process_h__
+//
+// Fred Xia (fxia@yahoo.com)
+//
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <string>
+#include "util.h"
+
+namespace epoll_demo {
+
+// Largest output kept in a spool file, per stream. The rest is discarded.
+#define MAX_SPOOL_SIZE      (1 << 20)
+
+// The command of a task run as a child process of the worker. The child is
+// watched through a pidfd and its stdout and stderr pipes, all of which the
+// worker adds to its epoll set. Output is moved from the pipes into spool
+// files with splice(), so it is never copied through the worker.
+class TaskProcess {
+public:
+  // Output is spooled to <spool_dir>/<task_name>.<spool_tag>.out and .err,
+  // the tag telling runs of the same task apart. Output on stdout beyond
+  // max_out is discarded, on stderr beyond MAX_SPOOL_SIZE
+  TaskProcess(const std::string& task_name, uint32_t sleep_ms,
+              const std::string& command, const std::string& spool_dir,
+              const std::string& spool_tag,
+              uint64_t max_out = MAX_SPOOL_SIZE);
+  ~TaskProcess();
+
+  // Start the command. Returns 0 for success, -1 for failure, in which case
+  // the result tells why.
+  int spawn();
+
+  // Move what is available on a pipe to its spool file. Returns 1 once the
+  // pipe is at end of file and closed, 0 if more may come, -1 if error
+  int drain(int fd);
+
+  // Collect exit status and resource usage once the process has exited.
+  // Returns 1 if reaped, 0 if still running, -1 if error, after which the
+  // command is over with exit status -1
+  int reap();
+
+  // Kill the command
+  void cancel();
+
+  bool cancelled() const { return _cancelled; }
+
+  // Milliseconds until the command is expected to finish
+  uint32_t time_left() const;
+
+  int pid_fd() const { return _pid_fd; }
+  int out_fd() const { return _out_fd; }
+  int err_fd() const { return _err_fd; }
+  const TaskResult& result() const { return _result; }
+
+  // Spool file of stdout
+  std::string out_path() const { return _spool_path + ".out"; }
+
+  // Spool files without their suffix
+  const std::string& spool_path() const { return _spool_path; }
+
+  // Remove the spool files of spool_path
+  static void remove_spool(const std::string& spool_path);
+
+  const std::string   task_name;
+  const uint32_t      sleep_ms;     // expected run time
+  const std::string   command;
+  const uint64_t      start_ms;     // monotonic
+
+private:
+  int open_spool(const char* suffix);
+
+  std::string _spool_path;  // spool files are <path>.out and <path>.err
+  pid_t       _pid;
+  int         _pid_fd;
+  int         _out_fd;      // read ends of the output pipes
+  int         _err_fd;
+  int         _out_spool;
+  int         _err_spool;
+  uint64_t    _max_out;
+  uint64_t    _out_size;    // bytes spooled so far
+  uint64_t    _err_size;
+  bool        _cancelled;
+  TaskResult  _result;
+};
+
+}
+
+#endif
@@ -6,6 +6,11 @@
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <netdb.h>
 #include <getopt.h>
 #include <time.h>
 #include <string.h>
@@ -14,8 +19,20 @@
 #include <assert.h>
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <map>
+#include <vector>
+#include <deque>
+#include <algorithm>
 #include "util.h"
+#include "shard.h"
 #include "server.h"
+#include "task_engine.h"
+#include "task_process.h"
+#include "load_gen.h"
+#include "host_agent.h"
+#include "trace.h"
 
 using namespace std;
 using namespace epoll_demo;
@@ -24,37 +41,120 @@ using namespace epoll_demo;
   log_message(_log_file, __FILE__, __LINE__, fmt, ##args); \
 } while (0)
 
-// Default epoll_wait timeout in milliseconds
-static const int default_timeout = 1000;
+// Events handled per epoll_wait()
+static const int max_events = 64;
+
+// Reconnect backoff in milliseconds. The delay before the n-th retry is
+// drawn uniformly from [0, min(max, base * 2^n)], so a fleet of workers
+// spreads out instead of hitting a restarted controller all at once.
+static const uint32_t reconnect_base_ms = 100;
+static const uint32_t reconnect_max_ms = 5000;
+
+// Resolve the address of the controller. Returns 0 for success, or the
+// error code of getaddrinfo()
+static int resolve_controller(const char* host, uint16_t port,
+                              struct sockaddr_in& addr)
+{
+  struct addrinfo hints, *res;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  int r = getaddrinfo(host, nullptr, &hints, &res);
+  if (r != 0) {
+    return r;
+  }
+  memcpy(&addr, res->ai_addr, sizeof(addr));
+  addr.sin_port = htons(port);
+  freeaddrinfo(res);
+  return 0;
+}
+
+// Output of a finished command on its way to the controller. The command
+// is reported done once all of it is sent.
+struct ResultUpload {
+  string      task_name;
+  TaskResult  result;
+  int         file;       // stdout spool
+  string      spool;      // spool files without their suffix
+  uint64_t    size;
+  uint64_t    offset;     // sent so far on this connection
+};
+
+// Data of a result chunk whose header is written, not all sent yet. Other
+// messages wait until it is, so they do not land inside the chunk.
+struct ChunkInFlight {
+  int         file;       // spool the data is sent from
+  off_t       offset;     // of the next byte to send
+  uint32_t    left;       // bytes not sent yet, 0 if no chunk is
+  bool        owned;      // file is closed with the chunk, its upload is
+                          // gone
+
+  ChunkInFlight() : file(-1), offset(0), left(0), owned(false) {}
+};
 
 struct TaskWorker {
 
   uint16_t  _controller_port;   // port to connect to controller
+  string    _controller_host;   // address of controller
+  struct sockaddr_in _controller_addr;
+  struct sockaddr_in _home_addr;    // controller given at launch
+  bool      _redirected;    // _controller_addr is a shard it was sent to
+  uint32_t  _redirects;     // redirects since the last task
   string    _worker_id;     // worker id assigned at launch
   int       _fd;            // server connection
+  bool      _connecting;    // _fd is a connect() in progress
+  uint32_t  _retries;       // failed connects since last connected
+  int       _timer_fd;      // fires when it is time to reconnect
+  uint32_t  _seed;          // random jitter of reconnects
   int       _epoll_fd;      // epoll file descriptor
-  time_t    _sleep_start;   // start time of sleep
-  string    _task_name;     // task name
-  uint32_t  _sleep_time;    // task sleep time
-  uint32_t  _timeout;       // timeout for epoll_pwait
+  uint32_t  _slots;         // tasks run at the same time
+  TaskEngine _engine;       // runs task payloads off the network thread
+  map<string, TaskJob*> _jobs;  // task name => job queued or running
+  map<string, TaskProcess*> _procs;   // task name => running command
+  map<int, TaskProcess*> _proc_fds;   // pidfd or output pipe => command
+  map<string, uint64_t> _leases;      // task name => lease, until reported
+  string    _spool_dir;     // where command output is kept
+  uint32_t  _keep_spools;   // spool files kept of finished commands
+  deque<string> _spools;    // of finished commands, oldest first
+  bool      _upload;        // stream command output to the controller
+  deque<ResultUpload> _uploads;   // in the order they are sent
+  uint32_t  _credit;        // result chunks the controller can take now
+  // The connection is non-blocking, what the socket cannot take now waits
+  // for EPOLLOUT
+  string    _inbuf;         // partial message of the controller
+  string    _out;           // bytes not written to the controller yet
+  string    _held;          // messages queued behind the chunk in flight
+  ChunkInFlight _chunk;
+  // completed tasks not reported yet
+  vector<pair<string, TaskResult>> _unreported;
   FILE*     _log_file;      // log file
   string    _log_file_name; // log file name
   bool      _is_slacker;    // slacker for testing
   struct epoll_event _ev;   // current interested events
 
-  TaskWorker(uint16_t controller_port, const char* worker_id, bool to_stderr,
-            bool is_slacker)
-    : _controller_port(controller_port), _worker_id(worker_id),
-      _fd(0), _epoll_fd(0), _sleep_start(0), _sleep_time(0),
-      _timeout(default_timeout), _is_slacker(is_slacker) {
-    
+  TaskWorker(const char* controller_host, uint16_t controller_port,
+             const char* worker_id, bool to_stderr, bool is_slacker,
+             uint32_t slots, const char* spool_dir, uint32_t keep_spools,
+             bool upload)
+    : _controller_port(controller_port), _controller_host(controller_host),
+      _redirected(false), _redirects(0), _worker_id(worker_id), _fd(0),
+      _connecting(false), _retries(0), _timer_fd(-1), _epoll_fd(0),
+      _slots(slots), _engine(slots),
+      _spool_dir(spool_dir), _keep_spools(keep_spools), _upload(upload),
+      _credit(0),
+      _is_slacker(is_slacker) {
+    _seed = time(0) ^ getpid();
+    for (char c : _worker_id) {
+      _seed = _seed * 31 + c;
+    }
+
     if (to_stderr) {
       _log_file = stderr;
       _log_file_name = "stderr";
     } else {
       char buffer[128];
       snprintf(buffer, sizeof(buffer), "/tmp/%s_XXXXXX", worker_id);
-      int fd = mkstemp(buffer);
+      int fd = mkostemp(buffer, O_CLOEXEC);
       _log_file = fdopen(fd, "w");
       if (_log_file == nullptr) {
         fprintf(stderr, "Cannot open log file %s", buffer);
@@ -66,6 +166,16 @@ struct TaskWorker {
   }
 
   ~TaskWorker() {
+    _engine.stop();
+    for (auto& it : _procs) {
+      delete it.second;
+    }
+    for (auto& u : _uploads) {
+      close(u.file);
+    }
+    if (_chunk.owned) {
+      close(_chunk.file);
+    }
     if (_epoll_fd) {
       close(_epoll_fd);
       _epoll_fd = 0;
@@ -74,6 +184,10 @@ struct TaskWorker {
       close(_fd);
       _fd = 0;
     }
+    if (_timer_fd >= 0) {
+      close(_timer_fd);
+      _timer_fd = -1;
+    }
     if (_log_file && _log_file != stderr) {
       fclose(_log_file);
       _log_file = nullptr;
@@ -81,47 +195,166 @@ struct TaskWorker {
   }
 
   int init() {
-    int epoll_fd = epoll_create1(0);
+    int r = resolve_controller(_controller_host.c_str(), _controller_port,
+                               _controller_addr);
+    if (r != 0) {
+      LOG("Cannot resolve controller %s: %s", _controller_host.c_str(),
+          gai_strerror(r));
+      return -1;
+    }
+    _home_addr = _controller_addr;
+    // Descriptors of the worker are not inherited by task commands
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
     if (epoll_fd < 0) {
       LOG("Init epoll error %s", strerror(errno));
       return -1;
     }
     _epoll_fd = epoll_fd;
+    if (_engine.start() < 0) {
+      LOG("Init task engine error %s", strerror(errno));
+      return -1;
+    }
+    // Pool threads report finished tasks through the engine event fd
+    struct epoll_event ev;
+    ev.data.fd = _engine.event_fd();
+    ev.events = EPOLLIN;
+    if (epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, _engine.event_fd(), &ev) < 0) {
+      LOG("Error in epoll_ctl(): %s", strerror(errno));
+      return -1;
+    }
+    _timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (_timer_fd < 0) {
+      LOG("Error in timerfd_create(): %s", strerror(errno));
+      return -1;
+    }
+    ev.data.fd = _timer_fd;
+    ev.events = EPOLLIN;
+    if (epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, _timer_fd, &ev) < 0) {
+      LOG("Error in epoll_ctl(): %s", strerror(errno));
+      return -1;
+    }
     return 0;
   }
 
+  // Pick the time of the next connect attempt, with capped exponential
+  // backoff and full jitter
+  void schedule_reconnect() {
+    if (_redirected) {
+      // Start over at the controller given at launch, the shard it was
+      // sent to may be gone
+      _controller_addr = _home_addr;
+      _redirected = false;
+    }
+    uint32_t limit = reconnect_max_ms;
+    if (_retries < 16) {
+      limit = min(limit, reconnect_base_ms << _retries);
+    }
+    _retries++;
+    uint32_t delay = rand_r(&_seed) % (limit + 1);
+    // A zero timer value disarms the timer, fire after 1 ns instead
+    struct itimerspec ts;
+    memset(&ts, 0, sizeof(ts));
+    ts.it_value.tv_sec = delay / 1000;
+    ts.it_value.tv_nsec = (delay % 1000) * 1000000 + 1;
+    if (timerfd_settime(_timer_fd, 0, &ts, nullptr) < 0) {
+      LOG("Error in timerfd_settime(): %s", strerror(errno));
+    }
+    LOG("Reconnect to server in %u ms", delay);
+  }
+
+  // Start a non-blocking connect to the controller. It completes in
+  // connect_done() once the socket becomes writable.
   int connect_server() {
     assert(_fd == 0);
-    struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(_controller_port);
-    addr.sin_addr.s_addr = htons(INADDR_ANY);
-    int conn_fd = socket(AF_INET, SOCK_STREAM, 0);
-    int r = ::connect(conn_fd, (struct sockaddr*)&addr, sizeof(addr));
-    if (r < 0) {
+    int conn_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                         0);
+    if (conn_fd < 0) {
+      LOG("Error in socket(): %s", strerror(errno));
+      schedule_reconnect();
+      return -1;
+    }
+    int r = ::connect(conn_fd, (struct sockaddr*)&_controller_addr,
+                      sizeof(_controller_addr));
+    if (r < 0 && errno != EINPROGRESS) {
       LOG("Error connect() to server: %s", strerror(errno));
+      close(conn_fd);
+      schedule_reconnect();
       return -1;
     }
-    // Register interest in server instruction
     _ev.data.fd = conn_fd;
-    _ev.events = EPOLLIN | EPOLLHUP;
-    r = epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, conn_fd, &_ev);
-    if (r < 0) {
+    _ev.events = EPOLLOUT;
+    if (epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, conn_fd, &_ev) < 0) {
       LOG("Error in epoll_ctl(): %s", strerror(errno));
       close(conn_fd);
+      schedule_reconnect();
       return -1;
     }
     _fd = conn_fd;
-    if (send_status() < 0) {
+    _connecting = true;
+    return _fd;
+  }
+
+  // The connect in progress finished, successfully or not
+  int connect_done() {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(_fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+      err = errno;
+    }
+    _connecting = false;
+    if (err) {
+      LOG("Error connect() to server: %s", strerror(err));
       disconnect_server();
       return -1;
     }
-    if (time_left() > 0) {
-      LOG("Reconnected to server, sleep for %d more secs",
-                  time_left());
-      _timeout = time_left() * 1000;
+    // Register interest in server instruction. The socket stays
+    // non-blocking, so a slow controller does not hold up the worker.
+    _ev.events = EPOLLIN | EPOLLHUP;
+    if (epoll_ctl(_epoll_fd, EPOLL_CTL_MOD, _fd, &_ev) < 0) {
+      LOG("Error in epoll_ctl(): %s", strerror(errno));
+      disconnect_server();
+      return -1;
+    }
+    LOG("Connected to server after %u retries", _retries);
+    _retries = 0;
+    // Report tasks finished while disconnected, then tasks still running,
+    // then ask for a task for every free slot
+    while (!_unreported.empty()) {
+      if (send_status(_unreported.back().first, 0,
+                      &_unreported.back().second) < 0) {
+        return -1;
+      }
+      _leases.erase(_unreported.back().first);
+      _unreported.pop_back();
+    }
+    for (auto& it : _jobs) {
+      if (send_status(it.first, max(it.second->time_left(), 1u)) < 0) {
+        return -1;
+      }
+      LOG("Reconnected to server, task %s sleeps for %u more ms",
+          it.first.c_str(), it.second->time_left());
+    }
+    for (auto& it : _procs) {
+      if (send_status(it.first, max(it.second->time_left(), 1u)) < 0) {
+        return -1;
+      }
+      LOG("Reconnected to server, task %s is running", it.first.c_str());
+    }
+    // A task whose output was being sent is still running to the
+    // controller, and its output is sent again from the start
+    for (auto& u : _uploads) {
+      if (send_status(u.task_name, 1) < 0) {
+        return -1;
+      }
+      u.offset = 0;
+    }
+    for (uint32_t i = running(); i < _slots; i++) {
+      if (send_status("", 0) < 0) {
+        return -1;
+      }
     }
+    _credit = RESULT_WINDOW;
+    send_uploads();
     return _fd;
   }
 
@@ -135,28 +368,110 @@ struct TaskWorker {
     }
     close(_fd);
     _fd = 0;
-    _timeout = default_timeout;
+    _connecting = false;
+    // Uploads start over on the next connection
+    _inbuf.clear();
+    _out.clear();
+    _held.clear();
+    if (_chunk.owned) {
+      close(_chunk.file);
+    }
+    _chunk = ChunkInFlight();
+    schedule_reconnect();
     return r;
   }
 
-  uint32_t time_left() {
-    uint32_t time_diff = (uint32_t)(time(0) - _sleep_start);
-    return (_sleep_time < time_diff ? 0 : _sleep_time - time_diff);
+  // Queue a message for the controller and write what the socket takes.
+  // Returns -1 if the connection failed
+  int send_msg(const char* msg, uint32_t msg_len) {
+    if (_chunk.left) {
+      _held.append(msg, msg_len);
+      return 0;
+    }
+    _out.append(msg, msg_len);
+    return flush_output();
+  }
+
+  // Write queued bytes, then the data of the chunk in flight, as far as the
+  // socket takes them, and watch for room for the rest. Returns -1 if the
+  // connection failed
+  int flush_output() {
+    while (true) {
+      ssize_t n;
+      if (!_out.empty()) {
+        n = ::write(_fd, _out.data(), _out.size());
+        if (n > 0) {
+          _out.erase(0, n);
+          continue;
+        }
+      } else if (_chunk.left) {
+        n = sendfile(_fd, _chunk.file, &_chunk.offset, _chunk.left);
+        if (n > 0) {
+          _chunk.left -= n;
+          if (_chunk.left == 0) {
+            if (_chunk.owned) {
+              close(_chunk.file);
+            }
+            _chunk = ChunkInFlight();
+            _out.swap(_held);
+          }
+          continue;
+        }
+        if (n == 0) {
+          // The spool file is cut short
+          LOG("Error in sendfile(): end of file");
+          disconnect_server();
+          return -1;
+        }
+      } else {
+        break;
+      }
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        break;
+      }
+      LOG("Error in write(): %s", strerror(errno));
+      disconnect_server();
+      return -1;
+    }
+    uint32_t events = EPOLLIN | EPOLLHUP |
+                      (_out.empty() && _chunk.left == 0 ? 0 : EPOLLOUT);
+    if (events != _ev.events) {
+      _ev.events = events;
+      if (epoll_ctl(_epoll_fd, EPOLL_CTL_MOD, _fd, &_ev) < 0) {
+        LOG("Error in epoll_ctl(): %s", strerror(errno));
+        disconnect_server();
+        return -1;
+      }
+    }
+    return 0;
+  }
+
+  // Number of tasks queued, running or sending their output
+  uint32_t running() const {
+    return _jobs.size() + _procs.size() + _uploads.size();
   }
 
-  // Send worker status to controller
-  int send_status() {
+  // Send status of a task to controller. An empty task name asks for a new
+  // task, a time left of 0 reports the task as done. The status carries the
+  // lease the task was assigned with.
+  int send_status(const string& task_name, uint32_t time_left,
+                  const TaskResult* result = nullptr) {
     uint32_t msg_sz;
+    auto lease_it = _leases.find(task_name);
     char* msg = serialize_client_message(_worker_id.c_str(),
-                                         _task_name.c_str(),
-                                         time_left(),
-                                         msg_sz);
+                                         task_name.c_str(),
+                                         time_left,
+                                         lease_it == _leases.end() ?
+                                           0 : lease_it->second,
+                                         msg_sz,
+                                         result);
     if (msg) {
-      int r = ::write(_fd, msg, msg_sz);
+      int r = send_msg(msg, msg_sz);
       free((void*)msg);
       if (r < 0) {
-        LOG("Error in write(): %s", strerror(errno));
-        disconnect_server();
         return -1;
       }
       LOG("Sent status to server");
@@ -165,89 +480,509 @@ struct TaskWorker {
     return -1;
   }
 
-  // Handle message from server. We only register EPOLLIN and EPOLLHUP
+  // Handle events of the connection: room to write, and messages from
+  // server. Returns 1 if told to exit, -1 if the connection failed
   int handle_connection(struct epoll_event& ev) {
     LOG("events: 0x%x", ev.events);
-    if (ev.events & EPOLLIN) {
-      uint32_t msg_len;
-      int r = ::read(_fd, (char*)&msg_len, sizeof(msg_len));
-      if (r != sizeof(uint32_t)) {
-        LOG("Error in read server message header: %d", r);
-        disconnect_server();
+    if (ev.events & EPOLLOUT) {
+      if (flush_output() < 0) {
         return -1;
       }
-      if (msg_len > MAX_SERVER_MSG_LEN) {
-        LOG("Error in server message len %u", msg_len);
-        disconnect_server();
+      send_uploads();
+      if (_fd == 0) {
         return -1;
       }
-      uint32_t body_len = msg_len - sizeof(msg_len);
-      char msg[body_len];
-      r = ::read(_fd, msg, body_len);
-      if (r != (int)body_len) {
-        LOG("Error in read server msg: %d", r);
-        disconnect_server();
-        return -1;
+    }
+    bool closed = false;
+    if (ev.events & EPOLLIN) {
+      char chunk[4096];
+      while (true) {
+        int r = ::read(_fd, chunk, sizeof(chunk));
+        if (r > 0) {
+          _inbuf.append(chunk, r);
+          continue;
+        }
+        if (r < 0 && errno == EINTR) {
+          continue;
+        }
+        if (r == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+          closed = true;
+        }
+        break;
       }
-      if (deserialize_server_message(msg, body_len, _task_name,
-                                     _sleep_time) < 0) {
-        LOG("Error in deserialize_server_message");
+    } else if (ev.events & EPOLLHUP) {
+      closed = true;
+    }
+    // A message with a command may arrive in more than one segment
+    size_t offset = 0;
+    while (_inbuf.size() - offset >= sizeof(uint32_t)) {
+      uint32_t msg_len;
+      memcpy(&msg_len, _inbuf.data() + offset, sizeof(msg_len));
+      if (msg_len > MAX_SERVER_MSG_LEN || msg_len <= sizeof(msg_len)) {
+        LOG("Error in server message len %u", msg_len);
         disconnect_server();
         return -1;
       }
-      if (_task_name == "") {
-        LOG("Task controller tells me to exit");
-        return 1;
+      if (_inbuf.size() - offset < msg_len) {
+        break;
       }
-      LOG("Received task from server %s, sleep time %d. I'm slacker: %d",
-          _task_name.c_str(), _sleep_time, _is_slacker);
-      // Start sleep
-      if (_is_slacker) {
-        _sleep_time += 20; // slack off on response
+      string msg = _inbuf.substr(offset + sizeof(msg_len),
+                                 msg_len - sizeof(msg_len));
+      offset += msg_len;
+      int r = handle_message(msg.data(), msg.size());
+      if (r != 0 || _fd == 0) {
+        // Told to exit, or redirected
+        return r;
       }
-      _sleep_start = time(0);
-      _timeout = _sleep_time * 1000;
     }
-    if (ev.events & EPOLLHUP) {
+    _inbuf.erase(0, offset);
+    if (closed) {
+      LOG("Connection to server closed");
       disconnect_server();
       return -1;
     }
     return 0;
   }
 
+  // Handle a message from server. Returns 1 if told to exit, -1 if the
+  // connection failed
+  int handle_message(const char* msg, uint32_t body_len) {
+    string task_name;
+    uint32_t sleep_ms;
+    uint64_t lease;
+    string command;
+    if (deserialize_server_message(msg, body_len, task_name,
+                                   sleep_ms, lease, command) < 0) {
+      LOG("Error in deserialize_server_message");
+      disconnect_server();
+      return -1;
+    }
+    if (sleep_ms == RESULT_ACK_SLEEP_TIME) {
+      _credit = min(_credit + 1, (uint32_t)RESULT_WINDOW);
+      send_uploads();
+      return 0;
+    }
+    if (task_name == "" && sleep_ms == REDIRECT_SLEEP_TIME) {
+      return redirect(command);
+    }
+    if (task_name == "") {
+      LOG("Task controller tells me to exit");
+      return 1;
+    }
+    trace_instant("received", task_name,
+                  sleep_ms == CANCEL_SLEEP_TIME ? "cancel" : nullptr);
+    auto it = _jobs.find(task_name);
+    auto proc_it = _procs.find(task_name);
+    auto lease_it = _leases.find(task_name);
+    if (sleep_ms == CANCEL_SLEEP_TIME) {
+      // The slot is given back once the job returns from the engine, or
+      // the command is reaped. A cancel of an older assignment of the
+      // task does not stop the current one.
+      if (lease && lease_it != _leases.end() && lease != lease_it->second) {
+        LOG("Ignore cancel of task %s, lease %lu", task_name.c_str(),
+            (unsigned long)lease);
+        return 0;
+      }
+      LOG("Cancel task %s", task_name.c_str());
+      if (it != _jobs.end()) {
+        it->second->cancel();
+      }
+      if (proc_it != _procs.end()) {
+        proc_it->second->cancel();
+      }
+      cancel_upload(task_name);
+      return 0;
+    }
+    if (it != _jobs.end() || proc_it != _procs.end()) {
+      // Given again, e.g. after the controller lost track of it. The
+      // run goes on under the new lease.
+      LOG("Task %s is already running", task_name.c_str());
+      _leases[task_name] = lease;
+      return 0;
+    }
+    _redirects = 0;
+    _leases[task_name] = lease;
+    if (!command.empty()) {
+      LOG("Received task from server %s, command '%s'",
+          task_name.c_str(), command.c_str());
+      start_process(task_name, sleep_ms, command);
+      return 0;
+    }
+    LOG("Received task from server %s, sleep time %u ms. I'm slacker: %d",
+        task_name.c_str(), sleep_ms, _is_slacker);
+    // Start sleep
+    if (_is_slacker) {
+      sleep_ms += 20000; // slack off on response
+    }
+    TaskJob* job = new TaskJob(task_name, sleep_ms);
+    _jobs[task_name] = job;
+    _engine.submit(job);
+    return 0;
+  }
+
+  // The controller has nothing for this worker and sends it to another
+  // shard of its cluster at address. Returns 1 to exit instead, 0 otherwise
+  int redirect(const string& address) {
+    struct sockaddr_in addr;
+    if (++_redirects > MAX_REDIRECTS) {
+      LOG("Redirected %u times without a task, exiting", MAX_REDIRECTS);
+      return 1;
+    }
+    if (resolve_address(address, addr) < 0) {
+      LOG("Cannot resolve controller %s, exiting", address.c_str());
+      return 1;
+    }
+    LOG("Redirected to controller %s", address.c_str());
+    disconnect_server();
+    _controller_addr = addr;
+    _redirected = true;
+    return 0;
+  }
+
+  // Report a finished task, or keep it until connected again. A cancelled
+  // task is not reported, its slot is offered for a new task instead.
+  void report_done(const string& task_name, bool cancelled,
+                   const TaskResult& result) {
+    if (cancelled) {
+      _leases.erase(task_name);
+      if (_fd) {
+        send_status("", 0);
+      }
+      return;
+    }
+    TraceScope scope("report", task_name);
+    if (_fd == 0 || send_status(task_name, 0, &result) < 0) {
+      _unreported.push_back(make_pair(task_name, result));
+    } else {
+      _leases.erase(task_name);
+    }
+  }
+
+  // Collect jobs finished by the engine and report them
+  void handle_completion() {
+    vector<TaskJob*> jobs;
+    _engine.completed(jobs);
+    TaskResult result;
+    memset(&result, 0, sizeof(result));
+    for (auto job : jobs) {
+      _jobs.erase(job->task_name);
+      result.run_ms = job->run_ms();
+      report_done(job->task_name, job->cancelled(), result);
+      delete job;
+    }
+  }
+
+  // The spool files of a command are done with. Only those of the last
+  // _keep_spools commands are kept.
+  void retire_spool(const string& spool) {
+    _spools.push_back(spool);
+    while (_spools.size() > _keep_spools) {
+      TaskProcess::remove_spool(_spools.front());
+      _spools.pop_front();
+    }
+  }
+
+  // Send the output of a finished command before reporting it done. An
+  // empty output is not sent.
+  void start_upload(TaskProcess* p) {
+    string path = p->out_path();
+    int file = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (file < 0 || fstat(file, &st) < 0 || st.st_size == 0) {
+      if (file >= 0) {
+        close(file);
+      }
+      report_done(p->task_name, false, p->result());
+      retire_spool(p->spool_path());
+      return;
+    }
+    ResultUpload u;
+    u.task_name = p->task_name;
+    u.result = p->result();
+    u.file = file;
+    u.spool = p->spool_path();
+    u.size = st.st_size;
+    u.offset = 0;
+    LOG("Send %lu bytes of output of task %s", (unsigned long)u.size,
+        u.task_name.c_str());
+    _uploads.push_back(u);
+    send_uploads();
+  }
+
+  // The controller gave the task to another worker. Its output is dropped,
+  // the controller drops chunks of it already on the way.
+  void cancel_upload(const string& task_name) {
+    for (auto it = _uploads.begin(); it != _uploads.end(); ++it) {
+      if (it->task_name == task_name) {
+        // Data of a chunk in flight is sent whole all the same
+        if (_chunk.left && _chunk.file == it->file) {
+          _chunk.owned = true;
+        } else {
+          close(it->file);
+        }
+        TaskResult result = it->result;
+        string spool = it->spool;
+        _uploads.erase(it);
+        report_done(task_name, true, result);
+        retire_spool(spool);
+        return;
+      }
+    }
+  }
+
+  // Send chunks of output as far as the controller has room for them, and
+  // report each task once all of its output is sent. Chunks are written
+  // with sendfile(), from the spool file straight to the socket, as far as
+  // it takes them. The rest goes out on EPOLLOUT.
+  void send_uploads() {
+    while (_fd && !_connecting && !_uploads.empty() && _chunk.left == 0) {
+      ResultUpload& u = _uploads.front();
+      if (u.offset == u.size) {
+        // The completion follows the last chunk on the connection
+        if (send_status(u.task_name, 0, &u.result) < 0) {
+          return;
+        }
+        _leases.erase(u.task_name);
+        close(u.file);
+        retire_spool(u.spool);
+        _uploads.pop_front();
+        continue;
+      }
+      if (_credit == 0) {
+        return;
+      }
+      uint32_t len = (uint32_t)min(u.size - u.offset,
+                                   (uint64_t)RESULT_CHUNK_LEN);
+      char header[RESULT_CHUNK_HEADER_LEN];
+      make_result_chunk_header(header, _leases[u.task_name], u.offset, len);
+      _out.append(header, sizeof(header));
+      _chunk.file = u.file;
+      _chunk.offset = u.offset;
+      _chunk.left = len;
+      u.offset += len;
+      _credit--;
+      if (flush_output() < 0) {
+        return;
+      }
+    }
+  }
+
+  // Run the command of a task as a child process watched by epoll
+  void start_process(const string& task_name, uint32_t sleep_ms,
+                     const string& command) {
+    TraceScope scope("spawn", task_name);
+    // Output sent to the controller is kept whole. Runs of a task by
+    // workers sharing the spool directory, e.g. a backup on the same host,
+    // have spool files of their own.
+    string tag = _worker_id + "." + to_string(_leases[task_name]);
+    TaskProcess* p = new TaskProcess(task_name, sleep_ms, command,
+                                     _spool_dir, tag,
+                                     _upload ? UINT64_MAX : MAX_SPOOL_SIZE);
+    if (p->spawn() < 0) {
+      LOG("Error: cannot run task %s: %s", task_name.c_str(),
+          strerror(errno));
+      report_done(task_name, false, p->result());
+      retire_spool(p->spool_path());
+      delete p;
+      return;
+    }
+    _procs[task_name] = p;
+    int fds[] = { p->pid_fd(), p->out_fd(), p->err_fd() };
+    for (int fd : fds) {
+      struct epoll_event ev;
+      ev.data.fd = fd;
+      ev.events = EPOLLIN;
+      if (epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        LOG("Error in epoll_ctl(): %s", strerror(errno));
+      }
+      _proc_fds[fd] = p;
+    }
+  }
+
+  // A command exited or has output. Its descriptors leave the epoll set
+  // when they are closed.
+  void handle_process_event(int fd) {
+    auto it = _proc_fds.find(fd);
+    if (it == _proc_fds.end()) {
+      return;
+    }
+    TaskProcess* p = it->second;
+    if (fd != p->pid_fd()) {
+      if (p->drain(fd) != 0) {
+        _proc_fds.erase(fd);
+      }
+      return;
+    }
+    int r = p->reap();
+    if (r == 0) {
+      return;
+    }
+    if (r < 0) {
+      LOG("Error: cannot collect exit status of task %s: %s",
+          p->task_name.c_str(), strerror(errno));
+    }
+    // Take what is left in the pipes. Output of a background child that
+    // outlives the command is dropped.
+    int fds[] = { p->pid_fd(), p->out_fd(), p->err_fd() };
+    for (int fd : fds) {
+      if (fd >= 0) {
+        _proc_fds.erase(fd);
+      }
+    }
+    if (p->out_fd() >= 0) {
+      p->drain(p->out_fd());
+    }
+    if (p->err_fd() >= 0) {
+      p->drain(p->err_fd());
+    }
+    LOG("Task %s exit status %d", p->task_name.c_str(),
+        p->result().exit_status);
+    // Processes are started in milliseconds
+    trace_span("run", p->task_name, p->start_ms * 1000, 0, "command");
+    _procs.erase(p->task_name);
+    if (_upload && !p->cancelled()) {
+      start_upload(p);
+    } else {
+      report_done(p->task_name, p->cancelled(), p->result());
+      retire_spool(p->spool_path());
+    }
+    delete p;
+  }
+
   int run_loop() {
     int r;
-    struct epoll_event events;
+    struct epoll_event events[max_events];
+    // Every wakeup is an event: a message, a finished task, or the
+    // reconnect timer
+    connect_server();
     while (true) {
-      if (_fd == 0) {
-        connect_server();
-      }
-      LOG("epoll wait %d", _timeout);
-      memset(&events, 0, sizeof(events));
-      r = epoll_wait(_epoll_fd, &events, 1, _timeout);
-      if (r > 0) {
-        r = handle_connection(events);
-        if (r > 0) {
-          break;
+      memset(events, 0, sizeof(events));
+      r = epoll_wait(_epoll_fd, events, max_events, -1);
+      for (int i = 0; i < r; i++) {
+        if (events[i].data.fd == _engine.event_fd()) {
+          handle_completion();
+        } else if (events[i].data.fd == _timer_fd) {
+          uint64_t expirations;
+          if (::read(_timer_fd, &expirations, sizeof(expirations)) > 0 &&
+              _fd == 0) {
+            connect_server();
+          }
+        } else if (events[i].data.fd != _fd) {
+          handle_process_event(events[i].data.fd);
+        } else if (_connecting) {
+          connect_done();
+        } else if (_fd && handle_connection(events[i]) > 0) {
+          LOG("Exiting task worker");
+          disconnect_server();
+          return 0;
         }
-      } else if (!_task_name.empty() && time_left() == 0) {
-        send_status(); // done with task
-        _timeout = default_timeout;
       }
     }
-    LOG("Exiting task worker");
-    disconnect_server();
     return 0;
   }
 };
 
 static const char* usage =
   "Usage:\n"
-  "\ttask_worker [-v] -p <port> -w <worker_id>\n"
+  "\ttask_worker [-v] [-a <address>] -p <port> -w <worker_id>\n"
+  "\ttask_worker [-v] -C <cluster> -w <worker_id>\n"
   "\t[-v] : log to stderr\n"
+  "\t[-a <address>] : host name or address of task controller, "
+  "default 127.0.0.1\n"
   "\t-p <port> : port of task controller\n"
   "\t-w <worker_id> : unique worker id\n"
-  "\t[-s] : act as slacker\n";
+  "\t-C <cluster> : connect to the shard of the controllers in file\n"
+  "\t\t<cluster> that <worker_id> hashes to\n"
+  "\t[-s] : act as slacker\n"
+  "\t[-n <slots>] : run up to <slots> tasks at the same time, default 1\n"
+  "\t[-o <dir>] : directory for output of task commands, default /tmp\n"
+  "\t[-k <runs>] : keep the output of the last <runs> commands, default\n"
+  "\t\t100\n"
+  "\t[-U] : send the stdout of task commands to the controller as their\n"
+  "\t\tresult\n"
+  "\t[-t <trace>] : record task lifecycle spans to <trace> as a Chrome "
+  "trace\n"
+  "\ttask_worker -g <workers> [-v] [-a <address>] -p <port> [-w <prefix>]\n"
+  "\ttask_worker -g <workers> [-v] -C <cluster> [-w <prefix>]\n"
+  "\t-g <workers> : simulate <workers> workers in this process, for load "
+  "testing\n"
+  "\t[-w <prefix>] : simulated worker ids are <prefix>_<n>, default sim\n"
+  "\t[-T <threads>] : threads hosting simulated workers, default 4\n"
+  "\t[-x <scale>] : multiply task sleep time by <scale>, default 1.0\n"
+  "\t[-l <ratio>] : fraction of simulated workers acting as slackers\n"
+  "\t[-c <rate>] : drop <rate> connections per second to simulate churn\n"
+  "\ttask_worker -H <agent port> [-v] [-a <address>] -p <port>\n"
+  "\t-H <agent port> : run as the agent of the workers of this host, who\n"
+  "\t\tconnect to <agent port> and are carried to the controller over\n"
+  "\t\tone connection\n";
+
+// Load generator mode, -g. Prints a summary of the run to stdout.
+static int run_load_gen(const char* host, uint16_t port,
+                        const LoadGenOptions& opts, bool to_stderr,
+                        const ShardRing* ring)
+{
+  FILE* log_file = stderr;
+  if (!to_stderr) {
+    char buffer[128];
+    snprintf(buffer, sizeof(buffer), "/tmp/%s_XXXXXX",
+             opts.id_prefix.c_str());
+    int fd = mkostemp(buffer, O_CLOEXEC);
+    log_file = fd >= 0 ? fdopen(fd, "w") : nullptr;
+    if (log_file == nullptr) {
+      fprintf(stderr, "Cannot open log file %s", buffer);
+      log_file = stderr;
+    } else {
+      fprintf(stdout, "Load generator log file is %s\n", buffer);
+    }
+  }
+  struct sockaddr_in addr;
+  int r = port ? resolve_controller(host, port, addr) : 0;
+  if (r != 0) {
+    log_message(log_file, __FILE__, __LINE__,
+                "Cannot resolve controller %s: %s", host, gai_strerror(r));
+    r = -1;
+  } else {
+    LoadGenerator gen(addr, opts, log_file, ring);
+    r = -1;
+    if (gen.valid()) {
+      uint64_t start_ms = monotonic_ms();
+      r = gen.run();
+      uint64_t elapsed_ms = max(monotonic_ms() - start_ms, (uint64_t)1);
+      const LoadGenStats& stats = gen.stats();
+      printf("workers %u elapsed_ms %lu connects %lu assigned %lu "
+             "completed %lu cancelled %lu churned %lu redirected %lu "
+             "errors %lu completed/s %.1f\n",
+             opts.num_workers, (unsigned long)elapsed_ms,
+             (unsigned long)stats.connects, (unsigned long)stats.assigned,
+             (unsigned long)stats.completed, (unsigned long)stats.cancelled,
+             (unsigned long)stats.churned, (unsigned long)stats.redirected,
+             (unsigned long)stats.errors,
+             stats.completed * 1000.0 / elapsed_ms);
+    }
+  }
+  if (log_file != stderr) {
+    fclose(log_file);
+  }
+  return r;
+}
+
+// Host agent mode, -H
+static int run_agent(const char* host, uint16_t port, uint16_t agent_port,
+                     bool to_stderr)
+{
+  struct sockaddr_in addr;
+  int r = port ? resolve_controller(host, port, addr) : -1;
+  if (r != 0) {
+    fprintf(stderr, "Cannot resolve controller %s port %u\n", host, port);
+    return -1;
+  }
+  HostAgent agent(agent_port, addr, to_stderr);
+  fprintf(stderr, "Host agent log file is %s\n",
+          agent.log_file_name().c_str());
+  // A worker may close its connection while a message is written to it
+  signal(SIGPIPE, SIG_IGN);
+  return agent.run_loop();
+}
 
 int main(int argc, char** argv)
 {
@@ -256,11 +991,22 @@ int main(int argc, char** argv)
   string worker_id;
   bool to_stderr = false;
   bool is_slacker = false;
+  int slots = 1;
+  const char* spool_dir = "/tmp";
+  int keep_spools = 100;
+  const char* host = "127.0.0.1";
+  LoadGenOptions gen_opts;
+  bool load_gen = false;
+  const char* trace_path = nullptr;
+  ShardRing ring;
+  const char* cluster_path = nullptr;
+  int agent_port = 0;
+  bool upload = false;
   if (argc == 0) {
     printf(usage);
     exit(0);
   }
-  while ((ch = getopt(argc, argv, "hsvp:w:")) > 0) {
+  while ((ch = getopt(argc, argv, "hsvUa:p:w:n:o:k:g:T:x:l:c:t:C:H:")) > 0) {
     switch (ch) {
     case 'h':
       printf(usage);
@@ -282,21 +1028,120 @@ int main(int argc, char** argv)
     case 's':
       is_slacker = true;
       break;
+    case 'a':
+      host = optarg;
+      break;
+    case 'o':
+      spool_dir = optarg;
+      break;
+    case 'k':
+      keep_spools = atoi(optarg);
+      if (keep_spools < 0) {
+        fprintf(stderr, "Invalid number of runs to keep %s\n", optarg);
+        exit(1);
+      }
+      break;
+    case 'U':
+      upload = true;
+      break;
+    case 'n':
+      slots = atoi(optarg);
+      if (slots <= 0) {
+        fprintf(stderr, "Invalid number of slots %d\n", slots);
+        exit(1);
+      }
+      break;
+    case 't':
+      trace_path = optarg;
+      break;
+    case 'C':
+      cluster_path = optarg;
+      break;
+    case 'H':
+      agent_port = atoi(optarg);
+      if (agent_port <= 0 || agent_port > MAX_PORT_NUMBER) {
+        fprintf(stderr, "Invalid agent port number %s\n", optarg);
+        exit(1);
+      }
+      break;
+    case 'g':
+      load_gen = true;
+      gen_opts.num_workers = atoi(optarg);
+      if ((int)gen_opts.num_workers <= 0) {
+        fprintf(stderr, "Invalid number of workers %s\n", optarg);
+        exit(1);
+      }
+      break;
+    case 'T':
+      gen_opts.num_threads = atoi(optarg);
+      if ((int)gen_opts.num_threads <= 0) {
+        fprintf(stderr, "Invalid number of threads %s\n", optarg);
+        exit(1);
+      }
+      break;
+    case 'x':
+      gen_opts.time_scale = atof(optarg);
+      if (gen_opts.time_scale < 0) {
+        fprintf(stderr, "Invalid time scale %s\n", optarg);
+        exit(1);
+      }
+      break;
+    case 'l':
+      gen_opts.slacker_ratio = atof(optarg);
+      if (gen_opts.slacker_ratio < 0 || gen_opts.slacker_ratio > 1) {
+        fprintf(stderr, "Invalid slacker ratio %s\n", optarg);
+        exit(1);
+      }
+      break;
+    case 'c':
+      gen_opts.churn_rate = atof(optarg);
+      if (gen_opts.churn_rate < 0) {
+        fprintf(stderr, "Invalid churn rate %s\n", optarg);
+        exit(1);
+      }
+      break;
     default:
       fprintf(stderr, "Invalid argument\n");
       printf(usage);
       exit(1);
     }
   }
+  if (cluster_path && ring.load(cluster_path, stderr) < 0) {
+    exit(1);
+  }
+  if (agent_port) {
+    return run_agent(host, (uint16_t)port, (uint16_t)agent_port,
+                     to_stderr) < 0 ? 1 : 0;
+  }
+  if (load_gen && (port || cluster_path)) {
+    if (!worker_id.empty()) {
+      gen_opts.id_prefix = worker_id;
+    }
+    return run_load_gen(host, (uint16_t)port, gen_opts, to_stderr,
+                        cluster_path ? &ring : nullptr) < 0 ? 1 : 0;
+  }
+  if (cluster_path && !worker_id.empty()) {
+    // Workers spread over the shards the way tasks do
+    const ShardInfo& shard = ring.shards()[ring.owner(worker_id)];
+    host = shard.host.c_str();
+    port = shard.port;
+  }
   if (!port || worker_id.empty()) {
     printf("Invalid arguments\n");
     printf(usage);
     exit(1);
   }
-  TaskWorker worker((uint16_t)port, worker_id.c_str(), to_stderr, is_slacker);
+  TaskWorker worker(host, (uint16_t)port, worker_id.c_str(), to_stderr,
+                    is_slacker, (uint32_t)slots, spool_dir,
+                    (uint32_t)keep_spools, upload);
   if (worker.init() < 0) {
     return -1;
   }
+  if (trace_path && trace_start(trace_path, worker_id) < 0) {
+    fprintf(stderr, "Cannot open trace file %s\n", trace_path);
+    return -1;
+  }
   worker.run_loop();
+  trace_stop();
   return 0;
 }
@@ -0,0 +1,67 @@
+//
+// Fred Xia (fxia@yahoo.com)
+//
+#include <math.h>
+#include <algorithm>
+#include "timeout_model.h"
+
+using namespace std;
+
+namespace epoll_demo {
+
+// Room for the round trip of assignment and completion. Never cut a task
+// off sooner than this past its expected time.
+static const uint32_t min_grace_ms = 1000;
+
+// Sleep time + 10 seconds, used until the model has enough samples
+static const uint32_t default_grace_ms = 10000;
+
+// Shorter tasks are mostly round trip, their ratios are taken as if they
+// were expected to run this long
+static const uint32_t min_expected_ms = 100;
+
+// Upper bound of the ratio a deadline is derived from, so a few wild samples
+// cannot keep a stuck task around forever
+static const double max_ratio = 10.0;
+
+void RuntimeStats::add(double ratio, double alpha)
+{
+  if (samples++ == 0) {
+    mean = ratio;
+    var = 0;
+    return;
+  }
+  double diff = ratio - mean;
+  double incr = alpha * diff;
+  mean += incr;
+  var = (1 - alpha) * (var + diff * incr);
+}
+
+void TimeoutModel::add_sample(const string& worker, uint32_t expected_ms,
+                              uint32_t actual_ms)
+{
+  double ratio = (double)actual_ms / max(expected_ms, min_expected_ms);
+  _global.add(ratio, _alpha);
+  _workers[worker].add(ratio, _alpha);
+}
+
+uint32_t TimeoutModel::deadline(const string& worker,
+                                uint32_t expected_ms) const
+{
+  const RuntimeStats* stats = nullptr;
+  auto it = _workers.find(worker);
+  if (it != _workers.end() && it->second.samples >= _min_samples) {
+    stats = &it->second;
+  } else if (_global.samples >= _min_samples) {
+    stats = &_global;
+  }
+  if (stats == nullptr) {
+    return expected_ms + default_grace_ms;
+  }
+  double ratio = stats->mean + _k * sqrt(stats->var);
+  ratio = min(max(ratio, 1.0), max_ratio);
+  return (uint32_t)ceil(max(expected_ms, min_expected_ms) * ratio) +
+         min_grace_ms;
+}
+
+}
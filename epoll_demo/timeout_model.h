@@ -0,0 +1,69 @@
+#ifndef __task_timeout_model_h__
+#define __task_timeout_model_h__
+//
+// Fred Xia (fxia@yahoo.com)
+//
+
+#include <stdint.h>
+#include <string>
+#include <map>
+
+namespace epoll_demo {
+
+// Exponentially weighted mean and variance of actual / expected run time
+// ratios of completed tasks.
+struct RuntimeStats {
+  uint32_t  samples;
+  double    mean;
+  double    var;
+
+  RuntimeStats() : samples(0), mean(0), var(0) {}
+
+  void add(double ratio, double alpha);
+};
+
+// Learns how long tasks actually take relative to their sleep time, per
+// worker and across all workers, and derives the deadline after which a
+// running task is considered stuck.
+class TimeoutModel {
+public:
+  TimeoutModel(double alpha = 0.2, double k = 4.0, uint32_t min_samples = 5)
+    : _alpha(alpha), _k(k), _min_samples(min_samples)
+  {}
+
+  // Record a completed task that was expected to take expected_ms and
+  // actually took actual_ms on worker.
+  void add_sample(const std::string& worker, uint32_t expected_ms,
+                  uint32_t actual_ms);
+
+  // Milliseconds after assignment when a task of expected_ms on worker
+  // should be reclaimed. Falls back to expected_ms + 10 seconds until enough
+  // samples have been seen.
+  uint32_t deadline(const std::string& worker, uint32_t expected_ms) const;
+
+  const RuntimeStats& global_stats() const { return _global; }
+  const std::map<std::string, RuntimeStats>& worker_stats() const {
+    return _workers;
+  }
+
+  // Restore statistics saved earlier, e.g. from a snapshot
+  void set_global_stats(const RuntimeStats& stats) { _global = stats; }
+  void set_worker_stats(const std::string& worker,
+                        const RuntimeStats& stats) {
+    _workers[worker] = stats;
+  }
+
+  // Forget a worker, e.g. when it is gone for good
+  void remove_worker(const std::string& worker) { _workers.erase(worker); }
+
+private:
+  double _alpha;          // EWMA weight of a new sample
+  double _k;              // deviations above mean tolerated
+  uint32_t _min_samples;  // samples needed before the stats are trusted
+  RuntimeStats _global;
+  std::map<std::string, RuntimeStats> _workers;
+};
+
+}
+
+#endif
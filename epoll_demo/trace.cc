@@ -0,0 +1,161 @@
+//
+// Fred Xia (fxia@yahoo.com)
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <vector>
+#include <mutex>
+#include "util.h"
+#include "trace.h"
+
+using namespace std;
+
+namespace epoll_demo {
+
+atomic<bool> trace_on(false);
+
+struct TraceEvent {
+  const char* stage;
+  const char* detail;
+  char        task[MAX_TASK_NAME_LEN + 1];
+  uint64_t    ts_us;
+  uint64_t    dur_us;       // UINT64_MAX for an instant
+  uint32_t    tid;
+};
+
+static mutex trace_mutex;
+static FILE* trace_file = nullptr;
+static vector<TraceEvent> trace_events;
+static bool trace_first = true;     // no event written to the file yet
+static uint32_t trace_pid;
+
+static uint32_t thread_id()
+{
+  static thread_local uint32_t tid = 0;
+  if (tid == 0) {
+    tid = syscall(SYS_gettid);
+  }
+  return tid;
+}
+
+static void write_json_string(FILE* f, const char* s)
+{
+  fputs(json_string(s).c_str(), f);
+}
+
+// Called with trace_mutex held
+static void write_events()
+{
+  for (auto& ev : trace_events) {
+    fprintf(trace_file, "%s\n{\"name\":\"%s\",\"cat\":\"task\",\"ph\":\"%s\","
+            "\"pid\":%u,\"tid\":%u,\"ts\":%lu", trace_first ? "" : ",",
+            ev.stage, ev.dur_us == UINT64_MAX ? "i" : "X", trace_pid, ev.tid,
+            (unsigned long)ev.ts_us);
+    trace_first = false;
+    if (ev.dur_us == UINT64_MAX) {
+      fprintf(trace_file, ",\"s\":\"t\"");
+    } else {
+      fprintf(trace_file, ",\"dur\":%lu", (unsigned long)ev.dur_us);
+    }
+    fprintf(trace_file, ",\"args\":{\"task\":");
+    write_json_string(trace_file, ev.task);
+    if (ev.detail) {
+      fprintf(trace_file, ",\"detail\":\"%s\"", ev.detail);
+    }
+    fprintf(trace_file, "}}");
+  }
+  trace_events.clear();
+}
+
+static void add_event(const char* stage, const string& task, uint64_t ts_us,
+                      uint64_t dur_us, const char* detail)
+{
+  TraceEvent ev;
+  ev.stage = stage;
+  ev.detail = detail;
+  size_t len = min(task.size(), (size_t)MAX_TASK_NAME_LEN);
+  memcpy(ev.task, task.data(), len);
+  ev.task[len] = '\0';
+  ev.ts_us = ts_us;
+  ev.dur_us = dur_us;
+  ev.tid = thread_id();
+  lock_guard<mutex> lock(trace_mutex);
+  if (trace_file == nullptr) {
+    return;
+  }
+  trace_events.push_back(ev);
+  if (trace_events.size() >= TRACE_BUFFER_EVENTS) {
+    write_events();
+  }
+}
+
+int trace_start(const char* path, const string& process_name)
+{
+  lock_guard<mutex> lock(trace_mutex);
+  if (trace_file) {
+    return -1;
+  }
+  trace_file = fopen(path, "w");
+  if (trace_file == nullptr) {
+    return -1;
+  }
+  trace_pid = getpid();
+  trace_events.reserve(TRACE_BUFFER_EVENTS);
+  fprintf(trace_file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+          "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,"
+          "\"args\":{\"name\":", trace_pid);
+  write_json_string(trace_file, process_name.c_str());
+  fprintf(trace_file, "}}");
+  trace_first = false;
+  static bool at_exit = false;
+  if (!at_exit) {
+    at_exit = true;
+    atexit(trace_stop);
+  }
+  trace_on = true;
+  return 0;
+}
+
+void trace_stop()
+{
+  trace_on = false;
+  lock_guard<mutex> lock(trace_mutex);
+  if (trace_file == nullptr) {
+    return;
+  }
+  write_events();
+  fprintf(trace_file, "\n]}\n");
+  fclose(trace_file);
+  trace_file = nullptr;
+}
+
+uint64_t trace_now_us()
+{
+  return monotonic_us();
+}
+
+void trace_span(const char* stage, const string& task, uint64_t begin_us,
+                uint64_t end_us, const char* detail)
+{
+  if (!trace_enabled()) {
+    return;
+  }
+  if (end_us == 0) {
+    end_us = trace_now_us();
+  }
+  add_event(stage, task, begin_us, end_us > begin_us ? end_us - begin_us : 0,
+            detail);
+}
+
+void trace_instant(const char* stage, const string& task, const char* detail)
+{
+  if (!trace_enabled()) {
+    return;
+  }
+  add_event(stage, task, trace_now_us(), UINT64_MAX, detail);
+}
+
+}
@@ -0,0 +1,77 @@
+#ifndef __task_trace_h__
+#define __task_trace_h__
+//
+// Fred Xia (fxia@yahoo.com)
+//
+
+#include <stdint.h>
+#include <string>
+#include <atomic>
+
+namespace epoll_demo {
+
+// Events kept in memory before they are appended to the trace file
+#define TRACE_BUFFER_EVENTS   65536
+
+// Optional tracing of the stages of task lifecycles, off unless started.
+// Every event is a span of a stage, e.g. the database write of a state
+// change, with the name of the task it belongs to, so the spans of one task
+// in the controller and on its worker can be lined up. Times are
+// CLOCK_MONOTONIC, which the processes of one host share.
+//
+// Events are buffered in memory and written as a Chrome trace, which
+// chrome://tracing and Perfetto open. A full buffer is written out by the
+// thread that fills it, so the cost is one write per TRACE_BUFFER_EVENTS
+// events. The file is complete once trace_stop() has run.
+
+extern std::atomic<bool> trace_on;
+
+inline bool trace_enabled()
+{
+  return trace_on.load(std::memory_order_relaxed);
+}
+
+// Start tracing to path. process_name labels the events of this process.
+// Returns 0 for success, -1 for failure
+int trace_start(const char* path, const std::string& process_name);
+
+// Write out buffered events and close the trace file. Also run at exit.
+void trace_stop();
+
+// Microseconds on the trace clock
+uint64_t trace_now_us();
+
+// Record a span of stage for a task, from begin_us to end_us, or to now if
+// end_us is 0. stage and detail must be string literals.
+void trace_span(const char* stage, const std::string& task, uint64_t begin_us,
+                uint64_t end_us = 0, const char* detail = nullptr);
+
+// Record a point in time of stage for a task
+void trace_instant(const char* stage, const std::string& task,
+                   const char* detail = nullptr);
+
+// Span of the enclosing scope, when the task is known up front
+class TraceScope {
+public:
+  TraceScope(const char* stage, const std::string& task,
+             const char* detail = nullptr)
+    : _stage(stage), _task(task), _detail(detail),
+      _begin_us(trace_enabled() ? trace_now_us() : 0)
+  {}
+
+  ~TraceScope() {
+    if (_begin_us) {
+      trace_span(_stage, _task, _begin_us, 0, _detail);
+    }
+  }
+
+private:
+  const char* _stage;
+  const std::string& _task;
+  const char* _detail;
+  uint64_t _begin_us;
+};
+
+}
+
+#endif
@@ -7,7 +7,10 @@
 #include <stdarg.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <time.h>
+#include <netdb.h>
 #include "util.h"
+#include "async_log.h"
 
 using namespace std;
 
@@ -16,10 +19,13 @@ namespace epoll_demo {
 char* serialize_client_message(const char* worker,
                                const char* task_name,
                                uint32_t time_left,
-                               uint32_t& sz)
+                               uint64_t lease,
+                               uint32_t& sz,
+                               const TaskResult* result)
 {
   uint32_t msg_len = strlen(worker) + strlen(task_name) + sizeof(time_left) +
-                     sizeof(uint32_t) + 2;
+                     sizeof(lease) + sizeof(uint32_t) + 2 +
+                     (result ? sizeof(*result) : 0);
   char* msg = (char*)malloc(msg_len);
   if (!msg) {
     return nullptr;
@@ -32,16 +38,28 @@ char* serialize_client_message(const char* worker,
   memcpy(p, task_name, strlen(task_name) + 1);
   p += strlen(task_name) + 1;
   memcpy(p, &time_left, sizeof(time_left));
+  p += sizeof(time_left);
+  memcpy(p, &lease, sizeof(lease));
+  p += sizeof(lease);
+  if (result) {
+    memcpy(p, result, sizeof(*result));
+  }
   sz = msg_len;
   return msg;
 }
 
 char* serialize_server_message(const char* task_name,
-                               uint32_t sleep_time,
+                               uint32_t sleep_ms,
+                               uint64_t lease,
+                               const char* command,
                                uint32_t& sz)
 {
-  uint32_t msg_len = strlen(task_name) + sizeof(sleep_time) +
-                     sizeof(uint32_t) + 1;
+  // The command is left out for a plain sleep, so the message of a demo
+  // task stays small
+  uint32_t command_len = strlen(command);
+  uint32_t msg_len = strlen(task_name) + sizeof(sleep_ms) + sizeof(lease) +
+                     sizeof(uint32_t) + 1 +
+                     (command_len ? command_len + 1 : 0);
   char* msg = (char*)malloc(msg_len);
   if (!msg) {
     return nullptr;
@@ -51,7 +69,13 @@ char* serialize_server_message(const char* task_name,
   p += sizeof(msg_len);
   memcpy(p, task_name, strlen(task_name) + 1);
   p += strlen(task_name) + 1;
-  memcpy(p, &sleep_time, sizeof(sleep_time));
+  memcpy(p, &sleep_ms, sizeof(sleep_ms));
+  p += sizeof(sleep_ms);
+  memcpy(p, &lease, sizeof(lease));
+  p += sizeof(lease);
+  if (command_len) {
+    memcpy(p, command, command_len + 1);
+  }
   sz = msg_len;
   return msg;
 }
@@ -60,7 +84,9 @@ int deserialize_client_message(const char* msg,
                                uint32_t msg_len,
                                string& worker,
                                string& task_name,
-                               uint32_t& time_left)
+                               uint32_t& time_left,
+                               uint64_t& lease,
+                               TaskResult* result)
 {
   const char* p = msg;
   const char* end = msg + msg_len;
@@ -89,20 +115,33 @@ int deserialize_client_message(const char* msg,
   name_buffer[i] = 0;
   p++;
   
-  if (end - p != sizeof(time_left)) {
+  if (end - p != sizeof(time_left) + sizeof(lease) &&
+      end - p != sizeof(time_left) + sizeof(lease) + sizeof(TaskResult)) {
     fprintf(stderr, "invalid time left %d, %ld, ", msg_len, end - p);
     return -1;
   }
   worker = id_buffer;
   task_name = name_buffer;
   memcpy(&time_left, p, sizeof(time_left));
+  p += sizeof(time_left);
+  memcpy(&lease, p, sizeof(lease));
+  p += sizeof(lease);
+  if (result) {
+    if (p < end) {
+      memcpy(result, p, sizeof(*result));
+    } else {
+      memset(result, 0, sizeof(*result));
+    }
+  }
   return 0;
 }
 
 int deserialize_server_message(const char* msg,
                                uint32_t msg_len,
                                string& task_name,
-                               uint32_t& sleep_time)
+                               uint32_t& sleep_ms,
+                               uint64_t& lease,
+                               string& command)
 {
   char name_buffer[MAX_TASK_NAME_LEN];
   const char* p = msg;
@@ -116,14 +155,41 @@ int deserialize_server_message(const char* msg,
   }
   name_buffer[i] = 0;
   p++;
-  if (end - p != sizeof(sleep_time)) {
+  if (end - p < (long)(sizeof(sleep_ms) + sizeof(lease))) {
     return -1;
   }
   task_name = name_buffer;
-  memcpy(&sleep_time, p, sizeof(sleep_time));
+  memcpy(&sleep_ms, p, sizeof(sleep_ms));
+  p += sizeof(sleep_ms);
+  memcpy(&lease, p, sizeof(lease));
+  p += sizeof(lease);
+  command.clear();
+  if (p < end) {
+    // Null terminated command up to the end of message
+    if (end[-1] != 0 || end - p > MAX_COMMAND_LEN) {
+      return -1;
+    }
+    command = p;
+  }
   return 0;
 }
 
+void make_result_chunk_header(char* header, uint64_t lease, uint64_t offset,
+                              uint32_t data_len)
+{
+  uint32_t len = (RESULT_CHUNK_HEADER_LEN + data_len) | RESULT_CHUNK_FLAG;
+  memcpy(header, &len, sizeof(len));
+  memcpy(header + sizeof(len), &lease, sizeof(lease));
+  memcpy(header + sizeof(len) + sizeof(lease), &offset, sizeof(offset));
+}
+
+void parse_result_chunk_header(const char* chunk, uint64_t& lease,
+                               uint64_t& offset)
+{
+  memcpy(&lease, chunk + sizeof(uint32_t), sizeof(lease));
+  memcpy(&offset, chunk + sizeof(uint32_t) + sizeof(lease), sizeof(offset));
+}
+
 int set_fd_non_block(int fd)
 {
   int opts = fcntl(fd, F_GETFL);
@@ -137,12 +203,75 @@ int set_fd_non_block(int fd)
   return 0;
 }
 
+uint64_t monotonic_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+string json_string(const string& s)
+{
+  string out = "\"";
+  for (unsigned char c : s) {
+    if (c == '"' || c == '\\') {
+      out.push_back('\\');
+      out.push_back(c);
+    } else if (c < 0x20) {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\u%04x", c);
+      out.append(buf);
+    } else {
+      out.push_back(c);
+    }
+  }
+  out.push_back('"');
+  return out;
+}
+
+int resolve_address(const string& address, struct sockaddr_in& addr)
+{
+  size_t colon = address.rfind(':');
+  if (colon == string::npos || colon == 0) {
+    return -1;
+  }
+  int port = atoi(address.c_str() + colon + 1);
+  if (port <= 0 || port > 65535) {
+    return -1;
+  }
+  struct addrinfo hints, *res;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(address.substr(0, colon).c_str(), nullptr, &hints,
+                  &res) != 0) {
+    return -1;
+  }
+  memcpy(&addr, res->ai_addr, sizeof(addr));
+  addr.sin_port = htons(port);
+  freeaddrinfo(res);
+  return 0;
+}
+
+uint64_t monotonic_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 void log_message(FILE* log_file, const char* file_name, uint32_t line,
                  const char* fmt, ...)
 {
-  fprintf(log_file, "%.16s:%d ", file_name, line);
   va_list args;
   va_start(args, fmt);
+  bool queued = async_log_message(log_file, file_name, line, fmt, args);
+  va_end(args);
+  if (queued) {
+    return;
+  }
+  fprintf(log_file, "%.16s:%d ", file_name, line);
+  va_start(args, fmt);
   vfprintf(log_file, fmt, args);
   va_end(args);
   fprintf(log_file, "\n");
@@ -5,39 +5,108 @@
 //
 
 #include <stdint.h>
+#include <netinet/in.h>
 #include <string>
 
 #define DEFAULT_TIMEOUT     1000
 #define MAX_TASK_NAME_LEN   32
 #define MAX_PORT_NUMBER     8192
+#define MAX_COMMAND_LEN     4096
+#define MAX_RESULT_PATH_LEN 1024
+
+// Durations on the wire are in milliseconds. Sleep time of a server message
+// that cancels the named task on the worker.
+#define CANCEL_SLEEP_TIME   0xffffffff
+
+// Sleep time of a server message with an empty task name that sends the
+// worker to the controller at the "<host>:<port>" given as the command.
+// Workers that do not know it take the message as a request to exit.
+#define REDIRECT_SLEEP_TIME 0xfffffffe
+
+// A worker redirected this many times in a row without getting a task
+// exits, so it does not bounce between shards that have nothing left
+#define MAX_REDIRECTS       8
+
+// A worker streams the output of a task to the controller before reporting
+// the task done, in chunks whose length word has RESULT_CHUNK_FLAG set:
+//
+//   (chunk length | RESULT_CHUNK_FLAG) lease offset data
+//
+// The chunk length counts the whole chunk, offset is where the data starts
+// in the output. A worker sends the output from offset 0 again after a
+// reconnect. The controller acknowledges every chunk with a server message
+// of sleep time RESULT_ACK_SLEEP_TIME once the data is written, and a
+// worker has at most RESULT_WINDOW chunks not acknowledged, so a large
+// result never piles up in the controller.
+#define RESULT_CHUNK_FLAG       0x40000000
+#define RESULT_CHUNK_HEADER_LEN (sizeof(uint32_t) + 2 * sizeof(uint64_t))
+#define RESULT_CHUNK_LEN        (1 << 16)
+#define RESULT_WINDOW           4
+#define RESULT_ACK_SLEEP_TIME   0xfffffffd
+#define MAX_RESULT_CHUNK_LEN    (RESULT_CHUNK_HEADER_LEN + RESULT_CHUNK_LEN)
 
 #define MAX_CLIENT_MSG_LEN \
-  (MAX_TASK_NAME_LEN + MAX_TASK_NAME_LEN + sizeof(uint32_t))
+  (MAX_TASK_NAME_LEN + MAX_TASK_NAME_LEN + sizeof(uint32_t) + \
+   sizeof(uint64_t) + sizeof(epoll_demo::TaskResult) + sizeof(uint32_t))
 
 #define MAX_SERVER_MSG_LEN \
-  (MAX_TASK_NAME_LEN + sizeof(uint32_t))
+  (MAX_TASK_NAME_LEN + sizeof(uint32_t) + sizeof(uint64_t) + \
+   MAX_COMMAND_LEN + sizeof(uint32_t))
 
 namespace epoll_demo {
 
+// Outcome of a task command, reported by the worker with the completion
+struct TaskResult {
+  int32_t   exit_status;    // exit code, or 128 + signal number
+  uint32_t  user_ms;        // user CPU time
+  uint32_t  sys_ms;         // system CPU time
+  uint32_t  max_rss_kb;     // peak resident set size
+  uint32_t  run_ms;         // wall time the task ran on the worker
+};
+
+// Every assignment of a task carries a lease, a fencing token larger than
+// that of any earlier assignment of the task. The worker echoes it in the
+// status of the task, and the controller drops a status whose lease is not
+// the current one. A request for a task has lease 0.
+
+// A completion carries a TaskResult if result is given
 char* serialize_client_message(const char* worker,
                                const char* task_name,
                                uint32_t time_left,
-                               uint32_t& sz);
+                               uint64_t lease,
+                               uint32_t& sz,
+                               const TaskResult* result = nullptr);
 
+// An empty command runs the plain sleep of a demo task
 char* serialize_server_message(const char* task_name,
-                               uint32_t sleep_time,
+                               uint32_t sleep_ms,
+                               uint64_t lease,
+                               const char* command,
                                uint32_t& sz);
 
+// result is zeroed if the message does not carry one
 int deserialize_client_message(const char* msg,
                                uint32_t msg_len,
                                std::string& worker,
                                std::string& task_name,
-                               uint32_t& time_left);
+                               uint32_t& time_left,
+                               uint64_t& lease,
+                               TaskResult* result = nullptr);
 
 int deserialize_server_message(const char* msg,
                                uint32_t msg_len,
                                std::string& task_name,
-                               uint32_t& sleep_time);
+                               uint32_t& sleep_ms,
+                               uint64_t& lease,
+                               std::string& command);
+
+// Header of a result chunk carrying data_len bytes of output at offset
+void make_result_chunk_header(char* header, uint64_t lease, uint64_t offset,
+                              uint32_t data_len);
+
+// Lease and offset of the result chunk starting at chunk
+void parse_result_chunk_header(const char* chunk, uint64_t& lease,
+                               uint64_t& offset);
 
 void log_message(FILE* log_file, const char* src_file, uint32_t line,
                  const char* fmt, ...)
@@ -45,6 +114,20 @@ void log_message(FILE* log_file, const char* src_file, uint32_t line,
 
 int set_fd_non_block(int fd);
 
+// Resolve "<host>:<port>" to an IPv4 address. Returns 0 for success, -1 for
+// failure
+int resolve_address(const std::string& address, struct sockaddr_in& addr);
+
+// s quoted and escaped as a JSON string
+std::string json_string(const std::string& s);
+
+// Milliseconds on CLOCK_MONOTONIC, for durations and deadlines that must
+// not jump with the wall clock
+uint64_t monotonic_ms();
+
+// Microseconds on CLOCK_MONOTONIC, for latency measurements
+uint64_t monotonic_us();
+
 }
 
 #endif